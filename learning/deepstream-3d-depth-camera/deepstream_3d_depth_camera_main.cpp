@@ -38,8 +38,14 @@
 #include <ds3d/gst/nvds3d_meta.h>
 #include <unistd.h>
 
+#include <iostream>
+#include <map>
+#include <mutex>
+
 #include "deepstream_3d_context.hpp"
-#include "deepstream_3d_context.hpp"
+#include "deepstream_3d_filter_queue.hpp"
+#include "deepstream_3d_recorder.hpp"
+#include "gst_rgbd_server/thread_policy.h"
 
 using namespace ds3d;
 
@@ -47,27 +53,23 @@ constexpr const char* kDs3dFilterPluginName = "nvds3dfilter";
 
 struct AppProfiler {
     config::ComponentConfig config;
-    profiling::FileWriter depthWriter;
-    profiling::FileWriter colorWriter;
-    profiling::FileWriter pointWriter;
+    app::AsyncRecordWriter depthWriter;
+    app::AsyncRecordWriter colorWriter;
+    app::AsyncRecordWriter pointWriter;
+    app::AsyncRecordWriter recorder;
+    bool recordCopy = false;
     bool enableDebug = false;
+    uint32_t queueStatsInterval = 0;
 
     AppProfiler() = default;
     AppProfiler(const AppProfiler&) = delete;
     void operator=(const AppProfiler&) = delete;
     ~AppProfiler()
     {
-        if (depthWriter.isOpen()) {
-            depthWriter.close();
-        }
-
-        if (colorWriter.isOpen()) {
-            colorWriter.close();
-        }
-
-        if (pointWriter.isOpen()) {
-            pointWriter.close();
-        }
+        closeWriter(depthWriter, "depth dump");
+        closeWriter(colorWriter, "color dump");
+        closeWriter(pointWriter, "point dump");
+        closeWriter(recorder, "recording");
     }
 
     ErrCode initProfiling(const config::ComponentConfig& compConf)
@@ -78,6 +80,10 @@ struct AppProfiler {
         std::string dumpDepthFile;
         std::string dumpColorFile;
         std::string dumpPointFile;
+        std::string recordFile;
+        std::string recordCompression;
+        std::string threadPolicy;
+        app::AsyncRecordWriter::Options options;
         if (node["dump_depth"]) {
             dumpDepthFile = node["dump_depth"].as<std::string>();
         }
@@ -87,6 +93,27 @@ struct AppProfiler {
         if (node["dump_points"]) {
             dumpPointFile = node["dump_points"].as<std::string>();
         }
+        if (node["record_file"]) {
+            recordFile = node["record_file"].as<std::string>();
+        }
+        if (node["record_compression"]) {
+            recordCompression = node["record_compression"].as<std::string>();
+        }
+        if (node["record_level"]) {
+            options.compressionLevel = node["record_level"].as<int>();
+        }
+        if (node["record_queue_size"]) {
+            options.maxQueuedFrames = node["record_queue_size"].as<size_t>();
+        }
+        if (node["record_copy"]) {
+            recordCopy = node["record_copy"].as<bool>();
+        }
+        if (node["thread_policy"]) {
+            threadPolicy = node["thread_policy"].as<std::string>();
+        }
+        if (node["queue_stats_interval"]) {
+            queueStatsInterval = node["queue_stats_interval"].as<uint32_t>();
+        }
         if (node["enable_debug"]) {
             enableDebug = node["enable_debug"].as<bool>();
             if (enableDebug) {
@@ -94,26 +121,129 @@ struct AppProfiler {
             }
         }
 
+        if (!threadPolicy.empty()) {
+            DS3D_FAILED_RETURN(
+                ThreadPolicy::instance().configure(threadPolicy), ErrCode::kConfig,
+                "invalid thread_policy: %s", threadPolicy.c_str());
+        }
+
+        // legacy dumps stay headerless so the file dataloader can read them
+        options.layout = app::RecordLayout::kRaw;
         if (!dumpDepthFile.empty()) {
             DS3D_FAILED_RETURN(
-                depthWriter.open(dumpDepthFile), ErrCode::kConfig, "create depth file: %s failed",
-                dumpDepthFile.c_str());
+                isGood(depthWriter.open(dumpDepthFile, options)), ErrCode::kConfig,
+                "create depth file: %s failed", dumpDepthFile.c_str());
         }
 
         if (!dumpColorFile.empty()) {
             DS3D_FAILED_RETURN(
-                colorWriter.open(dumpColorFile), ErrCode::kConfig, "create color file: %s failed",
-                dumpColorFile.c_str());
+                isGood(colorWriter.open(dumpColorFile, options)), ErrCode::kConfig,
+                "create color file: %s failed", dumpColorFile.c_str());
         }
         if (!dumpPointFile.empty()) {
             DS3D_FAILED_RETURN(
-                pointWriter.open(dumpPointFile), ErrCode::kConfig, "create point file: %s failed",
-                dumpPointFile.c_str());
+                isGood(pointWriter.open(dumpPointFile, options)), ErrCode::kConfig,
+                "create point file: %s failed", dumpPointFile.c_str());
+        }
+
+        if (!recordFile.empty()) {
+            options.layout = app::RecordLayout::kContainer;
+            DS3D_FAILED_RETURN(
+                app::parseRecordCodec(recordCompression, options.codec), ErrCode::kConfig,
+                "unknown record_compression: %s", recordCompression.c_str());
+            DS3D_FAILED_RETURN(
+                isGood(recorder.open(recordFile, options)), ErrCode::kConfig,
+                "create recording file: %s failed", recordFile.c_str());
         }
         return ErrCode::kGood;
     }
+
+    /* streams are registered on their first frame, once sizes are known */
+    uint32_t recordStream(RgbdStreamKind kind, const RgbdRecordingStreamInfo& info)
+    {
+        std::unique_lock<std::mutex> lock(_recordMutex);
+        auto it = _recordStreams.find(kind);
+        if (it != _recordStreams.end()) {
+            return it->second;
+        }
+        uint32_t id = recorder.addStream(info);
+        _recordStreams[kind] = id;
+        return id;
+    }
+
+    /* hold a reference on the frame instead of copying it, unless configured */
+    template <typename Guard>
+    void write(
+        app::AsyncRecordWriter& writer, uint32_t streamId, uint64_t timestampNs,
+        const Guard& frame)
+    {
+        std::shared_ptr<void> keepAlive;
+        if (!recordCopy) {
+            keepAlive = std::make_shared<Guard>(frame);
+        }
+        writer.push(streamId, timestampNs, frame->base(), frame->bytes(), std::move(keepAlive));
+    }
+
+private:
+    static void closeWriter(app::AsyncRecordWriter& writer, const char* name)
+    {
+        if (!writer.isOpen()) {
+            return;
+        }
+        if (!isGood(writer.close())) {
+            LOG_ERROR("%s: closing file failed", name);
+        }
+        app::AsyncRecordWriter::Stats s = writer.stats();
+        LOG_INFO(
+            "%s: %lu frames written, %lu dropped, %lu bytes, queue high-water %zu", name,
+            (unsigned long)s.written, (unsigned long)s.dropped, (unsigned long)s.bytesWritten,
+            s.queueHighWater);
+    }
+
+    std::mutex _recordMutex;
+    std::map<RgbdStreamKind, uint32_t> _recordStreams;
 };
 
+static uint64_t
+bufferTimestampNs(GstBuffer* buf)
+{
+    if (GST_BUFFER_PTS_IS_VALID(buf)) {
+        return GST_BUFFER_PTS(buf);
+    }
+    return (uint64_t)g_get_monotonic_time() * 1000;
+}
+
+static RgbdRecordingStreamInfo
+recordStreamInfo(
+    RgbdStreamKind kind, RgbdPixelFormat format, const Frame2DPlane& p, uint32_t bytes)
+{
+    RgbdRecordingStreamInfo info;
+    memset(&info, 0, sizeof(info));
+    info.kind = (uint32_t)kind;
+    info.format = (uint32_t)format;
+    info.width = p.width;
+    info.height = p.height;
+    info.stride = p.pitchInBytes;
+    info.bytesPerFrame = bytes;
+    return info;
+}
+
+static void
+recordIntrinsics(GuardDataMap& dataMap, const char* key, RgbdRecordingStreamInfo& info)
+{
+    IntrinsicsParam intrinsics;
+    if (!dataMap.hasData(key) || !isGood(dataMap.getData(key, intrinsics))) {
+        return;
+    }
+    info.hasIntrinsics = 1;
+    info.intrinsics.width = intrinsics.width;
+    info.intrinsics.height = intrinsics.height;
+    info.intrinsics.centerX = intrinsics.centerX;
+    info.intrinsics.centerY = intrinsics.centerY;
+    info.intrinsics.fx = intrinsics.fx;
+    info.intrinsics.fy = intrinsics.fy;
+}
+
 class DepthCameraApp : public app::Ds3dAppContext {
 public:
     DepthCameraApp() = default;
@@ -141,6 +271,28 @@ public:
 
     AppProfiler& profiler() { return _appProfiler; }
 
+    void addFilterQueue(
+        const std::string& name, GstElement* queue, const app::FilterQueueConfig& config)
+    {
+        _filterQueues.emplace_back(new app::FilterQueueMonitor(name, queue, config));
+    }
+
+    /* logs filter queue statistics every queue_stats_interval seconds */
+    void startQueueStats()
+    {
+        uint32_t interval = _appProfiler.queueStatsInterval;
+        if (interval && !_filterQueues.empty()) {
+            _queueStatsTimer = g_timeout_add_seconds(interval, onQueueStats, this);
+        }
+    }
+
+    void logFilterQueues() const
+    {
+        for (const auto& queue : _filterQueues) {
+            queue->log();
+        }
+    }
+
     ErrCode stop()
     {
         if (_dataloaderSrc.customProcessor) {
@@ -154,6 +306,10 @@ public:
             _datarenderSink.gstElement.reset();
             _datarenderSink.customProcessor.reset();
         }
+        if (_queueStatsTimer) {
+            g_source_remove(_queueStatsTimer);
+            _queueStatsTimer = 0;
+        }
         ErrCode c = app::Ds3dAppContext::stop();
         return c;
     }
@@ -161,11 +317,18 @@ public:
     void deinit() override
     {
         app::Ds3dAppContext::deinit();
+        _filterQueues.clear();
         _datarenderSink.customlib.reset();
         _dataloaderSrc.customlib.reset();
     }
 
 private:
+    static gboolean onQueueStats(gpointer udata)
+    {
+        ((DepthCameraApp*)udata)->logFilterQueues();
+        return G_SOURCE_CONTINUE;
+    }
+
     bool busCall(GstMessage* msg) final
     {
         DS_ASSERT(mainLoop());
@@ -197,6 +360,8 @@ private:
     gst::DataLoaderSrc _dataloaderSrc;
     gst::DataRenderSink _datarenderSink;
     AppProfiler _appProfiler;
+    std::vector<std::unique_ptr<app::FilterQueueMonitor>> _filterQueues;
+    guint _queueStatsTimer = 0;
 };
 
 static GstPadProbeReturn
@@ -252,20 +417,49 @@ appsrcBufferProbe(GstPad* pad, GstPadProbeInfo* info, gpointer udata)
         LOG_DEBUG("RGBA frame is found,  w: %d, h: %d", p.width, p.height);
     }
 
-    // dump depth data for debug
-    if (depthFrame && profiler.depthWriter.isOpen()) {
+    // dump depth/color data for debug, written on background threads
+    uint64_t timestamp = bufferTimestampNs(buf);
+    if (depthFrame && (profiler.depthWriter.isOpen() || profiler.recorder.isOpen())) {
         DS_ASSERT(depthFrame->memType() != MemType::kGpuCuda);
-        DS3D_FAILED_RETURN(
-            profiler.depthWriter.write((const uint8_t*)depthFrame->base(), depthFrame->bytes()),
-            GST_PAD_PROBE_DROP, "Dump depth data failed");
+        if (profiler.depthWriter.isOpen()) {
+            profiler.write(profiler.depthWriter, 0, timestamp, depthFrame);
+        }
+        if (profiler.recorder.isOpen()) {
+            RgbdRecordingStreamInfo info = recordStreamInfo(
+                RgbdStreamKind::kDepth, RgbdPixelFormat::kZ16, depthFrame->getPlane(0),
+                depthFrame->bytes());
+            DepthScale scale;
+            if (isGood(dataMap.getData(kDepthScaleUnit, scale))) {
+                info.depthScale = scale.scaleUnit;
+            }
+            recordIntrinsics(dataMap, kDepthIntrinsics, info);
+            uint32_t id = profiler.recordStream(RgbdStreamKind::kDepth, info);
+            profiler.write(profiler.recorder, id, timestamp, depthFrame);
+        }
     }
 
-    // dump color data for debug
-    if (colorFrame && profiler.colorWriter.isOpen()) {
+    if (colorFrame && (profiler.colorWriter.isOpen() || profiler.recorder.isOpen())) {
         DS_ASSERT(colorFrame->memType() != MemType::kGpuCuda);
-        DS3D_FAILED_RETURN(
-            profiler.colorWriter.write((const uint8_t*)colorFrame->base(), colorFrame->bytes()),
-            GST_PAD_PROBE_DROP, "Dump color data failed");
+        if (profiler.colorWriter.isOpen()) {
+            profiler.write(profiler.colorWriter, 0, timestamp, colorFrame);
+        }
+        if (profiler.recorder.isOpen()) {
+            RgbdRecordingStreamInfo info = recordStreamInfo(
+                RgbdStreamKind::kColor, RgbdPixelFormat::kRGBA8, colorFrame->getPlane(0),
+                colorFrame->bytes());
+            recordIntrinsics(dataMap, kColorIntrinsics, info);
+            uint32_t id = profiler.recordStream(RgbdStreamKind::kColor, info);
+            profiler.write(profiler.recorder, id, timestamp, colorFrame);
+        }
+    }
+
+    if (profiler.recorder.isOpen() && dataMap.hasData(kDepth2ColorExtrinsics)) {
+        ExtrinsicsParam d2c;
+        static_assert(sizeof(d2c.rotation) == 9 * sizeof(float), "rotation is 3x3 float");
+        if (isGood(dataMap.getData(kDepth2ColorExtrinsics, d2c))) {
+            float translation[3] = {d2c.translation.x, d2c.translation.y, d2c.translation.z};
+            profiler.recorder.setDepthToColorExtrinsics((const float*)&d2c.rotation, translation);
+        }
     }
 
     return GST_PAD_PROBE_OK;
@@ -353,12 +547,22 @@ appsinkBufferProbe(GstPad* pad, GstPadProbeInfo* info, gpointer udata)
             d2cExtrinsics.translation.x, d2cExtrinsics.translation.y, d2cExtrinsics.translation.z);
     }
 
-    // dump depth data for debug
-    if (pointFrame && profiler.pointWriter.isOpen()) {
+    // dump points data for debug, written on background threads
+    if (pointFrame && (profiler.pointWriter.isOpen() || profiler.recorder.isOpen())) {
         DS_ASSERT(pointFrame->memType() != MemType::kGpuCuda);
-        DS3D_FAILED_RETURN(
-            profiler.pointWriter.write((const uint8_t*)pointFrame->base(), pointFrame->bytes()),
-            GST_PAD_PROBE_DROP, "Dump points data failed");
+        uint64_t timestamp = bufferTimestampNs(buf);
+        if (profiler.pointWriter.isOpen()) {
+            profiler.write(profiler.pointWriter, 0, timestamp, pointFrame);
+        }
+        if (profiler.recorder.isOpen()) {
+            RgbdRecordingStreamInfo info;
+            memset(&info, 0, sizeof(info));
+            info.kind = (uint32_t)RgbdStreamKind::kPoints;
+            info.format = (uint32_t)RgbdPixelFormat::kXYZ32F;
+            info.stride = 3 * sizeof(float);
+            uint32_t id = profiler.recordStream(RgbdStreamKind::kPoints, info);
+            profiler.write(profiler.recorder, id, timestamp, pointFrame);
+        }
     }
 
     return GST_PAD_PROBE_OK;
@@ -576,8 +780,20 @@ main(int argc, char* argv[])
             auto& filterConfigs = configTable[config::ComponentType::kDataFilter];
             DS_ASSERT(filterConfigs.size());
             for (size_t i = 0; i < filterConfigs.size(); ++i) {
-                auto queue = gst::elementMake("queue", ("filterQueue" + std::to_string(i)).c_str());
+                std::string queueName = "filterQueue" + std::to_string(i);
+                auto queue = gst::elementMake("queue", queueName.c_str());
                 DS_ASSERT(queue);
+                app::FilterQueueConfig queueConfig;
+                DS3D_THROW_ERROR_FMT(
+                    isGood(app::parseFilterQueueConfig(filterConfigs[i].rawContent, queueConfig)),
+                    ErrCode::kConfig, "parse queue of datafilter: %s failed",
+                    filterConfigs[i].name.c_str());
+                if (!queueConfig.thread.empty()) {
+                    DS3D_THROW_ERROR_FMT(
+                        ThreadPolicy::instance().addRules(queueName + "=" + queueConfig.thread),
+                        ErrCode::kConfig, "invalid queue thread of datafilter: %s",
+                        filterConfigs[i].name.c_str());
+                }
                 auto filter =
                     gst::elementMake(kDs3dFilterPluginName, ("filter" + std::to_string(i)).c_str());
                 DS3D_THROW_ERROR_FMT(
@@ -587,6 +803,9 @@ main(int argc, char* argv[])
                     nullptr);
                 appCtx->add(queue).add(filter);
                 lastEle.link(queue).link(filter);
+                if (queueConfig.configured) {
+                    appCtx->addFilterQueue(queueName, queue.get(), queueConfig);
+                }
                 lastEle = filter;
             }
         }
@@ -594,6 +813,10 @@ main(int argc, char* argv[])
     });
     CHECK_ERROR(isGood(code), "Link pipeline elements failed");
 
+    // streaming threads of the dataloader source and filter queues follow
+    // ds3d::userapp thread_policy and the queue threads of the filters, if any
+    ThreadPolicy::instance().watch(GST_ELEMENT(appCtx->pipeline()));
+
     /* Add probe to get informed of the meta data generated, we add probe to
      * gstappsrc src pad of the dataloader */
     gst::PadPtr srcPad = loaderSrc.gstElement.staticPad("src");
@@ -612,6 +835,7 @@ main(int argc, char* argv[])
 
     CHECK_ERROR(isGood(appCtx->play()), "app context play failed");
     LOG_INFO("Play...");
+    appCtx->startQueueStats();
 
     // get window system and set close event callback
     if (renderSink.customProcessor) {
@@ -625,6 +849,8 @@ main(int argc, char* argv[])
 
     /* Wait till pipeline encounters an error or EOS */
     appCtx->runMainLoop();
+    ThreadPolicy::instance().report(std::cout);
+    appCtx->logFilterQueues();
 
     loaderSrc.reset();
     renderSink.reset();
@@ -0,0 +1,202 @@
+#ifndef DS3D_APP_DEEPSTREAM_3D_FILTER_QUEUE_H
+#define DS3D_APP_DEEPSTREAM_3D_FILTER_QUEUE_H
+
+#include <gst/gst.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include <ds3d/common/common.h>
+#include <ds3d/common/hpp/yaml_config.hpp>
+
+namespace ds3d { namespace app {
+
+/**
+ * Queue in front of one ds3d::datafilter, from the optional `queue` map of
+ * the filter's YAML entry:
+ *   queue:
+ *     max_size_buffers: 2       # frames held, byte and time limits off
+ *     leaky: downstream         # no, upstream (drop new) or downstream (drop old)
+ *     skip_when_behind: 1       # drop a frame when this many newer ones wait
+ *     thread: "3:fifo=40"       # CPUS[:fifo=N][:nice=N] of the queue's thread
+ * Left out, the queue keeps GStreamer's defaults.
+ */
+struct FilterQueueConfig {
+    bool configured = false;
+    uint32_t maxSizeBuffers = 0;  // 0 keeps the default limits
+    std::string leaky = "no";
+    uint32_t skipWhenBehind = 0;  // 0 never skips
+    std::string thread;
+};
+
+/* Reads the `queue` map of a datafilter entry and removes it from the
+ * content, so the filter only gets its own keys. */
+inline ErrCode
+parseFilterQueueConfig(std::string& rawContent, FilterQueueConfig& config)
+{
+    YAML::Node node = YAML::Load(rawContent);
+    YAML::Node queue = node["queue"];
+    if (!queue) {
+        return ErrCode::kGood;
+    }
+    config.configured = true;
+    if (queue["max_size_buffers"]) {
+        config.maxSizeBuffers = queue["max_size_buffers"].as<uint32_t>();
+    }
+    if (queue["leaky"]) {
+        config.leaky = queue["leaky"].as<std::string>();
+    }
+    if (queue["skip_when_behind"]) {
+        config.skipWhenBehind = queue["skip_when_behind"].as<uint32_t>();
+    }
+    if (queue["thread"]) {
+        config.thread = queue["thread"].as<std::string>();
+    }
+    DS3D_FAILED_RETURN(
+        config.leaky == "no" || config.leaky == "upstream" || config.leaky == "downstream",
+        ErrCode::kConfig, "queue leaky: %s must be no, upstream or downstream",
+        config.leaky.c_str());
+
+    node.remove("queue");
+    YAML::Emitter out;
+    out << node;
+    rawContent = out.c_str();
+    return ErrCode::kGood;
+}
+
+/**
+ * Applies a FilterQueueConfig to a queue element and counts what passes it.
+ * Frames entering and leaving are counted by pad probes, occupancy is
+ * sampled as each frame arrives and the queue's overrun signal counts the
+ * times it was full: a dropped frame when leaky, upstream blocked if not.
+ * The monitor must outlive the pipeline's PLAYING state.
+ */
+class FilterQueueMonitor {
+public:
+    struct Stats {
+        uint64_t enqueued = 0;
+        uint64_t dequeued = 0;
+        uint64_t skipped = 0;
+        uint64_t full = 0;
+        uint32_t highWater = 0;
+        double meanLevel = 0.0;
+    };
+
+    FilterQueueMonitor(const std::string& name, GstElement* queue, const FilterQueueConfig& config)
+        : _name(name), _skipWhenBehind(config.skipWhenBehind)
+    {
+        DS_ASSERT(queue);
+        _queue = GST_ELEMENT(gst_object_ref(queue));
+        if (config.maxSizeBuffers) {
+            // bound by frames only so latency is max_size_buffers frames
+            g_object_set(
+                G_OBJECT(_queue), "max-size-buffers", config.maxSizeBuffers, "max-size-bytes", 0u,
+                "max-size-time", (guint64)0, nullptr);
+        }
+        gst_util_set_object_arg(G_OBJECT(_queue), "leaky", config.leaky.c_str());
+        _overrunHandler = g_signal_connect(_queue, "overrun", G_CALLBACK(onOverrun), this);
+
+        GstPad* sink = gst_element_get_static_pad(_queue, "sink");
+        _sinkProbe = gst_pad_add_probe(
+            sink, GST_PAD_PROBE_TYPE_BUFFER, onSinkBuffer, this, nullptr);
+        gst_object_unref(sink);
+        GstPad* src = gst_element_get_static_pad(_queue, "src");
+        _srcProbe = gst_pad_add_probe(src, GST_PAD_PROBE_TYPE_BUFFER, onSrcBuffer, this, nullptr);
+        gst_object_unref(src);
+    }
+
+    ~FilterQueueMonitor()
+    {
+        g_signal_handler_disconnect(_queue, _overrunHandler);
+        GstPad* sink = gst_element_get_static_pad(_queue, "sink");
+        gst_pad_remove_probe(sink, _sinkProbe);
+        gst_object_unref(sink);
+        GstPad* src = gst_element_get_static_pad(_queue, "src");
+        gst_pad_remove_probe(src, _srcProbe);
+        gst_object_unref(src);
+        gst_object_unref(_queue);
+    }
+
+    FilterQueueMonitor(const FilterQueueMonitor&) = delete;
+    void operator=(const FilterQueueMonitor&) = delete;
+
+    const std::string& name() const { return _name; }
+
+    Stats stats() const
+    {
+        Stats s;
+        s.enqueued = _enqueued.load();
+        s.dequeued = _dequeued.load();
+        s.skipped = _skipped.load();
+        s.full = _full.load();
+        s.highWater = _highWater.load();
+        s.meanLevel = s.enqueued ? (double)_levelSum.load() / s.enqueued : 0.0;
+        return s;
+    }
+
+    void log() const
+    {
+        Stats s = stats();
+        LOG_INFO(
+            "%s: %lu frames in, %lu out, %lu skipped, full %lu times, occupancy mean %.2f "
+            "high-water %u",
+            _name.c_str(), (unsigned long)s.enqueued, (unsigned long)s.dequeued,
+            (unsigned long)s.skipped, (unsigned long)s.full, s.meanLevel, s.highWater);
+    }
+
+private:
+    uint32_t level() const
+    {
+        guint buffers = 0;
+        g_object_get(G_OBJECT(_queue), "current-level-buffers", &buffers, nullptr);
+        return buffers;
+    }
+
+    static GstPadProbeReturn onSinkBuffer(GstPad* pad, GstPadProbeInfo* info, gpointer udata)
+    {
+        FilterQueueMonitor* self = (FilterQueueMonitor*)udata;
+        uint32_t queued = self->level();
+        self->_enqueued.fetch_add(1);
+        self->_levelSum.fetch_add(queued);
+        uint32_t high = self->_highWater.load();
+        while (queued + 1 > high && !self->_highWater.compare_exchange_weak(high, queued + 1)) {
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    /* runs on the queue's thread, after the frame left the queue */
+    static GstPadProbeReturn onSrcBuffer(GstPad* pad, GstPadProbeInfo* info, gpointer udata)
+    {
+        FilterQueueMonitor* self = (FilterQueueMonitor*)udata;
+        if (self->_skipWhenBehind && self->level() >= self->_skipWhenBehind) {
+            self->_skipped.fetch_add(1);
+            return GST_PAD_PROBE_DROP;
+        }
+        self->_dequeued.fetch_add(1);
+        return GST_PAD_PROBE_OK;
+    }
+
+    static void onOverrun(GstElement* queue, gpointer udata)
+    {
+        ((FilterQueueMonitor*)udata)->_full.fetch_add(1);
+    }
+
+    std::string _name;
+    GstElement* _queue = nullptr;
+    uint32_t _skipWhenBehind = 0;
+    gulong _overrunHandler = 0;
+    gulong _sinkProbe = 0;
+    gulong _srcProbe = 0;
+    std::atomic<uint64_t> _enqueued{0};
+    std::atomic<uint64_t> _dequeued{0};
+    std::atomic<uint64_t> _skipped{0};
+    std::atomic<uint64_t> _full{0};
+    std::atomic<uint64_t> _levelSum{0};
+    std::atomic<uint32_t> _highWater{0};
+};
+
+}}  // namespace ds3d::app
+
+#endif  // DS3D_APP_DEEPSTREAM_3D_FILTER_QUEUE_H
@@ -0,0 +1,597 @@
+#ifndef DS3D_APP_DEEPSTREAM_3D_RECORDER_H
+#define DS3D_APP_DEEPSTREAM_3D_RECORDER_H
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef DS3D_RECORD_WITH_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef DS3D_RECORD_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include <ds3d/common/common.h>
+
+#include "gst_rgbd_server/rgbd_recording_format.h"
+
+namespace ds3d { namespace app {
+
+enum class RecordLayout {
+    kRaw,        // headerless concatenated frames, as read by the file dataloader
+    kContainer,  // indexed .rgbdrec container, see rgbd_recording_format.h
+};
+
+inline bool
+parseRecordCodec(const std::string& name, RgbdCodec& codec)
+{
+    if (name.empty() || name == "none") {
+        codec = RgbdCodec::kNone;
+    } else if (name == "lz4") {
+        codec = RgbdCodec::kLz4;
+    } else if (name == "zstd") {
+        codec = RgbdCodec::kZstd;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline bool
+recordCodecAvailable(RgbdCodec codec)
+{
+    switch (codec) {
+    case RgbdCodec::kNone:
+        return true;
+#ifdef DS3D_RECORD_WITH_LZ4
+    case RgbdCodec::kLz4:
+        return true;
+#endif
+#ifdef DS3D_RECORD_WITH_ZSTD
+    case RgbdCodec::kZstd:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+/**
+ * Writes frames from a background thread so pad probes never wait on disk.
+ *
+ * push() only queues a reference (or a copy) of the frame. A packing thread
+ * compresses frames into one of two aligned staging buffers while a flush
+ * thread writes the other one out, so the disk sees few large writes.
+ * When more than maxQueuedFrames are pending, new frames are dropped and
+ * counted instead of blocking the caller. kRaw files have no frame numbers
+ * to show a gap, so there push() waits for room instead and the dumps of
+ * several streams stay frame aligned.
+ */
+class AsyncRecordWriter {
+public:
+    struct Options {
+        RecordLayout layout = RecordLayout::kContainer;
+        RgbdCodec codec = RgbdCodec::kNone;
+        // higher compresses more for both codecs: zstd takes it as is, lz4
+        // runs its fast compressor at 1 and below, LZ4_compress_HC above
+        int compressionLevel = 1;
+        size_t maxQueuedFrames = 8;
+        size_t stagingBytes = 8 << 20;
+    };
+
+    struct Stats {
+        uint64_t pushed = 0;
+        uint64_t dropped = 0;
+        uint64_t written = 0;
+        uint64_t bytesWritten = 0;
+        size_t queueHighWater = 0;
+    };
+
+    AsyncRecordWriter() = default;
+    AsyncRecordWriter(const AsyncRecordWriter&) = delete;
+    void operator=(const AsyncRecordWriter&) = delete;
+    ~AsyncRecordWriter() { close(); }
+
+    bool isOpen() const { return _fd >= 0; }
+
+    ErrCode open(const std::string& path, const Options& options)
+    {
+        DS3D_FAILED_RETURN(!isOpen(), ErrCode::kConfig, "writer is already open");
+        DS3D_FAILED_RETURN(
+            recordCodecAvailable(options.codec), ErrCode::kConfig,
+            "compression codec: %u is not built in", (uint32_t)options.codec);
+        _options = options;
+        _options.stagingBytes = rgbdRecordingAlignUp(std::max<size_t>(options.stagingBytes, 1));
+        _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        DS3D_FAILED_RETURN(_fd >= 0, ErrCode::kConfig, "open file: %s failed", path.c_str());
+
+        memset(&_header, 0, sizeof(_header));
+        _headerDirty = false;
+        memcpy(_header.magic, kRgbdRecordingMagic, sizeof(_header.magic));
+        _header.version = kRgbdRecordingVersion;
+        _header.alignment = kRgbdRecordingAlignment;
+        _header.createdUnixNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                    std::chrono::system_clock::now().time_since_epoch())
+                                    .count();
+        _fileOffset = 0;
+        if (_options.layout == RecordLayout::kContainer) {
+            // reserve the header block, it is rewritten as streams are added
+            // and on close()
+            if (!writeHeader() || ::lseek(_fd, kRgbdRecordingAlignment, SEEK_SET) < 0) {
+                LOG_ERROR("write recording header of %s failed", path.c_str());
+                ::close(_fd);
+                _fd = -1;
+                return ErrCode::kConfig;
+            }
+            _fileOffset = kRgbdRecordingAlignment;
+        }
+
+        for (auto& staging : _staging) {
+            staging.reset(_options.stagingBytes);
+        }
+        _fill = &_staging[0];
+        _failed = false;
+        _stopping = false;
+        _packThread = std::thread(&AsyncRecordWriter::packLoop, this);
+        _flushThread = std::thread(&AsyncRecordWriter::flushLoop, this);
+        return ErrCode::kGood;
+    }
+
+    // Container layout only. Stream info may be updated later (e.g. when
+    // intrinsics first show up). The flush thread rewrites the header with
+    // its next write, so a recording cut short still lists its streams.
+    uint32_t addStream(const RgbdRecordingStreamInfo& info)
+    {
+        std::unique_lock<std::mutex> lock(_headerMutex);
+        DS_ASSERT(_header.numStreams < kRgbdRecordingMaxStreams);
+        _header.streams[_header.numStreams] = info;
+        _headerDirty = true;
+        return _header.numStreams++;
+    }
+
+    void updateStream(uint32_t streamId, const RgbdRecordingStreamInfo& info)
+    {
+        std::unique_lock<std::mutex> lock(_headerMutex);
+        DS_ASSERT(streamId < _header.numStreams);
+        _header.streams[streamId] = info;
+        _headerDirty = true;
+    }
+
+    RgbdRecordingStreamInfo streamInfo(uint32_t streamId)
+    {
+        std::unique_lock<std::mutex> lock(_headerMutex);
+        DS_ASSERT(streamId < _header.numStreams);
+        return _header.streams[streamId];
+    }
+
+    void setDepthToColorExtrinsics(const float rotation[9], const float translation[3])
+    {
+        std::unique_lock<std::mutex> lock(_headerMutex);
+        // called for every frame, only a change needs a header rewrite
+        if (_header.hasExtrinsics &&
+            !memcmp(_header.depthToColorRotation, rotation, sizeof(_header.depthToColorRotation)) &&
+            !memcmp(
+                _header.depthToColorTranslation, translation,
+                sizeof(_header.depthToColorTranslation))) {
+            return;
+        }
+        _headerDirty = true;
+        memcpy(_header.depthToColorRotation, rotation, sizeof(_header.depthToColorRotation));
+        memcpy(
+            _header.depthToColorTranslation, translation, sizeof(_header.depthToColorTranslation));
+        _header.hasExtrinsics = 1;
+    }
+
+    /**
+     * Queue a frame. If keepAlive is set, data must stay valid until it is
+     * released and no copy is made; otherwise the data is copied here.
+     * Returns false if the frame was dropped; kRaw writers block instead.
+     */
+    bool push(
+        uint32_t streamId, uint64_t timestampNs, const void* data, size_t bytes,
+        std::shared_ptr<void> keepAlive = nullptr)
+    {
+        if (!isOpen()) {
+            return false;
+        }
+        PendingFrame f;
+        f.streamId = streamId;
+        f.timestampNs = timestampNs;
+        f.bytes = bytes;
+        if (keepAlive) {
+            f.data = (const uint8_t*)data;
+            f.keepAlive = std::move(keepAlive);
+        } else {
+            f.copy.assign((const uint8_t*)data, (const uint8_t*)data + bytes);
+            f.data = f.copy.data();
+        }
+
+        std::unique_lock<std::mutex> lock(_queueMutex);
+        if (_options.layout == RecordLayout::kRaw) {
+            _spaceCond.wait(lock, [this]() {
+                return _failed || _stopping || _queue.size() < _options.maxQueuedFrames;
+            });
+        }
+        if (_failed || _stopping || _queue.size() >= _options.maxQueuedFrames) {
+            ++_stats.dropped;
+            return false;
+        }
+        _queue.emplace_back(std::move(f));
+        ++_stats.pushed;
+        _stats.queueHighWater = std::max(_stats.queueHighWater, _queue.size());
+        lock.unlock();
+        _queueCond.notify_one();
+        return true;
+    }
+
+    Stats stats()
+    {
+        std::unique_lock<std::mutex> lock(_queueMutex);
+        return _stats;
+    }
+
+    ErrCode close()
+    {
+        if (!isOpen()) {
+            return ErrCode::kGood;
+        }
+        {
+            std::unique_lock<std::mutex> lock(_queueMutex);
+            _stopping = true;
+        }
+        _queueCond.notify_all();
+        _spaceCond.notify_all();
+        if (_packThread.joinable()) {
+            _packThread.join();
+        }
+        {
+            std::unique_lock<std::mutex> lock(_flushMutex);
+            _flushStop = true;
+        }
+        _flushCond.notify_all();
+        if (_flushThread.joinable()) {
+            _flushThread.join();
+        }
+
+        ErrCode ret = _failed ? ErrCode::kUnknown : ErrCode::kGood;
+        if (!_failed && _options.layout == RecordLayout::kContainer) {
+            ret = writeIndex();
+        }
+        ::close(_fd);
+        _fd = -1;
+        _flushStop = false;
+        _index.clear();
+        _frameNumbers.clear();
+        return ret;
+    }
+
+private:
+    struct PendingFrame {
+        uint32_t streamId = 0;
+        uint64_t timestampNs = 0;
+        const uint8_t* data = nullptr;
+        size_t bytes = 0;
+        std::vector<uint8_t> copy;
+        std::shared_ptr<void> keepAlive;
+    };
+
+    struct StagingBuffer {
+        std::unique_ptr<uint8_t, decltype(&free)> mem{nullptr, free};
+        size_t capacity = 0;
+        size_t used = 0;
+        size_t frames = 0;
+
+        void reset(size_t bytes)
+        {
+            void* ptr = nullptr;
+            if (posix_memalign(&ptr, kRgbdRecordingAlignment, bytes) == 0) {
+                mem.reset((uint8_t*)ptr);
+                capacity = bytes;
+            } else {
+                mem.reset();
+                capacity = 0;
+            }
+            used = 0;
+            frames = 0;
+        }
+    };
+
+    void packLoop()
+    {
+        while (true) {
+            std::unique_lock<std::mutex> lock(_queueMutex);
+            _queueCond.wait(lock, [this]() { return _stopping || !_queue.empty(); });
+            if (_queue.empty()) {
+                break;  // stopping and drained
+            }
+            PendingFrame f = std::move(_queue.front());
+            _queue.pop_front();
+            lock.unlock();
+            _spaceCond.notify_all();
+
+            if (!_failed && !pack(f)) {
+                LOG_ERROR("recording: pack frame of stream %u failed", f.streamId);
+                _failed = true;
+            }
+        }
+        if (!_failed && _fill->used) {
+            handOff();
+        }
+        waitFlushIdle();
+    }
+
+    bool pack(const PendingFrame& f)
+    {
+        const bool container = _options.layout == RecordLayout::kContainer;
+        size_t bound = f.bytes;
+        if (container) {
+            bound = rgbdRecordingAlignUp(sizeof(RgbdFrameRecordHeader) + compressBound(f.bytes));
+        }
+        if (_fill->used + bound > _fill->capacity) {
+            if (_fill->used) {
+                handOff();
+            }
+            if (bound > _fill->capacity) {
+                // frame larger than the staging buffer, both buffers are idle here
+                _fill->reset(rgbdRecordingAlignUp(bound));
+                DS3D_FAILED_RETURN(_fill->capacity, false, "allocate staging buffer failed");
+            }
+        }
+
+        uint8_t* dst = _fill->mem.get() + _fill->used;
+        if (!container) {
+            memcpy(dst, f.data, f.bytes);
+            _fill->used += f.bytes;
+            ++_fill->frames;
+            return true;
+        }
+
+        RgbdFrameRecordHeader rec;
+        memset(&rec, 0, sizeof(rec));
+        memcpy(rec.magic, kRgbdFrameRecordMagic, sizeof(rec.magic));
+        rec.streamId = f.streamId;
+        if (_frameNumbers.size() <= f.streamId) {
+            _frameNumbers.resize(f.streamId + 1, 0);
+        }
+        rec.frameNumber = _frameNumbers[f.streamId]++;
+        rec.timestampNs = f.timestampNs;
+        rec.rawBytes = f.bytes;
+        uint8_t* payload = dst + sizeof(rec);
+        size_t stored = compress(f.data, f.bytes, payload, bound - sizeof(rec));
+        if (stored) {
+            rec.codec = (uint32_t)_options.codec;
+        } else {
+            // incompressible or no codec, store raw
+            rec.codec = (uint32_t)RgbdCodec::kNone;
+            memcpy(payload, f.data, f.bytes);
+            stored = f.bytes;
+        }
+        rec.storedBytes = stored;
+        memcpy(dst, &rec, sizeof(rec));
+
+        size_t recordBytes = rgbdRecordingAlignUp(sizeof(rec) + stored);
+        memset(payload + stored, 0, recordBytes - sizeof(rec) - stored);
+
+        RgbdRecordingIndexEntry entry;
+        entry.streamId = rec.streamId;
+        entry.codec = rec.codec;
+        entry.frameNumber = rec.frameNumber;
+        entry.timestampNs = rec.timestampNs;
+        entry.offset = _fileOffset + _fill->used;
+        entry.rawBytes = rec.rawBytes;
+        entry.storedBytes = rec.storedBytes;
+        _index.emplace_back(entry);
+
+        _fill->used += recordBytes;
+        ++_fill->frames;
+        return true;
+    }
+
+    size_t compressBound(size_t bytes) const
+    {
+        switch (_options.codec) {
+#ifdef DS3D_RECORD_WITH_LZ4
+        case RgbdCodec::kLz4:
+            return std::max<size_t>(bytes, LZ4_compressBound((int)bytes));
+#endif
+#ifdef DS3D_RECORD_WITH_ZSTD
+        case RgbdCodec::kZstd:
+            return std::max<size_t>(bytes, ZSTD_compressBound(bytes));
+#endif
+        default:
+            return bytes;
+        }
+    }
+
+    // returns 0 if the frame should be stored uncompressed
+    size_t compress(const uint8_t* src, size_t bytes, uint8_t* dst, size_t dstBytes)
+    {
+        size_t out = 0;
+        switch (_options.codec) {
+#ifdef DS3D_RECORD_WITH_LZ4
+        case RgbdCodec::kLz4: {
+            int n = _options.compressionLevel > 1
+                         ? LZ4_compress_HC(
+                               (const char*)src, (char*)dst, (int)bytes, (int)dstBytes,
+                               std::min(_options.compressionLevel, LZ4HC_CLEVEL_MAX))
+                         : LZ4_compress_default(
+                               (const char*)src, (char*)dst, (int)bytes, (int)dstBytes);
+            out = n > 0 ? (size_t)n : 0;
+            break;
+        }
+#endif
+#ifdef DS3D_RECORD_WITH_ZSTD
+        case RgbdCodec::kZstd: {
+            size_t n = ZSTD_compress(dst, dstBytes, src, bytes, _options.compressionLevel);
+            out = ZSTD_isError(n) ? 0 : n;
+            break;
+        }
+#endif
+        default:
+            DS3D_UNUSED(src);
+            DS3D_UNUSED(dst);
+            DS3D_UNUSED(dstBytes);
+            break;
+        }
+        return out < bytes ? out : 0;
+    }
+
+    // give the filled buffer to the flush thread and continue on the other one
+    void handOff()
+    {
+        std::unique_lock<std::mutex> lock(_flushMutex);
+        _flushCond.wait(lock, [this]() { return !_flushing; });
+        _flushing = _fill;
+        _fileOffset += _fill->used;
+        _fill = (_fill == &_staging[0]) ? &_staging[1] : &_staging[0];
+        _fill->used = 0;
+        _fill->frames = 0;
+        lock.unlock();
+        _flushCond.notify_all();
+    }
+
+    void waitFlushIdle()
+    {
+        std::unique_lock<std::mutex> lock(_flushMutex);
+        _flushCond.wait(lock, [this]() { return !_flushing; });
+    }
+
+    void flushLoop()
+    {
+        while (true) {
+            std::unique_lock<std::mutex> lock(_flushMutex);
+            _flushCond.wait(lock, [this]() { return _flushStop || _flushing; });
+            if (!_flushing) {
+                break;
+            }
+            StagingBuffer* buf = _flushing;
+            lock.unlock();
+
+            if (!writeAll(buf->mem.get(), buf->used)) {
+                LOG_ERROR("recording: write %zu bytes failed", buf->used);
+                _failed = true;
+            } else if (!rewriteHeaderIfDirty()) {
+                LOG_ERROR("recording: update header failed");
+                _failed = true;
+            } else {
+                std::unique_lock<std::mutex> statsLock(_queueMutex);
+                _stats.bytesWritten += buf->used;
+                _stats.written += buf->frames;
+            }
+            buf->used = 0;
+            buf->frames = 0;
+
+            lock.lock();
+            _flushing = nullptr;
+            lock.unlock();
+            _flushCond.notify_all();
+        }
+    }
+
+    bool writeAll(const uint8_t* data, size_t bytes)
+    {
+        while (bytes) {
+            ssize_t n = ::write(_fd, data, bytes);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            data += n;
+            bytes -= (size_t)n;
+        }
+        return true;
+    }
+
+    bool writeHeader()
+    {
+        std::vector<uint8_t> block(kRgbdRecordingAlignment, 0);
+        {
+            std::unique_lock<std::mutex> lock(_headerMutex);
+            memcpy(block.data(), &_header, sizeof(_header));
+        }
+        return ::pwrite(_fd, block.data(), block.size(), 0) == (ssize_t)block.size();
+    }
+
+    bool rewriteHeaderIfDirty()
+    {
+        if (_options.layout != RecordLayout::kContainer) {
+            return true;
+        }
+        {
+            std::unique_lock<std::mutex> lock(_headerMutex);
+            if (!_headerDirty) {
+                return true;
+            }
+            _headerDirty = false;
+        }
+        return writeHeader();
+    }
+
+    ErrCode writeIndex()
+    {
+        RgbdRecordingTrailer trailer;
+        memcpy(trailer.magic, kRgbdRecordingIndexMagic, sizeof(trailer.magic));
+        trailer.indexOffset = _fileOffset;
+        trailer.entryCount = _index.size();
+        DS3D_FAILED_RETURN(
+            writeAll((const uint8_t*)_index.data(), _index.size() * sizeof(_index[0])) &&
+                writeAll((const uint8_t*)&trailer, sizeof(trailer)),
+            ErrCode::kUnknown, "write recording index failed");
+        {
+            std::unique_lock<std::mutex> lock(_headerMutex);
+            _header.indexOffset = trailer.indexOffset;
+            _header.frameCount = trailer.entryCount;
+        }
+        DS3D_FAILED_RETURN(writeHeader(), ErrCode::kUnknown, "update recording header failed");
+        return ErrCode::kGood;
+    }
+
+    Options _options;
+    int _fd = -1;
+    uint64_t _fileOffset = 0;
+    std::atomic<bool> _failed{false};
+
+    std::mutex _headerMutex;
+    RgbdRecordingHeader _header;
+    bool _headerDirty = false;
+    std::vector<RgbdRecordingIndexEntry> _index;
+    std::vector<uint64_t> _frameNumbers;
+
+    std::mutex _queueMutex;
+    std::condition_variable _queueCond;
+    std::condition_variable _spaceCond;  // kRaw push() waiting for room
+    std::deque<PendingFrame> _queue;
+    bool _stopping = false;
+    Stats _stats;
+
+    std::mutex _flushMutex;
+    std::condition_variable _flushCond;
+    StagingBuffer _staging[2];
+    StagingBuffer* _fill = nullptr;
+    StagingBuffer* _flushing = nullptr;
+    bool _flushStop = false;
+
+    std::thread _packThread;
+    std::thread _flushThread;
+};
+
+}}  // namespace ds3d::app
+
+#endif  // DS3D_APP_DEEPSTREAM_3D_RECORDER_H
@@ -1,111 +1,212 @@
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <gst/gst.h>
 #include <gst/rtsp-server/rtsp-server.h>
-#include <librealsense2/rs.hpp>
 #include <gst/app/gstappsrc.h>
 
-int main(int argc, char *argv[]) {
-    // Initialize GStreamer
-    gst_init(&argc, &argv);
-
-    // Create a GStreamer pipeline
-    GstElement *pipeline = gst_pipeline_new("realsense_pipeline");
-
-    // Create elements
-    GstElement *source = gst_element_factory_make("appsrc", "video-source");
-    GstElement *convert = gst_element_factory_make("videoconvert", "video-convert");
-    GstElement *encoder = gst_element_factory_make("nvv4l2h264enc", "h264-encoder");
-    GstElement *payloader = gst_element_factory_make("rtph264pay", "h264-payloader");
-    GstElement *sink = gst_element_factory_make("udpsink", "udp-sink");
+#include "gst_rgbd_server/app_queue.h"
+#include "gst_rgbd_server/camera_source.h"
+#include "gst_rgbd_server/encoder_factory.h"
+#include "gst_rgbd_server/rtcp_rate_adapter.h"
+#include "gst_rgbd_server/rtp_protection.h"
+#include "gst_rgbd_server/stream_activation.h"
+
+// Serves the camera at rtsp://0.0.0.0:8554/color. The camera and the encoder
+// only run while at least one client watches, plus a grace period after the
+// last one leaves.
+struct RsServer {
+    std::unique_ptr<CameraSource> camera;
+    CameraConfig config;
+    std::unique_ptr<StreamActivation> activation;
+    std::thread captureThread;
+    std::atomic<bool> capturing{false};
+    std::mutex sinkMutex;
+    // two newest frames, older ones dropped when the encoder falls behind
+    std::unique_ptr<AppSrcQueue> sink;
+};
+
+static void captureLoop(RsServer *server) {
+    while (server->capturing) {
+        CameraFrameSet frames;
+        if (!server->camera->waitForFrames(frames, 100) || !frames.color) {
+            continue;
+        }
+        // Send the frame to GStreamer appsrc, wrapped instead of copied
+        const CameraImage &color = frames.color;
+        GstBuffer *buffer = gst_buffer_new_wrapped_full(
+            GST_MEMORY_FLAG_READONLY, const_cast<void *>(color.data),
+            color.size, 0, color.size,
+            new std::shared_ptr<void>(frames.keepAlive), [](gpointer data) {
+                delete static_cast<std::shared_ptr<void> *>(data);
+            });
+        std::lock_guard<std::mutex> lock(server->sinkMutex);
+        if (server->sink) {
+            server->sink->push(buffer);
+        } else {
+            gst_buffer_unref(buffer);
+        }
+    }
+}
 
-    if (!pipeline || !source || !convert || !encoder || !payloader || !sink) {
-        g_error("Failed to create elements.");
-        return -1;
+static void setActive(RsServer *server, bool active) {
+    if (active == server->capturing) {
+        return;
     }
+    if (!active) {
+        server->capturing = false;
+        server->captureThread.join();
+        server->camera->stop();
+        g_print("No clients, camera stopped.\n");
+        return;
+    }
+    if (!server->camera->start(server->config)) {
+        g_printerr("Failed to start camera.\n");
+        return;
+    }
+    server->capturing = true;
+    server->captureThread = std::thread(captureLoop, server);
+    g_print("Client connected, camera started.\n");
+}
+
+static void onMediaConfigure(GstRTSPMediaFactory *, GstRTSPMedia *media,
+                             gpointer user_data) {
+    RsServer *server = static_cast<RsServer *>(user_data);
+    GstElement *element = gst_rtsp_media_get_element(media);
+    GstElement *appsrc =
+        gst_bin_get_by_name_recurse_up(GST_BIN(element), "video-source");
 
     // Set properties for the appsrc element
-    g_object_set(G_OBJECT(source),
+    GstCaps *caps = gst_caps_new_simple("video/x-raw",
+             "format", G_TYPE_STRING, "BGR",
+             "width", G_TYPE_INT, server->config.width,
+             "height", G_TYPE_INT, server->config.height,
+             "framerate", GST_TYPE_FRACTION, server->config.fps, 1,
+             nullptr);
+    g_object_set(G_OBJECT(appsrc),
              "is-live", TRUE,
-             "num-buffers", -1,
-             "block", TRUE,
-             "caps", gst_caps_from_string("video/x-raw, format=RGB"),
+             "do-timestamp", TRUE,
+             "caps", caps,
              nullptr);
-    // Set properties for the encoder
-    g_object_set(G_OBJECT(encoder), "bitrate", 2000000, nullptr);
+    gst_util_set_object_arg(G_OBJECT(appsrc), "format", "time");
+    gst_caps_unref(caps);
 
-    // Set properties for the UDP sink (change the IP and port accordingly)
-    g_object_set(G_OBJECT(sink), "host", "127.0.0.1", "port", 5000, nullptr);
-
-    // Add elements to the pipeline
-    gst_bin_add_many(GST_BIN(pipeline), source, convert, encoder, payloader, sink, nullptr);
-
-    // Link elements
-    if (!gst_element_link_many(source, convert, encoder, payloader, sink, nullptr)) {
-        g_error("Failed to link elements.");
-        return -1;
+    {
+        std::lock_guard<std::mutex> lock(server->sinkMutex);
+        server->sink.reset(new AppSrcQueue(appsrc, "/color", QueuePolicy()));
+    }
+    server->activation->acquire(0);
+
+    // Follow the clients' receiver reports instead of a pinned bitrate
+    GstElement *encoder =
+        gst_bin_get_by_name_recurse_up(GST_BIN(element), "h264-encoder");
+    GstElement *adapt = gst_bin_get_by_name_recurse_up(GST_BIN(element), "adapt");
+    RtcpRateAdapter *adapter = new RtcpRateAdapter("/color", encoder, adapt,
+             server->config.width, server->config.height, server->config.fps,
+             RateControllerOptions());
+    adapter->attach(media);
+    g_object_set_data_full(G_OBJECT(media), "rate-adapter", adapter,
+             [](gpointer adapter) {
+                 delete static_cast<RtcpRateAdapter *>(adapter);
+             });
+    gst_object_unref(adapt);
+    gst_object_unref(encoder);
+
+    // ULPFEC in RED on every stream; RTX is set up by the factory
+    RtpProtectionOptions protection;
+    for (guint i = 0; i < gst_rtsp_media_n_streams(media); ++i) {
+        GstRTSPStream *stream = gst_rtsp_media_get_stream(media, i);
+        gst_rtsp_stream_set_ulpfec_pt(stream, protection.fecPt);
+        gst_rtsp_stream_set_ulpfec_percentage(stream, protection.fecPercentage);
     }
 
-    // Set the pipeline to the playing state
-    gst_element_set_state(pipeline, GST_STATE_PLAYING);
-
-    // RealSense configuration
-    rs2::config cfg;
-    rs2::pipeline pipe;
-    rs2::pipeline_profile profile;
-
-    // Enable the RGB stream
-    cfg.enable_stream(RS2_STREAM_COLOR, 640, 480, RS2_FORMAT_BGR8, 30);
-
-    // Start the pipeline
-    pipe.start(cfg);
-
-    // Main loop to capture and feed frames into GStreamer pipeline
-    while (1) {
-        rs2::frameset frames;
-        if (pipe.poll_for_frames(&frames)) {
-            // Get the RGB frame
-            rs2::video_frame color_frame = frames.get_color_frame();
-
-            // Send the frame to GStreamer appsrc
-            GstBuffer *buffer = gst_buffer_new_and_alloc(color_frame.get_width() * color_frame.get_height() * 3);
-            gst_buffer_fill(buffer, 0, color_frame.get_data(), color_frame.get_width() * color_frame.get_height() * 3);
-            gst_app_src_push_buffer(GST_APP_SRC(source), buffer);
-        }
-
-        // Handle GStreamer messages if any
-        GstBus *bus = gst_element_get_bus(pipeline);
-        GstMessage *msg = gst_bus_pop(bus);
-
-        if (msg != nullptr) {
-            GError *err;
-            gchar *debug_info;
-
-            switch (GST_MESSAGE_TYPE(msg)) {
-                case GST_MESSAGE_ERROR:
-                    gst_message_parse_error(msg, &err, &debug_info);
-                    g_error("Error: %s", err->message);
-                    g_error_free(err);
-                    g_free(debug_info);
-                    break;
-
-                case GST_MESSAGE_EOS:
-                    g_print("End of stream.\n");
-                    break;
+    // The shared media is unprepared once its last client is gone
+    g_signal_connect(media, "unprepared",
+             G_CALLBACK(+[](GstRTSPMedia *media, gpointer user_data) {
+                 RsServer *server = static_cast<RsServer *>(user_data);
+                 g_object_set_data(G_OBJECT(media), "rate-adapter", NULL);
+                 {
+                     std::lock_guard<std::mutex> lock(server->sinkMutex);
+                     server->sink.reset();
+                 }
+                 server->activation->release(0);
+             }),
+             server);
+
+    gst_object_unref(appsrc);
+    gst_object_unref(element);
+}
 
-                default:
-                    // Ignore other messages
-                    break;
-            }
+int main(int argc, char *argv[]) {
+    // Initialize GStreamer
+    gst_init(&argc, &argv);
 
-            gst_message_unref(msg);
-        }
+    RsServer server;
+    // Camera: the first RealSense, or e.g. "synthetic:1" without hardware
+    server.camera = createCameraSource(argc > 1 ? argv[1] : "realsense");
+    if (!server.camera) {
+        return -1;
+    }
+    server.config.width = 640;
+    server.config.height = 480;
+    server.config.fps = 30;
+    server.config.colorFormat = RgbdPixelFormat::kBGR8;
+    server.config.depth = false;
+    server.config.infrared = false;
+    server.config.imu = false;
+    server.activation.reset(new StreamActivation(
+        5000, [&server](uint32_t active) { setActive(&server, active != 0); }));
+
+    GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+    GstRTSPServer *rtspServer = gst_rtsp_server_new();
+    g_object_set(rtspServer, "service", "8554", nullptr);
+    GstRTSPMountPoints *mounts = gst_rtsp_server_get_mount_points(rtspServer);
+
+    // nvv4l2h264enc on a Jetson, the best available H.264 encoder elsewhere
+    EncoderRequest request;
+    request.width = server.config.width;
+    request.height = server.config.height;
+    request.fps = server.config.fps;
+    EncoderChoice encoder = EncoderFactory::select(request);
+    if (!encoder) {
+        g_printerr("No H.264 encoder available.\n");
+        return -1;
+    }
 
-        gst_object_unref(bus);
+    // Nothing is encoded until a client asks for the mount
+    GstRTSPMediaFactory *factory = gst_rtsp_media_factory_new();
+    std::string launch =
+        "( appsrc name=video-source ! videoconvert ! videoscale ! "
+        "videorate ! capsfilter name=adapt ! " +
+        encoder.launch("h264-encoder") + " ! " + encoder.payloader() +
+        " name=pay0 pt=96 )";
+    gst_rtsp_media_factory_set_launch(factory, launch.c_str());
+    gst_rtsp_media_factory_set_shared(factory, TRUE);
+    // Clients that offer AVPF get NACK based retransmission of packets up to
+    // the receiver's latency budget old
+    RtpProtectionOptions protection;
+    gst_rtsp_media_factory_set_profiles(
+        factory, GstRTSPProfile(GST_RTSP_PROFILE_AVP | GST_RTSP_PROFILE_AVPF));
+    gst_rtsp_media_factory_set_retransmission_time(
+        factory, protection.latencyMs * GST_MSECOND);
+    g_signal_connect(factory, "media-configure",
+             G_CALLBACK(onMediaConfigure), &server);
+    gst_rtsp_mount_points_add_factory(mounts, "/color", factory);
+    g_object_unref(mounts);
+
+    if (gst_rtsp_server_attach(rtspServer, NULL) == 0) {
+        g_printerr("Failed to attach the RTSP server.\n");
+        return -1;
     }
+    g_print("Serving rtsp://127.0.0.1:8554/color\n");
+    g_main_loop_run(loop);
 
-    // Stop the pipeline
-    gst_element_set_state(pipeline, GST_STATE_NULL);
-    gst_object_unref(pipeline);
+    server.activation.reset();
+    setActive(&server, false);
+    g_object_unref(rtspServer);
+    g_main_loop_unref(loop);
 
     return 0;
 }
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/gst.h>
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// What a full queue does with one more buffer.
+enum class QueueDrop {
+  kDropOldest, // evict the oldest queued buffer, latency stays bounded
+  kDropNewest, // discard the incoming buffer
+  kBlock,      // wait for room, for replays and files that must not lose data
+};
+
+// "drop-oldest", "drop-newest" or "block"
+bool parseQueueDrop(const std::string &name, QueueDrop &drop);
+const char *queueDropName(QueueDrop drop);
+
+// Capacity of an app source or sink queue. A limit of 0 is unlimited; the
+// queue is full once either limit is reached.
+struct QueuePolicy {
+  uint32_t maxFrames = 2;
+  uint64_t maxBytes = 0;
+  QueueDrop drop = QueueDrop::kDropOldest;
+};
+
+struct QueueStats {
+  uint64_t enqueued = 0;
+  uint64_t dropped = 0;
+  // most frames ever queued at once
+  uint64_t highWater = 0;
+};
+
+// Wraps an appsrc so every push goes through one bounded queue. Counters
+// are published as rgbd_queue_{enqueued_total,dropped_total,high_water}
+// {queue="name"}; queues created under the same name share them, so a mount
+// keeps counting across clients.
+//
+// appsrc evicts the oldest buffer itself from GStreamer 1.20 (leaky-type).
+// Older versions have neither leaky-type nor max-buffers: drop-oldest then
+// drops the newest instead, and a frame limit becomes a byte limit once the
+// first buffer shows the frame size.
+class AppSrcQueue {
+public:
+  AppSrcQueue(GstElement *appsrc, const std::string &name,
+              const QueuePolicy &policy);
+  ~AppSrcQueue();
+  AppSrcQueue(const AppSrcQueue &) = delete;
+  AppSrcQueue &operator=(const AppSrcQueue &) = delete;
+
+  // Takes ownership of buffer. Returns GST_FLOW_OK for a dropped buffer, any
+  // other value means the source is flushing or at EOS.
+  GstFlowReturn push(GstBuffer *buffer);
+  // Same for a list, e.g. the packets of one socket read. Only the byte limit
+  // applies: its buffers are not frames, and appsrc counts lists as one.
+  GstFlowReturn pushList(GstBufferList *list);
+  void endOfStream();
+
+  GstElement *element() const { return GST_ELEMENT(appsrc_); }
+  const QueuePolicy &policy() const { return policy_; }
+  QueueStats stats() const;
+
+private:
+  uint64_t levelFrames(gsize frameSize) const;
+
+  GstAppSrc *appsrc_;
+  QueuePolicy policy_;
+  // appsrc drops the oldest buffer itself
+  bool leaky_ = false;
+  // appsrc reports current-level-buffers
+  bool countsFrames_ = false;
+  gsize frameSize_ = 0;
+  std::atomic<double> &enqueued_;
+  std::atomic<double> &dropped_;
+  std::atomic<double> &highWater_;
+};
+
+// The pulling side: bounds an appsink the same way. A pad probe sees every
+// buffer before appsink queues it, so drop-newest and the counters need no
+// appsink support; drop-oldest and block use appsink's own max-buffers. A
+// byte limit becomes a frame limit from the size of each incoming buffer.
+// Samples must be taken with pull() for the level to stay right.
+class AppSinkQueue {
+public:
+  AppSinkQueue(GstElement *appsink, const std::string &name,
+               const QueuePolicy &policy);
+  ~AppSinkQueue();
+  AppSinkQueue(const AppSinkQueue &) = delete;
+  AppSinkQueue &operator=(const AppSinkQueue &) = delete;
+
+  // Waits up to timeout for the next sample, NULL on timeout or EOS. The
+  // caller unrefs the sample.
+  GstSample *pull(GstClockTime timeout);
+  bool isEos() const;
+
+  GstElement *element() const { return GST_ELEMENT(appsink_); }
+  QueueStats stats() const;
+
+private:
+  static GstPadProbeReturn onProbe(GstPad *pad, GstPadProbeInfo *info,
+                                   gpointer user_data);
+  GstPadProbeReturn admit(gsize size);
+
+  GstAppSink *appsink_;
+  QueuePolicy policy_;
+  GstPad *pad_ = nullptr;
+  gulong probe_ = 0;
+  std::mutex mutex_;
+  // buffers appsink holds, as far as admit() and pull() can tell
+  uint64_t queued_ = 0;
+  guint appsinkLimit_ = 0;
+  std::atomic<double> &enqueued_;
+  std::atomic<double> &dropped_;
+  std::atomic<double> &highWater_;
+};
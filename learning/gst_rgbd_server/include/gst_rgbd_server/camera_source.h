@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gst_rgbd_server/rgbd_recording_format.h"
+
+// Profile requested from a camera. Streams left disabled are not started, so
+// they cost neither USB bandwidth nor rendering time.
+struct CameraConfig {
+  int width = 1280;
+  int height = 720;
+  int fps = 30;
+  RgbdPixelFormat colorFormat = RgbdPixelFormat::kBGR8;
+  bool color = true;
+  bool depth = true;
+  bool infrared = true; // left and right
+  bool imu = true;
+  // depth aligned to the color viewpoint
+  bool alignDepth = false;
+};
+
+// One image of a frame set. data stays valid while the owning
+// CameraFrameSet (or a copy of its keepAlive) is alive.
+struct CameraImage {
+  const void *data = nullptr;
+  size_t size = 0;
+  int width = 0;
+  int height = 0;
+  int stride = 0;
+  RgbdPixelFormat format = RgbdPixelFormat::kUnknown;
+
+  explicit operator bool() const { return data != nullptr; }
+};
+
+struct CameraFrameSet {
+  uint64_t frameNumber = 0;
+  // capture time on the host steady clock, comparable across cameras
+  uint64_t timestampNs = 0;
+  CameraImage color;
+  CameraImage depth;
+  CameraImage infrared[2];
+  bool hasAccel = false;
+  bool hasGyro = false;
+  float accel[3] = {0, 0, 0}; // m/s^2
+  float gyro[3] = {0, 0, 0};  // rad/s
+  // owns the image memory, hand a copy to anything that outlives the set
+  std::shared_ptr<void> keepAlive;
+};
+
+// A source of synchronized RGB-D(+IMU) frame sets. Implementations are not
+// thread safe; one thread drives start/waitForFrames/stop.
+class CameraSource {
+public:
+  virtual ~CameraSource() = default;
+
+  virtual bool start(const CameraConfig &config) = 0;
+  virtual void stop() = 0;
+  virtual bool isStarted() const = 0;
+
+  // Blocks until the next frame set, false on timeout or when stopped.
+  virtual bool waitForFrames(CameraFrameSet &frames,
+                             uint32_t timeoutMs = 5000) = 0;
+
+  virtual std::string serial() const = 0;
+  virtual const CameraConfig &config() const = 0;
+  // Valid after start().
+  virtual RgbdIntrinsics colorIntrinsics() const = 0;
+  virtual RgbdIntrinsics depthIntrinsics() const = 0;
+  // meters per depth unit
+  virtual float depthScale() const = 0;
+};
+
+// Creates a source from a spec string:
+//   "realsense"            first connected device
+//   "realsense:<serial>"   a specific device
+//   "synthetic"            procedural scene, seed 0
+//   "synthetic:<seed>"     procedural scene with its own layout and serial
+// Returns nullptr for an unknown spec.
+std::unique_ptr<CameraSource> createCameraSource(const std::string &spec);
+
+// GStreamer video/x-raw format name of a pixel format, nullptr if there is
+// none, and back (kUnknown).
+const char *gstVideoFormat(RgbdPixelFormat format);
+RgbdPixelFormat pixelFormatFromGst(const std::string &format);
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "gst_rgbd_server/camera_source.h"
+#include "gst_rgbd_server/worker_pool.h"
+
+enum class YuvLayout { kI420, kNV12 };
+// Limited range matrices, as videoconvert uses for RGB to YUV
+enum class YuvMatrix { kBT601, kBT709 };
+
+bool parseYuvLayout(const std::string &name, YuvLayout &layout);
+// GStreamer format names, "I420" and "NV12"
+const char *yuvLayoutName(YuvLayout layout);
+// GStreamer colorimetry names, "bt601" and "bt709"
+const char *yuvMatrixName(YuvMatrix matrix);
+// BT.709 from 720 rows up, BT.601 below.
+YuvMatrix defaultYuvMatrix(int height);
+
+// Plane layout GStreamer assumes for a buffer without GstVideoMeta: rows
+// padded to 4 bytes, chroma rounded up for odd sizes.
+struct YuvPlanes {
+  size_t offset[3] = {0, 0, 0};
+  int stride[3] = {0, 0, 0};
+  size_t size = 0;
+};
+YuvPlanes yuvPlanes(YuvLayout layout, int width, int height);
+
+// Converts packed RGB or BGR to I420 or NV12 so the encoder's videoconvert
+// becomes a passthrough. Packed YUYV or UYVY straight from the sensor only
+// has its chroma averaged over row pairs. Pairs of rows are split into bands
+// over the pool; within a row the AVX2 or NEON kernel does 16 pixels at a
+// time. All kernels give identical output.
+class ColorConverter {
+public:
+  enum class Kernel { kScalar, kAvx2, kNeon };
+
+  // Without a pool everything runs on the calling thread.
+  ColorConverter(YuvLayout layout, YuvMatrix matrix,
+                 WorkerPool *pool = nullptr);
+
+  // dst holds yuvPlanes(layout, width, height).size bytes.
+  void convert(const uint8_t *src, int stride, bool bgr, int width,
+               int height, uint8_t *dst) const;
+  // Packed 4:2:2, YUYV or UYVY byte order.
+  void convert422(const uint8_t *src, int stride, bool uyvy, int width,
+                  int height, uint8_t *dst) const;
+  // False for formats other than kRGB8, kBGR8, kYUYV and kUYVY.
+  bool convert(const CameraImage &image, uint8_t *dst) const;
+  static bool canConvert(RgbdPixelFormat format);
+
+  // 2x2 box downscale of a frame in this converter's layout to
+  // (width / 2) x (height / 2); one level of a rendition pyramid.
+  void halve(const uint8_t *src, int width, int height, uint8_t *dst) const;
+
+  YuvLayout layout() const { return layout_; }
+  YuvMatrix matrix() const { return matrix_; }
+  Kernel kernel() const { return kernel_; }
+  // For benchmarking; falls back to kScalar if the CPU lacks the kernel.
+  void setKernel(Kernel kernel);
+  // The fastest kernel this CPU supports.
+  static Kernel bestKernel();
+  static const char *kernelName(Kernel kernel);
+
+private:
+  // Runs fn over [begin, end) ranges of row pairs covering the image.
+  void forEachBand(int height,
+                   const std::function<void(size_t, size_t)> &fn) const;
+
+  YuvLayout layout_;
+  YuvMatrix matrix_;
+  WorkerPool *pool_;
+  Kernel kernel_;
+};
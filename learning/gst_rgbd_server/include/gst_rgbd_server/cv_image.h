@@ -0,0 +1,11 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include "gst_rgbd_server/camera_source.h"
+
+// A color image the way imshow and imencode take it: BGR, or gray for kY8.
+// kBGR8 and kY8 are wrapped without a copy, so the result is only valid
+// while the image is; other formats are converted. Empty for depth and
+// formats without a conversion.
+cv::Mat bgrImage(const CameraImage &image);
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <gst/gst.h>
+
+#include <string>
+#include <vector>
+
+enum class VideoCodec { kH264, kH265, kVP8 };
+
+// Named tunings, mapped per encoder onto whatever properties it has.
+enum class EncoderPreset {
+  kDefault,
+  // no B-frames, no lookahead, every frame leaves as soon as it is encoded
+  kZeroLatency,
+  // zero latency plus a rolling intra refresh instead of periodic IDRs, so
+  // no frame is much larger than the others
+  kIntraRefresh,
+  // zero latency with each frame split into slices encoded in parallel
+  kSlicedThreads,
+};
+
+bool parseVideoCodec(const std::string &name, VideoCodec &codec);
+bool parseEncoderPreset(const std::string &name, EncoderPreset &preset);
+const char *videoCodecName(VideoCodec codec);
+const char *encoderPresetName(EncoderPreset preset);
+
+// One encoder element the factory knows how to drive.
+struct EncoderInfo {
+  const char *element;   // e.g. "nvv4l2h264enc"
+  VideoCodec codec;
+  bool hardware;
+  // conversion from system memory video/x-raw into what the encoder takes
+  const char *upload;
+  const char *bitrateProperty;
+  bool bitsPerSecond;    // bitrate unit is bit/s instead of kbit/s
+};
+
+struct EncoderRequest {
+  VideoCodec codec = VideoCodec::kH264;
+  EncoderPreset preset = EncoderPreset::kZeroLatency;
+  // empty or "auto" picks one, anything else must be available
+  std::string element;
+  int width = 1280;
+  int height = 720;
+  int fps = 30;
+  unsigned bitrateKbps = 2000;
+  // Encode synthetic frames through every candidate and keep the fastest
+  // that meets the budget; otherwise take the first available, hardware
+  // first.
+  bool calibrate = false;
+  double latencyBudgetMs = 20;
+  int calibrationFrames = 60;
+};
+
+struct EncoderChoice {
+  const EncoderInfo *info = nullptr;
+  EncoderPreset preset = EncoderPreset::kDefault;
+  unsigned bitrateKbps = 0;
+  // measured by calibration, < 0 when not calibrated
+  double latencyMs = -1;
+  double fps = -1;
+
+  explicit operator bool() const { return info != nullptr; }
+  // "<upload> ! <encoder> name=NAME <preset and bitrate properties>"
+  std::string launch(const std::string &name = "enc") const;
+  // The matching RTP payloader, e.g. "rtph264pay config-interval=1".
+  std::string payloader() const;
+  // Raw format the upload passes through without converting, NV12 for
+  // hardware encoders and I420 for software ones.
+  const char *rawFormat() const;
+};
+
+class EncoderFactory {
+public:
+  // Encoders for codec present in this GStreamer installation, in order of
+  // preference: hardware first.
+  static std::vector<const EncoderInfo *> available(VideoCodec codec);
+  static const EncoderInfo *find(const std::string &element);
+
+  // Encodes request.calibrationFrames frames of videotestsrc, sets the mean
+  // per frame latency and throughput. False if the encoder does not run,
+  // e.g. a GPU element on a machine without the GPU.
+  static bool calibrate(const EncoderInfo &info, const EncoderRequest &request,
+                        EncoderChoice &result);
+
+  static EncoderChoice select(const EncoderRequest &request);
+
+  // Sets the bitrate on an encoder element in its own unit.
+  static void setBitrate(GstElement *encoder, unsigned kbps);
+  // Applies preset properties to an encoder element built by hand.
+  static void applyPreset(GstElement *encoder, EncoderPreset preset);
+};
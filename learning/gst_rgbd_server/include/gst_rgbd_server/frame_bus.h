@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gst_rgbd_server/app_queue.h"
+#include "gst_rgbd_server/camera_source.h"
+
+// A published frame set. Consumers share it, nobody may change it; the
+// images live as long as any consumer holds it.
+using SharedFrameSet = std::shared_ptr<const CameraFrameSet>;
+
+// One consumer's queue of frame sets, bounded by its own QueuePolicy: the
+// frame limit counts sets, the byte limit their image bytes. A blocking
+// subscription makes the publisher wait, so only use it for consumers that
+// must see every frame and keep up on average.
+//
+// Counters are published as rgbd_bus_{delivered_total,dropped_total,
+// high_water}{consumer="name"}; delivered counts the sets pop() returned.
+class FrameSubscription {
+public:
+  FrameSubscription(const std::string &name, const QueuePolicy &policy);
+  FrameSubscription(const FrameSubscription &) = delete;
+  FrameSubscription &operator=(const FrameSubscription &) = delete;
+
+  // Waits up to timeoutMs, 0 to poll and -1 without limit, for the oldest
+  // queued set. False on timeout and once closed.
+  bool pop(SharedFrameSet &frames, int timeoutMs);
+  // Drops what is queued, e.g. sets of a camera profile no longer running.
+  void flush();
+  // Stops delivery; pop() and a publisher waiting for room return.
+  void close();
+  bool isClosed() const;
+
+  const std::string &name() const { return name_; }
+  QueueStats stats() const;
+
+private:
+  friend class FrameBus;
+  void offer(const SharedFrameSet &frames, uint64_t bytes);
+
+  std::string name_;
+  QueuePolicy policy_;
+  mutable std::mutex mutex_;
+  std::condition_variable ready_;
+  std::condition_variable space_;
+  std::deque<std::pair<SharedFrameSet, uint64_t>> queue_;
+  uint64_t queuedBytes_ = 0;
+  bool closed_ = false;
+  QueueStats stats_;
+  uint64_t popped_ = 0;
+  std::atomic<double> &delivered_;
+  std::atomic<double> &dropped_;
+  std::atomic<double> &highWater_;
+};
+
+// Fans the frame sets of one capture thread out to any number of consumers
+// in the process, RTSP, preview, recorders, depth processing, without
+// copying pixels: every subscription queues a reference to the same set.
+// A slow consumer only loses its own frames, by its own policy.
+class FrameBus {
+public:
+  FrameBus() = default;
+  ~FrameBus();
+  FrameBus(const FrameBus &) = delete;
+  FrameBus &operator=(const FrameBus &) = delete;
+
+  // A queue the caller drains with pop() from a thread of its choice. It
+  // stops receiving once closed or released.
+  std::shared_ptr<FrameSubscription> subscribe(const std::string &name,
+                                               const QueuePolicy &policy);
+  // Calls handler for every set the subscription takes, on a thread of its
+  // own, until close().
+  void consume(const std::string &name, const QueuePolicy &policy,
+               std::function<void(const CameraFrameSet &)> handler);
+
+  // Hands frames to every subscription. Called from one capture thread.
+  void publish(CameraFrameSet &&frames);
+  void flush();
+  // Closes all subscriptions and joins the consumer threads.
+  void close();
+
+private:
+  using Subscribers = std::vector<std::weak_ptr<FrameSubscription>>;
+
+  std::mutex mutex_;
+  // replaced, never changed, so publish() walks it without the lock
+  std::shared_ptr<const Subscribers> subscribers_ =
+      std::make_shared<Subscribers>();
+  std::vector<std::thread> consumers_;
+};
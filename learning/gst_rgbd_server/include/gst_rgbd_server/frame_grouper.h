@@ -0,0 +1,40 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "gst_rgbd_server/camera_source.h"
+
+// Groups frame sets of N cameras whose timestamps lie within a tolerance of
+// each other. Capture threads push(), a consumer pops complete groups. When
+// the cameras drift apart the oldest frame is dropped, so a slow or stalled
+// camera never holds back the others by more than maxQueued frames.
+class FrameGrouper {
+public:
+  FrameGrouper(size_t numCameras, uint64_t toleranceNs, size_t maxQueued = 4);
+
+  void push(size_t camera, CameraFrameSet frames);
+
+  // Blocks until a group is complete; group[i] is camera i. False on timeout
+  // or after close().
+  bool waitGroup(std::vector<CameraFrameSet> &group, uint32_t timeoutMs);
+  void close();
+
+  uint64_t groups() const;
+  uint64_t dropped() const;
+
+private:
+  bool tryGroup(std::vector<CameraFrameSet> &group);
+
+  uint64_t toleranceNs_;
+  size_t maxQueued_;
+  mutable std::mutex mutex_;
+  std::condition_variable pushed_;
+  std::vector<std::deque<CameraFrameSet>> queues_;
+  bool closed_ = false;
+  uint64_t groups_ = 0;
+  uint64_t dropped_ = 0;
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct GopCacheOptions {
+  // Most RTP bytes held for one GOP; a longer GOP is not cached
+  size_t maxBytes = 4 << 20;
+  // Least time between two keyframes forced by joining clients
+  guint keyframeIntervalMs = 1000;
+};
+
+// Shortens the wait of a client joining a shared RTSP media for its first
+// decodable frame. The RTP packets of the current GOP, from the last keyframe
+// on, are kept as the payloader sends them. Every PLAY forces a keyframe
+// upstream of the payloader, at most once per keyframeIntervalMs, and
+// RTSP-over-TCP clients are sent the cached GOP straight away, renumbered to
+// end just before the sequence number in their RTP-Info. UDP clients get the
+// next keyframe; gst-rtsp-server has no per-client path for UDP.
+//
+// Time from PLAY to the client's first keyframe is published as
+// rgbd_join_keyframe_ms, joins as rgbd_joins_total, joins served from the
+// cache as rgbd_joins_primed_total and forced keyframes as
+// rgbd_forced_keyframes_total, all under stream="<name>".
+class GopCache {
+public:
+  GopCache(const std::string &name, GstElement *encoder, GstElement *payloader,
+           const GopCacheOptions &options = GopCacheOptions());
+  ~GopCache();
+
+  GopCache(const GopCache &) = delete;
+  GopCache &operator=(const GopCache &) = delete;
+
+  // Hands the cache to the media, which deletes it when unprepared. PLAY
+  // requests for the media are routed to join() once watch() is set up.
+  void attach(GstRTSPMedia *media);
+  // Joins every PLAY of the server's clients to the cache of its media.
+  static void watch(GstRTSPServer *server);
+
+  // A client started playing on transport, with first live packet `seq`, or
+  // -1 if unknown. Runs on the server's main context.
+  void join(GstRTSPStreamTransport *transport, int seq);
+
+private:
+  static GstPadProbeReturn onEncoded(GstPad *pad, GstPadProbeInfo *info,
+                                     gpointer user_data);
+  static GstPadProbeReturn onPayloaded(GstPad *pad, GstPadProbeInfo *info,
+                                       gpointer user_data);
+  static void onPlayRequest(GstRTSPClient *client, GstRTSPContext *ctx,
+                            gpointer user_data);
+  void add(GstBuffer *packet);
+  void clear();
+  void forceKeyframe();
+  bool prime(GstRTSPStreamTransport *transport, int seq);
+
+  std::string name_;
+  std::string label_;
+  GstElement *encoder_;
+  GstElement *payloader_;
+  GopCacheOptions options_;
+  GstPad *encoderPad_ = nullptr;
+  GstPad *payloaderPad_ = nullptr;
+  gulong encoderProbe_ = 0;
+  gulong payloaderProbe_ = 0;
+
+  std::mutex mutex_;
+  std::vector<GstBuffer *> packets_;
+  size_t bytes_ = 0;
+  // set by a keyframe leaving the encoder, its packets start the next GOP
+  bool keyframePending_ = false;
+  // packets_ start at a keyframe
+  bool valid_ = false;
+  // g_get_monotonic_time() of the joins still waiting for a keyframe
+  std::vector<gint64> waiting_;
+
+  gint64 lastForced_ = 0;
+  guint forceCount_ = 0;
+};
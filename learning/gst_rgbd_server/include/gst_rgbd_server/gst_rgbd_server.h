@@ -2,39 +2,224 @@
 
 #include <gst/app/gstappsrc.h>
 #include <gst/gst.h>
-#include <librealsense2/rs.hpp>
 #include <opencv2/opencv.hpp>
 
 #include <gst/rtsp-server/rtsp-server.h>
 #include <gst/rtsp/gstrtspconnection.h>
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gst_rgbd_server/app_queue.h"
+#include "gst_rgbd_server/camera_source.h"
+#include "gst_rgbd_server/color_convert.h"
+#include "gst_rgbd_server/encoder_factory.h"
+#include "gst_rgbd_server/frame_bus.h"
+#include "gst_rgbd_server/gop_cache.h"
+#include "gst_rgbd_server/loss_injector.h"
+#include "gst_rgbd_server/media_pool.h"
+#include "gst_rgbd_server/multicast.h"
+#include "gst_rgbd_server/pre_event_ring.h"
+#include "gst_rgbd_server/rate_controller.h"
+#include "gst_rgbd_server/rgbd_replay_source.h"
+#include "gst_rgbd_server/segment_recorder.h"
+#include "gst_rgbd_server/shm_frame_ring.h"
+#include "gst_rgbd_server/snapshot_server.h"
+#include "gst_rgbd_server/stream_activation.h"
+#include "gst_rgbd_server/worker_pool.h"
+
 class GstRgbdServer {
 public:
+  // Serves the first connected RealSense device.
   GstRgbdServer();
+  explicit GstRgbdServer(std::unique_ptr<CameraSource> camera);
+  // Serve a recording instead of a connected camera.
+  explicit GstRgbdServer(std::unique_ptr<RgbdReplaySource> replay);
   ~GstRgbdServer();
 
+  // How long a camera stream keeps running after its last client left.
+  void setIdleGracePeriod(guint ms) { graceMs_ = ms; }
+  // Bounds for the RTCP driven bitrate control of every camera mount.
+  void setRateControl(const RateControllerOptions &options) {
+    rateOptions_ = options;
+  }
+  // Simulated network trouble on the outgoing RTP packets, for testing.
+  void setLossInjection(const LossInjectorOptions &options) {
+    lossOptions_ = options;
+  }
+  // Codec, encoder and preset of the camera mounts; size, frame rate and
+  // start bitrate come from the server.
+  void setEncoderRequest(const EncoderRequest &request) {
+    encoderRequest_ = request;
+  }
+  // Pixel format requested from the camera for the color mount. The default
+  // YUYV is what the sensor delivers, so nothing converts it to BGR and back.
+  void setColorFormat(RgbdPixelFormat format) {
+    baseConfig_.colorFormat = format;
+  }
+  // Convert RGB/BGR or YUYV/UYVY color to the encoder's YUV format before
+  // pushing, with this many helper threads (0: one per core). Off leaves it
+  // to the videoconvert of every media pipeline.
+  void setColorConversion(bool enabled, size_t threads = 4) {
+    convertColor_ = enabled;
+    convertThreads_ = threads;
+  }
+  // How much of the current GOP a camera mount keeps for joining RTSP/TCP
+  // clients, and how often joins may force a keyframe.
+  void setGopCache(const GopCacheOptions &options) { gopOptions_ = options; }
+  // Keep media prepared ahead of the clients of every camera mount. Off by
+  // default: each pooled media holds an encoder session while it waits.
+  void setMediaPool(const MediaPoolOptions &options) { mediaPool_ = options; }
+  // Also offer the camera mounts over RTSP negotiated multicast.
+  void setMulticast(const MulticastOptions &options) { multicast_ = options; }
+  // Threads serving RTSP clients and preparing media; gst-rtsp-server
+  // defaults to one for all of them.
+  void setRtspThreads(guint threads) { rtspThreads_ = threads; }
+  // Bounds the appsrc queue of every client; by default the two newest
+  // frames are kept and older ones dropped.
+  void setQueuePolicy(const QueuePolicy &policy) { queuePolicy_ = policy; }
+  // Also publish raw color and depth to processes on this machine through
+  // the shared memory ring /dev/shm/<name>, no encoding involved. Keeps both
+  // streams running whether or not anybody watches over RTSP.
+  void setSharedMemory(const std::string &name, uint32_t slots = 4) {
+    shmName_ = name;
+    shmSlots_ = slots;
+  }
+  // Write what the color mount streams, as encoded, to segment files, and
+  // optionally the depth mount and the IMU. Runs while the mounts have
+  // clients; nothing is encoded for the recording alone.
+  void setRecording(const RecorderOptions &options) {
+    recordOptions_ = options;
+    baseConfig_.imu = options.imu;
+  }
+  // Keep the last seconds of the encoded color and depth streams in
+  // budgetBytes of memory; an event, triggerEvent() or SIGUSR1, saves them
+  // and what follows to directory. Keeps both streams running and encodes
+  // them for the ring whether or not anybody watches the mounts.
+  void setPreEventBuffer(size_t budgetBytes, const std::string &directory) {
+    preEventBytes_ = budgetBytes;
+    preEventDir_ = directory;
+  }
+  void triggerEvent();
+  // Serve stills of the newest color and depth frames on endpoint,
+  // "unix:/path" or "[host:]port". Keeps both streams running.
+  void setSnapshotEndpoint(const std::string &endpoint) {
+    snapshotEndpoint_ = endpoint;
+  }
+  // Show color, depth and infrared in OpenCV windows, from the main loop,
+  // while a client keeps the camera running.
+  void setPreview(bool preview) { previewEnabled_ = preview; }
+  // Rewrite the metrics as a Prometheus text file every second.
+  void setMetricsFile(const std::string &path) { metricsFile_ = path; }
+
   void stream();
   void stopStreaming();
   void update();
   void onNeedData(GstElement *element, guint size);
+  void onMediaConfigure(GstRTSPMediaFactory *factory, GstRTSPMedia *media);
 
 private:
-  void initializeRealsense();
-  rs2::align alignmentFilter_{RS2_STREAM_COLOR};
-  rs2::pipeline rsPipeline_;
-  rs2::config rsPipelineConfig_;
-  rs2::frame_queue imuQueue_;
-  rs2::frame_queue frameQueue_;
-  rs2::depth_sensor *depthSensor_;
-  rs2::device device_;
-  double scale_;
-  rs2::threshold_filter threshold_filter_;
+  // Camera streams, each served on its own mount. The camera only runs the
+  // streams that currently have clients. The half and quarter resolution
+  // renditions are downscaled from the same color capture.
+  enum Stream : uint32_t {
+    kColorStream,
+    kDepthStream,
+    kInfraredStream,
+    kColorHalfStream,
+    kColorQuarterStream,
+  };
+  static constexpr uint32_t kNumStreams = 5;
+  static constexpr uint32_t kColorMask = (1u << kColorStream) |
+                                         (1u << kColorHalfStream) |
+                                         (1u << kColorQuarterStream);
+  // Pyramid level of a color rendition, 0 for full resolution
+  static int renditionLevel(Stream stream);
+  RateControllerOptions rateOptions(Stream stream) const;
+
+  void initializeCamera();
+  void addMount(Stream stream, const char *path);
+  void onMountConfigure(Stream stream, const char *path, GstRTSPMedia *media);
+  static gboolean writeMetrics(gpointer user_data);
+  static gboolean onPreview(gpointer user_data);
+  GstCaps *streamCaps(Stream stream) const;
+  void addSink(Stream stream, const char *path, GstElement *appsrc);
+  void removeSink(GstElement *appsrc);
+  void applyProfile(uint32_t activeMask);
+  void stopCapture();
+  void captureLoop();
+  // The RTSP consumer of the frame bus
+  void pushFrames(const CameraFrameSet &frames);
+  void setupColorConversion();
+  void setupSharedMemory();
+  void setupRecording();
+  void setupPreEvent();
+  void setupSnapshots();
+  void publishShared(const CameraFrameSet &frames);
+  void pushImage(Stream stream, const CameraImage &image,
+                 const std::shared_ptr<void> &keepAlive);
+  void pushRenditions(const CameraImage &image);
+  GstBuffer *convertColor(const CameraImage &image);
+  GstBuffer *halveColor(GstBuffer *src, int level);
+
+  std::unique_ptr<CameraSource> camera_;
+  CameraConfig baseConfig_;
+  double scale_ = 0.001;
+
+  guint graceMs_ = 5000;
+  RateControllerOptions rateOptions_;
+  EncoderRequest encoderRequest_;
+  EncoderChoice encoder_;
+  LossInjectorOptions lossOptions_;
+  QueuePolicy queuePolicy_;
+  GopCacheOptions gopOptions_;
+  MediaPoolOptions mediaPool_{0};
+  MulticastOptions multicast_;
+  GstRTSPAddressPool *multicastPool_ = nullptr;
+  guint rtspThreads_ = 4;
+  bool convertColor_ = true;
+  size_t convertThreads_ = 4;
+  std::unique_ptr<WorkerPool> convertPool_;
+  std::unique_ptr<ColorConverter> converter_;
+  // one per rendition level
+  GstBufferPool *colorPools_[3] = {nullptr, nullptr, nullptr};
+  std::string metricsFile_;
+  std::string shmName_;
+  uint32_t shmSlots_ = 4;
+  std::unique_ptr<ShmFrameWriter> shm_;
+  RecorderOptions recordOptions_;
+  std::unique_ptr<SegmentRecorder> colorRecorder_;
+  std::unique_ptr<SegmentRecorder> depthRecorder_;
+  size_t preEventBytes_ = 0;
+  std::string preEventDir_;
+  std::unique_ptr<PreEventRing> preEvent_;
+  int preEventTracks_[2] = {-1, -1};
+  // appsrc ! encoder ! fakesink per track, feeding the ring
+  GstElement *preEventPipelines_[2] = {nullptr, nullptr};
+  std::string snapshotEndpoint_;
+  std::unique_ptr<SnapshotServer> snapshot_;
+  std::unique_ptr<StreamActivation> activation_;
+  // The capture thread publishes every frame set here, each consumer takes
+  // them at its own pace
+  FrameBus bus_;
+  bool previewEnabled_ = false;
+  std::shared_ptr<FrameSubscription> preview_;
+  uint32_t activeMask_ = 0;
+  std::thread captureThread_;
+  std::atomic<bool> capturing_{false};
+  std::mutex sinksMutex_;
+  std::vector<std::unique_ptr<AppSrcQueue>> sinks_[kNumStreams];
 
   int32_t fps_{30};
   int width_ = 1280;
   int height_ = 720;
 
-  rs2::frame colorFrame_;
+  std::unique_ptr<RgbdReplaySource> replay_;
+  int replayColorStream_ = -1;
 
   GMainLoop *gsLoop_;
   GstRTSPServer *gsServer_;
@@ -45,4 +230,4 @@ private:
 
   const gchar *port = (char *)"8554";
   const gchar *host = (char *)"127.0.0.1";
-};
\ No newline at end of file
+};
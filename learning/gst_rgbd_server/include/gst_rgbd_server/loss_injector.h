@@ -0,0 +1,32 @@
+#pragma once
+
+#include <gst/gst.h>
+
+#include <cstdint>
+#include <string>
+
+// Degrades the RTP packets leaving a pad, for exercising rate control on
+// localhost. Attach it to a payloader's src pad: every buffer there is one
+// RTP packet, so dropping one is a lost packet for the receiver.
+struct LossInjectorOptions {
+  // Chance a loss starts at a packet; it takes out burstPackets in a row, so
+  // about lossPercent * burstPackets percent are lost
+  double lossPercent = 0;
+  unsigned burstPackets = 1;
+  // Each frame's packets are held until PTS + delay + uniform(0, jitter) on
+  // the pipeline clock, in order. Assumes PTS is running time, as it is for
+  // live appsrc pipelines with do-timestamp.
+  double delayMs = 0;
+  double jitterMs = 0;
+  uint32_t seed = 1;
+
+  bool enabled() const {
+    return lossPercent > 0 || delayMs > 0 || jitterMs > 0;
+  }
+};
+
+// Installs the injector as a pad probe, returns the probe id or 0. The probe
+// owns its state and goes away with the pad. Drops are counted as
+// rgbd_injected_drops_total, under stream="<name>" if a name is given.
+gulong attachLossInjector(GstPad *pad, const LossInjectorOptions &options,
+                          const std::string &name = "");
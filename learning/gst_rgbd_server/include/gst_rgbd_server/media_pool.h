@@ -0,0 +1,44 @@
+#pragma once
+
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+#include <functional>
+#include <string>
+
+struct MediaPoolOptions {
+  // Prepared media kept ready per factory, 0 for none
+  guint size = 1;
+  // The appsrc the warm-up frames are pushed into
+  std::string appsrc = "mysrc";
+  // How long a handed out media may go without PLAY before the pool lets go
+  // of it; until then the media stays prepared for its client
+  guint holdSeconds = 10;
+  // Called with the element of every media of the factory before it
+  // prepares. media-configure comes only at hand out, when a pooled media is
+  // prepared and its streaming threads run already
+  std::function<void(GstElement *)> beforePrepare;
+};
+
+// A media factory that keeps options.size media constructed, configured and
+// prepared ahead of the clients, so a DESCRIBE is answered with a pipeline
+// that already parsed its launch line, initialized its encoder and prerolled.
+// Each media handed out is replaced from a background thread.
+//
+// Media are prerolled with blank frames of the caps given to
+// startMediaPool(), pushed into the appsrc until the media is prepared;
+// media-configure is only emitted when a media is handed out, so the
+// application sets the appsrc up as usual; the factory's configure runs once,
+// before the pool prepares. Setup time, from construction until the media is
+// prepared and configured for its client, is published as the histogram
+// rgbd_media_setup_ms with pool="hit" or "miss", warm-up time as
+// rgbd_media_prewarm_ms and the media waiting as rgbd_media_pool_ready, all
+// under mount="<name>".
+GstRTSPMediaFactory *newPooledMediaFactory(const std::string &name,
+                                           const MediaPoolOptions &options);
+
+// Starts filling the pool of a factory made by newPooledMediaFactory(). Call
+// once its launch line and settings are final. Media are prepared on threads
+// of the server's thread pool; path is the factory's mount.
+void startMediaPool(GstRTSPMediaFactory *factory, GstRTSPServer *server,
+                    const std::string &path, GstCaps *caps);
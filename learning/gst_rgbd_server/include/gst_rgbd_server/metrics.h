@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Process wide set of named gauges, written out in the Prometheus text format
+// so a node_exporter textfile collector or a plain `cat` can pick them up.
+// Names may carry labels, e.g. rgbd_encoder_bitrate_kbps{mount="/head"}.
+class Metrics {
+public:
+  static Metrics &instance();
+
+  // Returns the gauge for name, created at 0, so hot paths can look it up
+  // once. The reference stays valid until a remove() matching name; code
+  // removing its own labels must drop it first, anything else holding a gauge
+  // that may be removed keeps share().
+  std::atomic<double> &gauge(const std::string &name) { return *share(name); }
+  std::shared_ptr<std::atomic<double>> share(const std::string &name);
+  void set(const std::string &name, double value) { *share(name) = value; }
+  void add(const std::string &name, double delta);
+  static void add(std::atomic<double> &value, double delta);
+  // Counts value into the histogram name, e.g. rgbd_setup_ms{mount="/head"}:
+  // name_bucket{mount="/head",le="B"} for every bound B and +Inf, as
+  // cumulative counts, plus name_sum and name_count.
+  void observe(const std::string &name, double value,
+               const std::vector<double> &bounds);
+  // Drops every gauge whose name contains label, e.g. stream="/head" when a
+  // mount goes away. A gauge is freed once no share() holds it.
+  void remove(const std::string &label);
+  // Reference counted remove() for labels several owners share, e.g. the
+  // media of one mount: release() removes label once every retain() of it
+  // was released.
+  void retain(const std::string &label);
+  void release(const std::string &label);
+
+  void write(std::ostream &out) const;
+  // Writes to path through a temporary file so readers never see half of it.
+  bool writeFile(const std::string &path) const;
+
+private:
+  Metrics() = default;
+
+  mutable std::mutex mutex_;
+  std::map<std::string, std::shared_ptr<std::atomic<double>>> gauges_;
+  std::map<std::string, int> retained_;
+};
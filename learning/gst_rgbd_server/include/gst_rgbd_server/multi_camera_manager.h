@@ -0,0 +1,90 @@
+#pragma once
+
+#include <gst/app/gstappsrc.h>
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gst_rgbd_server/app_queue.h"
+#include "gst_rgbd_server/camera_source.h"
+#include "gst_rgbd_server/worker_pool.h"
+
+struct MultiCameraOptions {
+  // profile requested from every camera
+  CameraConfig camera;
+  // RTSP server, one mount per camera at /cam/<serial>
+  std::string host = "127.0.0.1";
+  std::string port = "8554";
+  // > 0 streams camera i as RTP/H.264 to udpHost:udpBasePort + i instead
+  int udpBasePort = 0;
+  std::string udpHost = "127.0.0.1";
+  // conversion workers shared by all cameras, 0 = one per core
+  size_t workers = 0;
+  // appsrc queue in front of each encoder
+  QueuePolicy queue;
+};
+
+// Runs one capture thread per camera and schedules color conversion for all
+// of them on a single bounded WorkerPool. Encoders get cores / cameras
+// threads each, so N cameras never ask for more than the machine has.
+class MultiCameraManager {
+public:
+  explicit MultiCameraManager(const MultiCameraOptions &options);
+  ~MultiCameraManager();
+
+  // Adds every connected RealSense device by serial, returns how many.
+  size_t addConnectedRealSense();
+  bool addCamera(std::unique_ptr<CameraSource> camera);
+  size_t numCameras() const { return cameras_.size(); }
+  std::string mountPath(size_t camera) const;
+
+  // Starts the cameras, the outputs and the capture threads.
+  bool start();
+  // Serves until stop() is called from another thread or a signal handler.
+  void run();
+  void stop();
+
+private:
+  struct Camera {
+    MultiCameraManager *owner = nullptr;
+    size_t index = 0;
+    std::unique_ptr<CameraSource> source;
+    std::thread thread;
+    // one conversion in flight per camera keeps frames in order
+    std::atomic<bool> converting{false};
+    std::mutex sinksMutex;
+    std::vector<std::unique_ptr<AppSrcQueue>> sinks;
+    std::atomic<uint64_t> captured{0};
+    std::atomic<uint64_t> pushed{0};
+    std::atomic<uint64_t> dropped{0};
+    // RGBA frames lose alpha here first; only the converting task uses it
+    std::vector<uint8_t> rgbScratch;
+    bool formatReported = false;
+  };
+
+  bool startRtsp();
+  bool startUdp();
+  std::string encodeBranch(size_t camera) const;
+  GstCaps *rawCaps(const Camera &camera) const;
+  void addSink(Camera &camera, GstElement *appsrc);
+  void removeSink(Camera &camera, GstElement *appsrc);
+  void captureLoop(Camera &camera);
+  void convertAndPush(Camera &camera, const CameraFrameSet &frames);
+  static gboolean reportStats(gpointer user_data);
+
+  MultiCameraOptions options_;
+  std::unique_ptr<WorkerPool> pool_;
+  std::vector<std::unique_ptr<Camera>> cameras_;
+  std::atomic<bool> running_{false};
+
+  GMainLoop *loop_ = nullptr;
+  GstRTSPServer *server_ = nullptr;
+  GstElement *udpPipeline_ = nullptr;
+  guint statsSource_ = 0;
+};
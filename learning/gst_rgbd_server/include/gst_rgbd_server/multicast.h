@@ -0,0 +1,43 @@
+#pragma once
+
+#include <gst/rtsp-server/rtsp-server.h>
+
+#include <string>
+
+// RTSP negotiated multicast: a client asking for udp-mcast transport joins
+// the group of the mount's shared media, so a dozen viewers cost one RTP flow
+// out of the server. Clients that ask for plain UDP or TCP still get their
+// own unicast copy unless unicastFallback is off.
+//
+// To try it on one host keep ttl at 1, set iface to "lo" and route the
+// groups there: ip route add 239.255.0.0/16 dev lo; then receive with
+// rtspsrc protocols=udp-mcast.
+struct MulticastOptions {
+  // First and last group handed out, one per stream; empty is unicast only
+  std::string firstAddress;
+  std::string lastAddress;
+  guint16 firstPort = 5000;
+  guint16 lastPort = 5999;
+  // Hops the packets may take, and the most a client may ask for
+  guint8 ttl = 1;
+  // Interface the groups are sent on, the routing table's choice if empty
+  std::string iface;
+  bool unicastFallback = true;
+
+  bool enabled() const { return !firstAddress.empty(); }
+};
+
+// Parses ADDR[-ADDR][:PORT-PORT], e.g. 239.255.42.1-239.255.42.16:5000-5999.
+// A single address serves one stream, so give a range for more mounts.
+bool parseMulticast(const std::string &spec, MulticastOptions &options);
+
+// The groups and ports of options, NULL and an error if the range is
+// invalid. Give all factories of a server the same pool, each takes the next
+// free group from it; pools of their own would hand out the same one.
+GstRTSPAddressPool *newMulticastPool(const MulticastOptions &options);
+
+// Serves the factory's media over multicast from pool, nothing if pool is
+// NULL. The factory should be shared, otherwise every client still gets a
+// pipeline and a group of its own.
+void applyMulticast(GstRTSPMediaFactory *factory,
+                    const MulticastOptions &options, GstRTSPAddressPool *pool);
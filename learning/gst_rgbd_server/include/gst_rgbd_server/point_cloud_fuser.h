@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "gst_rgbd_server/camera_source.h"
+#include "gst_rgbd_server/worker_pool.h"
+
+// 4x4 homogeneous transform from camera to world, column-major like the
+// H_t265_d400 matrix handed to glMultMatrixf in rs/src/utils.hpp.
+struct CameraExtrinsics {
+  float matrix[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+};
+
+// Reads {"cameras": [{"serial": "...", "world_from_camera": [16 floats,
+// column-major]}]} into a serial -> extrinsics map.
+bool loadCameraExtrinsics(const std::string &path,
+                          std::map<std::string, CameraExtrinsics> &out);
+
+// Everything the fuser needs to know about one camera.
+struct FusionCamera {
+  RgbdIntrinsics depthIntrinsics;
+  float depthScale = 0.001f;
+  CameraExtrinsics extrinsics;
+};
+
+// Interleaved world space points with per point color, ready for GL vertex
+// arrays or serialization.
+struct FusedCloud {
+  uint64_t timestampNs = 0;
+  std::vector<float> xyz;    // 3 per point
+  std::vector<uint8_t> rgb;  // 3 per point
+  size_t size() const { return xyz.size() / 3; }
+};
+
+// Deprojects each camera's depth, transforms it into the world frame and
+// writes all cameras into one cloud. Work is split into row bands over all
+// cameras and run on a WorkerPool: a counting pass sizes the output, then
+// each band writes to its own slice so no band waits on another.
+class PointCloudFuser {
+public:
+  struct Options {
+    int step = 2;          // use every step-th pixel in both directions
+    float minDepth = 0.1f; // meters
+    float maxDepth = 8.0f;
+    int rowsPerBand = 32;
+  };
+
+  PointCloudFuser(WorkerPool &pool, std::vector<FusionCamera> cameras,
+                  const Options &options);
+
+  // frames[i] must come from cameras[i], with depth aligned to color when
+  // colors are wanted.
+  void fuse(const std::vector<CameraFrameSet> &frames, FusedCloud &cloud);
+
+private:
+  struct Band {
+    size_t camera;
+    int rowBegin;
+    int rowEnd;
+    size_t count;
+    size_t offset;
+  };
+
+  void depthRange(const FusionCamera &camera, uint16_t &minUnits,
+                  uint16_t &maxUnits) const;
+  size_t countBand(const CameraFrameSet &frames, const Band &band) const;
+  void fillBand(const CameraFrameSet &frames, const Band &band,
+                FusedCloud &cloud) const;
+
+  WorkerPool &pool_;
+  std::vector<FusionCamera> cameras_;
+  Options options_;
+  std::vector<Band> bands_;
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+// Keeps the last seconds of encoded video in memory so an incident can be
+// saved with what led up to it. The only knob is the memory budget: the
+// ring holds as many seconds as fit.
+//
+// Access units of every track are copied into one preallocated byte arena,
+// indexed by a fixed array of entries, so buffering allocates nothing once
+// running. The oldest entries make room for new ones, whole GOPs at a time:
+// once a track lost a frame its remaining delta frames go as they reach the
+// front, so what is kept of every track starts at a keyframe.
+//
+// trigger() hands the ring to a writer thread, which saves the buffered
+// pre-roll and as many seconds after the trigger as it held before, all
+// tracks in one Matroska file <directory>/event-<date>-<time>.<ms>.mkv. A
+// trigger while writing extends the event. The writer reads behind the live
+// tracks and never makes them wait; if it falls a whole ring behind it skips
+// to the next keyframes.
+//
+// Buffered seconds are published as rgbd_preevent_buffered_seconds, events
+// as rgbd_preevent_events_total and frames the writer had to skip as
+// rgbd_preevent_skipped_total.
+
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gst_rgbd_server/encoder_factory.h"
+
+class PreEventRing {
+public:
+  static constexpr int kMaxTracks = 4;
+
+  PreEventRing(size_t budgetBytes, const std::string &directory);
+  ~PreEventRing();
+
+  PreEventRing(const PreEventRing &) = delete;
+  PreEventRing &operator=(const PreEventRing &) = delete;
+
+  // Adds a track before any is attached, returns its id or -1.
+  int addTrack(const std::string &name, VideoCodec codec);
+  // Buffers what leaves pad, an encoder's src pad, until detach() or the
+  // next attach() of the track.
+  void attach(int track, GstPad *pad);
+  // Stops tapping pad, or whatever the track taps for nullptr.
+  void detach(int track, GstPad *pad = nullptr);
+  // Buffers the media's encoder until the media is unprepared. The ring must
+  // outlive the media.
+  void attach(int track, GstRTSPMedia *media, GstElement *encoder);
+
+  // Saves the pre-roll and the seconds after it. Cheap, but not async-signal
+  // safe; call it from a thread or a main context, as triggerOnSignal() does.
+  void trigger();
+  // Triggers on every signum, e.g. SIGUSR1, delivered through the default
+  // main context.
+  void triggerOnSignal(int signum);
+
+private:
+  struct Entry {
+    uint64_t seq;
+    size_t offset;
+    size_t size;
+    int track;
+    bool keyframe;
+    GstClockTime pts;
+    GstClockTime dts;
+    GstClockTime duration;
+    gint64 hostNs;
+  };
+  struct Track {
+    std::string name;
+    VideoCodec codec;
+    GstPad *pad = nullptr;
+    gulong probe = 0;
+    GstCaps *caps = nullptr;
+    // entries of the track were evicted, drop its deltas up to a keyframe
+    bool broken = false;
+  };
+
+  static GstPadProbeReturn onEncoded(GstPad *pad, GstPadProbeInfo *info,
+                                     gpointer user_data);
+  // Track tapping pad or -1, with mutex_ held
+  int findTrack(GstPad *pad) const;
+  void push(GstPad *pad, GstBuffer *frame);
+  bool reserve(size_t size, size_t &offset);
+  void evictFront();
+  // index-th oldest entry
+  Entry &entry(size_t index) {
+    return entries_[(head_ + index) % entries_.size()];
+  }
+  void run();
+  void writeEvent();
+
+  std::string directory_;
+  std::vector<uint8_t> arena_;
+  std::vector<Entry> entries_;
+  Track tracks_[kMaxTracks];
+  int trackCount_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  size_t head_ = 0;
+  size_t count_ = 0;
+  size_t writePos_ = 0;
+  uint64_t nextSeq_ = 0;
+  // steady clock of the pending trigger, 0 if none
+  gint64 triggerNs_ = 0;
+  // steady clock the event being written ends at, set with its trigger:
+  // as long after the trigger as the ring held before it
+  gint64 eventEndNs_ = 0;
+  bool stopping_ = false;
+  std::thread writer_;
+  guint signalSource_ = 0;
+
+  std::atomic<double> &buffered_;
+  std::atomic<double> &events_;
+  std::atomic<double> &skipped_;
+};
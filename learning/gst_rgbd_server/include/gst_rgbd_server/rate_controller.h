@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+
+// What the receivers told us in their last RTCP receiver reports, worst
+// receiver first.
+struct ReceiverReport {
+  double fractionLost = 0;  // 0..1 since the previous report
+  double jitterMs = 0;      // interarrival jitter
+  double rttMs = -1;        // < 0 when unknown
+};
+
+struct RateControllerOptions {
+  uint32_t minKbps = 300;
+  uint32_t maxKbps = 8000;
+  uint32_t startKbps = 2000;
+  // below lowLoss the rate grows by increasePercent per report; above
+  // highLoss it shrinks by half the loss, as in the loss based part of
+  // Google congestion control
+  double lowLoss = 0.02;
+  double highLoss = 0.10;
+  double increasePercent = 8;
+  // RTT or jitter this far above the best seen means queues are building
+  double queueDelayMs = 80;
+  double queueDecrease = 0.85;
+  // Once the bitrate sits at minKbps and is still congested, trade frame
+  // rate and then resolution for quality instead of losing packets.
+  bool adaptFrameRate = true;
+  bool adaptResolution = true;
+  int degradeAfterReports = 3;
+  int upgradeAfterReports = 10;
+};
+
+// The encoder settings the controller asks for.
+struct RateDecision {
+  uint32_t bitrateKbps = 0;
+  int fpsDivisor = 1;   // 1 or 2
+  int scaleDivisor = 1; // 1 or 2, applied to width and height
+  bool operator==(const RateDecision &other) const {
+    return bitrateKbps == other.bitrateKbps &&
+           fpsDivisor == other.fpsDivisor &&
+           scaleDivisor == other.scaleDivisor;
+  }
+  bool operator!=(const RateDecision &other) const { return !(*this == other); }
+};
+
+// Grows the rate by increasePercent per clean report and cuts it on loss or
+// queueing delay, both multiplicatively, on RTCP feedback. No GStreamer
+// here, RtcpRateAdapter feeds it and applies its decisions.
+class RateController {
+public:
+  explicit RateController(const RateControllerOptions &options);
+
+  const RateDecision &update(const ReceiverReport &report);
+  const RateDecision &decision() const { return decision_; }
+  const RateControllerOptions &options() const { return options_; }
+  // Why the last update changed or kept the rate, for logs and metrics.
+  enum class Reason { kHold, kIncrease, kLossDecrease, kDelayDecrease };
+  Reason reason() const { return reason_; }
+
+private:
+  RateControllerOptions options_;
+  RateDecision decision_;
+  Reason reason_ = Reason::kHold;
+  double rate_;
+  double baseRttMs_ = -1;
+  double baseJitterMs_ = -1;
+  int congestedReports_ = 0;
+  int clearReports_ = 0;
+};
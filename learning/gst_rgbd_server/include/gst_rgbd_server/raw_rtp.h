@@ -0,0 +1,34 @@
+#pragma once
+
+#include <gst/gst.h>
+
+#include <string>
+
+// Uncompressed RFC 4175 video over RTP, for wired links where bandwidth is
+// cheaper than the latency of an encoder and a decoder.
+//
+// RFC 4175 has no 16 bit gray sampling, so depth travels as YCbCr-4:2:2 at
+// its own width: a UYVY pgroup is 4 bytes for 2 pixels, exactly two Z16
+// samples, so packets only ever split a row between pgroups and never inside
+// a depth sample. The receiver reinterprets the UYVY frame as GRAY16_LE of
+// the same size. Like every 4:2:2 pgroup this needs an even width.
+
+// Socket buffers of both ends. A frame leaves as one burst of packets, which
+// the default buffers of a few hundred kB cannot hold at 720p; the kernel
+// caps it at net.core.wmem_max / rmem_max.
+constexpr int kRawSocketBufferBytes = 8 << 20;
+// Payload size per packet, below a 1500 byte Ethernet MTU
+constexpr unsigned kRawDefaultMtu = 1400;
+
+// rtpvrawpay sending each frame as one buffer list, which RtpBatchSink sends
+// in a few sendmmsg() calls instead of a send per packet.
+GstElement *makeRawPayloader(const char *name, unsigned mtu = kRawDefaultMtu);
+
+// Caps of a depth appsrc as they go into the payloader: the GRAY16_LE caps
+// with the format swapped for UYVY. NULL unless depth is GRAY16_LE with an
+// even width.
+GstCaps *rawDepthCaps(const GstCaps *depth);
+
+// udpsrc caps of a YCbCr-4:2:2 RFC 4175 stream of the given size, color or
+// depth alike.
+std::string rawRtpCaps(int width, int height, int payload = 96);
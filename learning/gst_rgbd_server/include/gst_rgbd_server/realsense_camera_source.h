@@ -0,0 +1,41 @@
+#pragma once
+
+#include <librealsense2/rs.hpp>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gst_rgbd_server/camera_source.h"
+
+class RealSenseCameraSource : public CameraSource {
+public:
+  // An empty serial takes the first device found at start().
+  explicit RealSenseCameraSource(const std::string &serial = "");
+  ~RealSenseCameraSource() override;
+
+  // Serial numbers of the connected devices.
+  static std::vector<std::string> enumerate();
+
+  bool start(const CameraConfig &config) override;
+  void stop() override;
+  bool isStarted() const override { return started_; }
+  bool waitForFrames(CameraFrameSet &frames, uint32_t timeoutMs) override;
+
+  std::string serial() const override { return serial_; }
+  const CameraConfig &config() const override { return config_; }
+  RgbdIntrinsics colorIntrinsics() const override { return colorIntrinsics_; }
+  RgbdIntrinsics depthIntrinsics() const override { return depthIntrinsics_; }
+  float depthScale() const override { return scale_; }
+
+private:
+  std::string serial_;
+  CameraConfig config_;
+  bool started_ = false;
+
+  rs2::pipeline rsPipeline_;
+  std::unique_ptr<rs2::align> alignmentFilter_;
+  float scale_ = 0.001f;
+  RgbdIntrinsics colorIntrinsics_{};
+  RgbdIntrinsics depthIntrinsics_{};
+};
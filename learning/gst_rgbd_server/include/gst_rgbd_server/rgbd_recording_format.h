@@ -0,0 +1,126 @@
+#pragma once
+
+// On-disk layout of an indexed RGB-D recording (.rgbdrec).
+//
+//   [0, 4096)            RgbdRecordingHeader, zero padded
+//   [4096, indexOffset)  frame records, each starting on a 4096 byte boundary:
+//                        RgbdFrameRecordHeader followed by storedBytes payload
+//   [indexOffset, ...)   RgbdRecordingIndexEntry[frameCount]
+//   [end - 24, end)      RgbdRecordingTrailer
+//
+// The header is rewritten on close with the final index offset, so a reader
+// can jump to any frame of any stream through the index without scanning.
+// Records carry their own magic so a truncated file can still be recovered.
+
+#include <cstddef>
+#include <cstdint>
+
+constexpr char kRgbdRecordingMagic[8] = {'R', 'G', 'B', 'D', 'R', 'E', 'C', '1'};
+constexpr char kRgbdRecordingIndexMagic[8] = {'R', 'G', 'B', 'D', 'I', 'D', 'X', '1'};
+constexpr char kRgbdFrameRecordMagic[4] = {'F', 'R', 'A', 'M'};
+constexpr uint32_t kRgbdRecordingVersion = 1;
+constexpr uint32_t kRgbdRecordingAlignment = 4096;
+constexpr uint32_t kRgbdRecordingMaxStreams = 8;
+
+enum class RgbdStreamKind : uint32_t {
+  kUnknown = 0,
+  kDepth = 1,
+  kColor = 2,
+  kPoints = 3,
+  kInfrared = 4,
+  kAccel = 5,
+  kGyro = 6,
+};
+
+enum class RgbdPixelFormat : uint32_t {
+  kUnknown = 0,
+  kZ16 = 1,
+  kRGBA8 = 2,
+  kRGB8 = 3,
+  kBGR8 = 4,
+  kY8 = 5,
+  kXYZ32F = 6,
+  kYUYV = 7,
+  kMotionXYZ32F = 8,
+  kUYVY = 9,
+};
+
+enum class RgbdCodec : uint32_t {
+  kNone = 0,
+  kLz4 = 1,
+  kZstd = 2,
+};
+
+struct RgbdIntrinsics {
+  uint32_t width;
+  uint32_t height;
+  float centerX;
+  float centerY;
+  float fx;
+  float fy;
+};
+
+struct RgbdRecordingStreamInfo {
+  uint32_t kind;   // RgbdStreamKind
+  uint32_t format; // RgbdPixelFormat
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint32_t bytesPerFrame; // 0 when frames are variable sized (points)
+  uint32_t hasIntrinsics;
+  RgbdIntrinsics intrinsics;
+  float depthScale; // meters per depth unit, 0 for non-depth streams
+  uint32_t reserved[8];
+};
+
+struct RgbdRecordingHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t alignment;
+  uint32_t numStreams;
+  uint32_t hasExtrinsics;
+  uint64_t indexOffset; // 0 while recording or if the writer died
+  uint64_t frameCount;
+  uint64_t createdUnixNs;
+  float depthToColorRotation[9]; // column-major
+  float depthToColorTranslation[3];
+  RgbdRecordingStreamInfo streams[kRgbdRecordingMaxStreams];
+};
+
+struct RgbdFrameRecordHeader {
+  char magic[4];
+  uint32_t streamId;
+  uint32_t codec; // RgbdCodec
+  uint32_t reserved;
+  uint64_t frameNumber; // per stream
+  uint64_t timestampNs;
+  uint64_t rawBytes;
+  uint64_t storedBytes;
+};
+
+struct RgbdRecordingIndexEntry {
+  uint32_t streamId;
+  uint32_t codec;
+  uint64_t frameNumber;
+  uint64_t timestampNs;
+  uint64_t offset; // file offset of the RgbdFrameRecordHeader
+  uint64_t rawBytes;
+  uint64_t storedBytes;
+};
+
+struct RgbdRecordingTrailer {
+  char magic[8];
+  uint64_t indexOffset;
+  uint64_t entryCount;
+};
+
+static_assert(sizeof(RgbdRecordingHeader) <= kRgbdRecordingAlignment,
+              "recording header must fit in the first block");
+static_assert(sizeof(RgbdFrameRecordHeader) == 48, "unexpected record size");
+static_assert(sizeof(RgbdRecordingIndexEntry) == 48, "unexpected index size");
+static_assert(sizeof(RgbdRecordingTrailer) == 24, "unexpected trailer size");
+
+inline uint64_t rgbdRecordingAlignUp(uint64_t value) {
+  return (value + kRgbdRecordingAlignment - 1) &
+         ~uint64_t(kRgbdRecordingAlignment - 1);
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <gst/app/gstappsrc.h>
+#include <gst/gst.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gst_rgbd_server/app_queue.h"
+#include "gst_rgbd_server/rgbd_recording_format.h"
+
+enum class ReplayPacing {
+  kRealtime,  // recorded timestamps (fps for raw files)
+  kFixedRate, // options.fps
+  kMaxRate,   // as fast as the consumer pulls
+};
+
+struct ReplayOptions {
+  ReplayPacing pacing = ReplayPacing::kRealtime;
+  double fps = 30.0;
+  bool loop = false;
+  // frames advised to the kernel ahead of the read position
+  uint32_t readaheadFrames = 8;
+};
+
+// One headerless file of equally sized frames, e.g. depth_uint16_848x480.bin
+// written by the ds3d dump_depth option.
+struct RawReplayStream {
+  std::string path;
+  RgbdStreamKind kind = RgbdStreamKind::kUnknown;
+  RgbdPixelFormat format = RgbdPixelFormat::kUnknown;
+  uint32_t width = 0;
+  uint32_t height = 0;
+
+  // "<kind>:<format>:<width>x<height>:<path>", e.g.
+  // "depth:z16:848x480:depth_uint16_848x480.bin"
+  static bool parse(const std::string &spec, RawReplayStream &out);
+};
+
+// Buffers of one replay step, one entry per stream (nullptr if the stream has
+// no frame at this step). The caller owns the references.
+struct ReplayFrame {
+  uint64_t frameNumber = 0;
+  GstClockTime pts = GST_CLOCK_TIME_NONE;
+  GstClockTime duration = GST_CLOCK_TIME_NONE;
+  std::vector<GstBuffer *> buffers;
+
+  ReplayFrame() = default;
+  ReplayFrame(const ReplayFrame &) = delete;
+  ReplayFrame &operator=(const ReplayFrame &) = delete;
+  ~ReplayFrame() { clear(); }
+  void clear();
+};
+
+// Replays .rgbdrec recordings or raw frame files from memory maps. Frames are
+// handed out as read-only GstBuffers wrapping the mapping (no copy) unless
+// they were stored compressed.
+class RgbdReplaySource {
+public:
+  RgbdReplaySource();
+  ~RgbdReplaySource();
+
+  bool open(const std::string &path, const ReplayOptions &options);
+  bool openRaw(const std::vector<RawReplayStream> &streams,
+               const ReplayOptions &options);
+
+  size_t numStreams() const { return streams_.size(); }
+  int findStream(RgbdStreamKind kind) const;
+  const RgbdRecordingStreamInfo &streamInfo(size_t stream) const;
+  uint64_t frameCount() const { return frameCount_; }
+  // caller owns the returned caps, nullptr for non video streams
+  GstCaps *caps(size_t stream) const;
+
+  // Position the next step at an exact frame, through the index.
+  bool seek(uint64_t frameNumber);
+
+  // Blocks according to the pacing mode and returns the next step.
+  // Returns false at the end of a non looping replay.
+  bool next(ReplayFrame &frame);
+
+  // Random access to a single frame without pacing, nullptr if missing.
+  GstBuffer *buffer(size_t stream, uint64_t frameNumber) const;
+
+  // Feed one stream into an appsrc from a replay thread, for pipelines that
+  // only need a single stream. Sets caps and time format on the appsrc. The
+  // thread blocks while four frames are queued, so stop the pipeline before
+  // stopPushing() or it waits for the consumer.
+  bool startPushing(GstAppSrc *appsrc, size_t stream);
+  void stopPushing();
+
+private:
+  struct Mapping;
+  struct FrameRef {
+    uint32_t mapping = 0; // index into mappings_
+    uint64_t offset = 0; // payload offset
+    uint64_t storedBytes = 0;
+    uint64_t rawBytes = 0;
+    uint64_t timestampNs = 0;
+    RgbdCodec codec = RgbdCodec::kNone;
+  };
+  struct Stream {
+    RgbdRecordingStreamInfo info;
+    std::vector<FrameRef> frames;
+  };
+
+  void reset();
+  void advise(uint64_t frameNumber) const;
+  void pace(GstClockTime pts);
+  GstBuffer *makeBuffer(const Stream &stream, const FrameRef &ref) const;
+
+  ReplayOptions options_;
+  std::vector<std::shared_ptr<Mapping>> mappings_;
+  std::vector<Stream> streams_;
+  uint64_t frameCount_ = 0;
+  uint64_t position_ = 0;
+  uint64_t loops_ = 0;
+  GstClockTime loopDuration_ = 0;
+  bool paceStarted_ = false;
+  std::chrono::steady_clock::time_point paceStart_;
+
+  struct PushThread;
+  std::unique_ptr<PushThread> pusher_;
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+#include <map>
+#include <string>
+
+#include "gst_rgbd_server/rate_controller.h"
+
+// Reads the RTCP receiver reports of one RTP session once per interval and
+// lets a RateController retune the encoder in place. Every decision is
+// published through Metrics under stream="<name>".
+//
+// encoder is any element EncoderFactory knows, which sets the bitrate in the
+// element's own unit. adapt is an optional capsfilter in front of it, behind
+// videoscale ! videorate, whose caps are narrowed when the controller trades
+// frame rate or resolution.
+// Runs on the default main context.
+class RtcpRateAdapter {
+public:
+  RtcpRateAdapter(const std::string &name, GstElement *encoder,
+                  GstElement *adapt, int width, int height, int fps,
+                  const RateControllerOptions &options,
+                  guint intervalMs = 1000);
+  ~RtcpRateAdapter();
+
+  RtcpRateAdapter(const RtcpRateAdapter &) = delete;
+  RtcpRateAdapter &operator=(const RtcpRateAdapter &) = delete;
+
+  // Follows the first stream of an RTSP media. The media must outlive the
+  // adapter; delete it from the media's "unprepared" handler.
+  void attach(GstRTSPMedia *media);
+  // Follows session `session` of an rtpbin.
+  void attach(GstElement *rtpbin, guint session);
+
+  const RateController &controller() const { return controller_; }
+
+private:
+  static gboolean onPoll(gpointer user_data);
+  GObject *session() const;
+  bool readReport(ReceiverReport &report);
+  void apply(const RateDecision &decision);
+
+  std::string name_;
+  std::string label_;
+  GstElement *encoder_;
+  GstElement *adapt_;
+  int width_, height_, fps_;
+  RateController controller_;
+  RateDecision applied_;
+
+  GstRTSPMedia *media_ = nullptr;
+  GstElement *rtpbin_ = nullptr;
+  guint sessionId_ = 0;
+  guint intervalMs_;
+  guint pollSource_ = 0;
+  // last extended highest sequence number per receiver, to skip stale RBs
+  std::map<guint, guint> lastSeq_;
+};
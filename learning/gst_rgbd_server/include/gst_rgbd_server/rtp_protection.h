@@ -0,0 +1,101 @@
+#pragma once
+
+#include <gst/gst.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Loss protection for the rtpbin sessions of rs_gst_pub and rs_gst_sub:
+// ULPFEC inside RED repairs isolated losses without a round trip, RTX
+// retransmits what FEC could not, requested by RTCP NACKs (AVPF), and the
+// receiver's jitterbuffer waits just long enough for either. Both ends must
+// agree on the options.
+struct RtpProtectionOptions {
+  bool fec = true;
+  // FEC packets per 100 media packets
+  unsigned fecPercentage = 10;
+  bool rtx = true;
+  // Most the receiver waits for a packet, retransmissions included
+  unsigned latencyMs = 80;
+  // Least the adaptive jitterbuffer goes down to on a clean link
+  unsigned minLatencyMs = 10;
+
+  guint mediaPt = 96;
+  guint redPt = 122;
+  guint fecPt = 123;
+  // retransmissions of media and of RED packets
+  guint rtxPt = 97;
+  guint redRtxPt = 98;
+};
+
+// Adds the FEC encoder and the RTX sender to every session rtpbin creates
+// from now on, and switches it to AVPF. Call before requesting the
+// send_rtp_sink pads.
+void protectRtpSender(GstElement *rtpbin, const RtpProtectionOptions &options);
+
+struct RtpReceiverStats {
+  uint64_t received = 0;
+  uint64_t lost = 0; // given up on, after FEC and RTX
+  uint64_t rtxRequests = 0;
+  uint64_t rtxRecovered = 0;
+  uint64_t fecRecovered = 0;
+  unsigned latencyMs = 0;
+  double jitterMs = 0;
+};
+
+// The receiving half: RED/ULPFEC decoder, RTX receiver, payload type map and
+// an adaptive jitterbuffer. Once per interval the jitterbuffer latency is
+// set from the measured jitter and, with RTX, the retransmission round trip,
+// between minLatencyMs and latencyMs. Counters are published as
+// rgbd_rtp_{received,lost,rtx_requests,rtx_recovered,fec_recovered}_total
+// and rgbd_rtp_{latency_ms,jitter_ms} under stream="<name>".
+//
+// Construct before requesting the recv_rtp_sink pads. mediaCaps are the
+// caps of the protected payload type, e.g. H.264 or RFC 4175 raw.
+// Runs on the default main context.
+class RtpReceiverProtection {
+public:
+  RtpReceiverProtection(const std::string &name, GstElement *rtpbin,
+                        const std::string &mediaCaps,
+                        const RtpProtectionOptions &options,
+                        guint intervalMs = 1000);
+  ~RtpReceiverProtection();
+
+  RtpReceiverProtection(const RtpReceiverProtection &) = delete;
+  RtpReceiverProtection &operator=(const RtpReceiverProtection &) = delete;
+
+  RtpReceiverStats stats() const { return stats_; }
+
+private:
+  static GstCaps *onRequestPtMap(GstElement *rtpbin, guint session, guint pt,
+                                 gpointer user_data);
+  static GstElement *onRequestAuxReceiver(GstElement *rtpbin, guint session,
+                                          gpointer user_data);
+  static GstElement *onRequestFecDecoder(GstElement *rtpbin, guint session,
+                                         gpointer user_data);
+  static void onNewJitterbuffer(GstElement *rtpbin, GstElement *jitterbuffer,
+                                guint session, guint ssrc, gpointer user_data);
+  static gboolean onPoll(gpointer user_data);
+  void poll();
+  void track(std::vector<std::unique_ptr<GWeakRef>> &refs,
+             GstElement *element);
+  // References to the elements still alive, forgetting the others
+  std::vector<GstElement *> alive(std::vector<std::unique_ptr<GWeakRef>> &refs);
+
+  std::string name_;
+  std::string label_;
+  GstElement *rtpbin_;
+  GstCaps *mediaCaps_;
+  RtpProtectionOptions options_;
+  // Weak, rtpbin drops jitterbuffers of timed out sources and decoders of
+  // closed sessions; the elements are added from streaming threads
+  std::mutex elementsMutex_;
+  std::vector<std::unique_ptr<GWeakRef>> jitterbuffers_;
+  std::vector<std::unique_ptr<GWeakRef>> fecDecoders_;
+  std::vector<gulong> handlers_;
+  guint pollSource_ = 0;
+  RtpReceiverStats stats_;
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "gst_rgbd_server/camera_source.h"
+#include "gst_rgbd_server/encoder_factory.h"
+
+struct RecorderOptions {
+  // splitmuxsink location pattern, e.g. /data/head-%05d.mkv. A .mp4 name
+  // writes MP4, anything else Matroska, which stays readable when the
+  // process dies mid segment. Empty records nothing.
+  std::string location;
+  // Segments are cut at the first keyframe after this long
+  guint segmentSeconds = 60;
+  // Oldest segments are deleted beyond this many, 0 keeps them all
+  guint maxFiles = 0;
+  // Encoded data waiting for the writer; past it frames are dropped up to
+  // the next keyframe rather than making the encoder wait
+  size_t maxQueueBytes = 8 << 20;
+  // Side channels: the depth mount's encoded stream as its own segments,
+  // <location>-depth, and IMU samples as a text track of the color segments
+  bool depth = false;
+  bool imu = false;
+
+  bool enabled() const { return !location.empty(); }
+};
+
+// location with suffix inserted before its extension, head-%05d.mkv becomes
+// head-%05d-depth.mkv.
+std::string recordingLocation(const std::string &location,
+                              const std::string &suffix);
+
+// Writes an already encoded stream to fixed length segments without encoding
+// it again. A pad probe after the encoder refs each frame into a pipeline of
+// its own, appsrc ! parser ! splitmuxsink, which muxes and writes on its own
+// threads, so a slow disk never stalls the live branch.
+//
+// The tapped pad may change, e.g. when a shared RTSP media is rebuilt for the
+// next client; the recording picks up at the new pad's first keyframe with
+// its timestamps continuing where the last one stopped.
+//
+// Bytes queued for writing are published as rgbd_recorder_queue_bytes,
+// frames written and dropped as rgbd_recorder_frames_total and
+// rgbd_recorder_dropped_total, all under recording="<name>".
+class SegmentRecorder {
+public:
+  SegmentRecorder(const std::string &name, const std::string &location,
+                  VideoCodec codec, const RecorderOptions &options,
+                  bool imuTrack = false);
+  ~SegmentRecorder();
+
+  SegmentRecorder(const SegmentRecorder &) = delete;
+  SegmentRecorder &operator=(const SegmentRecorder &) = delete;
+
+  // False if the recording pipeline could not be built.
+  bool isOpen() const { return pipeline_ != nullptr; }
+
+  // Records what leaves pad, an encoder's src pad, until detach() or the
+  // next attach().
+  void attach(GstPad *pad);
+  // Stops tapping pad, or whatever is tapped for nullptr.
+  void detach(GstPad *pad = nullptr);
+  // Records through the media's encoder until the media is unprepared. The
+  // recorder must outlive the media.
+  void attach(GstRTSPMedia *media, GstElement *encoder);
+
+  // The IMU samples of a frame set as one line of the text track, e.g.
+  // "accel 0.01 -9.81 0.20 gyro 0.00 0.01 0.00". Ignored without imuTrack.
+  void pushImu(const CameraFrameSet &frames);
+
+private:
+  static GstPadProbeReturn onEncoded(GstPad *pad, GstPadProbeInfo *info,
+                                     gpointer user_data);
+  void setCaps(GstCaps *caps);
+  void push(GstBuffer *frame);
+
+  std::string name_;
+  std::string label_;
+  RecorderOptions options_;
+  GstElement *pipeline_ = nullptr;
+  GstElement *video_ = nullptr;
+  GstElement *imu_ = nullptr;
+
+  std::mutex mutex_;
+  GstPad *pad_ = nullptr;
+  gulong probe_ = 0;
+  // the tapped pad changed, rebase its timestamps at its first keyframe
+  bool rebase_ = true;
+  // nothing goes out before the next keyframe
+  bool needKeyframe_ = true;
+  GstCaps *caps_ = nullptr;
+  GstClockTimeDiff offset_ = 0;
+  // end of the last frame written, where the next pad's frames continue
+  GstClockTime end_ = 0;
+  // steady clock time of the last frame, to place IMU samples next to it
+  gint64 lastHostNs_ = 0;
+  GstClockTime lastPts_ = GST_CLOCK_TIME_NONE;
+  GstClockTime lastImuPts_ = 0;
+
+  std::shared_ptr<std::atomic<double>> queued_;
+  std::shared_ptr<std::atomic<double>> frames_;
+  std::shared_ptr<std::atomic<double>> dropped_;
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <gst/gst.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "gst_rgbd_server/app_queue.h"
+#include "gst_rgbd_server/shm_frame_ring.h"
+
+// GStreamer ends of a shared memory ring, built on appsrc and appsink like
+// every other app element here, so any pipeline can publish into a ring or
+// consume one without an encoder in between.
+
+// Feeds one image kind of a ring into an appsrc from its own thread. Each
+// frame is copied once, out of the ring into the buffer, and only pushed if
+// the writer did not overwrite it meanwhile. Caps follow the frames; the
+// ring is reopened when its writer restarts.
+class ShmRingSource {
+public:
+  ShmRingSource(const std::string &ring, RgbdStreamKind kind,
+                GstElement *appsrc, const QueuePolicy &policy = QueuePolicy());
+  ~ShmRingSource();
+
+  void start();
+  void stop();
+
+private:
+  void run();
+  void updateCaps(const ShmImageInfo &info);
+
+  std::string ring_;
+  RgbdStreamKind kind_;
+  AppSrcQueue queue_;
+  std::thread thread_;
+  std::atomic<bool> running_{false};
+  uint32_t format_ = 0;
+  uint32_t width_ = 0;
+  uint32_t height_ = 0;
+};
+
+// Writes every sample reaching an appsink into a ring as a one image frame
+// set of the given kind. The appsink should ask for a format
+// pixelFormatFromGst() knows.
+class ShmRingSink {
+public:
+  ShmRingSink(const std::string &ring, RgbdStreamKind kind,
+              GstElement *appsink, uint32_t slotCount, uint64_t slotBytes);
+  ~ShmRingSink();
+
+  bool isOpen() const { return writer_.isOpen(); }
+
+private:
+  static GstFlowReturn onNewSample(GstElement *appsink, gpointer user_data);
+  void write(GstSample *sample);
+
+  RgbdStreamKind kind_;
+  GstElement *appsink_;
+  gulong handler_ = 0;
+  ShmFrameWriter writer_;
+  uint64_t frames_ = 0;
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+// Same-host transport of raw frame sets through a POSIX shared memory ring,
+// /dev/shm/<name>. One writer, any number of readers; nothing is encoded.
+//
+//   [0, 4096)                     ShmRingHeader
+//   [4096 + i * slotStride, ...)  slot i: ShmSlotHeader, padded to 4096,
+//                                 then slotBytes of image payload
+//
+// Frame set n (from 1) goes to slot n % slotCount. Each slot carries a
+// generation, 2n once frame set n is complete and odd while it is being
+// written, so a reader that fell a whole ring behind sees that its slot was
+// reused instead of reading torn data. Readers sleep on a futex in the
+// header that the writer bumps after every frame set.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "gst_rgbd_server/camera_source.h"
+#include "gst_rgbd_server/rgbd_recording_format.h"
+
+constexpr char kShmRingMagic[8] = {'R', 'G', 'B', 'D', 'S', 'H', 'M', '1'};
+constexpr uint32_t kShmRingVersion = 1;
+constexpr uint32_t kShmRingAlignment = 4096;
+constexpr uint32_t kShmMaxImages = 4;
+
+struct ShmImageInfo {
+  uint32_t kind;   // RgbdStreamKind
+  uint32_t format; // RgbdPixelFormat
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint32_t size;
+  uint64_t offset; // from the start of the slot payload
+  RgbdIntrinsics intrinsics;
+  float depthScale; // meters per depth unit, 0 for non-depth images
+  uint32_t reserved[3];
+};
+
+struct ShmRingHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t slotCount;
+  uint64_t slotBytes;
+  uint64_t slotStride;
+  // sequence of the newest complete frame set, 0 before the first
+  std::atomic<uint64_t> published;
+  // futex word, changes with every frame set and on close
+  std::atomic<uint32_t> wake;
+  // set when the writer goes away; a new writer creates a new ring
+  std::atomic<uint32_t> closed;
+};
+
+struct ShmSlotHeader {
+  std::atomic<uint64_t> generation;
+  uint64_t frameNumber;
+  // capture time on the host steady clock, as in CameraFrameSet
+  uint64_t timestampNs;
+  uint32_t imageCount;
+  uint32_t reserved;
+  ShmImageInfo images[kShmMaxImages];
+};
+
+static_assert(sizeof(ShmRingHeader) <= kShmRingAlignment,
+              "ring header must fit its page");
+static_assert(sizeof(ShmSlotHeader) <= kShmRingAlignment,
+              "slot header must fit its page");
+
+// One image handed to ShmFrameWriter::write().
+struct ShmImage {
+  RgbdStreamKind kind = RgbdStreamKind::kUnknown;
+  CameraImage image;
+  RgbdIntrinsics intrinsics = {};
+  float depthScale = 0;
+};
+
+class ShmFrameWriter {
+public:
+  ShmFrameWriter() = default;
+  ~ShmFrameWriter();
+  ShmFrameWriter(const ShmFrameWriter &) = delete;
+  ShmFrameWriter &operator=(const ShmFrameWriter &) = delete;
+
+  // Creates /dev/shm/<name>, replacing a ring left behind by an earlier
+  // writer. slotBytes bounds the payload of one frame set.
+  bool open(const std::string &name, uint32_t slotCount, uint64_t slotBytes);
+  // Marks the ring closed, wakes the readers and unlinks it.
+  void close();
+  bool isOpen() const { return header_ != nullptr; }
+
+  // Copies up to kShmMaxImages images into the next slot and wakes the
+  // readers. False if they do not fit a slot.
+  bool write(uint64_t frameNumber, uint64_t timestampNs,
+             const ShmImage *images, size_t count);
+  uint64_t published() const { return sequence_; }
+
+private:
+  std::string name_;
+  ShmRingHeader *header_ = nullptr;
+  size_t mappedBytes_ = 0;
+  uint64_t sequence_ = 0;
+};
+
+// A frame set as it sits in shared memory, valid until the writer comes
+// around to its slot again; check with ShmFrameReader::release().
+struct ShmFrameView {
+  uint64_t sequence = 0;
+  uint64_t frameNumber = 0;
+  uint64_t timestampNs = 0;
+  uint32_t imageCount = 0;
+  ShmImageInfo images[kShmMaxImages];
+  const uint8_t *data[kShmMaxImages] = {};
+
+  // Index of the first image of kind, -1 if the frame set has none.
+  int find(RgbdStreamKind kind) const;
+};
+
+class ShmFrameReader {
+public:
+  ShmFrameReader() = default;
+  ~ShmFrameReader();
+  ShmFrameReader(const ShmFrameReader &) = delete;
+  ShmFrameReader &operator=(const ShmFrameReader &) = delete;
+
+  // Maps an existing ring read only; false until a writer created it.
+  bool open(const std::string &name);
+  void close();
+  bool isOpen() const { return header_ != nullptr; }
+  // The writer closed the ring, reopen to follow its successor.
+  bool writerClosed() const;
+
+  // Waits up to timeoutMs for the frame set after the last one acquired,
+  // without copying. A reader close to being lapped skips ahead to the
+  // newest frame set rather than chase the writer through the ring.
+  bool acquire(ShmFrameView &view, int timeoutMs);
+  // True if the slot still holds the view's frame set. Whatever was read
+  // through the view is torn when this returns false and must be dropped.
+  bool release(const ShmFrameView &view) const;
+
+  // Frame sets the reader skipped.
+  uint64_t skipped() const { return skipped_; }
+
+private:
+  const ShmSlotHeader *slot(uint64_t sequence) const;
+  bool load(uint64_t sequence, ShmFrameView &view) const;
+
+  ShmRingHeader *header_ = nullptr;
+  size_t mappedBytes_ = 0;
+  uint64_t last_ = 0;
+  uint64_t skipped_ = 0;
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gst_rgbd_server/camera_source.h"
+
+// Still images of the newest frame set over HTTP/1.0, for dashboards that
+// poll a camera every few seconds instead of holding an RTSP session:
+//
+//   GET /color.jpg   GET /color.png   GET /depth.png (16 bit, raw units)
+//
+// The frame bus consumer only hands over the frame set's reference through a
+// triple buffer, so publishing never waits for a request or copies pixels.
+// Images are encoded when first asked for and kept per frame id, so any
+// number of requests between two frames cost one encode. Responses carry
+// X-Frame-Id and X-Timestamp-Ns, the capture time on the steady clock.
+//
+// Requests are answered one at a time on a thread of their own. Served
+// requests are published as rgbd_snapshot_requests_total, encodes as
+// rgbd_snapshot_encodes_total.
+class SnapshotServer {
+public:
+  SnapshotServer();
+  ~SnapshotServer();
+
+  SnapshotServer(const SnapshotServer &) = delete;
+  SnapshotServer &operator=(const SnapshotServer &) = delete;
+
+  // Listens on "unix:/path/to.sock" or "[host:]port", host defaulting to
+  // 127.0.0.1. False if the endpoint cannot be opened.
+  bool start(const std::string &endpoint);
+  void stop();
+  bool isRunning() const { return listenFd_ >= 0; }
+
+  // Makes frames the newest frame set. Wait-free, called from one consumer
+  // thread; the set's images stay referenced until two newer ones came.
+  void publish(const CameraFrameSet &frames);
+
+private:
+  struct Slot {
+    uint64_t frameId = 0;
+    uint64_t timestampNs = 0;
+    CameraImage color;
+    CameraImage depth;
+    std::shared_ptr<void> keepAlive;
+  };
+  struct Encoded {
+    uint64_t frameId = 0;
+    std::vector<unsigned char> bytes;
+  };
+
+  void run();
+  void serve(int fd);
+  // The newest published slot, read by the serving thread only
+  const Slot &latest();
+  bool encode(const std::string &path, const Slot &slot, Encoded *&out,
+              const char *&type);
+
+  // Triple buffer: the writer fills back_, then swaps it with middle_; the
+  // reader swaps front_ with middle_ when that holds something newer
+  static constexpr uint8_t kFresh = 4;
+  Slot slots_[3];
+  uint8_t back_ = 0;
+  std::atomic<uint8_t> middle_{1};
+  uint8_t front_ = 2;
+
+  Encoded colorJpeg_;
+  Encoded colorPng_;
+  Encoded depthPng_;
+
+  std::string unixPath_;
+  int listenFd_ = -1;
+  int wakeFds_[2] = {-1, -1};
+  std::thread thread_;
+
+  std::atomic<double> &requests_;
+  std::atomic<double> &encodes_;
+};
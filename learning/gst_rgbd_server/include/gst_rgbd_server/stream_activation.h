@@ -0,0 +1,48 @@
+#pragma once
+
+#include <glib.h>
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+// Reference counts the consumers of up to 32 streams and reports which
+// streams should be running. A stream activates with its first consumer and
+// deactivates only after its last consumer has been gone for a grace period,
+// so a client reconnecting right away does not restart the device.
+// Grace timers run on the default GLib main context.
+class StreamActivation {
+public:
+  // Called with the new mask of active streams whenever it changes, from the
+  // acquiring thread or the main context.
+  using Callback = std::function<void(uint32_t activeMask)>;
+
+  StreamActivation(guint graceMs, Callback onChange);
+  ~StreamActivation();
+
+  void acquire(uint32_t stream);
+  void release(uint32_t stream);
+
+  uint32_t active() const;
+  guint graceMs() const { return graceMs_; }
+
+private:
+  static constexpr uint32_t kMaxStreams = 32;
+  struct Timer {
+    StreamActivation *owner;
+    uint32_t stream;
+  };
+
+  static gboolean onGraceExpired(gpointer user_data);
+  void notify();
+
+  guint graceMs_;
+  Callback onChange_;
+  mutable std::mutex mutex_;
+  // serializes onChange_ so changes apply in order, always with the latest mask
+  std::mutex changeMutex_;
+  uint32_t counts_[kMaxStreams] = {};
+  guint timers_[kMaxStreams] = {};
+  Timer timerData_[kMaxStreams];
+  uint32_t active_ = 0;
+};
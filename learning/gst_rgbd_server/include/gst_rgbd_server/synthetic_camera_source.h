@@ -0,0 +1,81 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gst_rgbd_server/camera_source.h"
+
+// Ray casts a procedural scene (a floor, a back wall and a few spheres moving
+// on seeded orbits) into consistent color, Z16, left/right IR and IMU streams.
+// Frame content depends only on the seed and the frame number, so two runs
+// with the same seed produce identical frames.
+class SyntheticCameraSource : public CameraSource {
+public:
+  static constexpr float kHorizontalFovDeg = 69.4f;
+  static constexpr float kDepthScale = 0.001f;
+  static constexpr float kStereoBaseline = 0.05f; // meters, IR left to right
+
+  explicit SyntheticCameraSource(uint32_t seed = 0);
+  ~SyntheticCameraSource() override;
+
+  // Paced to config.fps by default; unpaced sources render as fast as they
+  // are pulled, for throughput benchmarks.
+  void setRealtime(bool realtime) { realtime_ = realtime; }
+
+  bool start(const CameraConfig &config) override;
+  void stop() override;
+  bool isStarted() const override { return started_; }
+  bool waitForFrames(CameraFrameSet &frames, uint32_t timeoutMs) override;
+
+  std::string serial() const override;
+  const CameraConfig &config() const override { return config_; }
+  // Color, depth and IR left share one exactly known pinhole model.
+  RgbdIntrinsics colorIntrinsics() const override { return intrinsics_; }
+  RgbdIntrinsics depthIntrinsics() const override { return intrinsics_; }
+  float depthScale() const override { return kDepthScale; }
+
+private:
+  struct Sphere {
+    float center[3];
+    float orbit[3];
+    float radius;
+    float speed; // rad/s
+    float phase;
+    float albedo[3];
+  };
+  // A sphere at its position for one frame, with a conservative screen
+  // space bounding box so most pixels skip the intersection test.
+  struct Placed {
+    float center[3];
+    float radius2;
+    float invRadius;
+    const float *albedo;
+    int uMin, uMax, vMin, vMax;
+  };
+  struct Hit;
+  struct Storage;
+
+  void place(float t, std::vector<Placed> &placed) const;
+  void trace(float originX, int u, int v, const std::vector<Placed> &placed,
+             Hit &hit) const;
+  uint8_t infrared(const Hit &hit, float worldX, int v, float shade) const;
+  void renderSpan(int v, int uBegin, int uEnd,
+                  const std::vector<Placed> &placed, Storage &storage) const;
+  void render(uint64_t frameNumber, Storage &storage) const;
+  std::shared_ptr<Storage> acquireStorage();
+
+  uint32_t seed_;
+  bool realtime_ = true;
+  bool started_ = false;
+  CameraConfig config_;
+  RgbdIntrinsics intrinsics_{};
+  std::vector<Sphere> spheres_;
+  std::vector<float> rayX_; // per column
+  std::vector<float> rayY_; // per row
+  std::shared_ptr<Storage> background_;
+  std::vector<std::shared_ptr<Storage>> pool_;
+  uint64_t frameNumber_ = 0;
+  std::chrono::steady_clock::time_point startTime_;
+};
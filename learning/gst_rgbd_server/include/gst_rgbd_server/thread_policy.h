@@ -0,0 +1,97 @@
+#pragma once
+
+#include <gst/gst.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Where a thread may run and how urgently.
+struct ThreadRule {
+  // glob over the thread name or its alias, e.g. "capture", "queue*", "*enc*"
+  std::string pattern;
+  // allowed cores, any if empty
+  std::vector<int> cpus;
+  // 1-99 runs the thread SCHED_FIFO at that priority, 0 leaves it SCHED_OTHER
+  int fifoPriority = 0;
+  bool setNice = false;
+  int nice = 0;
+};
+
+// Parses rules separated by ';', each PATTERN=CPUS[:fifo=PRIO][:nice=N]
+// with CPUS a list like 2,4-5 or * for any, e.g.
+// "capture=2:fifo=50;queue*=3;*enc*=4-5:nice=-5;udpsink*=3".
+bool parseThreadRules(const std::string &spec, std::vector<ThreadRule> &rules);
+
+// Pins and prioritizes the threads of the camera path so planners and other
+// load on the machine cannot preempt them, by name. Our own threads call
+// enter() and leave(); GStreamer streaming threads are created by a task
+// pool of our own, one dedicated thread per task named after the element
+// that owns it and matched against both that name and the element's
+// factory, e.g. "queue0" or "queue". The first matching rule applies.
+//
+// SCHED_FIFO needs CAP_SYS_NICE or an rtprio limit, a negative nice value
+// likewise; without them the thread keeps running where the rest of the
+// rule put it and a warning is printed once.
+//
+// sample() publishes the CPU time of every thread entered as
+// rgbd_thread_cpu_seconds_total{thread,tid}, its share of a core since the
+// previous sample as rgbd_thread_cpu_percent and the core it last ran on as
+// rgbd_thread_last_cpu.
+//
+// Nothing is changed or tracked until configure() was called, so code may
+// call enter() and watch() unconditionally.
+class ThreadPolicy {
+public:
+  static ThreadPolicy &instance();
+
+  // Parses spec and makes it the rules; false and an error on a bad spec. An
+  // empty spec only tracks CPU usage.
+  bool configure(const std::string &spec);
+  // Parses spec and puts its rules ahead of the current ones, so a rule for
+  // one element set up later wins over a broad pattern. Enables the policy.
+  bool addRules(const std::string &spec);
+  bool isEnabled() const { return enabled_.load(); }
+
+  // Names the calling thread, applies the rule matching name or alias and
+  // tracks the thread until leave() or its exit.
+  void enter(const std::string &name, const std::string &alias = "");
+  void leave();
+
+  // Runs the streaming threads started from now on in element's pipeline on
+  // threads enter()ed with the element's name. Call it before the pipeline
+  // leaves NULL. Takes the pipeline bus' sync handler.
+  void watch(GstElement *element);
+
+  void sample();
+  // Samples, then writes one line per tracked thread.
+  void report(std::ostream &out);
+
+private:
+  struct Tracked {
+    std::string name;
+    pid_t tid;
+    std::string labels;
+    double cpuSeconds;
+    gint64 sampledUs;
+    double percent;
+    int lastCpu;
+  };
+
+  ThreadPolicy() = default;
+  static GstBusSyncReply onSyncMessage(GstBus *bus, GstMessage *message,
+                                       gpointer user_data);
+  const ThreadRule *match(const std::string &name,
+                          const std::string &alias) const;
+  void apply(const ThreadRule &rule, const std::string &name);
+
+  std::atomic<bool> enabled_{false};
+  std::mutex mutex_;
+  std::vector<ThreadRule> rules_;
+  std::vector<Tracked> threads_;
+  bool warnedAffinity_ = false;
+  bool warnedPriority_ = false;
+};
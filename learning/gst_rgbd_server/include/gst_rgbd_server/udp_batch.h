@@ -0,0 +1,127 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// UDP sockets that move many RTP packets per syscall: sendmmsg(), optionally
+// with UDP GSO so the kernel segments runs of equal size packets itself, and
+// recvmmsg() into caller provided buffers. udpsink and udpsrc make one
+// syscall per packet, which at a few hundred packets per frame and stream is
+// where publishing spends its CPU.
+
+struct UdpBatchOptions {
+  // Packets per sendmmsg() / recvmmsg() call
+  unsigned batch = 64;
+  // Hand runs of equal size packets to the kernel as one UDP_SEGMENT send;
+  // turned off by itself where the kernel or the device refuses it
+  bool gso = true;
+  // SO_SNDBUF / SO_RCVBUF, 0 keeps the system default
+  int socketBufferBytes = 0;
+  // Largest packet a receiver accepts, larger ones are truncated and dropped
+  unsigned maxPacket = 2048;
+};
+
+// Sends to one destination. Packets are collected with add() and leave on
+// flush(), in order, so a caller flushes once per frame or buffer list.
+// Metrics are labelled socket="NAME":
+//   rgbd_udp_send_syscalls_total, rgbd_udp_packets_sent_total,
+//   rgbd_udp_gso_sends_total, rgbd_udp_send_errors_total and
+//   rgbd_udp_send_batch_packets, the packets per syscall of the last flush.
+class UdpBatchSender {
+public:
+  UdpBatchSender(const std::string &name,
+                 const UdpBatchOptions &options = UdpBatchOptions());
+  ~UdpBatchSender();
+
+  UdpBatchSender(const UdpBatchSender &) = delete;
+  UdpBatchSender &operator=(const UdpBatchSender &) = delete;
+
+  bool open(const std::string &host, int port);
+  void close();
+  bool isOpen() const { return fd_ >= 0; }
+  bool gsoEnabled() const { return gso_; }
+
+  // One packet made of iovCount pieces. The memory must stay valid until
+  // flush() returns.
+  void add(const iovec *iov, size_t iovCount);
+  size_t pending() const { return packets_.size(); }
+  // False if packets could not be sent; they are dropped either way.
+  bool flush();
+
+private:
+  struct Packet {
+    size_t iov;   // first piece in iovs_
+    size_t count; // pieces
+    size_t size;  // bytes
+  };
+
+  // Builds msgs_ for packets_[from, end): one message per packet, or per
+  // run of equal size packets when GSO is on
+  void buildMessages(size_t from);
+  // Sends msgs_. Returns the packet to rebuild from when the kernel refused
+  // GSO, packets_.size() once everything is out.
+  size_t sendMessages(bool &ok, size_t &syscalls);
+
+  std::string name_;
+  UdpBatchOptions options_;
+  int fd_ = -1;
+  bool gso_ = false;
+
+  std::vector<iovec> iovs_;
+  std::vector<Packet> packets_;
+  // rebuilt on every flush, kept to reuse their storage
+  std::vector<struct mmsghdr> msgs_;
+  std::vector<size_t> msgPackets_; // first packet of each message
+  std::vector<char> controls_;
+
+  std::atomic<double> &syscalls_;
+  std::atomic<double> &sent_;
+  std::atomic<double> &gsoSends_;
+  std::atomic<double> &errors_;
+  std::atomic<double> &batchPackets_;
+};
+
+// Receives on one port. Metrics are labelled socket="NAME":
+//   rgbd_udp_receive_syscalls_total, rgbd_udp_packets_received_total,
+//   rgbd_udp_receive_truncated_total and rgbd_udp_receive_batch_packets,
+//   the packets of the last recvmmsg().
+class UdpBatchReceiver {
+public:
+  UdpBatchReceiver(const std::string &name,
+                   const UdpBatchOptions &options = UdpBatchOptions());
+  ~UdpBatchReceiver();
+
+  UdpBatchReceiver(const UdpBatchReceiver &) = delete;
+  UdpBatchReceiver &operator=(const UdpBatchReceiver &) = delete;
+
+  bool open(int port, const std::string &address = "0.0.0.0");
+  void close();
+  bool isOpen() const { return fd_ >= 0; }
+  const UdpBatchOptions &options() const { return options_; }
+
+  // Waits up to timeoutMs for packets, then reads up to count of them with
+  // one recvmmsg(), packet i into buffers[i] of at most options().maxPacket
+  // bytes. Sizes go to lengths[i]; truncated packets get length 0. Returns
+  // the packets read, 0 on timeout and -1 on error.
+  int receive(uint8_t *const *buffers, size_t *lengths, size_t count,
+              int timeoutMs);
+
+private:
+  std::string name_;
+  UdpBatchOptions options_;
+  int fd_ = -1;
+
+  std::vector<struct mmsghdr> msgs_;
+  std::vector<iovec> iovs_;
+
+  std::atomic<double> &syscalls_;
+  std::atomic<double> &received_;
+  std::atomic<double> &truncated_;
+  std::atomic<double> &batchPackets_;
+};
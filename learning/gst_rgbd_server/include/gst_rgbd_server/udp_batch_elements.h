@@ -0,0 +1,70 @@
+#pragma once
+
+#include <gst/gst.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gst_rgbd_server/app_queue.h"
+#include "gst_rgbd_server/udp_batch.h"
+
+// Batched UDP ends for RTP pipelines, built on appsink and appsrc like the
+// shared memory ring: an appsink where udpsink would be, an appsrc where
+// udpsrc would be.
+
+// Sends whatever reaches an appsink to host:port. The appsink takes buffer
+// lists, so a payloader pushing one list per frame (rtpvrawpay with
+// chunks-per-frame=1, rtph264pay with the fragments of a NAL unit) leaves
+// in one flush. Packet memories are sent from where they are, without merging
+// header and payload.
+class RtpBatchSink {
+public:
+  RtpBatchSink(GstElement *appsink, const std::string &host, int port,
+               const std::string &name,
+               const UdpBatchOptions &options = UdpBatchOptions());
+  ~RtpBatchSink();
+
+  bool isOpen() const { return sender_.isOpen(); }
+
+private:
+  static GstFlowReturn onNewSample(GstElement *appsink, gpointer user_data);
+  void send(GstSample *sample);
+  void add(GstBuffer *buffer);
+
+  GstElement *appsink_;
+  gulong handler_ = 0;
+  UdpBatchSender sender_;
+  // mapped memories of the packets added since the last flush
+  std::vector<GstMemory *> memories_;
+  std::vector<GstMapInfo> maps_;
+  std::vector<iovec> iovs_;
+};
+
+// Reads a port with recvmmsg() from its own thread and pushes each read as
+// one buffer list. Packets are received straight into buffers of a pool,
+// which go downstream as they are and come back once the depayloader is
+// done with them. Every packet is stamped with the pipeline running time,
+// as udpsrc does, for the jitterbuffer. The appsrc needs RTP caps.
+class RtpBatchSource {
+public:
+  RtpBatchSource(GstElement *appsrc, int port, const std::string &name,
+                 const UdpBatchOptions &options = UdpBatchOptions(),
+                 const std::string &address = "0.0.0.0");
+  ~RtpBatchSource();
+
+  bool isOpen() const { return receiver_.isOpen(); }
+  void start();
+  void stop();
+
+private:
+  void run();
+
+  GstElement *appsrc_;
+  AppSrcQueue queue_;
+  UdpBatchReceiver receiver_;
+  GstBufferPool *pool_ = nullptr;
+  std::thread thread_;
+  std::atomic<bool> running_{false};
+};
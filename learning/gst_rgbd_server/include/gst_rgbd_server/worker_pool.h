@@ -0,0 +1,50 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads draining a bounded job queue. Shared by all cameras of
+// a process so conversion work never oversubscribes the cores.
+class WorkerPool {
+public:
+  // threads == 0 uses one thread per core. maxQueued bounds the backlog;
+  // trySubmit() refuses work beyond it instead of growing latency. Every
+  // thread runs onStart first, e.g. to name or pin itself.
+  explicit WorkerPool(size_t threads = 0, size_t maxQueued = 64,
+                      std::function<void()> onStart = nullptr);
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  // Returns false (and drops the job) if the queue is full or stopping.
+  bool trySubmit(std::function<void()> job);
+  // Blocks while the queue is full, false if the pool is stopping.
+  bool submit(std::function<void()> job);
+
+  // Runs fn(0) .. fn(count - 1) on the pool and the calling thread, returns
+  // when all are done. Must not be called from a pool thread.
+  void parallelFor(size_t count, const std::function<void(size_t)> &fn);
+
+  size_t size() const { return threads_.size(); }
+  size_t queued() const;
+
+  static size_t hardwareThreads();
+
+private:
+  void run();
+
+  size_t maxQueued_;
+  std::function<void()> onStart_;
+  mutable std::mutex mutex_;
+  std::condition_variable jobReady_;
+  std::condition_variable spaceReady_;
+  std::deque<std::function<void()>> jobs_;
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+};
@@ -0,0 +1,249 @@
+#include "gst_rgbd_server/app_queue.h"
+
+#include <algorithm>
+
+#include "gst_rgbd_server/metrics.h"
+
+namespace {
+
+std::atomic<double> &counter(const char *metric, const std::string &name) {
+  return Metrics::instance().gauge(std::string(metric) + "{queue=\"" + name +
+                                   "\"}");
+}
+
+// Queues under one name may push from different threads
+void increment(std::atomic<double> &value) {
+  double current = value.load();
+  while (!value.compare_exchange_weak(current, current + 1)) {
+  }
+}
+
+void raise(std::atomic<double> &value, double level) {
+  double current = value.load();
+  while (level > current && !value.compare_exchange_weak(current, level)) {
+  }
+}
+
+bool hasProperty(gpointer object, const char *property) {
+  return g_object_class_find_property(G_OBJECT_GET_CLASS(object), property) !=
+         NULL;
+}
+
+} // namespace
+
+bool parseQueueDrop(const std::string &name, QueueDrop &drop) {
+  if (name == "drop-oldest") {
+    drop = QueueDrop::kDropOldest;
+  } else if (name == "drop-newest") {
+    drop = QueueDrop::kDropNewest;
+  } else if (name == "block") {
+    drop = QueueDrop::kBlock;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *queueDropName(QueueDrop drop) {
+  switch (drop) {
+  case QueueDrop::kDropOldest:
+    return "drop-oldest";
+  case QueueDrop::kDropNewest:
+    return "drop-newest";
+  case QueueDrop::kBlock:
+    return "block";
+  }
+  return "unknown";
+}
+
+AppSrcQueue::AppSrcQueue(GstElement *appsrc, const std::string &name,
+                         const QueuePolicy &policy)
+    : appsrc_(GST_APP_SRC(gst_object_ref(appsrc))), policy_(policy),
+      enqueued_(counter("rgbd_queue_enqueued_total", name)),
+      dropped_(counter("rgbd_queue_dropped_total", name)),
+      highWater_(counter("rgbd_queue_high_water", name)) {
+  countsFrames_ = hasProperty(appsrc, "current-level-buffers");
+  if (hasProperty(appsrc, "max-buffers")) {
+    g_object_set(G_OBJECT(appsrc), "max-buffers", guint64(policy.maxFrames),
+                 NULL);
+  }
+  gst_app_src_set_max_bytes(appsrc_, policy.maxBytes);
+  g_object_set(G_OBJECT(appsrc), "block", policy.drop == QueueDrop::kBlock,
+               NULL);
+  if (policy.drop != QueueDrop::kBlock && hasProperty(appsrc, "leaky-type")) {
+    gst_util_set_object_arg(G_OBJECT(appsrc), "leaky-type",
+                            policy.drop == QueueDrop::kDropOldest
+                                ? "downstream"
+                                : "upstream");
+    leaky_ = policy.drop == QueueDrop::kDropOldest;
+  }
+}
+
+AppSrcQueue::~AppSrcQueue() { gst_object_unref(appsrc_); }
+
+uint64_t AppSrcQueue::levelFrames(gsize frameSize) const {
+  if (countsFrames_) {
+    guint64 frames = 0;
+    g_object_get(G_OBJECT(appsrc_), "current-level-buffers", &frames, NULL);
+    return frames;
+  }
+  guint64 bytes = gst_app_src_get_current_level_bytes(appsrc_);
+  return frameSize ? (bytes + frameSize - 1) / frameSize : 0;
+}
+
+GstFlowReturn AppSrcQueue::push(GstBuffer *buffer) {
+  gsize size = gst_buffer_get_size(buffer);
+  if (!frameSize_ && size) {
+    frameSize_ = size;
+    // Without max-buffers appsrc can only count bytes
+    if (!countsFrames_ && policy_.maxFrames) {
+      uint64_t bytes = uint64_t(policy_.maxFrames) * size;
+      if (!policy_.maxBytes || bytes < policy_.maxBytes) {
+        gst_app_src_set_max_bytes(appsrc_, bytes);
+      }
+    }
+  }
+
+  uint64_t frames = levelFrames(frameSize_);
+  bool full = (policy_.maxFrames && frames >= policy_.maxFrames) ||
+              (policy_.maxBytes && gst_app_src_get_current_level_bytes(
+                                       appsrc_) >= policy_.maxBytes);
+  if (full && policy_.drop != QueueDrop::kBlock) {
+    increment(dropped_);
+    if (!leaky_) {
+      gst_buffer_unref(buffer);
+      return GST_FLOW_OK;
+    }
+    // appsrc evicts the oldest buffer to make room
+  }
+
+  GstFlowReturn ret = gst_app_src_push_buffer(appsrc_, buffer);
+  if (ret == GST_FLOW_OK) {
+    increment(enqueued_);
+    raise(highWater_, double(levelFrames(frameSize_)));
+  }
+  return ret;
+}
+
+GstFlowReturn AppSrcQueue::pushList(GstBufferList *list) {
+  bool full = policy_.maxBytes && gst_app_src_get_current_level_bytes(
+                                      appsrc_) >= policy_.maxBytes;
+  if (full && policy_.drop != QueueDrop::kBlock) {
+    increment(dropped_);
+    if (!leaky_) {
+      gst_buffer_list_unref(list);
+      return GST_FLOW_OK;
+    }
+  }
+
+  GstFlowReturn ret = gst_app_src_push_buffer_list(appsrc_, list);
+  if (ret == GST_FLOW_OK) {
+    increment(enqueued_);
+  }
+  return ret;
+}
+
+void AppSrcQueue::endOfStream() { gst_app_src_end_of_stream(appsrc_); }
+
+QueueStats AppSrcQueue::stats() const {
+  QueueStats stats;
+  stats.enqueued = uint64_t(enqueued_.load());
+  stats.dropped = uint64_t(dropped_.load());
+  stats.highWater = uint64_t(highWater_.load());
+  return stats;
+}
+
+AppSinkQueue::AppSinkQueue(GstElement *appsink, const std::string &name,
+                           const QueuePolicy &policy)
+    : appsink_(GST_APP_SINK(gst_object_ref(appsink))), policy_(policy),
+      enqueued_(counter("rgbd_queue_enqueued_total", name)),
+      dropped_(counter("rgbd_queue_dropped_total", name)),
+      highWater_(counter("rgbd_queue_high_water", name)) {
+  // drop-newest is decided in admit(), appsink itself never fills up then
+  appsinkLimit_ = policy.drop == QueueDrop::kDropNewest ? 0 : policy.maxFrames;
+  gst_app_sink_set_max_buffers(appsink_, appsinkLimit_);
+  gst_app_sink_set_drop(appsink_, policy.drop == QueueDrop::kDropOldest);
+
+  pad_ = gst_element_get_static_pad(appsink, "sink");
+  probe_ = gst_pad_add_probe(
+      pad_,
+      GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER |
+                      GST_PAD_PROBE_TYPE_EVENT_FLUSH),
+      &AppSinkQueue::onProbe, this, NULL);
+}
+
+AppSinkQueue::~AppSinkQueue() {
+  gst_pad_remove_probe(pad_, probe_);
+  gst_object_unref(pad_);
+  gst_object_unref(appsink_);
+}
+
+GstPadProbeReturn AppSinkQueue::onProbe(GstPad *, GstPadProbeInfo *info,
+                                        gpointer user_data) {
+  AppSinkQueue *queue = static_cast<AppSinkQueue *>(user_data);
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+    return queue->admit(gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info)));
+  }
+  // appsink empties its queue on a flush
+  if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) ==
+      GST_EVENT_FLUSH_STOP) {
+    std::lock_guard<std::mutex> lock(queue->mutex_);
+    queue->queued_ = 0;
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn AppSinkQueue::admit(gsize size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  guint limit = policy_.maxFrames;
+  if (policy_.maxBytes && size) {
+    guint byBytes = guint(std::max<uint64_t>(1, policy_.maxBytes / size));
+    limit = limit ? std::min(limit, byBytes) : byBytes;
+  }
+  if (policy_.drop != QueueDrop::kDropNewest && limit != appsinkLimit_) {
+    gst_app_sink_set_max_buffers(appsink_, limit);
+    appsinkLimit_ = limit;
+  }
+
+  if (limit && queued_ >= limit) {
+    switch (policy_.drop) {
+    case QueueDrop::kDropNewest:
+      increment(dropped_);
+      return GST_PAD_PROBE_DROP;
+    case QueueDrop::kDropOldest:
+      // appsink evicts the oldest sample when this one arrives
+      increment(dropped_);
+      --queued_;
+      break;
+    case QueueDrop::kBlock:
+      break;
+    }
+  }
+  ++queued_;
+  increment(enqueued_);
+  // a blocked buffer waits outside the queue
+  raise(highWater_, double(limit ? std::min<uint64_t>(queued_, limit)
+                                 : queued_));
+  return GST_PAD_PROBE_OK;
+}
+
+GstSample *AppSinkQueue::pull(GstClockTime timeout) {
+  GstSample *sample = gst_app_sink_try_pull_sample(appsink_, timeout);
+  if (sample) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queued_) {
+      --queued_;
+    }
+  }
+  return sample;
+}
+
+bool AppSinkQueue::isEos() const { return gst_app_sink_is_eos(appsink_); }
+
+QueueStats AppSinkQueue::stats() const {
+  QueueStats stats;
+  stats.enqueued = uint64_t(enqueued_.load());
+  stats.dropped = uint64_t(dropped_.load());
+  stats.highWater = uint64_t(highWater_.load());
+  return stats;
+}
@@ -0,0 +1,57 @@
+#include "gst_rgbd_server/camera_source.h"
+
+#include <cstdlib>
+#include <iostream>
+
+#include "gst_rgbd_server/realsense_camera_source.h"
+#include "gst_rgbd_server/synthetic_camera_source.h"
+
+std::unique_ptr<CameraSource> createCameraSource(const std::string &spec) {
+  std::string kind = spec.substr(0, spec.find(':'));
+  std::string arg =
+      spec.find(':') == std::string::npos ? "" : spec.substr(spec.find(':') + 1);
+
+  if (kind == "realsense") {
+    return std::unique_ptr<CameraSource>(new RealSenseCameraSource(arg));
+  }
+  if (kind == "synthetic") {
+    uint32_t seed = arg.empty() ? 0 : std::strtoul(arg.c_str(), nullptr, 10);
+    return std::unique_ptr<CameraSource>(new SyntheticCameraSource(seed));
+  }
+  std::cerr << "Unknown camera source: " << spec << std::endl;
+  return nullptr;
+}
+
+const char *gstVideoFormat(RgbdPixelFormat format) {
+  switch (format) {
+  case RgbdPixelFormat::kZ16:
+    return "GRAY16_LE";
+  case RgbdPixelFormat::kRGBA8:
+    return "RGBA";
+  case RgbdPixelFormat::kRGB8:
+    return "RGB";
+  case RgbdPixelFormat::kBGR8:
+    return "BGR";
+  case RgbdPixelFormat::kY8:
+    return "GRAY8";
+  case RgbdPixelFormat::kYUYV:
+    return "YUY2";
+  case RgbdPixelFormat::kUYVY:
+    return "UYVY";
+  default:
+    return nullptr;
+  }
+}
+
+RgbdPixelFormat pixelFormatFromGst(const std::string &format) {
+  const RgbdPixelFormat formats[] = {
+      RgbdPixelFormat::kZ16, RgbdPixelFormat::kRGBA8, RgbdPixelFormat::kRGB8,
+      RgbdPixelFormat::kBGR8, RgbdPixelFormat::kY8,   RgbdPixelFormat::kYUYV,
+      RgbdPixelFormat::kUYVY};
+  for (RgbdPixelFormat candidate : formats) {
+    if (format == gstVideoFormat(candidate)) {
+      return candidate;
+    }
+  }
+  return RgbdPixelFormat::kUnknown;
+}
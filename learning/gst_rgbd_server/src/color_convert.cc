@@ -0,0 +1,648 @@
+#include "gst_rgbd_server/color_convert.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RGBD_HAVE_AVX2_KERNEL 1
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define RGBD_HAVE_NEON_KERNEL 1
+#endif
+
+namespace {
+
+// 8 bit fixed point rows of the limited range matrices. Chroma rows sum to
+// zero so grey stays at 128 exactly.
+struct Coefficients {
+  int yr, yg, yb;
+  int ur, ug, ub;
+  int vr, vg, vb;
+};
+
+const Coefficients kBT601 = {66, 129, 25, -38, -74, 112, 112, -94, -18};
+const Coefficients kBT709 = {47, 157, 16, -26, -86, 112, 112, -102, -10};
+
+// Two source rows and where their luma and shared chroma go. y1 is null for
+// the last row of an odd height, src1 then repeats src0.
+struct RowPair {
+  const uint8_t *src0;
+  const uint8_t *src1;
+  uint8_t *y0;
+  uint8_t *y1;
+  uint8_t *u;
+  uint8_t *v;
+  int uvStep; // 1 for I420, 2 for NV12's interleaved plane
+};
+
+inline uint8_t luma(const Coefficients &k, int r, int g, int b) {
+  return uint8_t(((k.yr * r + k.yg * g + k.yb * b + 128) >> 8) + 16);
+}
+
+// Always positive before the shift, so the rounding matches the kernels'
+// arithmetic shift of the unbiased sum
+inline uint8_t chroma(int cr, int cg, int cb, int r, int g, int b) {
+  return uint8_t((cr * r + cg * g + cb * b + 128 + (128 << 8)) >> 8);
+}
+
+// Chroma is computed from the rounded mean of each 2x2 block.
+void scalarRows(const Coefficients &k, const RowPair &rows, int width, int x,
+                int ri, int bi) {
+  for (; x < width; x += 2) {
+    int x1 = std::min(x + 1, width - 1);
+    const uint8_t *p00 = rows.src0 + 3 * x;
+    const uint8_t *p01 = rows.src0 + 3 * x1;
+    const uint8_t *p10 = rows.src1 + 3 * x;
+    const uint8_t *p11 = rows.src1 + 3 * x1;
+    rows.y0[x] = luma(k, p00[ri], p00[1], p00[bi]);
+    rows.y0[x1] = luma(k, p01[ri], p01[1], p01[bi]);
+    if (rows.y1) {
+      rows.y1[x] = luma(k, p10[ri], p10[1], p10[bi]);
+      rows.y1[x1] = luma(k, p11[ri], p11[1], p11[bi]);
+    }
+    int r = (p00[ri] + p01[ri] + p10[ri] + p11[ri] + 2) >> 2;
+    int g = (p00[1] + p01[1] + p10[1] + p11[1] + 2) >> 2;
+    int b = (p00[bi] + p01[bi] + p10[bi] + p11[bi] + 2) >> 2;
+    int c = (x / 2) * rows.uvStep;
+    rows.u[c] = chroma(k.ur, k.ug, k.ub, r, g, b);
+    rows.v[c] = chroma(k.vr, k.vg, k.vb, r, g, b);
+  }
+}
+
+// 4:2:2 to 4:2:0: luma is copied, chroma is the rounded mean of the two
+// rows. src1 may repeat src0 for the last row of an odd height.
+void scalarRows422(const RowPair &rows, int width, int x, bool uyvy) {
+  const int yi = uyvy ? 1 : 0;
+  const int ui = uyvy ? 0 : 1;
+  const int vi = uyvy ? 2 : 3;
+  for (; x < width; x += 2) {
+    const uint8_t *m0 = rows.src0 + 2 * x;
+    const uint8_t *m1 = rows.src1 + 2 * x;
+    rows.y0[x] = m0[yi];
+    if (rows.y1) {
+      rows.y1[x] = m1[yi];
+    }
+    if (x + 1 < width) {
+      rows.y0[x + 1] = m0[yi + 2];
+      if (rows.y1) {
+        rows.y1[x + 1] = m1[yi + 2];
+      }
+    }
+    int c = (x / 2) * rows.uvStep;
+    rows.u[c] = uint8_t((m0[ui] + m1[ui] + 1) >> 1);
+    rows.v[c] = uint8_t((m0[vi] + m1[vi] + 1) >> 1);
+  }
+}
+
+// Halves one plane row of 1 (Y, U, V) or 2 (NV12 UV) byte pixels from two
+// source rows. Vertical then horizontal rounded means; r1 may repeat r0.
+void scalarHalveRow(const uint8_t *r0, const uint8_t *r1, uint8_t *dst,
+                    int srcWidth, int dstWidth, int channels, int x) {
+  for (; x < dstWidth; ++x) {
+    int s0 = 2 * x * channels;
+    int s1 = std::min(2 * x + 1, srcWidth - 1) * channels;
+    for (int c = 0; c < channels; ++c) {
+      int v0 = (r0[s0 + c] + r1[s0 + c] + 1) >> 1;
+      int v1 = (r0[s1 + c] + r1[s1 + c] + 1) >> 1;
+      dst[x * channels + c] = uint8_t((v0 + v1 + 1) >> 1);
+    }
+  }
+}
+
+#ifdef RGBD_HAVE_AVX2_KERNEL
+
+// Splits 16 packed 3 byte pixels into their three channels.
+__attribute__((target("avx2"))) inline void
+deinterleave16(const uint8_t *p, __m128i &c0, __m128i &c1, __m128i &c2) {
+  __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16));
+  __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 32));
+  c0 = _mm_or_si128(
+      _mm_or_si128(
+          _mm_shuffle_epi8(a, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1,
+                                            -1, -1, -1, -1, -1, -1)),
+          _mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8,
+                                            11, 14, -1, -1, -1, -1, -1))),
+      _mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                        -1, 1, 4, 7, 10, 13)));
+  c1 = _mm_or_si128(
+      _mm_or_si128(
+          _mm_shuffle_epi8(a, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1,
+                                            -1, -1, -1, -1, -1, -1, -1)),
+          _mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12,
+                                            15, -1, -1, -1, -1, -1))),
+      _mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                        -1, 2, 5, 8, 11, 14)));
+  c2 = _mm_or_si128(
+      _mm_or_si128(
+          _mm_shuffle_epi8(a, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1,
+                                            -1, -1, -1, -1, -1, -1, -1)),
+          _mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10,
+                                            13, -1, -1, -1, -1, -1, -1))),
+      _mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                        0, 3, 6, 9, 12, 15)));
+}
+
+// 16 luma values of one row. Every term is positive and the sum stays below
+// 2^16, so unsigned 16 bit lanes suffice.
+__attribute__((target("avx2"))) inline void
+lumaAvx2(const Coefficients &k, __m128i r, __m128i g, __m128i b, uint8_t *y) {
+  __m256i sum = _mm256_add_epi16(
+      _mm256_add_epi16(
+          _mm256_mullo_epi16(_mm256_cvtepu8_epi16(r), _mm256_set1_epi16(k.yr)),
+          _mm256_mullo_epi16(_mm256_cvtepu8_epi16(g), _mm256_set1_epi16(k.yg))),
+      _mm256_add_epi16(
+          _mm256_mullo_epi16(_mm256_cvtepu8_epi16(b), _mm256_set1_epi16(k.yb)),
+          _mm256_set1_epi16(128)));
+  sum = _mm256_add_epi16(_mm256_srli_epi16(sum, 8), _mm256_set1_epi16(16));
+  // packus works per 128 bit lane, gather the two low quads
+  __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(sum, sum),
+                                            _MM_SHUFFLE(3, 1, 2, 0));
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(y),
+                   _mm256_castsi256_si128(packed));
+}
+
+// Rounded mean of the 2x2 blocks over two rows of 16 pixels.
+__attribute__((target("avx2"))) inline __m128i blockMean(__m128i row0,
+                                                         __m128i row1) {
+  const __m128i ones = _mm_set1_epi8(1);
+  __m128i sum = _mm_add_epi16(_mm_maddubs_epi16(row0, ones),
+                              _mm_maddubs_epi16(row1, ones));
+  return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+__attribute__((target("avx2"))) inline __m128i
+chromaAvx2(int cr, int cg, int cb, __m128i r, __m128i g, __m128i b) {
+  __m128i sum = _mm_add_epi16(
+      _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(cr)),
+                    _mm_mullo_epi16(g, _mm_set1_epi16(cg))),
+      _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(cb)),
+                    _mm_set1_epi16(128)));
+  return _mm_add_epi16(_mm_srai_epi16(sum, 8), _mm_set1_epi16(128));
+}
+
+__attribute__((target("avx2"))) void avx2Rows(const Coefficients &k,
+                                              const RowPair &rows, int width,
+                                              bool bgr) {
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m128i r0, g0, b0, r1, g1, b1;
+    deinterleave16(rows.src0 + 3 * x, r0, g0, b0);
+    deinterleave16(rows.src1 + 3 * x, r1, g1, b1);
+    if (bgr) {
+      std::swap(r0, b0);
+      std::swap(r1, b1);
+    }
+    lumaAvx2(k, r0, g0, b0, rows.y0 + x);
+    if (rows.y1) {
+      lumaAvx2(k, r1, g1, b1, rows.y1 + x);
+    }
+    __m128i r = blockMean(r0, r1);
+    __m128i g = blockMean(g0, g1);
+    __m128i b = blockMean(b0, b1);
+    // 8 U bytes then 8 V bytes
+    __m128i uv = _mm_packus_epi16(chromaAvx2(k.ur, k.ug, k.ub, r, g, b),
+                                  chromaAvx2(k.vr, k.vg, k.vb, r, g, b));
+    int c = (x / 2) * rows.uvStep;
+    if (rows.uvStep == 2) {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(rows.u + c),
+                       _mm_unpacklo_epi8(uv, _mm_srli_si128(uv, 8)));
+    } else {
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(rows.u + c), uv);
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(rows.v + c),
+                       _mm_srli_si128(uv, 8));
+    }
+  }
+  scalarRows(k, rows, width, x, bgr ? 2 : 0, bgr ? 0 : 2);
+}
+
+// 8 pixels of packed 4:2:2 into [Y0..Y7, U0..U3, V0..V3].
+__attribute__((target("avx2"))) inline __m128i split422(const uint8_t *p,
+                                                        bool uyvy) {
+  const __m128i yuyv = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 5, 9, 13,
+                                     3, 7, 11, 15);
+  const __m128i uyvyMask = _mm_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15, 0, 4, 8,
+                                         12, 2, 6, 10, 14);
+  return _mm_shuffle_epi8(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)),
+      uyvy ? uyvyMask : yuyv);
+}
+
+// 16 luma bytes of one row and its 8 U then 8 V bytes.
+__attribute__((target("avx2"))) inline __m128i
+splitRow422(const uint8_t *p, bool uyvy, uint8_t *y) {
+  __m128i a = split422(p, uyvy);
+  __m128i b = split422(p + 16, uyvy);
+  if (y) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(y),
+                     _mm_unpacklo_epi64(a, b));
+  }
+  return _mm_unpacklo_epi32(_mm_srli_si128(a, 8), _mm_srli_si128(b, 8));
+}
+
+__attribute__((target("avx2"))) void avx2Rows422(const RowPair &rows,
+                                                 int width, bool uyvy) {
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m128i uv0 = splitRow422(rows.src0 + 2 * x, uyvy, rows.y0 + x);
+    __m128i uv1 = splitRow422(rows.src1 + 2 * x, uyvy,
+                              rows.y1 ? rows.y1 + x : nullptr);
+    // (a + b + 1) >> 1, as the scalar path
+    __m128i uv = _mm_avg_epu8(uv0, uv1);
+    int c = (x / 2) * rows.uvStep;
+    if (rows.uvStep == 2) {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(rows.u + c),
+                       _mm_unpacklo_epi8(uv, _mm_srli_si128(uv, 8)));
+    } else {
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(rows.u + c), uv);
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(rows.v + c),
+                       _mm_srli_si128(uv, 8));
+    }
+  }
+  scalarRows422(rows, width, x, uyvy);
+}
+
+// 16 output bytes from 32 bytes of each source row.
+__attribute__((target("avx2"))) inline __m128i
+halve16(const uint8_t *r0, const uint8_t *r1, const __m128i &order) {
+  const __m128i ones = _mm_set1_epi8(1);
+  const __m128i one = _mm_set1_epi16(1);
+  __m128i lo = _mm_avg_epu8(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(r0)),
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(r1)));
+  __m128i hi = _mm_avg_epu8(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(r0 + 16)),
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(r1 + 16)));
+  // neighbours of the same channel next to each other, then pair sums
+  lo = _mm_maddubs_epi16(_mm_shuffle_epi8(lo, order), ones);
+  hi = _mm_maddubs_epi16(_mm_shuffle_epi8(hi, order), ones);
+  return _mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(lo, one), 1),
+                          _mm_srli_epi16(_mm_add_epi16(hi, one), 1));
+}
+
+__attribute__((target("avx2"))) void
+avx2HalveRow(const uint8_t *r0, const uint8_t *r1, uint8_t *dst, int srcWidth,
+             int dstWidth, int channels) {
+  const __m128i order =
+      channels == 2 ? _mm_setr_epi8(0, 2, 1, 3, 4, 6, 5, 7, 8, 10, 9, 11, 12,
+                                    14, 13, 15)
+                    : _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
+                                    13, 14, 15);
+  const int step = 16 / channels;
+  int x = 0;
+  for (; x + step <= dstWidth && 2 * (x + step) <= srcWidth; x += step) {
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i *>(dst + x * channels),
+        halve16(r0 + 2 * x * channels, r1 + 2 * x * channels, order));
+  }
+  scalarHalveRow(r0, r1, dst, srcWidth, dstWidth, channels, x);
+}
+
+#endif // RGBD_HAVE_AVX2_KERNEL
+
+#ifdef RGBD_HAVE_NEON_KERNEL
+
+inline uint8x16_t lumaNeon(const Coefficients &k, uint8x16_t r, uint8x16_t g,
+                           uint8x16_t b) {
+  const uint16x8_t round = vdupq_n_u16(128);
+  uint16x8_t lo = vmull_u8(vget_low_u8(r), vdup_n_u8(uint8_t(k.yr)));
+  lo = vmlal_u8(lo, vget_low_u8(g), vdup_n_u8(uint8_t(k.yg)));
+  lo = vmlal_u8(lo, vget_low_u8(b), vdup_n_u8(uint8_t(k.yb)));
+  uint16x8_t hi = vmull_u8(vget_high_u8(r), vdup_n_u8(uint8_t(k.yr)));
+  hi = vmlal_u8(hi, vget_high_u8(g), vdup_n_u8(uint8_t(k.yg)));
+  hi = vmlal_u8(hi, vget_high_u8(b), vdup_n_u8(uint8_t(k.yb)));
+  uint8x16_t y = vcombine_u8(vshrn_n_u16(vaddq_u16(lo, round), 8),
+                             vshrn_n_u16(vaddq_u16(hi, round), 8));
+  return vaddq_u8(y, vdupq_n_u8(16));
+}
+
+inline int16x8_t blockMean(uint8x16_t row0, uint8x16_t row1) {
+  uint16x8_t sum = vaddq_u16(vpaddlq_u8(row0), vpaddlq_u8(row1));
+  return vreinterpretq_s16_u16(vshrq_n_u16(vaddq_u16(sum, vdupq_n_u16(2)), 2));
+}
+
+inline uint8x8_t chromaNeon(int cr, int cg, int cb, int16x8_t r, int16x8_t g,
+                            int16x8_t b) {
+  int16x8_t sum = vmulq_n_s16(r, int16_t(cr));
+  sum = vmlaq_n_s16(sum, g, int16_t(cg));
+  sum = vmlaq_n_s16(sum, b, int16_t(cb));
+  sum = vshrq_n_s16(vaddq_s16(sum, vdupq_n_s16(128)), 8);
+  return vqmovun_s16(vaddq_s16(sum, vdupq_n_s16(128)));
+}
+
+void neonRows(const Coefficients &k, const RowPair &rows, int width, bool bgr) {
+  const int ri = bgr ? 2 : 0;
+  const int bi = bgr ? 0 : 2;
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    uint8x16x3_t p0 = vld3q_u8(rows.src0 + 3 * x);
+    uint8x16x3_t p1 = vld3q_u8(rows.src1 + 3 * x);
+    vst1q_u8(rows.y0 + x, lumaNeon(k, p0.val[ri], p0.val[1], p0.val[bi]));
+    if (rows.y1) {
+      vst1q_u8(rows.y1 + x, lumaNeon(k, p1.val[ri], p1.val[1], p1.val[bi]));
+    }
+    int16x8_t r = blockMean(p0.val[ri], p1.val[ri]);
+    int16x8_t g = blockMean(p0.val[1], p1.val[1]);
+    int16x8_t b = blockMean(p0.val[bi], p1.val[bi]);
+    uint8x8_t u = chromaNeon(k.ur, k.ug, k.ub, r, g, b);
+    uint8x8_t v = chromaNeon(k.vr, k.vg, k.vb, r, g, b);
+    int c = (x / 2) * rows.uvStep;
+    if (rows.uvStep == 2) {
+      uint8x8x2_t uv = {{u, v}};
+      vst2_u8(rows.u + c, uv);
+    } else {
+      vst1_u8(rows.u + c, u);
+      vst1_u8(rows.v + c, v);
+    }
+  }
+  scalarRows(k, rows, width, x, ri, bi);
+}
+
+void neonRows422(const RowPair &rows, int width, bool uyvy) {
+  const int yi = uyvy ? 1 : 0;
+  const int ui = uyvy ? 0 : 1;
+  const int vi = uyvy ? 2 : 3;
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    uint8x8x4_t m0 = vld4_u8(rows.src0 + 2 * x);
+    uint8x8x4_t m1 = vld4_u8(rows.src1 + 2 * x);
+    uint8x8x2_t y0 = {{m0.val[yi], m0.val[yi + 2]}};
+    vst2_u8(rows.y0 + x, y0);
+    if (rows.y1) {
+      uint8x8x2_t y1 = {{m1.val[yi], m1.val[yi + 2]}};
+      vst2_u8(rows.y1 + x, y1);
+    }
+    uint8x8_t u = vrhadd_u8(m0.val[ui], m1.val[ui]);
+    uint8x8_t v = vrhadd_u8(m0.val[vi], m1.val[vi]);
+    int c = (x / 2) * rows.uvStep;
+    if (rows.uvStep == 2) {
+      uint8x8x2_t uv = {{u, v}};
+      vst2_u8(rows.u + c, uv);
+    } else {
+      vst1_u8(rows.u + c, u);
+      vst1_u8(rows.v + c, v);
+    }
+  }
+  scalarRows422(rows, width, x, uyvy);
+}
+
+void neonHalveRow(const uint8_t *r0, const uint8_t *r1, uint8_t *dst,
+                  int srcWidth, int dstWidth, int channels) {
+  int x = 0;
+  if (channels == 2) {
+    for (; x + 8 <= dstWidth && 2 * (x + 8) <= srcWidth; x += 8) {
+      uint8x16x2_t a = vld2q_u8(r0 + 4 * x);
+      uint8x16x2_t b = vld2q_u8(r1 + 4 * x);
+      uint8x8x2_t out;
+      for (int c = 0; c < 2; ++c) {
+        out.val[c] =
+            vrshrn_n_u16(vpaddlq_u8(vrhaddq_u8(a.val[c], b.val[c])), 1);
+      }
+      vst2_u8(dst + 2 * x, out);
+    }
+  } else {
+    for (; x + 8 <= dstWidth && 2 * (x + 8) <= srcWidth; x += 8) {
+      uint8x16_t v = vrhaddq_u8(vld1q_u8(r0 + 2 * x), vld1q_u8(r1 + 2 * x));
+      vst1_u8(dst + x, vrshrn_n_u16(vpaddlq_u8(v), 1));
+    }
+  }
+  scalarHalveRow(r0, r1, dst, srcWidth, dstWidth, channels, x);
+}
+
+#endif // RGBD_HAVE_NEON_KERNEL
+
+int roundUp(int value, int multiple) {
+  return (value + multiple - 1) / multiple * multiple;
+}
+
+// Source rows and destination planes of row pair `pair`.
+RowPair rowPair(const uint8_t *src, int stride, int height, YuvLayout layout,
+                const YuvPlanes &planes, uint8_t *dst, size_t pair) {
+  int row = int(pair) * 2;
+  bool last = row + 1 >= height;
+  RowPair rows;
+  rows.src0 = src + size_t(stride) * row;
+  rows.src1 = last ? rows.src0 : rows.src0 + stride;
+  rows.y0 = dst + size_t(planes.stride[0]) * row;
+  rows.y1 = last ? nullptr : rows.y0 + planes.stride[0];
+  rows.u = dst + planes.offset[1] + size_t(planes.stride[1]) * pair;
+  if (layout == YuvLayout::kNV12) {
+    rows.v = rows.u + 1;
+    rows.uvStep = 2;
+  } else {
+    rows.v = dst + planes.offset[2] + size_t(planes.stride[2]) * pair;
+    rows.uvStep = 1;
+  }
+  return rows;
+}
+
+} // namespace
+
+bool parseYuvLayout(const std::string &name, YuvLayout &layout) {
+  if (name == "I420" || name == "i420") {
+    layout = YuvLayout::kI420;
+  } else if (name == "NV12" || name == "nv12") {
+    layout = YuvLayout::kNV12;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *yuvLayoutName(YuvLayout layout) {
+  return layout == YuvLayout::kNV12 ? "NV12" : "I420";
+}
+
+const char *yuvMatrixName(YuvMatrix matrix) {
+  return matrix == YuvMatrix::kBT709 ? "bt709" : "bt601";
+}
+
+YuvMatrix defaultYuvMatrix(int height) {
+  return height >= 720 ? YuvMatrix::kBT709 : YuvMatrix::kBT601;
+}
+
+YuvPlanes yuvPlanes(YuvLayout layout, int width, int height) {
+  YuvPlanes planes;
+  int chromaRows = roundUp(height, 2) / 2;
+  planes.stride[0] = roundUp(width, 4);
+  planes.offset[1] = size_t(planes.stride[0]) * roundUp(height, 2);
+  if (layout == YuvLayout::kNV12) {
+    planes.stride[1] = planes.stride[0];
+    planes.size = planes.offset[1] + size_t(planes.stride[1]) * chromaRows;
+    return planes;
+  }
+  planes.stride[1] = planes.stride[2] = roundUp(roundUp(width, 2) / 2, 4);
+  planes.offset[2] = planes.offset[1] + size_t(planes.stride[1]) * chromaRows;
+  planes.size = planes.offset[2] + size_t(planes.stride[2]) * chromaRows;
+  return planes;
+}
+
+ColorConverter::ColorConverter(YuvLayout layout, YuvMatrix matrix,
+                               WorkerPool *pool)
+    : layout_(layout), matrix_(matrix), pool_(pool), kernel_(bestKernel()) {}
+
+void ColorConverter::setKernel(Kernel kernel) {
+  Kernel best = bestKernel();
+  kernel_ = kernel == Kernel::kScalar || kernel == best ? kernel
+                                                        : Kernel::kScalar;
+}
+
+ColorConverter::Kernel ColorConverter::bestKernel() {
+#ifdef RGBD_HAVE_AVX2_KERNEL
+  // One binary for every x86 box, the kernel is picked at run time
+  if (__builtin_cpu_supports("avx2")) {
+    return Kernel::kAvx2;
+  }
+#endif
+#ifdef RGBD_HAVE_NEON_KERNEL
+  return Kernel::kNeon;
+#endif
+  return Kernel::kScalar;
+}
+
+const char *ColorConverter::kernelName(Kernel kernel) {
+  switch (kernel) {
+  case Kernel::kAvx2:
+    return "avx2";
+  case Kernel::kNeon:
+    return "neon";
+  case Kernel::kScalar:
+    break;
+  }
+  return "scalar";
+}
+
+void ColorConverter::forEachBand(
+    int height, const std::function<void(size_t, size_t)> &fn) const {
+  const size_t pairs = size_t(height + 1) / 2;
+  // Bands of at least 16 row pairs, one per pool thread plus the caller
+  size_t bands = pool_ ? std::min(pool_->size() + 1, pairs / 16) : 1;
+  if (bands <= 1) {
+    fn(0, pairs);
+    return;
+  }
+  pool_->parallelFor(bands, [&](size_t band) {
+    fn(pairs * band / bands, pairs * (band + 1) / bands);
+  });
+}
+
+void ColorConverter::convert(const uint8_t *src, int stride, bool bgr,
+                             int width, int height, uint8_t *dst) const {
+  const Coefficients &k = matrix_ == YuvMatrix::kBT709 ? kBT709 : kBT601;
+  const YuvPlanes planes = yuvPlanes(layout_, width, height);
+  forEachBand(height, [&](size_t begin, size_t end) {
+    for (size_t pair = begin; pair < end; ++pair) {
+      RowPair rows = rowPair(src, stride, height, layout_, planes, dst, pair);
+      switch (kernel_) {
+#ifdef RGBD_HAVE_AVX2_KERNEL
+      case Kernel::kAvx2:
+        avx2Rows(k, rows, width, bgr);
+        break;
+#endif
+#ifdef RGBD_HAVE_NEON_KERNEL
+      case Kernel::kNeon:
+        neonRows(k, rows, width, bgr);
+        break;
+#endif
+      default:
+        scalarRows(k, rows, width, 0, bgr ? 2 : 0, bgr ? 0 : 2);
+        break;
+      }
+    }
+  });
+}
+
+void ColorConverter::convert422(const uint8_t *src, int stride, bool uyvy,
+                                int width, int height, uint8_t *dst) const {
+  const YuvPlanes planes = yuvPlanes(layout_, width, height);
+  forEachBand(height, [&](size_t begin, size_t end) {
+    for (size_t pair = begin; pair < end; ++pair) {
+      RowPair rows = rowPair(src, stride, height, layout_, planes, dst, pair);
+      switch (kernel_) {
+#ifdef RGBD_HAVE_AVX2_KERNEL
+      case Kernel::kAvx2:
+        avx2Rows422(rows, width, uyvy);
+        break;
+#endif
+#ifdef RGBD_HAVE_NEON_KERNEL
+      case Kernel::kNeon:
+        neonRows422(rows, width, uyvy);
+        break;
+#endif
+      default:
+        scalarRows422(rows, width, 0, uyvy);
+        break;
+      }
+    }
+  });
+}
+
+void ColorConverter::halve(const uint8_t *src, int width, int height,
+                           uint8_t *dst) const {
+  const int dstWidth = width / 2;
+  const int dstHeight = height / 2;
+  const YuvPlanes from = yuvPlanes(layout_, width, height);
+  const YuvPlanes to = yuvPlanes(layout_, dstWidth, dstHeight);
+  const int planeCount = layout_ == YuvLayout::kNV12 ? 2 : 3;
+  for (int plane = 0; plane < planeCount; ++plane) {
+    // pixels per row and rows; chroma planes round up
+    bool chromaPlane = plane > 0;
+    int channels = chromaPlane && layout_ == YuvLayout::kNV12 ? 2 : 1;
+    int srcWidth = chromaPlane ? (width + 1) / 2 : width;
+    int srcHeight = chromaPlane ? (height + 1) / 2 : height;
+    int outWidth = chromaPlane ? (dstWidth + 1) / 2 : dstWidth;
+    int outHeight = chromaPlane ? (dstHeight + 1) / 2 : dstHeight;
+    const uint8_t *srcPlane = src + from.offset[plane];
+    uint8_t *dstPlane = dst + to.offset[plane];
+    // one band row pair per output row
+    forEachBand(2 * outHeight, [&](size_t begin, size_t end) {
+      for (size_t row = begin; row < end; ++row) {
+        const uint8_t *r0 = srcPlane + size_t(from.stride[plane]) * 2 * row;
+        const uint8_t *r1 =
+            2 * int(row) + 1 < srcHeight ? r0 + from.stride[plane] : r0;
+        uint8_t *out = dstPlane + size_t(to.stride[plane]) * row;
+        switch (kernel_) {
+#ifdef RGBD_HAVE_AVX2_KERNEL
+        case Kernel::kAvx2:
+          avx2HalveRow(r0, r1, out, srcWidth, outWidth, channels);
+          break;
+#endif
+#ifdef RGBD_HAVE_NEON_KERNEL
+        case Kernel::kNeon:
+          neonHalveRow(r0, r1, out, srcWidth, outWidth, channels);
+          break;
+#endif
+        default:
+          scalarHalveRow(r0, r1, out, srcWidth, outWidth, channels, 0);
+          break;
+        }
+      }
+    });
+  }
+}
+
+bool ColorConverter::canConvert(RgbdPixelFormat format) {
+  return format == RgbdPixelFormat::kRGB8 ||
+         format == RgbdPixelFormat::kBGR8 ||
+         format == RgbdPixelFormat::kYUYV || format == RgbdPixelFormat::kUYVY;
+}
+
+bool ColorConverter::convert(const CameraImage &image, uint8_t *dst) const {
+  if (!canConvert(image.format)) {
+    return false;
+  }
+  if (image.format == RgbdPixelFormat::kYUYV ||
+      image.format == RgbdPixelFormat::kUYVY) {
+    int stride = image.stride > 0 ? image.stride : image.width * 2;
+    convert422(static_cast<const uint8_t *>(image.data), stride,
+               image.format == RgbdPixelFormat::kUYVY, image.width,
+               image.height, dst);
+    return true;
+  }
+  int stride = image.stride > 0 ? image.stride : image.width * 3;
+  convert(static_cast<const uint8_t *>(image.data), stride,
+          image.format == RgbdPixelFormat::kBGR8, image.width, image.height,
+          dst);
+  return true;
+}
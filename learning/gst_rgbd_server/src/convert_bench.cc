@@ -0,0 +1,217 @@
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/gst.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include "gst_rgbd_server/color_convert.h"
+
+static gint width = 1280;
+static gint height = 720;
+static gint frames = 300;
+static gint threads = 4;
+static gint videoconvertThreads = 1;
+static gchar *layoutName = nullptr;
+static gboolean rgb = FALSE;
+static bool bgr = true;
+static gboolean skipVideoconvert = FALSE;
+
+static GOptionEntry entries[] = {
+    {"width", 0, 0, G_OPTION_ARG_INT, &width, "Frame width (default: 1280)",
+     "W"},
+    {"height", 0, 0, G_OPTION_ARG_INT, &height,
+     "Frame height (default: 720)", "H"},
+    {"frames", 'n', 0, G_OPTION_ARG_INT, &frames,
+     "Frames per measurement (default: 300)", "N"},
+    {"threads", 't', 0, G_OPTION_ARG_INT, &threads,
+     "Helper threads of the banded run (default: 4)", "N"},
+    {"videoconvert-threads", 0, 0, G_OPTION_ARG_INT, &videoconvertThreads,
+     "n-threads of the videoconvert run (default: 1)", "N"},
+    {"layout", 'l', 0, G_OPTION_ARG_STRING, &layoutName,
+     "I420 or NV12 (default: I420)", "FORMAT"},
+    {"rgb", 0, 0, G_OPTION_ARG_NONE, &rgb,
+     "Convert RGB instead of BGR input", NULL},
+    {"no-videoconvert", 0, 0, G_OPTION_ARG_NONE, &skipVideoconvert,
+     "Only time the in-tree converter", NULL},
+    {NULL}};
+
+// Rows padded to 4 bytes, as appsrc expects without GstVideoMeta
+static int stride() { return (width * 3 + 3) & ~3; }
+
+// Gradients with noise, so flat areas and edges both show up in the diff.
+static std::vector<uint8_t> makeFrame() {
+    std::vector<uint8_t> frame(size_t(stride()) * height);
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> noise(-24, 24);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            uint8_t *p = &frame[size_t(y) * stride() + x * 3];
+            int base[3] = {x * 255 / width, y * 255 / height,
+                           (x + y) * 255 / (width + height)};
+            for (int c = 0; c < 3; ++c) {
+                int value = base[c] + noise(rng);
+                p[c] = uint8_t(std::min(255, std::max(0, value)));
+            }
+        }
+    }
+    return frame;
+}
+
+static double timeConverter(const ColorConverter &converter,
+                            const std::vector<uint8_t> &frame,
+                            std::vector<uint8_t> &out) {
+    converter.convert(frame.data(), stride(), bgr, width, height, out.data());
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; ++i) {
+        converter.convert(frame.data(), stride(), bgr, width, height,
+                          out.data());
+    }
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count() / frames;
+}
+
+// Runs the frame through appsrc ! videoconvert ! appsink, the path the
+// converter replaces. Returns the mean ms per frame, < 0 on failure.
+static double timeVideoconvert(const std::vector<uint8_t> &frame,
+                               YuvLayout layout, YuvMatrix matrix,
+                               std::vector<uint8_t> &out) {
+    std::ostringstream launch;
+    launch << "appsrc name=src format=time caps=video/x-raw,format="
+           << (bgr ? "BGR" : "RGB") << ",width=" << width
+           << ",height=" << height << ",framerate=30/1 ! videoconvert n-threads="
+           << videoconvertThreads << " ! video/x-raw,format="
+           << yuvLayoutName(layout) << ",colorimetry=" << yuvMatrixName(matrix)
+           << " ! appsink name=sink sync=false";
+    GError *error = NULL;
+    GstElement *pipeline = gst_parse_launch(launch.str().c_str(), &error);
+    if (error) {
+        std::cerr << "videoconvert pipeline: " << error->message << std::endl;
+        g_clear_error(&error);
+        if (pipeline) {
+            gst_object_unref(pipeline);
+        }
+        return -1;
+    }
+    GstElement *src = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+    double totalMs = 0;
+    for (int i = 0; i <= frames; ++i) {
+        GstBuffer *buffer =
+            gst_buffer_new_allocate(NULL, frame.size(), NULL);
+        gst_buffer_fill(buffer, 0, frame.data(), frame.size());
+        GST_BUFFER_PTS(buffer) = gst_util_uint64_scale(i, GST_SECOND, 30);
+        auto start = std::chrono::steady_clock::now();
+        gst_app_src_push_buffer(GST_APP_SRC(src), buffer);
+        GstSample *sample = gst_app_sink_pull_sample(GST_APP_SINK(sink));
+        std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        if (!sample) {
+            totalMs = -1;
+            break;
+        }
+        // the first frame also negotiates, leave it out
+        if (i > 0) {
+            totalMs += elapsed.count();
+        } else {
+            gst_buffer_extract(gst_sample_get_buffer(sample), 0, out.data(),
+                               out.size());
+        }
+        gst_sample_unref(sample);
+    }
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(src);
+    gst_object_unref(sink);
+    gst_object_unref(pipeline);
+    return totalMs < 0 ? -1 : totalMs / frames;
+}
+
+// Largest difference per plane and the share of samples off by more than 1.
+static void compare(const std::vector<uint8_t> &ours,
+                    const std::vector<uint8_t> &reference, YuvLayout layout) {
+    YuvPlanes planes = yuvPlanes(layout, width, height);
+    const char *names[3] = {"Y", layout == YuvLayout::kNV12 ? "UV" : "U", "V"};
+    int planeCount = layout == YuvLayout::kNV12 ? 2 : 3;
+    for (int plane = 0; plane < planeCount; ++plane) {
+        size_t begin = planes.offset[plane];
+        size_t end = plane + 1 < planeCount ? planes.offset[plane + 1]
+                                            : planes.size;
+        int maxDiff = 0;
+        size_t over = 0;
+        for (size_t i = begin; i < end; ++i) {
+            int diff = std::abs(int(ours[i]) - int(reference[i]));
+            maxDiff = std::max(maxDiff, diff);
+            over += diff > 1;
+        }
+        std::cout << "  " << names[plane] << ": max diff " << maxDiff << ", "
+                  << 100.0 * over / (end - begin) << "% off by more than 1"
+                  << std::endl;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    GError *error = NULL;
+    GOptionContext *optctx =
+        g_option_context_new("- RGB to YUV conversion benchmark");
+    g_option_context_add_main_entries(optctx, entries, NULL);
+    g_option_context_add_group(optctx, gst_init_get_option_group());
+    if (!g_option_context_parse(optctx, &argc, &argv, &error)) {
+        std::cerr << "Error parsing options: " << error->message << std::endl;
+        g_option_context_free(optctx);
+        g_clear_error(&error);
+        return -1;
+    }
+    g_option_context_free(optctx);
+    bgr = !rgb;
+
+    YuvLayout layout = YuvLayout::kI420;
+    if (layoutName && !parseYuvLayout(layoutName, layout)) {
+        std::cerr << "Unknown layout: " << layoutName << std::endl;
+        return -1;
+    }
+    YuvMatrix matrix = defaultYuvMatrix(height);
+    std::vector<uint8_t> frame = makeFrame();
+    std::vector<uint8_t> out(yuvPlanes(layout, width, height).size);
+    std::cout << width << "x" << height << (bgr ? " BGR" : " RGB") << " to "
+              << yuvLayoutName(layout) << " " << yuvMatrixName(matrix) << ", "
+              << frames << " frames" << std::endl;
+
+    ColorConverter scalar(layout, matrix);
+    scalar.setKernel(ColorConverter::Kernel::kScalar);
+    std::cout << "scalar, 1 thread: " << timeConverter(scalar, frame, out)
+              << " ms/frame" << std::endl;
+
+    ColorConverter simd(layout, matrix);
+    std::cout << ColorConverter::kernelName(simd.kernel()) << ", 1 thread: "
+              << timeConverter(simd, frame, out) << " ms/frame" << std::endl;
+
+    WorkerPool pool(size_t(std::max(0, threads)));
+    ColorConverter banded(layout, matrix, &pool);
+    std::cout << ColorConverter::kernelName(banded.kernel()) << ", "
+              << pool.size() + 1 << " threads: "
+              << timeConverter(banded, frame, out) << " ms/frame" << std::endl;
+
+    if (skipVideoconvert) {
+        return 0;
+    }
+    std::vector<uint8_t> reference(out.size());
+    double videoconvertMs = timeVideoconvert(frame, layout, matrix, reference);
+    if (videoconvertMs < 0) {
+        return -1;
+    }
+    std::cout << "videoconvert, " << videoconvertThreads
+              << " thread(s): " << videoconvertMs << " ms/frame" << std::endl;
+    banded.convert(frame.data(), stride(), bgr, width, height, out.data());
+    std::cout << "Difference to videoconvert:" << std::endl;
+    compare(out, reference, layout);
+    return 0;
+}
@@ -0,0 +1,42 @@
+#include "gst_rgbd_server/cv_image.h"
+
+#include <opencv2/imgproc.hpp>
+
+cv::Mat bgrImage(const CameraImage &image) {
+  cv::Mat color;
+  if (!image) {
+    return color;
+  }
+  void *data = const_cast<void *>(image.data);
+  switch (image.format) {
+  case RgbdPixelFormat::kYUYV:
+    cv::cvtColor(cv::Mat(image.height, image.width, CV_8UC2, data,
+                         image.stride),
+                 color, cv::COLOR_YUV2BGR_YUYV);
+    break;
+  case RgbdPixelFormat::kUYVY:
+    cv::cvtColor(cv::Mat(image.height, image.width, CV_8UC2, data,
+                         image.stride),
+                 color, cv::COLOR_YUV2BGR_UYVY);
+    break;
+  case RgbdPixelFormat::kRGB8:
+    cv::cvtColor(cv::Mat(image.height, image.width, CV_8UC3, data,
+                         image.stride),
+                 color, cv::COLOR_RGB2BGR);
+    break;
+  case RgbdPixelFormat::kRGBA8:
+    cv::cvtColor(cv::Mat(image.height, image.width, CV_8UC4, data,
+                         image.stride),
+                 color, cv::COLOR_RGBA2BGR);
+    break;
+  case RgbdPixelFormat::kBGR8:
+    color = cv::Mat(image.height, image.width, CV_8UC3, data, image.stride);
+    break;
+  case RgbdPixelFormat::kY8:
+    color = cv::Mat(image.height, image.width, CV_8UC1, data, image.stride);
+    break;
+  default:
+    break;
+  }
+  return color;
+}
@@ -0,0 +1,450 @@
+#include "gst_rgbd_server/encoder_factory.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+
+namespace {
+
+const char *const kNvmmUpload =
+    "nvvideoconvert ! video/x-raw(memory:NVMM),format=NV12";
+const char *const kNv12Upload = "videoconvert ! video/x-raw,format=NV12";
+const char *const kI420Upload = "videoconvert ! video/x-raw,format=I420";
+
+// In order of preference within a codec: Jetson / NVIDIA, VA, Quick Sync,
+// then software.
+const EncoderInfo kEncoders[] = {
+    {"nvv4l2h264enc", VideoCodec::kH264, true, kNvmmUpload, "bitrate", true},
+    {"vah264enc", VideoCodec::kH264, true, kNv12Upload, "bitrate", false},
+    {"vaapih264enc", VideoCodec::kH264, true, kNv12Upload, "bitrate", false},
+    {"qsvh264enc", VideoCodec::kH264, true, kNv12Upload, "bitrate", false},
+    {"x264enc", VideoCodec::kH264, false, kI420Upload, "bitrate", false},
+    {"openh264enc", VideoCodec::kH264, false, kI420Upload, "bitrate", true},
+    {"nvv4l2h265enc", VideoCodec::kH265, true, kNvmmUpload, "bitrate", true},
+    {"vah265enc", VideoCodec::kH265, true, kNv12Upload, "bitrate", false},
+    {"vaapih265enc", VideoCodec::kH265, true, kNv12Upload, "bitrate", false},
+    {"x265enc", VideoCodec::kH265, false, kI420Upload, "bitrate", false},
+    {"nvv4l2vp8enc", VideoCodec::kVP8, true, kNvmmUpload, "bitrate", true},
+    {"vp8enc", VideoCodec::kVP8, false, kI420Upload, "target-bitrate", true},
+};
+
+struct PresetProperties {
+  const char *element;
+  EncoderPreset preset;
+  const char *properties;
+};
+
+// Intra refresh and sliced threads add to the zero latency set; an encoder
+// without an entry for one gets only the zero latency set. Properties
+// an installed version lacks are skipped, e.g. preset-level exists on
+// Jetson and tuning-info-id on dGPU builds of nvv4l2h264enc.
+const PresetProperties kPresets[] = {
+    {"x264enc", EncoderPreset::kZeroLatency,
+     "tune=zerolatency speed-preset=ultrafast bframes=0"},
+    {"x264enc", EncoderPreset::kIntraRefresh, "intra-refresh=true key-int-max=60"},
+    {"x264enc", EncoderPreset::kSlicedThreads, "sliced-threads=true"},
+    {"x265enc", EncoderPreset::kZeroLatency,
+     "tune=zerolatency speed-preset=ultrafast"},
+    {"x265enc", EncoderPreset::kIntraRefresh,
+     "key-int-max=60 option-string=intra-refresh=1"},
+    {"x265enc", EncoderPreset::kSlicedThreads, "option-string=slices=4"},
+    {"openh264enc", EncoderPreset::kZeroLatency,
+     "complexity=low rate-control=bitrate"},
+    {"openh264enc", EncoderPreset::kSlicedThreads,
+     "slice-mode=n-slices num-slices=4"},
+    {"nvv4l2h264enc", EncoderPreset::kZeroLatency,
+     "maxperf-enable=true preset-level=1 tuning-info-id=2 insert-sps-pps=true "
+     "idrinterval=60 iframeinterval=60"},
+    {"nvv4l2h264enc", EncoderPreset::kIntraRefresh,
+     "SliceIntraRefreshInterval=60"},
+    {"nvv4l2h264enc", EncoderPreset::kSlicedThreads,
+     "slice-header-spacing=8 bit-packetization=false"},
+    {"nvv4l2h265enc", EncoderPreset::kZeroLatency,
+     "maxperf-enable=true preset-level=1 tuning-info-id=2 insert-sps-pps=true "
+     "idrinterval=60 iframeinterval=60"},
+    {"nvv4l2h265enc", EncoderPreset::kIntraRefresh,
+     "SliceIntraRefreshInterval=60"},
+    {"nvv4l2h265enc", EncoderPreset::kSlicedThreads,
+     "slice-header-spacing=8 bit-packetization=false"},
+    {"nvv4l2vp8enc", EncoderPreset::kZeroLatency, "maxperf-enable=true"},
+    {"vah264enc", EncoderPreset::kZeroLatency,
+     "b-frames=0 rate-control=cbr key-int-max=60"},
+    {"vah264enc", EncoderPreset::kSlicedThreads, "num-slices=4"},
+    {"vah265enc", EncoderPreset::kZeroLatency,
+     "b-frames=0 rate-control=cbr key-int-max=60"},
+    {"vah265enc", EncoderPreset::kSlicedThreads, "num-slices=4"},
+    {"vaapih264enc", EncoderPreset::kZeroLatency,
+     "max-bframes=0 rate-control=cbr keyframe-period=60"},
+    {"vaapih264enc", EncoderPreset::kSlicedThreads, "num-slices=4"},
+    {"vaapih265enc", EncoderPreset::kZeroLatency,
+     "max-bframes=0 rate-control=cbr keyframe-period=60"},
+    {"vaapih265enc", EncoderPreset::kSlicedThreads, "num-slices=4"},
+    {"qsvh264enc", EncoderPreset::kZeroLatency,
+     "b-frames=0 rate-control=cbr gop-size=60"},
+    {"vp8enc", EncoderPreset::kZeroLatency,
+     "deadline=1 cpu-used=8 lag-in-frames=0 end-usage=cbr"},
+    {"vp8enc", EncoderPreset::kSlicedThreads, "token-partitions=2 threads=4"},
+};
+
+bool hasProperty(const char *element, const std::string &property) {
+  GstElementFactory *factory = gst_element_factory_find(element);
+  if (!factory) {
+    return false;
+  }
+  GType type = gst_element_factory_get_element_type(factory);
+  if (type == G_TYPE_INVALID) {
+    // not loaded yet, loading resolves the type
+    GstPluginFeature *loaded =
+        gst_plugin_feature_load(GST_PLUGIN_FEATURE(factory));
+    if (loaded) {
+      type = gst_element_factory_get_element_type(GST_ELEMENT_FACTORY(loaded));
+      gst_object_unref(loaded);
+    }
+  }
+  gst_object_unref(factory);
+  if (type == G_TYPE_INVALID) {
+    return false;
+  }
+  gpointer klass = g_type_class_ref(type);
+  bool found = g_object_class_find_property(G_OBJECT_CLASS(klass),
+                                            property.c_str()) != nullptr;
+  g_type_class_unref(klass);
+  return found;
+}
+
+bool hasPreset(const char *element, EncoderPreset preset) {
+  for (const PresetProperties &entry : kPresets) {
+    if (entry.preset == preset && strcmp(entry.element, element) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// key=value pairs of preset for element that the element actually has.
+std::vector<std::pair<std::string, std::string>>
+presetProperties(const char *element, EncoderPreset preset) {
+  std::vector<std::pair<std::string, std::string>> properties;
+  if (preset == EncoderPreset::kDefault) {
+    return properties;
+  }
+  for (const PresetProperties &entry : kPresets) {
+    if (strcmp(entry.element, element) != 0 ||
+        (entry.preset != preset &&
+         entry.preset != EncoderPreset::kZeroLatency)) {
+      continue;
+    }
+    std::istringstream words(entry.properties);
+    std::string word;
+    while (words >> word) {
+      size_t eq = word.find('=');
+      std::string key = word.substr(0, eq);
+      if (eq != std::string::npos && hasProperty(element, key)) {
+        properties.emplace_back(key, word.substr(eq + 1));
+      }
+    }
+  }
+  return properties;
+}
+
+struct LatencyProbe {
+  std::mutex mutex;
+  std::map<GstClockTime, std::chrono::steady_clock::time_point> pending;
+  std::chrono::steady_clock::time_point firstOut, lastOut;
+  double latencySum = 0;
+  int frames = 0;
+  int skip = 5; // encoder start up is not steady state
+};
+
+} // namespace
+
+bool parseVideoCodec(const std::string &name, VideoCodec &codec) {
+  for (VideoCodec c : {VideoCodec::kH264, VideoCodec::kH265, VideoCodec::kVP8}) {
+    if (name == videoCodecName(c)) {
+      codec = c;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parseEncoderPreset(const std::string &name, EncoderPreset &preset) {
+  for (EncoderPreset p :
+       {EncoderPreset::kDefault, EncoderPreset::kZeroLatency,
+        EncoderPreset::kIntraRefresh, EncoderPreset::kSlicedThreads}) {
+    if (name == encoderPresetName(p)) {
+      preset = p;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *videoCodecName(VideoCodec codec) {
+  switch (codec) {
+  case VideoCodec::kH265:
+    return "h265";
+  case VideoCodec::kVP8:
+    return "vp8";
+  default:
+    return "h264";
+  }
+}
+
+const char *encoderPresetName(EncoderPreset preset) {
+  switch (preset) {
+  case EncoderPreset::kZeroLatency:
+    return "zero-latency";
+  case EncoderPreset::kIntraRefresh:
+    return "intra-refresh";
+  case EncoderPreset::kSlicedThreads:
+    return "sliced-threads";
+  default:
+    return "default";
+  }
+}
+
+std::string EncoderChoice::launch(const std::string &name) const {
+  if (!info) {
+    return "";
+  }
+  std::ostringstream launch;
+  launch << info->upload << " ! " << info->element << " name=" << name;
+  for (const auto &property : presetProperties(info->element, preset)) {
+    launch << " " << property.first << "=" << property.second;
+  }
+  if (bitrateKbps) {
+    launch << " " << info->bitrateProperty << "="
+           << (info->bitsPerSecond ? bitrateKbps * 1000 : bitrateKbps);
+  }
+  return launch.str();
+}
+
+std::string EncoderChoice::payloader() const {
+  if (info && info->codec == VideoCodec::kH265) {
+    return "rtph265pay config-interval=1";
+  }
+  if (info && info->codec == VideoCodec::kVP8) {
+    return "rtpvp8pay";
+  }
+  return "rtph264pay config-interval=1";
+}
+
+const char *EncoderChoice::rawFormat() const {
+  return info && info->hardware ? "NV12" : "I420";
+}
+
+std::vector<const EncoderInfo *> EncoderFactory::available(VideoCodec codec) {
+  std::vector<const EncoderInfo *> found;
+  for (const EncoderInfo &info : kEncoders) {
+    if (info.codec != codec) {
+      continue;
+    }
+    GstElementFactory *factory = gst_element_factory_find(info.element);
+    if (factory) {
+      found.push_back(&info);
+      gst_object_unref(factory);
+    }
+  }
+  return found;
+}
+
+const EncoderInfo *EncoderFactory::find(const std::string &element) {
+  for (const EncoderInfo &info : kEncoders) {
+    if (element == info.element) {
+      return &info;
+    }
+  }
+  return nullptr;
+}
+
+bool EncoderFactory::calibrate(const EncoderInfo &info,
+                               const EncoderRequest &request,
+                               EncoderChoice &result) {
+  result.info = &info;
+  result.preset = request.preset;
+  result.bitrateKbps = request.bitrateKbps;
+
+  std::ostringstream launch;
+  launch << "videotestsrc num-buffers=" << request.calibrationFrames
+         << " pattern=ball ! video/x-raw,width=" << request.width
+         << ",height=" << request.height << ",framerate=" << request.fps
+         << "/1 ! videoconvert ! " << result.launch("enc")
+         << " ! fakesink sync=false";
+  GError *error = NULL;
+  GstElement *pipeline = gst_parse_launch(launch.str().c_str(), &error);
+  if (!pipeline || error) {
+    g_clear_error(&error);
+    if (pipeline) {
+      gst_object_unref(pipeline);
+    }
+    return false;
+  }
+
+  LatencyProbe probe;
+  GstElement *encoder = gst_bin_get_by_name(GST_BIN(pipeline), "enc");
+  GstPad *sinkPad = gst_element_get_static_pad(encoder, "sink");
+  GstPad *srcPad = gst_element_get_static_pad(encoder, "src");
+  gst_pad_add_probe(
+      sinkPad, GST_PAD_PROBE_TYPE_BUFFER,
+      [](GstPad *, GstPadProbeInfo *info, gpointer data) {
+        LatencyProbe *probe = static_cast<LatencyProbe *>(data);
+        std::lock_guard<std::mutex> lock(probe->mutex);
+        probe->pending[GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info))] =
+            std::chrono::steady_clock::now();
+        return GST_PAD_PROBE_OK;
+      },
+      &probe, NULL);
+  gst_pad_add_probe(
+      srcPad, GST_PAD_PROBE_TYPE_BUFFER,
+      [](GstPad *, GstPadProbeInfo *info, gpointer data) {
+        LatencyProbe *probe = static_cast<LatencyProbe *>(data);
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(probe->mutex);
+        auto it =
+            probe->pending.find(GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info)));
+        if (it == probe->pending.end()) {
+          return GST_PAD_PROBE_OK;
+        }
+        if (probe->skip > 0) {
+          --probe->skip;
+        } else {
+          if (probe->frames == 0) {
+            probe->firstOut = now;
+          }
+          probe->lastOut = now;
+          probe->latencySum +=
+              std::chrono::duration<double, std::milli>(now - it->second)
+                  .count();
+          ++probe->frames;
+        }
+        probe->pending.erase(it);
+        return GST_PAD_PROBE_OK;
+      },
+      &probe, NULL);
+  gst_object_unref(srcPad);
+  gst_object_unref(sinkPad);
+  gst_object_unref(encoder);
+
+  bool ok = false;
+  if (gst_element_set_state(pipeline, GST_STATE_PLAYING) !=
+      GST_STATE_CHANGE_FAILURE) {
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstMessage *msg = gst_bus_timed_pop_filtered(
+        bus, 30 * GST_SECOND,
+        GstMessageType(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+    ok = msg && GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS;
+    if (msg) {
+      gst_message_unref(msg);
+    }
+    gst_object_unref(bus);
+  }
+  gst_element_set_state(pipeline, GST_STATE_NULL);
+  gst_object_unref(pipeline);
+
+  if (!ok || probe.frames < 2) {
+    return false;
+  }
+  result.latencyMs = probe.latencySum / probe.frames;
+  double seconds =
+      std::chrono::duration<double>(probe.lastOut - probe.firstOut).count();
+  result.fps = seconds > 0 ? (probe.frames - 1) / seconds : 0;
+  return true;
+}
+
+EncoderChoice EncoderFactory::select(const EncoderRequest &request) {
+  std::vector<const EncoderInfo *> candidates;
+  if (!request.element.empty() && request.element != "auto") {
+    const EncoderInfo *info = find(request.element);
+    GstElementFactory *factory =
+        info ? gst_element_factory_find(info->element) : nullptr;
+    if (!factory) {
+      std::cerr << "Encoder " << request.element << " is not available."
+                << std::endl;
+      return EncoderChoice();
+    }
+    gst_object_unref(factory);
+    candidates.push_back(info);
+  } else {
+    candidates = available(request.codec);
+  }
+
+  EncoderChoice best;
+  if (!request.calibrate) {
+    if (!candidates.empty()) {
+      best.info = candidates.front();
+      best.preset = request.preset;
+      best.bitrateKbps = request.bitrateKbps;
+    }
+  } else {
+    bool bestMeetsBudget = false;
+    for (const EncoderInfo *info : candidates) {
+      EncoderChoice trial;
+      if (!calibrate(*info, request, trial)) {
+        std::cout << "Encoder " << info->element << ": does not run here."
+                  << std::endl;
+        continue;
+      }
+      bool meetsBudget = trial.latencyMs <= request.latencyBudgetMs &&
+                         trial.fps >= request.fps;
+      std::cout << "Encoder " << info->element << ": " << trial.latencyMs
+                << " ms per frame, " << trial.fps << " fps"
+                << (meetsBudget ? "" : " (over budget)") << std::endl;
+      // Anything within budget beats anything over it, then lowest latency
+      if (!best || (meetsBudget && !bestMeetsBudget) ||
+          (meetsBudget == bestMeetsBudget && trial.latencyMs < best.latencyMs)) {
+        best = trial;
+        bestMeetsBudget = meetsBudget;
+      }
+    }
+    if (best && !bestMeetsBudget) {
+      std::cout << "No encoder meets the " << request.latencyBudgetMs
+                << " ms budget, using the fastest." << std::endl;
+    }
+  }
+
+  if (best && (best.preset == EncoderPreset::kIntraRefresh ||
+               best.preset == EncoderPreset::kSlicedThreads) &&
+      !hasPreset(best.info->element, best.preset)) {
+    std::cerr << "Encoder " << best.info->element << " has no "
+              << encoderPresetName(best.preset) << " preset, using "
+              << encoderPresetName(EncoderPreset::kZeroLatency) << "."
+              << std::endl;
+    best.preset = EncoderPreset::kZeroLatency;
+  }
+  if (best) {
+    std::cout << "Using " << best.info->element << " ("
+              << encoderPresetName(best.preset) << ")" << std::endl;
+  } else {
+    std::cerr << "No " << videoCodecName(request.codec)
+              << " encoder available." << std::endl;
+  }
+  return best;
+}
+
+void EncoderFactory::setBitrate(GstElement *encoder, unsigned kbps) {
+  GstElementFactory *factory = gst_element_get_factory(encoder);
+  const EncoderInfo *info =
+      factory ? find(gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory)))
+              : nullptr;
+  // unknown encoders: assume the x264enc convention
+  const char *property = info ? info->bitrateProperty : "bitrate";
+  unsigned value = info && info->bitsPerSecond ? kbps * 1000 : kbps;
+  gst_util_set_object_arg(G_OBJECT(encoder), property,
+                          std::to_string(value).c_str());
+}
+
+void EncoderFactory::applyPreset(GstElement *encoder, EncoderPreset preset) {
+  GstElementFactory *factory = gst_element_get_factory(encoder);
+  if (!factory) {
+    return;
+  }
+  const char *element = gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory));
+  for (const auto &property : presetProperties(element, preset)) {
+    gst_util_set_object_arg(G_OBJECT(encoder), property.first.c_str(),
+                            property.second.c_str());
+  }
+}
@@ -0,0 +1,199 @@
+#include "gst_rgbd_server/frame_bus.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "gst_rgbd_server/metrics.h"
+#include "gst_rgbd_server/thread_policy.h"
+
+namespace {
+
+std::atomic<double> &counter(const char *metric, const std::string &name) {
+  return Metrics::instance().gauge(std::string(metric) + "{consumer=\"" +
+                                   name + "\"}");
+}
+
+uint64_t imageBytes(const CameraFrameSet &frames) {
+  return frames.color.size + frames.depth.size + frames.infrared[0].size +
+         frames.infrared[1].size;
+}
+
+} // namespace
+
+FrameSubscription::FrameSubscription(const std::string &name,
+                                     const QueuePolicy &policy)
+    : name_(name), policy_(policy),
+      delivered_(counter("rgbd_bus_delivered_total", name)),
+      dropped_(counter("rgbd_bus_dropped_total", name)),
+      highWater_(counter("rgbd_bus_high_water", name)) {}
+
+bool FrameSubscription::pop(SharedFrameSet &frames, int timeoutMs) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto ready = [this] { return closed_ || !queue_.empty(); };
+  if (timeoutMs < 0) {
+    ready_.wait(lock, ready);
+  } else if (!ready_.wait_for(lock, std::chrono::milliseconds(timeoutMs),
+                              ready)) {
+    return false;
+  }
+  if (closed_) {
+    return false;
+  }
+  frames = std::move(queue_.front().first);
+  queuedBytes_ -= queue_.front().second;
+  queue_.pop_front();
+  // Counted once taken; kDropOldest may still evict what was queued
+  delivered_ = double(++popped_);
+  lock.unlock();
+  space_.notify_one();
+  return true;
+}
+
+void FrameSubscription::flush() {
+  std::deque<std::pair<SharedFrameSet, uint64_t>> dropped;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    dropped.swap(queue_);
+    queuedBytes_ = 0;
+  }
+  // the sets are released outside the lock
+  space_.notify_all();
+}
+
+void FrameSubscription::close() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+  }
+  ready_.notify_all();
+  space_.notify_all();
+  flush();
+}
+
+bool FrameSubscription::isClosed() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return closed_;
+}
+
+QueueStats FrameSubscription::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+void FrameSubscription::offer(const SharedFrameSet &frames, uint64_t bytes) {
+  // The oldest set is released outside the lock
+  SharedFrameSet evicted;
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto full = [this, bytes] {
+    return (policy_.maxFrames && queue_.size() >= policy_.maxFrames) ||
+           (policy_.maxBytes && !queue_.empty() &&
+            queuedBytes_ + bytes > policy_.maxBytes);
+  };
+  if (policy_.drop == QueueDrop::kBlock) {
+    space_.wait(lock, [this, &full] { return closed_ || !full(); });
+  }
+  if (closed_) {
+    return;
+  }
+  if (full()) {
+    ++stats_.dropped;
+    dropped_ = double(stats_.dropped);
+    if (policy_.drop == QueueDrop::kDropNewest) {
+      return;
+    }
+    evicted = std::move(queue_.front().first);
+    queuedBytes_ -= queue_.front().second;
+    queue_.pop_front();
+  }
+  queue_.emplace_back(frames, bytes);
+  queuedBytes_ += bytes;
+  ++stats_.enqueued;
+  stats_.highWater = std::max<uint64_t>(stats_.highWater, queue_.size());
+  highWater_ = double(stats_.highWater);
+  lock.unlock();
+  ready_.notify_one();
+}
+
+FrameBus::~FrameBus() { close(); }
+
+std::shared_ptr<FrameSubscription>
+FrameBus::subscribe(const std::string &name, const QueuePolicy &policy) {
+  auto subscription = std::make_shared<FrameSubscription>(name, policy);
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto subscribers = std::make_shared<Subscribers>();
+  // Released subscriptions leave with the next change
+  for (const auto &weak : *subscribers_) {
+    if (!weak.expired()) {
+      subscribers->push_back(weak);
+    }
+  }
+  subscribers->push_back(subscription);
+  subscribers_ = subscribers;
+  return subscription;
+}
+
+void FrameBus::consume(const std::string &name, const QueuePolicy &policy,
+                       std::function<void(const CameraFrameSet &)> handler) {
+  std::shared_ptr<FrameSubscription> subscription = subscribe(name, policy);
+  std::lock_guard<std::mutex> lock(mutex_);
+  consumers_.emplace_back([subscription, handler] {
+    ThreadPolicy::instance().enter("bus-" + subscription->name());
+    SharedFrameSet frames;
+    while (subscription->pop(frames, -1)) {
+      handler(*frames);
+      frames.reset();
+    }
+    ThreadPolicy::instance().leave();
+  });
+}
+
+void FrameBus::publish(CameraFrameSet &&frames) {
+  std::shared_ptr<const Subscribers> subscribers;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    subscribers = subscribers_;
+  }
+  if (subscribers->empty()) {
+    return;
+  }
+  uint64_t bytes = imageBytes(frames);
+  SharedFrameSet shared =
+      std::make_shared<const CameraFrameSet>(std::move(frames));
+  for (const auto &weak : *subscribers) {
+    if (std::shared_ptr<FrameSubscription> subscription = weak.lock()) {
+      subscription->offer(shared, bytes);
+    }
+  }
+}
+
+void FrameBus::flush() {
+  std::shared_ptr<const Subscribers> subscribers;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    subscribers = subscribers_;
+  }
+  for (const auto &weak : *subscribers) {
+    if (std::shared_ptr<FrameSubscription> subscription = weak.lock()) {
+      subscription->flush();
+    }
+  }
+}
+
+void FrameBus::close() {
+  std::vector<std::thread> consumers;
+  std::shared_ptr<const Subscribers> subscribers;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    consumers.swap(consumers_);
+    subscribers = subscribers_;
+    subscribers_ = std::make_shared<Subscribers>();
+  }
+  for (const auto &weak : *subscribers) {
+    if (std::shared_ptr<FrameSubscription> subscription = weak.lock()) {
+      subscription->close();
+    }
+  }
+  for (std::thread &consumer : consumers) {
+    consumer.join();
+  }
+}
@@ -0,0 +1,89 @@
+#include "gst_rgbd_server/frame_grouper.h"
+
+#include <algorithm>
+#include <chrono>
+
+FrameGrouper::FrameGrouper(size_t numCameras, uint64_t toleranceNs,
+                           size_t maxQueued)
+    : toleranceNs_(toleranceNs), maxQueued_(maxQueued ? maxQueued : 1),
+      queues_(numCameras) {}
+
+void FrameGrouper::push(size_t camera, CameraFrameSet frames) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::deque<CameraFrameSet> &queue = queues_[camera];
+    if (queue.size() >= maxQueued_) {
+      queue.pop_front();
+      ++dropped_;
+    }
+    queue.push_back(std::move(frames));
+  }
+  pushed_.notify_one();
+}
+
+// Called with mutex_ held.
+bool FrameGrouper::tryGroup(std::vector<CameraFrameSet> &group) {
+  for (;;) {
+    uint64_t newest = 0;
+    for (const auto &queue : queues_) {
+      if (queue.empty()) {
+        return false;
+      }
+      newest = std::max(newest, queue.front().timestampNs);
+    }
+    // Any front older than the newest front by more than the tolerance can
+    // never be matched, later frames of the other cameras are newer still
+    bool droppedAny = false;
+    for (auto &queue : queues_) {
+      if (newest - queue.front().timestampNs > toleranceNs_) {
+        queue.pop_front();
+        ++dropped_;
+        droppedAny = true;
+      }
+    }
+    if (droppedAny) {
+      continue;
+    }
+    group.resize(queues_.size());
+    for (size_t i = 0; i < queues_.size(); ++i) {
+      group[i] = std::move(queues_[i].front());
+      queues_[i].pop_front();
+    }
+    ++groups_;
+    return true;
+  }
+}
+
+bool FrameGrouper::waitGroup(std::vector<CameraFrameSet> &group,
+                             uint32_t timeoutMs) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+  while (!closed_) {
+    if (tryGroup(group)) {
+      return true;
+    }
+    if (pushed_.wait_until(lock, deadline) == std::cv_status::timeout) {
+      return tryGroup(group);
+    }
+  }
+  return false;
+}
+
+void FrameGrouper::close() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+  }
+  pushed_.notify_all();
+}
+
+uint64_t FrameGrouper::groups() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return groups_;
+}
+
+uint64_t FrameGrouper::dropped() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return dropped_;
+}
@@ -0,0 +1,186 @@
+#include <glib.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+#include "gst_rgbd_server/frame_grouper.h"
+#include "gst_rgbd_server/point_cloud_fuser.h"
+#include "gst_rgbd_server/realsense_camera_source.h"
+
+static gchar **cameraSpecs = nullptr;
+static gchar *extrinsicsFile = nullptr;
+static gchar *plyFile = nullptr;
+static gdouble toleranceMs = 10.0;
+static gint step = 2;
+static gint frames = 300;
+
+// Give up when the grouper produces nothing for this many seconds in a row
+static const int kMaxGroupTimeouts = 10;
+
+static GOptionEntry entries[] = {
+    {"camera", 'c', 0, G_OPTION_ARG_STRING_ARRAY, &cameraSpecs,
+     "Camera to fuse, repeatable: realsense[:SERIAL] or synthetic[:SEED] "
+     "(default: every connected RealSense)",
+     "SPEC"},
+    {"extrinsics", 'e', 0, G_OPTION_ARG_FILENAME, &extrinsicsFile,
+     "JSON file with a world_from_camera matrix per serial", "FILE"},
+    {"tolerance", 't', 0, G_OPTION_ARG_DOUBLE, &toleranceMs,
+     "Max timestamp spread within a group in ms (default: 10)", "MS"},
+    {"step", 's', 0, G_OPTION_ARG_INT, &step,
+     "Use every STEP-th depth pixel (default: 2)", "STEP"},
+    {"frames", 'n', 0, G_OPTION_ARG_INT, &frames,
+     "Number of fused clouds to produce (default: 300)", "N"},
+    {"ply", 0, 0, G_OPTION_ARG_FILENAME, &plyFile,
+     "Write the last fused cloud as PLY", "FILE"},
+    {NULL}};
+
+static void writePly(const std::string &path, const FusedCloud &cloud) {
+    std::ofstream out(path, std::ios::binary);
+    out << "ply\nformat binary_little_endian 1.0\nelement vertex "
+        << cloud.size()
+        << "\nproperty float x\nproperty float y\nproperty float z\n"
+           "property uchar red\nproperty uchar green\nproperty uchar blue\n"
+           "end_header\n";
+    for (size_t i = 0; i < cloud.size(); ++i) {
+        out.write(reinterpret_cast<const char *>(&cloud.xyz[3 * i]),
+                  3 * sizeof(float));
+        out.write(reinterpret_cast<const char *>(&cloud.rgb[3 * i]), 3);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    GError *error = NULL;
+    GOptionContext *optctx = g_option_context_new("- fused point cloud");
+    g_option_context_add_main_entries(optctx, entries, NULL);
+    if (!g_option_context_parse(optctx, &argc, &argv, &error)) {
+        std::cerr << "Error parsing options: " << error->message << std::endl;
+        g_option_context_free(optctx);
+        g_clear_error(&error);
+        return -1;
+    }
+    g_option_context_free(optctx);
+    if (frames <= 0) {
+        std::cerr << "--frames must be positive." << std::endl;
+        return -1;
+    }
+
+    std::vector<std::unique_ptr<CameraSource>> cameras;
+    if (cameraSpecs) {
+        for (gchar **spec = cameraSpecs; *spec; ++spec) {
+            cameras.push_back(createCameraSource(*spec));
+            if (!cameras.back()) {
+                return -1;
+            }
+        }
+    } else {
+        for (const std::string &serial : RealSenseCameraSource::enumerate()) {
+            cameras.emplace_back(new RealSenseCameraSource(serial));
+        }
+    }
+    if (cameras.empty()) {
+        std::cerr << "No cameras." << std::endl;
+        return -1;
+    }
+
+    std::map<std::string, CameraExtrinsics> extrinsics;
+    if (extrinsicsFile && !loadCameraExtrinsics(extrinsicsFile, extrinsics)) {
+        return -1;
+    }
+
+    CameraConfig config;
+    config.width = 640;
+    config.height = 480;
+    config.infrared = false;
+    config.imu = false;
+    config.alignDepth = true;
+    std::vector<FusionCamera> fusionCameras;
+    for (auto &camera : cameras) {
+        if (!camera->start(config)) {
+            return -1;
+        }
+        FusionCamera fusion;
+        fusion.depthIntrinsics = camera->depthIntrinsics();
+        fusion.depthScale = camera->depthScale();
+        auto it = extrinsics.find(camera->serial());
+        if (it != extrinsics.end()) {
+            fusion.extrinsics = it->second;
+        } else {
+            std::cout << "No extrinsics for " << camera->serial()
+                      << ", using identity." << std::endl;
+        }
+        fusionCameras.push_back(fusion);
+    }
+
+    FrameGrouper grouper(cameras.size(), uint64_t(toleranceMs * 1e6));
+    std::atomic<bool> running{true};
+    std::vector<std::thread> captureThreads;
+    for (size_t i = 0; i < cameras.size(); ++i) {
+        captureThreads.emplace_back([&, i] {
+            CameraFrameSet frameSet;
+            while (running) {
+                if (cameras[i]->waitForFrames(frameSet, 1000)) {
+                    grouper.push(i, std::move(frameSet));
+                }
+            }
+        });
+    }
+
+    WorkerPool pool;
+    PointCloudFuser::Options options;
+    options.step = step;
+    PointCloudFuser fuser(pool, fusionCameras, options);
+
+    FusedCloud cloud;
+    std::vector<CameraFrameSet> group;
+    double fuseSeconds = 0;
+    size_t points = 0;
+    auto begin = std::chrono::steady_clock::now();
+    int fused = 0;
+    int timeouts = 0;
+    while (fused < frames && timeouts < kMaxGroupTimeouts) {
+        if (!grouper.waitGroup(group, 1000)) {
+            ++timeouts;
+            continue;
+        }
+        timeouts = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        fuser.fuse(group, cloud);
+        fuseSeconds += std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - t0)
+                           .count();
+        points += cloud.size();
+        ++fused;
+    }
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - begin)
+                         .count();
+
+    running = false;
+    grouper.close();
+    for (std::thread &thread : captureThreads) {
+        thread.join();
+    }
+
+    if (fused == 0) {
+        std::cerr << "No synchronized frames within " << kMaxGroupTimeouts
+                  << " s, " << grouper.dropped() << " frames dropped for sync"
+                  << std::endl;
+        return -1;
+    }
+    if (fused < frames) {
+        std::cerr << "Cameras stopped delivering after " << fused
+                  << " clouds." << std::endl;
+    }
+    std::cout << fused << " clouds in " << seconds << " s ("
+              << fused / seconds << " fps), fuse "
+              << 1000.0 * fuseSeconds / fused << " ms, "
+              << points / fused << " points per cloud, "
+              << grouper.dropped() << " frames dropped for sync" << std::endl;
+    if (plyFile) {
+        writePly(plyFile, cloud);
+    }
+    return 0;
+}
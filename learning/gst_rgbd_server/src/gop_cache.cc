@@ -0,0 +1,244 @@
+#include "gst_rgbd_server/gop_cache.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "gst_rgbd_server/metrics.h"
+
+namespace {
+
+// What gst_video_event_new_upstream_force_key_unit() builds, without
+// linking gstreamer-video for it
+GstEvent *forceKeyUnitEvent(guint count) {
+  return gst_event_new_custom(
+      GST_EVENT_CUSTOM_UPSTREAM,
+      gst_structure_new("GstForceKeyUnit", "running-time", GST_TYPE_CLOCK_TIME,
+                        GST_CLOCK_TIME_NONE, "all-headers", G_TYPE_BOOLEAN,
+                        TRUE, "count", G_TYPE_UINT, count, NULL));
+}
+
+// seq= of the first url in an RTP-Info header, -1 if there is none
+int rtpInfoSeq(GstRTSPMessage *response) {
+  gchar *value = NULL;
+  if (!response ||
+      gst_rtsp_message_get_header(response, GST_RTSP_HDR_RTP_INFO, &value,
+                                  0) != GST_RTSP_OK) {
+    return -1;
+  }
+  const char *seq = strstr(value, "seq=");
+  return seq ? int(strtoul(seq + 4, NULL, 10) & 0xffff) : -1;
+}
+
+} // namespace
+
+GopCache::GopCache(const std::string &name, GstElement *encoder,
+                   GstElement *payloader, const GopCacheOptions &options)
+    : name_(name), label_("{stream=\"" + name + "\"}"),
+      encoder_(GST_ELEMENT(gst_object_ref(encoder))),
+      payloader_(GST_ELEMENT(gst_object_ref(payloader))), options_(options) {
+  Metrics::instance().retain("stream=\"" + name_ + "\"");
+  // A keyframe leaving the encoder marks where the payloader's next packets
+  // start a new GOP; both run on the same streaming thread, in order
+  encoderPad_ = gst_element_get_static_pad(encoder_, "src");
+  payloaderPad_ = gst_element_get_static_pad(payloader_, "src");
+  if (encoderPad_) {
+    encoderProbe_ = gst_pad_add_probe(encoderPad_, GST_PAD_PROBE_TYPE_BUFFER,
+                                      &GopCache::onEncoded, this, NULL);
+  }
+  if (payloaderPad_) {
+    payloaderProbe_ = gst_pad_add_probe(
+        payloaderPad_,
+        GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER |
+                        GST_PAD_PROBE_TYPE_BUFFER_LIST),
+        &GopCache::onPayloaded, this, NULL);
+  }
+}
+
+GopCache::~GopCache() {
+  if (encoderProbe_) {
+    gst_pad_remove_probe(encoderPad_, encoderProbe_);
+  }
+  if (payloaderProbe_) {
+    gst_pad_remove_probe(payloaderPad_, payloaderProbe_);
+  }
+  if (encoderPad_) {
+    gst_object_unref(encoderPad_);
+  }
+  if (payloaderPad_) {
+    gst_object_unref(payloaderPad_);
+  }
+  clear();
+  // Other media of the mount may still count under the same label
+  Metrics::instance().release("stream=\"" + name_ + "\"");
+  gst_object_unref(payloader_);
+  gst_object_unref(encoder_);
+}
+
+void GopCache::attach(GstRTSPMedia *media) {
+  g_object_set_data_full(G_OBJECT(media), "gop-cache", this,
+                         [](gpointer cache) {
+                           delete static_cast<GopCache *>(cache);
+                         });
+  g_signal_connect(media, "unprepared",
+                   G_CALLBACK(+[](GstRTSPMedia *media, gpointer) {
+                     g_object_set_data(G_OBJECT(media), "gop-cache", NULL);
+                   }),
+                   NULL);
+}
+
+void GopCache::watch(GstRTSPServer *server) {
+  g_signal_connect(server, "client-connected",
+                   G_CALLBACK(+[](GstRTSPServer *, GstRTSPClient *client,
+                                  gpointer) {
+                     g_signal_connect(client, "play-request",
+                                      G_CALLBACK(&GopCache::onPlayRequest),
+                                      NULL);
+                   }),
+                   NULL);
+}
+
+void GopCache::onPlayRequest(GstRTSPClient *, GstRTSPContext *ctx, gpointer) {
+  // Emitted once the PLAY response, with its RTP-Info, is on its way
+  if (!ctx->sessmedia) {
+    return;
+  }
+  GstRTSPMedia *media = gst_rtsp_session_media_get_media(ctx->sessmedia);
+  GopCache *cache =
+      static_cast<GopCache *>(g_object_get_data(G_OBJECT(media), "gop-cache"));
+  GstRTSPStreamTransport *transport =
+      gst_rtsp_session_media_get_transport(ctx->sessmedia, 0);
+  if (cache && transport) {
+    cache->join(transport, rtpInfoSeq(ctx->response));
+  }
+}
+
+void GopCache::join(GstRTSPStreamTransport *transport, int seq) {
+  Metrics &metrics = Metrics::instance();
+  metrics.add("rgbd_joins_total" + label_, 1);
+  gint64 start = g_get_monotonic_time();
+  if (prime(transport, seq)) {
+    metrics.add("rgbd_joins_primed_total" + label_, 1);
+    metrics.set("rgbd_join_keyframe_ms" + label_,
+                (g_get_monotonic_time() - start) / 1000.0);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    waiting_.push_back(start);
+  }
+  forceKeyframe();
+}
+
+bool GopCache::prime(GstRTSPStreamTransport *transport, int seq) {
+  const GstRTSPTransport *spec = gst_rtsp_stream_transport_get_transport(transport);
+  if (!spec || spec->lower_transport != GST_RTSP_LOWER_TRANS_TCP || seq < 0) {
+    return false;
+  }
+  std::vector<GstBuffer *> packets;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!valid_) {
+      return false;
+    }
+    for (GstBuffer *packet : packets_) {
+      packets.push_back(gst_buffer_ref(packet));
+    }
+  }
+  if (packets.empty()) {
+    return false;
+  }
+  // Sequence numbers run up to just before the client's first live packet,
+  // so its jitterbuffer takes the GOP as the start of the stream
+  guint16 next = guint16(seq - packets.size());
+  bool sent = true;
+  for (GstBuffer *packet : packets) {
+    GstBuffer *copy = gst_buffer_copy(packet);
+    guint8 number[2] = {guint8(next >> 8), guint8(next & 0xff)};
+    gst_buffer_fill(copy, 2, number, 2);
+    ++next;
+    sent = gst_rtsp_stream_transport_send_rtp(transport, copy) && sent;
+    gst_buffer_unref(copy);
+    gst_buffer_unref(packet);
+  }
+  return sent;
+}
+
+void GopCache::forceKeyframe() {
+  gint64 now = g_get_monotonic_time();
+  if (lastForced_ &&
+      now - lastForced_ < gint64(options_.keyframeIntervalMs) * 1000) {
+    return;
+  }
+  lastForced_ = now;
+  // Travels upstream from the payloader's sink pad to the encoder
+  if (gst_element_send_event(payloader_, forceKeyUnitEvent(++forceCount_))) {
+    Metrics::instance().add("rgbd_forced_keyframes_total" + label_, 1);
+  } else {
+    std::cerr << name_ << ": encoder ignored the keyframe request."
+              << std::endl;
+  }
+}
+
+GstPadProbeReturn GopCache::onEncoded(GstPad *, GstPadProbeInfo *info,
+                                      gpointer user_data) {
+  GopCache *self = static_cast<GopCache *>(user_data);
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+    return GST_PAD_PROBE_OK;
+  }
+  std::vector<gint64> waiting;
+  {
+    std::lock_guard<std::mutex> lock(self->mutex_);
+    self->keyframePending_ = true;
+    waiting.swap(self->waiting_);
+  }
+  gint64 now = g_get_monotonic_time();
+  for (gint64 joined : waiting) {
+    Metrics::instance().set("rgbd_join_keyframe_ms" + self->label_,
+                            (now - joined) / 1000.0);
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn GopCache::onPayloaded(GstPad *, GstPadProbeInfo *info,
+                                        gpointer user_data) {
+  GopCache *self = static_cast<GopCache *>(user_data);
+  std::lock_guard<std::mutex> lock(self->mutex_);
+  if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER) {
+    self->add(GST_PAD_PROBE_INFO_BUFFER(info));
+  } else {
+    GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+    for (guint i = 0; i < gst_buffer_list_length(list); ++i) {
+      self->add(gst_buffer_list_get(list, i));
+    }
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+void GopCache::add(GstBuffer *packet) {
+  if (keyframePending_) {
+    clear();
+    keyframePending_ = false;
+    valid_ = true;
+  }
+  if (!valid_) {
+    return;
+  }
+  bytes_ += gst_buffer_get_size(packet);
+  if (bytes_ > options_.maxBytes) {
+    // Too long to replay; wait for the next keyframe
+    clear();
+    return;
+  }
+  packets_.push_back(gst_buffer_ref(packet));
+}
+
+void GopCache::clear() {
+  for (GstBuffer *packet : packets_) {
+    gst_buffer_unref(packet);
+  }
+  packets_.clear();
+  bytes_ = 0;
+  valid_ = false;
+}
@@ -1,64 +1,70 @@
 #include "gst_rgbd_server/gst_rgbd_server.h"
+#include "gst_rgbd_server/cv_image.h"
+#include "gst_rgbd_server/metrics.h"
+#include "gst_rgbd_server/rtcp_rate_adapter.h"
+#include "gst_rgbd_server/thread_policy.h"
+#include <algorithm>
+#include <csignal>
 #include <iostream>
+#include <unistd.h>
 using namespace cv;
-GstRgbdServer::GstRgbdServer() { initializeRealsense(); }
+GstRgbdServer::GstRgbdServer()
+    : GstRgbdServer(createCameraSource("realsense")) {}
 
-GstRgbdServer::~GstRgbdServer() {}
-
-void GstRgbdServer::initializeRealsense() {
-  std::cout << "Initializing Realsense." << std::endl;
-
-  rs2::context context;
-  rs2::device_list availableDevices = context.query_devices();
+GstRgbdServer::GstRgbdServer(std::unique_ptr<CameraSource> camera)
+    : camera_(std::move(camera)) {
+  initializeCamera();
+}
 
-  if (availableDevices.size() == 0) {
-    std::cout << "No device connected, please connect a RealSense device."
-              << std::endl;
+GstRgbdServer::GstRgbdServer(std::unique_ptr<RgbdReplaySource> replay)
+    : replay_(std::move(replay)) {
+  replayColorStream_ = replay_->findStream(RgbdStreamKind::kColor);
+  if (replayColorStream_ < 0) {
+    // depth only recordings are served as GRAY16
+    replayColorStream_ = replay_->findStream(RgbdStreamKind::kDepth);
   }
+  if (replayColorStream_ >= 0) {
+    const RgbdRecordingStreamInfo &info = replay_->streamInfo(replayColorStream_);
+    width_ = info.width;
+    height_ = info.height;
+  }
+  std::cout << "Replaying " << replay_->frameCount() << " frames." << std::endl;
+}
 
-  rs2::device_hub hub(context);
-  device_ = hub.wait_for_device();
-
-  // Need to get the depth sensor specifically as it is the one that controls
-  // the sync funciton
-  depthSensor_ = new rs2::depth_sensor(device_.first<rs2::depth_sensor>());
-  scale_ = depthSensor_->get_option(RS2_OPTION_DEPTH_UNITS);
-
-  // RGB stream
-  rsPipelineConfig_.enable_stream(RS2_STREAM_COLOR, width_, height_,
-                                  RS2_FORMAT_BGR8, fps_);
-  // Depth stream
-  rsPipelineConfig_.enable_stream(RS2_STREAM_DEPTH, width_, height_,
-                                  RS2_FORMAT_Z16, fps_);
-
-  rsPipelineConfig_.enable_stream(RS2_STREAM_INFRARED, 1, width_, height_,
-                                  RS2_FORMAT_Y8, fps_);
-  rsPipelineConfig_.enable_stream(RS2_STREAM_INFRARED, 2, width_, height_,
-                                  RS2_FORMAT_Y8, fps_);
-  // Accel stream
-  rsPipelineConfig_.enable_stream(RS2_STREAM_ACCEL, RS2_FORMAT_MOTION_XYZ32F);
-  // Gyro stream
-  rsPipelineConfig_.enable_stream(RS2_STREAM_GYRO, RS2_FORMAT_MOTION_XYZ32F);
-
-  std::cout << "Realsense correctly initialized and ready to run." << std::endl;
-
-  auto selection = rsPipeline_.start(rsPipelineConfig_);
-  auto depth_sensor = selection.get_device().first<rs2::depth_sensor>();
-  if (depth_sensor.supports(RS2_OPTION_EMITTER_ENABLED)) {
-    depth_sensor.set_option(RS2_OPTION_EMITTER_ENABLED, 1.f); // Enable emitter
+GstRgbdServer::~GstRgbdServer() {
+  // Pending grace timers must not fire into a half destroyed server
+  activation_.reset();
+  stopCapture();
+  // Consumers use the members below
+  bus_.close();
+  for (GstElement *&pipeline : preEventPipelines_) {
+    if (pipeline) {
+      gst_element_set_state(pipeline, GST_STATE_NULL);
+      gst_object_unref(pipeline);
+      pipeline = nullptr;
+    }
+  }
+  for (GstBufferPool *pool : colorPools_) {
+    if (pool) {
+      gst_buffer_pool_set_active(pool, FALSE);
+      gst_object_unref(pool);
+    }
   }
+  if (multicastPool_) {
+    g_object_unref(multicastPool_);
+  }
+}
 
-  GOptionEntry entries[] = {{"port", 'p', 0, G_OPTION_ARG_STRING, &port,
-                             "Port to listen on( default: "
-                             "8554"
-                             ")",
-                             "PORT"},
-                            {"address", 'a', 0, G_OPTION_ARG_STRING, &host,
-                             "Host address( default: "
-                             "127.0.0.1"
-                             ")",
-                             "HOST"},
-                            {NULL}};
+void GstRgbdServer::initializeCamera() {
+  // Nothing is opened here, the camera starts with the first client
+  baseConfig_.width = width_;
+  baseConfig_.height = height_;
+  baseConfig_.fps = fps_;
+  // The sensor's own format, librealsense converts anything else on the CPU
+  baseConfig_.colorFormat = RgbdPixelFormat::kYUYV;
+  baseConfig_.imu = false;
+  std::cout << "Camera " << camera_->serial()
+            << " ready, streams start on demand." << std::endl;
 }
 
 void GstRgbdServer::stream() {
@@ -72,104 +78,731 @@ void GstRgbdServer::stream() {
   g_object_set(gsServer_, "address", host, NULL);
   g_object_set(gsServer_, "service", port, NULL);
 
+  GstRTSPThreadPool *threads = gst_rtsp_server_get_thread_pool(gsServer_);
+  gst_rtsp_thread_pool_set_max_threads(threads, gint(rtspThreads_));
+  g_object_unref(threads);
+
   /* get the mount points for this server, every server has a default object
    * that be used to map uri mount points to media factories */
   gsMounts_ = gst_rtsp_server_get_mount_points(gsServer_);
 
-  /* make a media factory for a test stream. The default media factory can use
-   * gst-launch syntax to create pipelines.
-   * any launch line works as long as it contains elements named pay%d. Each
-   * element with pay%d names will be a stream */
-  gsFactory_ = gst_rtsp_media_factory_new();
+  if (replay_) {
+    /* make a media factory for a test stream. The default media factory can
+     * use gst-launch syntax to create pipelines.
+     * any launch line works as long as it contains elements named pay%d. Each
+     * element with pay%d names will be a stream */
+    gsFactory_ = gst_rtsp_media_factory_new();
+
+    std::string pipelineStr = "( appsrc name=mysrc ! videoconvert ! x264enc ! "
+                              "rtph264pay name=pay0 pt=96 )";
+    gst_rtsp_media_factory_set_launch(gsFactory_, pipelineStr.c_str());
+    // One media reads the replay; next() has a single cursor, so a media
+    // per client would split the frames between them
+    gst_rtsp_media_factory_set_shared(gsFactory_, TRUE);
+
+    // Configure the appsrc of every new media pipeline
+    g_signal_connect(gsFactory_, "media-configure",
+                     G_CALLBACK(+[](GstRTSPMediaFactory *factory,
+                                    GstRTSPMedia *media, gpointer user_data) {
+                       GstRgbdServer *server =
+                           static_cast<GstRgbdServer *>(user_data);
+                       server->onMediaConfigure(factory, media);
+                     }),
+                     this);
+
+    gst_rtsp_mount_points_add_factory(gsMounts_, "/head", gsFactory_);
+  } else {
+    // Pick the encoder once for all mounts, the same binary runs on Jetson
+    // and on x86 boxes without a GPU
+    encoderRequest_.width = width_;
+    encoderRequest_.height = height_;
+    encoderRequest_.fps = fps_;
+    encoderRequest_.bitrateKbps = rateOptions_.startKbps;
+    encoder_ = EncoderFactory::select(encoderRequest_);
+    if (!encoder_) {
+      return;
+    }
+    setupColorConversion();
+    activation_.reset(new StreamActivation(
+        graceMs_, [this](uint32_t activeMask) { applyProfile(activeMask); }));
+    // One pool for all mounts, so each stream gets a group of its own
+    multicastPool_ = newMulticastPool(multicast_);
+    addMount(kColorStream, "/head");
+    // Renditions come out of the converter's pyramid
+    if (converter_) {
+      addMount(kColorHalfStream, "/head/half");
+      addMount(kColorQuarterStream, "/head/quarter");
+    }
+    addMount(kDepthStream, "/depth");
+    addMount(kInfraredStream, "/ir");
+    GopCache::watch(gsServer_);
+    bus_.consume("rtsp", QueuePolicy(),
+                 [this](const CameraFrameSet &frames) { pushFrames(frames); });
+    setupSharedMemory();
+    setupRecording();
+    setupPreEvent();
+    setupSnapshots();
+    if (previewEnabled_) {
+      QueuePolicy newest;
+      newest.maxFrames = 1;
+      preview_ = bus_.subscribe("preview", newest);
+      g_timeout_add(10, &GstRgbdServer::onPreview, this);
+    }
+  }
 
-  std::string pipelineStr = "appsrc name=mysource ! videoconvert ! x264enc ! "
-                            "rtph264pay name=pay0 pt=96";
-  g_object_set(G_OBJECT(gsFactory_), "launch", pipelineStr.c_str(), NULL);
+  if (!metricsFile_.empty()) {
+    g_timeout_add_seconds(1, &GstRgbdServer::writeMetrics, this);
+  }
 
-  // Set the callback for the 'need-data' signal on appsrc
+  // Attach the server to the default main context
+  gst_rtsp_server_attach(gsServer_, NULL);
+
+  g_main_loop_run(gsLoop_);
+}
+
+void GstRgbdServer::addMount(Stream stream, const char *path) {
+  // Pooled media prepare before media-configure, the pool watches their
+  // threads in time
+  MediaPoolOptions pool = mediaPool_;
+  pool.beforePrepare = [](GstElement *element) {
+    ThreadPolicy::instance().watch(element);
+  };
+  GstRTSPMediaFactory *factory =
+      mediaPool_.size ? newPooledMediaFactory(path, pool)
+                      : gst_rtsp_media_factory_new();
+  // videoscale ! videorate ! adapt let the rate controller lower resolution
+  // and frame rate; with its caps unset the filter passes everything
+  EncoderChoice encoder = encoder_;
+  encoder.bitrateKbps = rateOptions(stream).startKbps;
+  std::string launch =
+      "( appsrc name=mysrc ! videoconvert ! videoscale ! videorate ! "
+      "capsfilter name=adapt ! " +
+      encoder.launch("enc") + " ! " + encoder.payloader() +
+      " name=pay0 pt=96 )";
+  gst_rtsp_media_factory_set_launch(factory, launch.c_str());
+  // One encoder per mount however many clients watch it; the media is
+  // unprepared when its last client leaves, which releases the stream
+  gst_rtsp_media_factory_set_shared(factory, TRUE);
+  // Viewers asking for multicast share one RTP flow of that media
+  applyMulticast(factory, multicast_, multicastPool_);
+  g_object_set_data(G_OBJECT(factory), "stream", GUINT_TO_POINTER(stream));
+  g_object_set_data_full(G_OBJECT(factory), "path", g_strdup(path), g_free);
   g_signal_connect(
-      gsFactory_, "need-data",
-      G_CALLBACK(+[](GstElement *element, guint size, gpointer user_data) {
+      factory, "media-configure",
+      G_CALLBACK(+[](GstRTSPMediaFactory *factory, GstRTSPMedia *media,
+                     gpointer user_data) {
         GstRgbdServer *server = static_cast<GstRgbdServer *>(user_data);
-        server->onNeedData(element, size);
+        Stream stream = Stream(
+            GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(factory), "stream")));
+        const char *path = static_cast<const char *>(
+            g_object_get_data(G_OBJECT(factory), "path"));
+        server->onMountConfigure(stream, path, media);
       }),
       this);
+  gst_rtsp_mount_points_add_factory(gsMounts_, path, factory);
+  if (mediaPool_.size) {
+    GstCaps *caps = streamCaps(stream);
+    startMediaPool(factory, gsServer_, path, caps);
+    gst_caps_unref(caps);
+  }
+  std::cout << "Serving rtsp://" << host << ":" << port << path << std::endl;
+}
 
-  gst_rtsp_mount_points_add_factory(gsMounts_, "/head", gsFactory_);
+void GstRgbdServer::onMountConfigure(Stream stream, const char *path,
+                                     GstRTSPMedia *media) {
+  GstElement *element = gst_rtsp_media_get_element(media);
+  // Before the media prepares and its streaming threads start; the pool did
+  // that for its media
+  if (!mediaPool_.size) {
+    ThreadPolicy::instance().watch(element);
+  }
+  GstElement *appsrc =
+      gst_bin_get_by_name_recurse_up(GST_BIN(element), "mysrc");
+  GstElement *encoder = gst_bin_get_by_name_recurse_up(GST_BIN(element), "enc");
+  GstElement *adapt =
+      gst_bin_get_by_name_recurse_up(GST_BIN(element), "adapt");
+  GstElement *payloader =
+      gst_bin_get_by_name_recurse_up(GST_BIN(element), "pay0");
+
+  addSink(stream, path, appsrc);
+  g_signal_connect(media, "unprepared",
+                   G_CALLBACK(+[](GstRTSPMedia *, gpointer appsrc) {
+                     GstRgbdServer *server = static_cast<GstRgbdServer *>(
+                         g_object_get_data(G_OBJECT(appsrc), "server"));
+                     server->removeSink(static_cast<GstElement *>(appsrc));
+                   }),
+                   appsrc);
+
+  // The adapter lives as long as the media is prepared
+  int level = std::max(0, renditionLevel(stream));
+  RtcpRateAdapter *adapter =
+      new RtcpRateAdapter(path, encoder, adapt, width_ >> level,
+                          height_ >> level, fps_, rateOptions(stream));
+  adapter->attach(media);
+  g_object_set_data_full(G_OBJECT(media), "rate-adapter", adapter,
+                         [](gpointer adapter) {
+                           delete static_cast<RtcpRateAdapter *>(adapter);
+                         });
+  g_signal_connect(media, "unprepared",
+                   G_CALLBACK(+[](GstRTSPMedia *media, gpointer) {
+                     g_object_set_data(G_OBJECT(media), "rate-adapter", NULL);
+                   }),
+                   NULL);
+
+  // A client joining the running media starts from the cached GOP or a
+  // forced keyframe instead of the encoder's next one
+  GopCache *cache = new GopCache(path, encoder, payloader, gopOptions_);
+  cache->attach(media);
+
+  // Recordings tap the encoder's output of whichever media runs the mount
+  if (stream == kColorStream && colorRecorder_) {
+    colorRecorder_->attach(media, encoder);
+  } else if (stream == kDepthStream && depthRecorder_) {
+    depthRecorder_->attach(media, encoder);
+  }
 
-  // Attach the server to the default main context
-  gst_rtsp_server_attach(gsServer_, NULL);
+  if (lossOptions_.enabled()) {
+    GstPad *pad = gst_element_get_static_pad(payloader, "src");
+    attachLossInjector(pad, lossOptions_);
+    gst_object_unref(pad);
+  }
 
-  g_main_loop_run(gsLoop_);
+  gst_object_unref(payloader);
+  gst_object_unref(adapt);
+  gst_object_unref(encoder);
+  gst_object_unref(appsrc);
+  gst_object_unref(element);
 }
 
-// Callback for the 'need-data' signal on appsrc
-void GstRgbdServer::onNeedData(GstElement *element, guint size) {
+gboolean GstRgbdServer::writeMetrics(gpointer user_data) {
+  GstRgbdServer *server = static_cast<GstRgbdServer *>(user_data);
+  ThreadPolicy::instance().sample();
+  if (!Metrics::instance().writeFile(server->metricsFile_)) {
+    std::cerr << "Failed to write metrics to " << server->metricsFile_
+              << std::endl;
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+void GstRgbdServer::setupColorConversion() {
+  if (!convertColor_ || !ColorConverter::canConvert(baseConfig_.colorFormat)) {
+    return;
+  }
+  YuvLayout layout;
+  parseYuvLayout(encoder_.rawFormat(), layout);
+  // YUYV and UYVY keep the sensor's BT.601 values, only chroma is subsampled
+  bool packed422 = baseConfig_.colorFormat == RgbdPixelFormat::kYUYV ||
+                   baseConfig_.colorFormat == RgbdPixelFormat::kUYVY;
+  convertPool_.reset(new WorkerPool(convertThreads_, 64, [] {
+    ThreadPolicy::instance().enter("convert");
+  }));
+  converter_.reset(new ColorConverter(
+      layout, packed422 ? YuvMatrix::kBT601 : defaultYuvMatrix(height_),
+      convertPool_.get()));
+
+  // Recycled frame buffers per rendition; every client's pipeline holds a
+  // reference until its encoder is done with the frame, so no pool is capped
+  const Stream renditions[] = {kColorStream, kColorHalfStream,
+                               kColorQuarterStream};
+  for (Stream stream : renditions) {
+    int level = renditionLevel(stream);
+    GstCaps *caps = streamCaps(stream);
+    GstBufferPool *pool = gst_buffer_pool_new();
+    GstStructure *config = gst_buffer_pool_get_config(pool);
+    gst_buffer_pool_config_set_params(
+        config, caps,
+        guint(yuvPlanes(layout, width_ >> level, height_ >> level).size), 2,
+        0);
+    gst_buffer_pool_set_config(pool, config);
+    gst_buffer_pool_set_active(pool, TRUE);
+    gst_caps_unref(caps);
+    colorPools_[level] = pool;
+  }
+  std::cout << "Converting color to " << yuvLayoutName(layout) << " "
+            << yuvMatrixName(converter_->matrix()) << " with "
+            << ColorConverter::kernelName(converter_->kernel()) << " on "
+            << convertPool_->size() + 1 << " threads." << std::endl;
+}
+
+// A quarter of the pixels, a quarter of the bitrate per rendition level.
+RateControllerOptions GstRgbdServer::rateOptions(Stream stream) const {
+  RateControllerOptions options = rateOptions_;
+  int level = std::max(0, renditionLevel(stream));
+  options.maxKbps = std::max(options.minKbps, options.maxKbps >> (2 * level));
+  options.startKbps =
+      std::max(options.minKbps, options.startKbps >> (2 * level));
+  return options;
+}
+
+int GstRgbdServer::renditionLevel(Stream stream) {
+  switch (stream) {
+  case kColorStream:
+    return 0;
+  case kColorHalfStream:
+    return 1;
+  case kColorQuarterStream:
+    return 2;
+  default:
+    return -1;
+  }
+}
+
+GstCaps *GstRgbdServer::streamCaps(Stream stream) const {
+  int level = renditionLevel(stream);
+  if (level >= 0 && converter_) {
+    return gst_caps_new_simple(
+        "video/x-raw", "format", G_TYPE_STRING,
+        yuvLayoutName(converter_->layout()), "colorimetry", G_TYPE_STRING,
+        yuvMatrixName(converter_->matrix()), "width", G_TYPE_INT,
+        width_ >> level, "height", G_TYPE_INT, height_ >> level, "framerate",
+        GST_TYPE_FRACTION, fps_, 1, NULL);
+  }
+  const char *format = "BGR";
+  switch (stream) {
+  case kColorStream:
+  case kColorHalfStream:
+  case kColorQuarterStream:
+    // renditions are only mounted with the converter
+    format = baseConfig_.colorFormat == RgbdPixelFormat::kRGB8    ? "RGB"
+             : baseConfig_.colorFormat == RgbdPixelFormat::kRGBA8 ? "RGBA"
+             : baseConfig_.colorFormat == RgbdPixelFormat::kYUYV  ? "YUY2"
+             : baseConfig_.colorFormat == RgbdPixelFormat::kUYVY  ? "UYVY"
+                                                                  : "BGR";
+    break;
+  case kDepthStream:
+    format = "GRAY16_LE";
+    break;
+  case kInfraredStream:
+    format = "GRAY8";
+    break;
+  }
+  return gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING, format,
+                             "width", G_TYPE_INT, width_, "height",
+                             G_TYPE_INT, height_, "framerate",
+                             GST_TYPE_FRACTION, fps_, 1, NULL);
+}
+
+void GstRgbdServer::addSink(Stream stream, const char *path,
+                            GstElement *appsrc) {
+  GstCaps *caps = streamCaps(stream);
+  // Timestamp with the media pipeline's running time, each client starts at 0
+  g_object_set(G_OBJECT(appsrc), "caps", caps, "is-live", TRUE,
+               "do-timestamp", TRUE, NULL);
+  gst_util_set_object_arg(G_OBJECT(appsrc), "format", "time");
+  gst_caps_unref(caps);
+  g_object_set_data(G_OBJECT(appsrc), "server", this);
+  g_object_set_data(G_OBJECT(appsrc), "stream", GUINT_TO_POINTER(stream));
+
+  {
+    std::lock_guard<std::mutex> lock(sinksMutex_);
+    sinks_[stream].emplace_back(new AppSrcQueue(appsrc, path, queuePolicy_));
+  }
+  // Starts the stream on the device if this is its first client
+  activation_->acquire(stream);
+}
+
+void GstRgbdServer::removeSink(GstElement *appsrc) {
+  Stream stream =
+      Stream(GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(appsrc), "stream")));
+  {
+    std::lock_guard<std::mutex> lock(sinksMutex_);
+    auto &sinks = sinks_[stream];
+    auto it = std::find_if(sinks.begin(), sinks.end(),
+                           [appsrc](const std::unique_ptr<AppSrcQueue> &sink) {
+                             return sink->element() == appsrc;
+                           });
+    if (it == sinks.end()) {
+      return;
+    }
+    sinks.erase(it);
+  }
+  activation_->release(stream);
+}
+
+void GstRgbdServer::applyProfile(uint32_t activeMask) {
+  if (activeMask == activeMask_) {
+    return;
+  }
+  // The device can only change its profile while stopped
+  stopCapture();
+  // Queued sets are of the old profile
+  bus_.flush();
+  activeMask_ = activeMask;
+  if (!activeMask) {
+    std::cout << "No clients left, camera " << camera_->serial()
+              << " stopped." << std::endl;
+    return;
+  }
+
+  CameraConfig config = baseConfig_;
+  config.color = activeMask & kColorMask;
+  config.depth = activeMask & (1u << kDepthStream);
+  config.infrared = activeMask & (1u << kInfraredStream);
+  config.alignDepth = config.color && config.depth;
+  if (!camera_->start(config)) {
+    std::cout << "Failed to start camera." << std::endl;
+    return;
+  }
+  scale_ = camera_->depthScale();
+  std::cout << "Camera " << camera_->serial() << " running color "
+            << config.color << ", depth " << config.depth << ", infrared "
+            << config.infrared << std::endl;
 
-  rs2::frameset frames;
-  frames = rsPipeline_.wait_for_frames();
+  capturing_ = true;
+  captureThread_ = std::thread(&GstRgbdServer::captureLoop, this);
+}
 
-  colorFrame_ = frames.get_color_frame();
+void GstRgbdServer::stopCapture() {
+  capturing_ = false;
+  if (captureThread_.joinable()) {
+    captureThread_.join();
+  }
+  if (camera_ && camera_->isStarted()) {
+    camera_->stop();
+  }
+}
 
-  // Check if the frame is valid
-  if (colorFrame_) {
-    const void *data = colorFrame_.get_data();
-    int size = colorFrame_.get_data_size();
+void GstRgbdServer::captureLoop() {
+  ThreadPolicy::instance().enter("capture");
+  while (capturing_) {
+    CameraFrameSet frames;
+    if (!camera_->waitForFrames(frames, 1000)) {
+      continue;
+    }
+    bus_.publish(std::move(frames));
+  }
+  ThreadPolicy::instance().leave();
+}
 
-    // Assuming the color frame is in BGR format
-    GstBuffer *buffer = gst_buffer_new_wrapped_full(
-        GST_MEMORY_FLAG_READONLY, const_cast<void *>(data), size, 0, size,
-        nullptr, nullptr);
+void GstRgbdServer::pushFrames(const CameraFrameSet &frames) {
+  if (converter_) {
+    pushRenditions(frames.color);
+  } else {
+    pushImage(kColorStream, frames.color, frames.keepAlive);
+  }
+  pushImage(kDepthStream, frames.depth, frames.keepAlive);
+  pushImage(kInfraredStream, frames.infrared[0], frames.keepAlive);
+}
 
-    // Push the buffer to the appsrc element
+void GstRgbdServer::setupSharedMemory() {
+  if (shmName_.empty()) {
+    return;
+  }
+  // Room for 4 byte color and 16 bit depth at full size, plus alignment
+  uint64_t slotBytes = uint64_t(width_) * height_ * 6 + 128;
+  shm_.reset(new ShmFrameWriter);
+  if (!shm_->open(shmName_, shmSlots_, slotBytes)) {
+    shm_.reset();
+    return;
+  }
+  std::cout << "Publishing color and depth to /dev/shm/" << shmName_
+            << std::endl;
+  bus_.consume("shm", QueuePolicy(), [this](const CameraFrameSet &frames) {
+    publishShared(frames);
+  });
+  // A permanent consumer of both streams
+  activation_->acquire(kColorStream);
+  activation_->acquire(kDepthStream);
+}
+
+void GstRgbdServer::setupRecording() {
+  if (!recordOptions_.enabled()) {
+    return;
+  }
+  colorRecorder_.reset(new SegmentRecorder("/head", recordOptions_.location,
+                                           encoder_.info->codec,
+                                           recordOptions_, recordOptions_.imu));
+  if (recordOptions_.depth) {
+    depthRecorder_.reset(new SegmentRecorder(
+        "/depth", recordingLocation(recordOptions_.location, "-depth"),
+        encoder_.info->codec, recordOptions_));
+  }
+  if (recordOptions_.imu) {
+    // Motion samples are small, a longer queue rides out a slow disk
+    QueuePolicy imu;
+    imu.maxFrames = 8;
+    bus_.consume("recorder", imu, [this](const CameraFrameSet &frames) {
+      colorRecorder_->pushImu(frames);
+    });
+  }
+}
+
+void GstRgbdServer::setupPreEvent() {
+  if (!preEventBytes_) {
+    return;
+  }
+  preEvent_.reset(new PreEventRing(preEventBytes_, preEventDir_));
+  preEventTracks_[0] = preEvent_->addTrack("color", encoder_.info->codec);
+  preEventTracks_[1] = preEvent_->addTrack("depth", encoder_.info->codec);
+  // Encoders of their own, so the ring holds the last seconds even when no
+  // client watches; the mounts' encoders come and go with their clients
+  const Stream streams[2] = {kColorStream, kDepthStream};
+  for (int i = 0; i < 2; ++i) {
+    EncoderChoice encoder = encoder_;
+    encoder.bitrateKbps = rateOptions(streams[i]).startKbps;
+    std::string launch = "appsrc name=mysrc ! videoconvert ! " +
+                         encoder.launch("enc") +
+                         " ! fakesink sync=false async=false";
+    GError *error = NULL;
+    GstElement *pipeline = gst_parse_launch(launch.c_str(), &error);
+    if (!pipeline) {
+      std::cerr << "Cannot build the pre-event encoder: "
+                << (error ? error->message : launch) << std::endl;
+      g_clear_error(&error);
+      preEvent_.reset();
+      return;
+    }
+    g_clear_error(&error);
+    GstElement *appsrc = gst_bin_get_by_name(GST_BIN(pipeline), "mysrc");
+    GstElement *enc = gst_bin_get_by_name(GST_BIN(pipeline), "enc");
+    GstPad *pad = gst_element_get_static_pad(enc, "src");
+    preEvent_->attach(preEventTracks_[i], pad);
+    gst_object_unref(pad);
+    ThreadPolicy::instance().watch(pipeline);
+    addSink(streams[i], i ? "pre-event/depth" : "pre-event/color", appsrc);
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    gst_object_unref(enc);
+    gst_object_unref(appsrc);
+    preEventPipelines_[i] = pipeline;
+  }
+  preEvent_->triggerOnSignal(SIGUSR1);
+  std::cout << "Buffering " << (preEventBytes_ >> 20)
+            << " MB before events, kill -USR1 " << getpid() << " to save."
+            << std::endl;
+}
+
+void GstRgbdServer::setupSnapshots() {
+  if (snapshotEndpoint_.empty()) {
+    return;
+  }
+  snapshot_.reset(new SnapshotServer);
+  if (!snapshot_->start(snapshotEndpoint_)) {
+    snapshot_.reset();
+    return;
+  }
+  QueuePolicy newest;
+  newest.maxFrames = 1;
+  bus_.consume("snapshot", newest, [this](const CameraFrameSet &frames) {
+    snapshot_->publish(frames);
+  });
+  activation_->acquire(kColorStream);
+  activation_->acquire(kDepthStream);
+}
+
+void GstRgbdServer::triggerEvent() {
+  if (preEvent_) {
+    preEvent_->trigger();
+  }
+}
+
+void GstRgbdServer::publishShared(const CameraFrameSet &frames) {
+  ShmImage images[2];
+  size_t count = 0;
+  if (frames.color) {
+    images[count].kind = RgbdStreamKind::kColor;
+    images[count].image = frames.color;
+    images[count].intrinsics = camera_->colorIntrinsics();
+    ++count;
+  }
+  if (frames.depth) {
+    images[count].kind = RgbdStreamKind::kDepth;
+    images[count].image = frames.depth;
+    images[count].intrinsics = camera_->depthIntrinsics();
+    images[count].depthScale = scale_;
+    ++count;
+  }
+  if (count) {
+    shm_->write(frames.frameNumber, frames.timestampNs, images, count);
+  }
+}
+
+void GstRgbdServer::pushImage(Stream stream, const CameraImage &image,
+                              const std::shared_ptr<void> &keepAlive) {
+  if (!image) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(sinksMutex_);
+  if (sinks_[stream].empty()) {
+    return;
+  }
+  // The buffer holds its own reference on the frame set so the camera does
+  // not recycle the memory under us.
+  GstBuffer *buffer = gst_buffer_new_wrapped_full(
+      GST_MEMORY_FLAG_READONLY, const_cast<void *>(image.data), image.size, 0,
+      image.size, new std::shared_ptr<void>(keepAlive), [](gpointer keepAlive) {
+        delete static_cast<std::shared_ptr<void> *>(keepAlive);
+      });
+  for (auto &sink : sinks_[stream]) {
+    sink->push(gst_buffer_ref(buffer));
+  }
+  gst_buffer_unref(buffer);
+}
+
+// Converts the color image once and downscales it only as far as the
+// smallest rendition somebody watches; every level feeds all its clients.
+void GstRgbdServer::pushRenditions(const CameraImage &image) {
+  if (!image) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(sinksMutex_);
+  const Stream renditions[] = {kColorStream, kColorHalfStream,
+                               kColorQuarterStream};
+  int deepest = -1;
+  for (Stream stream : renditions) {
+    if (!sinks_[stream].empty()) {
+      deepest = renditionLevel(stream);
+    }
+  }
+  if (deepest < 0) {
+    return;
+  }
+
+  GstBuffer *level = convertColor(image);
+  for (int i = 0; level; ++i) {
+    for (auto &sink : sinks_[renditions[i]]) {
+      sink->push(gst_buffer_ref(level));
+    }
+    GstBuffer *next = i < deepest ? halveColor(level, i) : NULL;
+    gst_buffer_unref(level);
+    level = next;
+  }
+}
+
+// Converted once per frame, however many clients the mount has.
+GstBuffer *GstRgbdServer::convertColor(const CameraImage &image) {
+  GstBuffer *buffer = NULL;
+  if (gst_buffer_pool_acquire_buffer(colorPools_[0], &buffer, NULL) !=
+      GST_FLOW_OK) {
+    return NULL;
+  }
+  GstMapInfo map;
+  if (!gst_buffer_map(buffer, &map, GST_MAP_WRITE)) {
+    gst_buffer_unref(buffer);
+    return NULL;
+  }
+  bool converted =
+      converter_->convert(image, static_cast<uint8_t *>(map.data));
+  gst_buffer_unmap(buffer, &map);
+  if (!converted) {
+    gst_buffer_unref(buffer);
+    return NULL;
+  }
+  return buffer;
+}
+
+// Level `level` + 1 of the pyramid from level `level`.
+GstBuffer *GstRgbdServer::halveColor(GstBuffer *src, int level) {
+  GstBuffer *buffer = NULL;
+  if (gst_buffer_pool_acquire_buffer(colorPools_[level + 1], &buffer, NULL) !=
+      GST_FLOW_OK) {
+    return NULL;
+  }
+  GstMapInfo from, to;
+  if (!gst_buffer_map(src, &from, GST_MAP_READ)) {
+    gst_buffer_unref(buffer);
+    return NULL;
+  }
+  if (!gst_buffer_map(buffer, &to, GST_MAP_WRITE)) {
+    gst_buffer_unmap(src, &from);
+    gst_buffer_unref(buffer);
+    return NULL;
+  }
+  converter_->halve(from.data, width_ >> level, height_ >> level, to.data);
+  gst_buffer_unmap(buffer, &to);
+  gst_buffer_unmap(src, &from);
+  return buffer;
+}
+
+void GstRgbdServer::onMediaConfigure(GstRTSPMediaFactory *factory,
+                                     GstRTSPMedia *media) {
+  GstElement *element = gst_rtsp_media_get_element(media);
+  // Before the media prepares and its streaming threads start
+  ThreadPolicy::instance().watch(element);
+  GstElement *appsrc =
+      gst_bin_get_by_name_recurse_up(GST_BIN(element), "mysrc");
+
+  GstCaps *caps = replay_->caps(replayColorStream_);
+  // Timestamp with the media pipeline's running time, each client starts at 0
+  g_object_set(G_OBJECT(appsrc), "caps", caps, "is-live", TRUE,
+               "do-timestamp", TRUE, NULL);
+  gst_util_set_object_arg(G_OBJECT(appsrc), "format", "time");
+  gst_caps_unref(caps);
+
+  // Set the callback for the 'need-data' signal on appsrc
+  g_signal_connect(
+      appsrc, "need-data",
+      G_CALLBACK(+[](GstElement *element, guint size, gpointer user_data) {
+        GstRgbdServer *server = static_cast<GstRgbdServer *>(user_data);
+        server->onNeedData(element, size);
+      }),
+      this);
+
+  gst_object_unref(appsrc);
+  gst_object_unref(element);
+}
+
+// Callback for the 'need-data' signal on appsrc
+void GstRgbdServer::onNeedData(GstElement *element, guint size) {
+  // Only replays pull, cameras push from captureLoop().
+  // next() paces the replay, so this blocks like wait_for_frames()
+  ReplayFrame frame;
+  if (replayColorStream_ < 0 || !replay_->next(frame)) {
+    gst_app_src_end_of_stream(GST_APP_SRC(element));
+    return;
+  }
+  GstBuffer *buffer = frame.buffers[replayColorStream_];
+  frame.buffers[replayColorStream_] = nullptr;
+  if (buffer) {
+    GST_BUFFER_PTS(buffer) = GST_CLOCK_TIME_NONE;
     gst_app_src_push_buffer(GST_APP_SRC(element), buffer);
-    GstElement  *appsrc;
-    appsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), "mysrc");
   }
 }
 
-void GstRgbdServer::update() {
-  rs2::frameset frames;
-  frames = rsPipeline_.wait_for_frames();
+gboolean GstRgbdServer::onPreview(gpointer user_data) {
+  static_cast<GstRgbdServer *>(user_data)->update();
+  return G_SOURCE_CONTINUE;
+}
 
-  rs2::align align_to_color(RS2_STREAM_COLOR);
-  frames = align_to_color.process(frames);
+void GstRgbdServer::update() {
+  // Only shows something while a client keeps the camera running
+  SharedFrameSet shared;
+  if (!preview_ || !preview_->pop(shared, 0)) {
+    return;
+  }
+  const CameraFrameSet &frames = *shared;
 
   // Get imu data
-  if (rs2::motion_frame accel_frame =
-          frames.first_or_default(RS2_STREAM_ACCEL)) {
-    rs2_vector accel_sample = accel_frame.get_motion_data();
-    std::cout << "Accel:" << accel_sample.x << ", " << accel_sample.y << ", "
-              << accel_sample.z << std::endl;
-  }
-  if (rs2::motion_frame gyro_frame = frames.first_or_default(RS2_STREAM_GYRO)) {
-    rs2_vector gyro_sample = gyro_frame.get_motion_data();
-    std::cout << "Gyro:" << gyro_sample.x << ", " << gyro_sample.y << ", "
-              << gyro_sample.z << std::endl;
-  }
-
-  // Get each frame
-  colorFrame_ = frames.get_color_frame();
-  rs2::depth_frame depth_frame = frames.get_depth_frame();
-  rs2::video_frame ir_frame_left = frames.get_infrared_frame(1);
-  rs2::video_frame ir_frame_right = frames.get_infrared_frame(2);
-
-  // Creating OpenCV Matrix from a color image
-  Mat color(Size(width_, height_), CV_8UC3, (void *)colorFrame_.get_data(),
-            Mat::AUTO_STEP);
-  Mat pic_right(Size(width_, height_), CV_8UC1,
-                (void *)ir_frame_right.get_data());
-  Mat pic_left(Size(width_, height_), CV_8UC1,
-               (void *)ir_frame_left.get_data());
-  Mat pic_depth(Size(width_, height_), CV_16U, (void *)depth_frame.get_data(),
-                Mat::AUTO_STEP);
-
-  // Display in a GUI
-  namedWindow("Display Image");
-  imshow("Display Image", color);
-  imshow("Display depth", pic_depth * 30);
-  imshow("Display pic_left", pic_left);
-  imshow("Display pic_right", pic_right);
+  if (frames.hasAccel) {
+    std::cout << "Accel:" << frames.accel[0] << ", " << frames.accel[1] << ", "
+              << frames.accel[2] << std::endl;
+  }
+  if (frames.hasGyro) {
+    std::cout << "Gyro:" << frames.gyro[0] << ", " << frames.gyro[1] << ", "
+              << frames.gyro[2] << std::endl;
+  }
+
+  // Creating OpenCV Matrix from a color image, converted to BGR only here
+  // where something displays it. Only the streams clients asked for are
+  // running.
+  if (frames.color) {
+    imshow("Display Image", bgrImage(frames.color));
+  }
+  if (frames.depth) {
+    Mat pic_depth(frames.depth.height, frames.depth.width, CV_16U,
+                  (void *)frames.depth.data, frames.depth.stride);
+    imshow("Display depth", pic_depth * 30);
+  }
+  if (frames.infrared[0]) {
+    Mat pic_left(frames.infrared[0].height, frames.infrared[0].width, CV_8UC1,
+                 (void *)frames.infrared[0].data, frames.infrared[0].stride);
+    imshow("Display pic_left", pic_left);
+  }
+  if (frames.infrared[1]) {
+    Mat pic_right(frames.infrared[1].height, frames.infrared[1].width,
+                  CV_8UC1, (void *)frames.infrared[1].data,
+                  frames.infrared[1].stride);
+    imshow("Display pic_right", pic_right);
+  }
   waitKey(1);
 }
 
@@ -0,0 +1,120 @@
+#include "gst_rgbd_server/loss_injector.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <random>
+
+#include "gst_rgbd_server/metrics.h"
+
+namespace {
+
+struct InjectorState {
+  InjectorState(const LossInjectorOptions &options, const std::string &name)
+      : options(options), rng(options.seed),
+        dropped(Metrics::instance().share(
+            "rgbd_injected_drops_total" +
+            (name.empty() ? "" : "{stream=\"" + name + "\"}"))) {}
+
+  LossInjectorOptions options;
+  std::mt19937 rng;
+  std::uniform_real_distribution<double> uniform{0.0, 1.0};
+  // the mount or stream may remove its labels first
+  std::shared_ptr<std::atomic<double>> dropped;
+  // packets of the current burst still to drop
+  unsigned remaining = 0;
+  GstClockTime lastPts = GST_CLOCK_TIME_NONE;
+  GstClockTime frameDue = 0;
+};
+
+bool shouldDrop(InjectorState &state) {
+  if (!state.remaining &&
+      state.uniform(state.rng) * 100.0 < state.options.lossPercent) {
+    state.remaining = std::max(1u, state.options.burstPackets);
+  }
+  if (!state.remaining) {
+    return false;
+  }
+  --state.remaining;
+  Metrics::add(*state.dropped, 1);
+  return true;
+}
+
+// Blocks the streaming thread until the frame of this packet is due.
+void hold(GstPad *pad, InjectorState &state, GstClockTime pts) {
+  if ((state.options.delayMs <= 0 && state.options.jitterMs <= 0) ||
+      !GST_CLOCK_TIME_IS_VALID(pts)) {
+    return;
+  }
+  if (pts != state.lastPts) {
+    state.lastPts = pts;
+    double extraMs = state.options.delayMs +
+                     state.uniform(state.rng) * state.options.jitterMs;
+    // Never reorder: a frame is due no earlier than the one before it
+    state.frameDue = std::max(state.frameDue,
+                              pts + GstClockTime(extraMs * GST_MSECOND));
+  }
+
+  GstElement *parent = gst_pad_get_parent_element(pad);
+  if (!parent) {
+    return;
+  }
+  GstClock *clock = gst_element_get_clock(parent);
+  if (clock) {
+    GstClockID id = gst_clock_new_single_shot_id(
+        clock, gst_element_get_base_time(parent) + state.frameDue);
+    gst_clock_id_wait(id, NULL);
+    gst_clock_id_unref(id);
+    gst_object_unref(clock);
+  }
+  gst_object_unref(parent);
+}
+
+GstPadProbeReturn onPacket(GstPad *pad, GstPadProbeInfo *info,
+                           gpointer user_data) {
+  InjectorState &state = *static_cast<InjectorState *>(user_data);
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    hold(pad, state, GST_BUFFER_PTS(buffer));
+    return shouldDrop(state) ? GST_PAD_PROBE_DROP : GST_PAD_PROBE_OK;
+  }
+
+  // Payloaders push whole frames as buffer lists
+  GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+  if (gst_buffer_list_length(list) > 0) {
+    hold(pad, state, GST_BUFFER_PTS(gst_buffer_list_get(list, 0)));
+  }
+  if (state.options.lossPercent <= 0) {
+    return GST_PAD_PROBE_OK;
+  }
+  list = gst_buffer_list_make_writable(list);
+  GST_PAD_PROBE_INFO_DATA(info) = list;
+  gst_buffer_list_foreach(
+      list,
+      [](GstBuffer **buffer, guint, gpointer user_data) -> gboolean {
+        InjectorState &state = *static_cast<InjectorState *>(user_data);
+        if (shouldDrop(state)) {
+          gst_buffer_unref(*buffer);
+          *buffer = NULL;
+        }
+        return TRUE;
+      },
+      &state);
+  return GST_PAD_PROBE_OK;
+}
+
+} // namespace
+
+gulong attachLossInjector(GstPad *pad, const LossInjectorOptions &options,
+                          const std::string &name) {
+  if (!options.enabled()) {
+    return 0;
+  }
+  return gst_pad_add_probe(
+      pad,
+      GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER |
+                      GST_PAD_PROBE_TYPE_BUFFER_LIST),
+      onPacket, new InjectorState(options, name), [](gpointer state) {
+        delete static_cast<InjectorState *>(state);
+      });
+}
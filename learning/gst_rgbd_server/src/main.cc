@@ -1,16 +1,359 @@
+#include <algorithm>
 #include <iostream>
 #include "gst_rgbd_server/gst_rgbd_server.h"
+#include "gst_rgbd_server/thread_policy.h"
 
+static gchar *cameraSpec = nullptr;
+static gchar *replayFile = nullptr;
+static gchar **replayRaw = nullptr;
+static gchar *replayPacing = nullptr;
+static gdouble replayFps = 30.0;
+static gboolean replayLoop = FALSE;
+static gint graceMs = 5000;
+static gint minKbps = 300;
+static gint maxKbps = 8000;
+static gint startKbps = 2000;
+static gboolean fixedSize = FALSE;
+static gdouble injectLoss = 0;
+static gdouble injectDelay = 0;
+static gdouble injectJitter = 0;
+static gchar *metricsFile = nullptr;
+static gchar *codecName = nullptr;
+static gchar *encoderName = nullptr;
+static gchar *presetName = nullptr;
+static gboolean calibrate = FALSE;
+static gdouble latencyBudgetMs = 20;
+static gboolean useVideoconvert = FALSE;
+static gint convertThreads = 4;
+static gchar *colorFormat = nullptr;
+static gint queueFrames = 2;
+static gint64 queueBytes = 0;
+static gchar *queueDrop = nullptr;
+static gchar *shmName = nullptr;
+static gint shmSlots = 4;
+static gint gopCacheKb = 4096;
+static gint keyframeIntervalMs = 1000;
+static gint mediaPoolSize = 0;
+static gchar *multicastSpec = nullptr;
+static gint multicastTtl = 1;
+static gchar *multicastIface = nullptr;
+static gboolean multicastOnly = FALSE;
+static gint rtspThreads = 4;
+static gchar *recordLocation = nullptr;
+static gint recordSegmentS = 60;
+static gint recordMaxFiles = 0;
+static gboolean recordDepth = FALSE;
+static gboolean recordImu = FALSE;
+static gint preEventMb = 0;
+static gchar *eventDir = nullptr;
+static gchar *snapshotEndpoint = nullptr;
+static gboolean preview = FALSE;
+static gchar *threadRules = nullptr;
+
+static GOptionEntry entries[] = {
+    {"camera", 'c', 0, G_OPTION_ARG_STRING, &cameraSpec,
+     "Camera to serve: realsense[:SERIAL] or synthetic[:SEED] "
+     "(default: realsense)",
+     "SPEC"},
+    {"replay", 'r', 0, G_OPTION_ARG_FILENAME, &replayFile,
+     "Serve an .rgbdrec recording instead of the camera", "FILE"},
+    {"replay-raw", 0, 0, G_OPTION_ARG_STRING_ARRAY, &replayRaw,
+     "Serve a raw frame file, e.g. color:rgba:1920x1080:color.bin", "SPEC"},
+    {"pacing", 0, 0, G_OPTION_ARG_STRING, &replayPacing,
+     "Replay pacing: realtime, fixed or max (default: realtime)", "MODE"},
+    {"fps", 0, 0, G_OPTION_ARG_DOUBLE, &replayFps,
+     "Replay rate for fixed pacing and raw files (default: 30)", "FPS"},
+    {"loop", 0, 0, G_OPTION_ARG_NONE, &replayLoop, "Loop the replay", NULL},
+    {"grace-ms", 0, 0, G_OPTION_ARG_INT, &graceMs,
+     "Keep a camera stream running this long after its last client left "
+     "(default: 5000)",
+     "MS"},
+    {"min-kbps", 0, 0, G_OPTION_ARG_INT, &minKbps,
+     "Lowest bitrate the rate control may pick (default: 300)", "KBPS"},
+    {"max-kbps", 0, 0, G_OPTION_ARG_INT, &maxKbps,
+     "Highest bitrate the rate control may pick (default: 8000)", "KBPS"},
+    {"start-kbps", 0, 0, G_OPTION_ARG_INT, &startKbps,
+     "Bitrate of a new stream (default: 2000)", "KBPS"},
+    {"fixed-size", 0, 0, G_OPTION_ARG_NONE, &fixedSize,
+     "Never lower frame rate or resolution under congestion", NULL},
+    {"inject-loss", 0, 0, G_OPTION_ARG_DOUBLE, &injectLoss,
+     "Drop this percentage of outgoing RTP packets (testing)", "PERCENT"},
+    {"inject-delay", 0, 0, G_OPTION_ARG_DOUBLE, &injectDelay,
+     "Delay outgoing RTP packets (testing)", "MS"},
+    {"inject-jitter", 0, 0, G_OPTION_ARG_DOUBLE, &injectJitter,
+     "Add up to this much random delay per frame (testing)", "MS"},
+    {"metrics", 'm', 0, G_OPTION_ARG_FILENAME, &metricsFile,
+     "Write rate control metrics to FILE every second", "FILE"},
+    {"codec", 0, 0, G_OPTION_ARG_STRING, &codecName,
+     "h264, h265 or vp8 (default: h264)", "CODEC"},
+    {"encoder", 'e', 0, G_OPTION_ARG_STRING, &encoderName,
+     "Encoder element, e.g. nvv4l2h264enc or x264enc (default: auto)",
+     "ELEMENT"},
+    {"preset", 0, 0, G_OPTION_ARG_STRING, &presetName,
+     "default, zero-latency, intra-refresh or sliced-threads "
+     "(default: zero-latency)",
+     "PRESET"},
+    {"calibrate", 0, 0, G_OPTION_ARG_NONE, &calibrate,
+     "Time every available encoder on synthetic frames at startup and use "
+     "the fastest within the latency budget",
+     NULL},
+    {"latency-budget", 0, 0, G_OPTION_ARG_DOUBLE, &latencyBudgetMs,
+     "Per frame encode latency budget for --calibrate (default: 20)", "MS"},
+    {"color-format", 0, 0, G_OPTION_ARG_STRING, &colorFormat,
+     "Camera color format: yuyv, uyvy, bgr or rgb (default: yuyv)",
+     "FORMAT"},
+    {"videoconvert", 0, 0, G_OPTION_ARG_NONE, &useVideoconvert,
+     "Leave RGB to YUV conversion to videoconvert in each media pipeline",
+     NULL},
+    {"convert-threads", 0, 0, G_OPTION_ARG_INT, &convertThreads,
+     "Threads helping the capture thread convert color to YUV, 0 for one "
+     "per core (default: 4)",
+     "N"},
+    {"queue-frames", 0, 0, G_OPTION_ARG_INT, &queueFrames,
+     "Frames queued per client before the drop policy applies, 0 for no "
+     "limit (default: 2)",
+     "N"},
+    {"queue-bytes", 0, 0, G_OPTION_ARG_INT64, &queueBytes,
+     "Bytes queued per client before the drop policy applies, 0 for no "
+     "limit (default: 0)",
+     "BYTES"},
+    {"queue-drop", 0, 0, G_OPTION_ARG_STRING, &queueDrop,
+     "Full client queue: drop-oldest, drop-newest or block "
+     "(default: drop-oldest)",
+     "POLICY"},
+    {"shm", 0, 0, G_OPTION_ARG_STRING, &shmName,
+     "Also publish raw color and depth to /dev/shm/NAME for readers on this "
+     "machine",
+     "NAME"},
+    {"shm-slots", 0, 0, G_OPTION_ARG_INT, &shmSlots,
+     "Frame sets the shared memory ring holds (default: 4)", "N"},
+    {"gop-cache-kb", 0, 0, G_OPTION_ARG_INT, &gopCacheKb,
+     "Most of the current GOP kept per mount for joining RTSP/TCP clients "
+     "(default: 4096)",
+     "KB"},
+    {"join-keyframe-ms", 0, 0, G_OPTION_ARG_INT, &keyframeIntervalMs,
+     "Least time between keyframes forced by joining clients (default: 1000)",
+     "MS"},
+    {"media-pool", 0, 0, G_OPTION_ARG_INT, &mediaPoolSize,
+     "Media kept prepared per mount to answer DESCRIBE without building a "
+     "pipeline (default: 0)",
+     "N"},
+    {"multicast", 0, 0, G_OPTION_ARG_STRING, &multicastSpec,
+     "Also serve the camera mounts over multicast from this group range, e.g. "
+     "239.255.42.1-239.255.42.16:5000-5999",
+     "ADDR[-ADDR][:PORT-PORT]"},
+    {"multicast-ttl", 0, 0, G_OPTION_ARG_INT, &multicastTtl,
+     "Hops multicast packets may take (default: 1)", "TTL"},
+    {"multicast-iface", 0, 0, G_OPTION_ARG_STRING, &multicastIface,
+     "Interface to send multicast on, lo to test on one host", "IFACE"},
+    {"multicast-only", 0, 0, G_OPTION_ARG_NONE, &multicastOnly,
+     "Refuse unicast transports when multicast is on", NULL},
+    {"rtsp-threads", 0, 0, G_OPTION_ARG_INT, &rtspThreads,
+     "Threads serving RTSP clients (default: 4)", "N"},
+    {"record", 0, 0, G_OPTION_ARG_STRING, &recordLocation,
+     "Record the encoded color stream to segments, e.g. /data/head-%05d.mkv "
+     "(.mp4 for MP4)",
+     "PATTERN"},
+    {"record-segment-s", 0, 0, G_OPTION_ARG_INT, &recordSegmentS,
+     "Length of a recorded segment (default: 60)", "S"},
+    {"record-max-files", 0, 0, G_OPTION_ARG_INT, &recordMaxFiles,
+     "Recorded segments kept, oldest deleted first (default: 0, all)", "N"},
+    {"record-depth", 0, 0, G_OPTION_ARG_NONE, &recordDepth,
+     "Also record the encoded depth stream, to PATTERN with -depth added",
+     NULL},
+    {"record-imu", 0, 0, G_OPTION_ARG_NONE, &recordImu,
+     "Also record the IMU as a text track of the color segments", NULL},
+    {"pre-event-mb", 0, 0, G_OPTION_ARG_INT, &preEventMb,
+     "Memory holding the encoded streams before an event; SIGUSR1 saves them "
+     "and as long after. Keeps color and depth running and encodes them once "
+     "more for it (default: 0, off)",
+     "MB"},
+    {"event-dir", 0, 0, G_OPTION_ARG_STRING, &eventDir,
+     "Directory events are saved to (default: .)", "DIR"},
+    {"snapshot", 0, 0, G_OPTION_ARG_STRING, &snapshotEndpoint,
+     "Serve /color.jpg, /color.png and /depth.png of the newest frames over "
+     "HTTP on [HOST:]PORT or unix:PATH",
+     "ENDPOINT"},
+    {"preview", 0, 0, G_OPTION_ARG_NONE, &preview,
+     "Show the camera streams in windows while clients watch", NULL},
+    {"threads", 0, 0, G_OPTION_ARG_STRING, &threadRules,
+     "Pin and prioritize threads by name, e.g. "
+     "'capture=2:fifo=50;mysrc=3:fifo=40;convert=4-5'; also tracks their CPU "
+     "usage in the metrics file",
+     "RULES"},
+    {NULL}};
+
+static std::unique_ptr<RgbdReplaySource> openReplay() {
+    ReplayOptions options;
+    options.fps = replayFps;
+    options.loop = replayLoop;
+    std::string pacing = replayPacing ? replayPacing : "realtime";
+    if (pacing == "fixed") {
+        options.pacing = ReplayPacing::kFixedRate;
+    } else if (pacing == "max") {
+        options.pacing = ReplayPacing::kMaxRate;
+    } else if (pacing != "realtime") {
+        std::cerr << "Unknown pacing: " << pacing << std::endl;
+        return nullptr;
+    }
+
+    std::unique_ptr<RgbdReplaySource> replay(new RgbdReplaySource);
+    if (replayFile) {
+        if (!replay->open(replayFile, options)) {
+            return nullptr;
+        }
+        return replay;
+    }
+
+    std::vector<RawReplayStream> streams;
+    for (gchar **spec = replayRaw; spec && *spec; ++spec) {
+        RawReplayStream stream;
+        if (!RawReplayStream::parse(*spec, stream)) {
+            std::cerr << "Invalid raw replay spec: " << *spec << std::endl;
+            return nullptr;
+        }
+        streams.push_back(stream);
+    }
+    if (!replay->openRaw(streams, options)) {
+        return nullptr;
+    }
+    return replay;
+}
+
+int main(int argc, char *argv[]) {
+    GError *error = NULL;
+    GOptionContext *optctx = g_option_context_new("- RGB-D RTSP server");
+    g_option_context_add_main_entries(optctx, entries, NULL);
+    g_option_context_add_group(optctx, gst_init_get_option_group());
+    if (!g_option_context_parse(optctx, &argc, &argv, &error)) {
+        std::cerr << "Error parsing options: " << error->message << std::endl;
+        g_option_context_free(optctx);
+        g_clear_error(&error);
+        return -1;
+    }
+    g_option_context_free(optctx);
+    if (threadRules && !ThreadPolicy::instance().configure(threadRules)) {
+        return -1;
+    }
+
+    std::unique_ptr<GstRgbdServer> server;
+    if (replayFile || replayRaw) {
+        std::unique_ptr<RgbdReplaySource> replay = openReplay();
+        if (!replay) {
+            return -1;
+        }
+        server.reset(new GstRgbdServer(std::move(replay)));
+    } else {
+        std::unique_ptr<CameraSource> camera =
+            createCameraSource(cameraSpec ? cameraSpec : "realsense");
+        if (!camera) {
+            return -1;
+        }
+        server.reset(new GstRgbdServer(std::move(camera)));
+        server->setIdleGracePeriod(guint(std::max(0, graceMs)));
+
+        RateControllerOptions rate;
+        rate.minKbps = uint32_t(std::max(1, minKbps));
+        rate.maxKbps = uint32_t(std::max(minKbps, maxKbps));
+        rate.startKbps = uint32_t(std::max(1, startKbps));
+        rate.adaptFrameRate = rate.adaptResolution = !fixedSize;
+        server->setRateControl(rate);
+
+        LossInjectorOptions loss;
+        loss.lossPercent = injectLoss;
+        loss.delayMs = injectDelay;
+        loss.jitterMs = injectJitter;
+        server->setLossInjection(loss);
+        if (metricsFile) {
+            server->setMetricsFile(metricsFile);
+        }
+
+        EncoderRequest encoder;
+        if (codecName && !parseVideoCodec(codecName, encoder.codec)) {
+            std::cerr << "Unknown codec: " << codecName << std::endl;
+            return -1;
+        }
+        if (presetName && !parseEncoderPreset(presetName, encoder.preset)) {
+            std::cerr << "Unknown preset: " << presetName << std::endl;
+            return -1;
+        }
+        encoder.element = encoderName ? encoderName : "auto";
+        encoder.calibrate = calibrate;
+        encoder.latencyBudgetMs = latencyBudgetMs;
+        server->setEncoderRequest(encoder);
+        if (colorFormat) {
+            std::string format = colorFormat;
+            if (format == "yuyv") {
+                server->setColorFormat(RgbdPixelFormat::kYUYV);
+            } else if (format == "uyvy") {
+                server->setColorFormat(RgbdPixelFormat::kUYVY);
+            } else if (format == "bgr") {
+                server->setColorFormat(RgbdPixelFormat::kBGR8);
+            } else if (format == "rgb") {
+                server->setColorFormat(RgbdPixelFormat::kRGB8);
+            } else {
+                std::cerr << "Unknown color format: " << format << std::endl;
+                return -1;
+            }
+        }
+        server->setColorConversion(!useVideoconvert,
+                                   size_t(std::max(0, convertThreads)));
+
+        QueuePolicy queue;
+        queue.maxFrames = uint32_t(std::max(0, queueFrames));
+        queue.maxBytes = uint64_t(std::max<gint64>(0, queueBytes));
+        if (queueDrop && !parseQueueDrop(queueDrop, queue.drop)) {
+            std::cerr << "Unknown queue policy: " << queueDrop << std::endl;
+            return -1;
+        }
+        server->setQueuePolicy(queue);
+        GopCacheOptions gop;
+        gop.maxBytes = size_t(std::max(0, gopCacheKb)) << 10;
+        gop.keyframeIntervalMs = guint(std::max(0, keyframeIntervalMs));
+        server->setGopCache(gop);
+        MediaPoolOptions pool;
+        pool.size = guint(std::max(0, mediaPoolSize));
+        server->setMediaPool(pool);
+        if (multicastSpec) {
+            MulticastOptions multicast;
+            if (!parseMulticast(multicastSpec, multicast)) {
+                std::cerr << "Invalid multicast range: " << multicastSpec
+                          << std::endl;
+                return -1;
+            }
+            multicast.ttl = guint8(std::min(255, std::max(1, multicastTtl)));
+            multicast.iface = multicastIface ? multicastIface : "";
+            multicast.unicastFallback = !multicastOnly;
+            server->setMulticast(multicast);
+        }
+        if (recordLocation) {
+            RecorderOptions record;
+            record.location = recordLocation;
+            record.segmentSeconds = guint(std::max(1, recordSegmentS));
+            record.maxFiles = guint(std::max(0, recordMaxFiles));
+            record.depth = recordDepth;
+            record.imu = recordImu;
+            server->setRecording(record);
+        }
+        if (preEventMb > 0) {
+            server->setPreEventBuffer(size_t(preEventMb) << 20,
+                                      eventDir ? eventDir : ".");
+        }
+        if (snapshotEndpoint) {
+            server->setSnapshotEndpoint(snapshotEndpoint);
+        }
+        server->setPreview(preview);
+        if (shmName) {
+            server->setSharedMemory(shmName, uint32_t(std::max(2, shmSlots)));
+        }
+    }
+    server->setRtspThreads(guint(std::max(1, rtspThreads)));
 
-int main() {
     // Displaying a message to the console
-    GstRgbdServer server;
     std::cout << "Hello, World!" << std::endl;
-    server.stream();
+    server->stream();
     std::cout << "Hello, World!" << std::endl;
 
-    server.update();
-
     // Returning 0 indicates successful completion of the program
     return 0;
 }
@@ -0,0 +1,427 @@
+#include "gst_rgbd_server/media_pool.h"
+
+#include <gst/app/gstappsrc.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "gst_rgbd_server/metrics.h"
+
+namespace {
+
+// milliseconds, from a cached pipeline to a cold hardware encoder
+const std::vector<double> kSetupBoundsMs = {1,   5,   10,   25,   50,  100,
+                                            250, 500, 1000, 2500, 5000};
+
+// Bytes of one frame of the raw formats the servers push, 0 if unknown
+gsize frameBytes(GstCaps *caps) {
+  GstStructure *s = gst_caps_get_structure(caps, 0);
+  const gchar *format = gst_structure_get_string(s, "format");
+  gint width = 0, height = 0;
+  if (!format || !gst_structure_get_int(s, "width", &width) ||
+      !gst_structure_get_int(s, "height", &height)) {
+    return 0;
+  }
+  gsize pixels = gsize(width) * gsize(height);
+  if (!strcmp(format, "I420") || !strcmp(format, "NV12")) {
+    return pixels * 3 / 2;
+  }
+  if (!strcmp(format, "GRAY8")) {
+    return pixels;
+  }
+  if (!strcmp(format, "YUY2") || !strcmp(format, "UYVY") ||
+      !strcmp(format, "GRAY16_LE")) {
+    return pixels * 2;
+  }
+  if (!strcmp(format, "BGR") || !strcmp(format, "RGB")) {
+    return pixels * 3;
+  }
+  if (!strcmp(format, "RGBA") || !strcmp(format, "BGRA") ||
+      !strcmp(format, "BGRx")) {
+    return pixels * 4;
+  }
+  return 0;
+}
+
+double elapsedMs(gint64 since) {
+  return (g_get_monotonic_time() - since) / 1000.0;
+}
+
+class MediaPool;
+
+struct RgbdPooledFactory {
+  GstRTSPMediaFactory parent;
+  MediaPool *pool;
+};
+
+struct RgbdPooledFactoryClass {
+  GstRTSPMediaFactoryClass parent_class;
+};
+
+GType rgbd_pooled_factory_get_type();
+
+// One media waiting in the pool, with the warm-up feeding its appsrc
+struct PooledMedia {
+  GstRTSPMedia *media;
+  GstElement *appsrc;
+  GstBuffer *blank;
+  gulong needData;
+};
+
+class MediaPool {
+public:
+  MediaPool(const std::string &name, const MediaPoolOptions &options)
+      : name_(name), label_("{mount=\"" + name + "\"}"), options_(options) {}
+  ~MediaPool();
+
+  void start(GstRTSPMediaFactory *factory, GstRTSPServer *server,
+             const std::string &path, GstCaps *caps);
+  GstRTSPMedia *construct(GstRTSPMediaFactory *factory,
+                          const GstRTSPUrl *url);
+  const std::string &name() const { return name_; }
+
+private:
+  static void onWarmUpNeedData(GstElement *appsrc, guint size,
+                               gpointer user_data);
+  static gboolean releaseHold(gpointer media);
+  void beforePrepare(GstRTSPMedia *media);
+  void run();
+  PooledMedia *prewarm();
+  void discard(PooledMedia *pooled);
+  void hold(GstRTSPMedia *media);
+
+  std::string name_;
+  std::string label_;
+  MediaPoolOptions options_;
+  GstRTSPMediaFactory *factory_ = nullptr;
+  GstRTSPThreadPool *threads_ = nullptr;
+  GstRTSPUrl *url_ = nullptr;
+  GstCaps *caps_ = nullptr;
+  gsize frameBytes_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::deque<PooledMedia *> ready_;
+  bool stopping_ = false;
+  std::thread thread_;
+};
+
+G_DEFINE_TYPE(RgbdPooledFactory, rgbd_pooled_factory,
+              GST_TYPE_RTSP_MEDIA_FACTORY)
+
+GstRTSPMedia *pooledConstruct(GstRTSPMediaFactory *factory,
+                              const GstRTSPUrl *url) {
+  return reinterpret_cast<RgbdPooledFactory *>(factory)->pool->construct(
+      factory, url);
+}
+
+// A pooled media was configured before the pool prepared it; configuring
+// it again at hand out would change settings of a running media
+void pooledConfigure(GstRTSPMediaFactory *factory, GstRTSPMedia *media) {
+  if (g_object_get_data(G_OBJECT(media), "media-pool-configured")) {
+    return;
+  }
+  GST_RTSP_MEDIA_FACTORY_CLASS(rgbd_pooled_factory_parent_class)
+      ->configure(factory, media);
+}
+
+// Runs after the application's media-configure handlers, which is when a
+// media taken from the pool is ready for its client
+void pooledMediaConfigure(GstRTSPMediaFactory *factory, GstRTSPMedia *media) {
+  GstRTSPMediaFactoryClass *parent =
+      GST_RTSP_MEDIA_FACTORY_CLASS(rgbd_pooled_factory_parent_class);
+  if (parent->media_configure) {
+    parent->media_configure(factory, media);
+  }
+  gint64 *start = static_cast<gint64 *>(
+      g_object_steal_data(G_OBJECT(media), "media-pool-hit"));
+  if (!start) {
+    return;
+  }
+  Metrics::instance().observe(
+      "rgbd_media_setup_ms{mount=\"" +
+          reinterpret_cast<RgbdPooledFactory *>(factory)->pool->name() +
+          "\",pool=\"hit\"}",
+      elapsedMs(*start), kSetupBoundsMs);
+  delete start;
+}
+
+void pooledFinalize(GObject *object) {
+  delete reinterpret_cast<RgbdPooledFactory *>(object)->pool;
+  G_OBJECT_CLASS(rgbd_pooled_factory_parent_class)->finalize(object);
+}
+
+void rgbd_pooled_factory_class_init(RgbdPooledFactoryClass *klass) {
+  G_OBJECT_CLASS(klass)->finalize = pooledFinalize;
+  GST_RTSP_MEDIA_FACTORY_CLASS(klass)->construct = pooledConstruct;
+  GST_RTSP_MEDIA_FACTORY_CLASS(klass)->configure = pooledConfigure;
+  GST_RTSP_MEDIA_FACTORY_CLASS(klass)->media_configure = pooledMediaConfigure;
+}
+
+void rgbd_pooled_factory_init(RgbdPooledFactory *factory) {
+  factory->pool = nullptr;
+}
+
+MediaPool::~MediaPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  for (PooledMedia *pooled : ready_) {
+    discard(pooled);
+  }
+  if (caps_) {
+    gst_caps_unref(caps_);
+  }
+  if (url_) {
+    gst_rtsp_url_free(url_);
+  }
+  if (threads_) {
+    g_object_unref(threads_);
+  }
+}
+
+void MediaPool::start(GstRTSPMediaFactory *factory, GstRTSPServer *server,
+                      const std::string &path, GstCaps *caps) {
+  frameBytes_ = frameBytes(caps);
+  if (!options_.size || thread_.joinable()) {
+    return;
+  }
+  if (!frameBytes_) {
+    gchar *description = gst_caps_to_string(caps);
+    std::cerr << name_ << ": no warm-up frames for " << description
+              << ", media are not pooled." << std::endl;
+    g_free(description);
+    return;
+  }
+  std::string uri = "rtsp://127.0.0.1" + path;
+  if (gst_rtsp_url_parse(uri.c_str(), &url_) != GST_RTSP_OK) {
+    return;
+  }
+  factory_ = factory;
+  threads_ = gst_rtsp_server_get_thread_pool(server);
+  caps_ = gst_caps_ref(caps);
+  thread_ = std::thread(&MediaPool::run, this);
+}
+
+GstRTSPMedia *MediaPool::construct(GstRTSPMediaFactory *factory,
+                                   const GstRTSPUrl *url) {
+  gint64 start = g_get_monotonic_time();
+  PooledMedia *pooled = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!ready_.empty()) {
+      pooled = ready_.front();
+      ready_.pop_front();
+    }
+    Metrics::instance().set("rgbd_media_pool_ready" + label_,
+                            double(ready_.size()));
+  }
+  wake_.notify_one();
+
+  if (pooled) {
+    // From here on media-configure sets the appsrc up for real frames
+    g_signal_handler_disconnect(pooled->appsrc, pooled->needData);
+    GstRTSPMedia *media = pooled->media;
+    gst_object_unref(pooled->appsrc);
+    gst_buffer_unref(pooled->blank);
+    delete pooled;
+    hold(media);
+    // Timed until media-configure was handled, see pooledMediaConfigure()
+    g_object_set_data_full(G_OBJECT(media), "media-pool-hit", new gint64(start),
+                           [](gpointer start) {
+                             delete static_cast<gint64 *>(start);
+                           });
+    return media;
+  }
+
+  GstRTSPMedia *media =
+      GST_RTSP_MEDIA_FACTORY_CLASS(rgbd_pooled_factory_parent_class)
+          ->construct(factory, url);
+  if (media) {
+    beforePrepare(media);
+    // The client prepares it right after; time it until it is
+    g_object_set_data(G_OBJECT(media), "media-pool-start",
+                      new gint64(start));
+    g_signal_connect_data(
+        media, "prepared",
+        G_CALLBACK(+[](GstRTSPMedia *media, gpointer user_data) {
+          gint64 *start = static_cast<gint64 *>(
+              g_object_steal_data(G_OBJECT(media), "media-pool-start"));
+          if (!start) {
+            return;
+          }
+          Metrics::instance().observe(
+              "rgbd_media_setup_ms{mount=\"" +
+                  *static_cast<std::string *>(user_data) + "\",pool=\"miss\"}",
+              elapsedMs(*start), kSetupBoundsMs);
+          delete start;
+        }),
+        new std::string(name_),
+        [](gpointer name, GClosure *) {
+          delete static_cast<std::string *>(name);
+        },
+        GConnectFlags(0));
+  }
+  return media;
+}
+
+// The pool's own prepare keeps a media prepared while it waits. Once handed
+// out the client has prepared it too, and the pool's share is given back on
+// its first PLAY, or after holdSeconds for a client that never plays.
+void MediaPool::hold(GstRTSPMedia *media) {
+  g_object_set_data(G_OBJECT(media), "media-pool-hold", GINT_TO_POINTER(1));
+  g_signal_connect(media, "new-state",
+                   G_CALLBACK(+[](GstRTSPMedia *media, gint state, gpointer) {
+                     if (state == GST_STATE_PLAYING) {
+                       g_idle_add_full(G_PRIORITY_DEFAULT,
+                                       &MediaPool::releaseHold,
+                                       g_object_ref(media), g_object_unref);
+                     }
+                   }),
+                   NULL);
+  g_timeout_add_seconds_full(G_PRIORITY_DEFAULT, options_.holdSeconds,
+                             &MediaPool::releaseHold, g_object_ref(media),
+                             g_object_unref);
+}
+
+void MediaPool::beforePrepare(GstRTSPMedia *media) {
+  if (!options_.beforePrepare) {
+    return;
+  }
+  GstElement *element = gst_rtsp_media_get_element(media);
+  options_.beforePrepare(element);
+  gst_object_unref(element);
+}
+
+gboolean MediaPool::releaseHold(gpointer data) {
+  GstRTSPMedia *media = static_cast<GstRTSPMedia *>(data);
+  if (g_object_steal_data(G_OBJECT(media), "media-pool-hold")) {
+    gst_rtsp_media_unprepare(media);
+  }
+  return G_SOURCE_REMOVE;
+}
+
+void MediaPool::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_) {
+    if (ready_.size() >= options_.size) {
+      wake_.wait(lock);
+      continue;
+    }
+    lock.unlock();
+    PooledMedia *pooled = prewarm();
+    lock.lock();
+    if (!pooled) {
+      // Try again later rather than spin on a broken pipeline
+      wake_.wait_for(lock, std::chrono::seconds(5));
+      continue;
+    }
+    if (stopping_) {
+      discard(pooled);
+      break;
+    }
+    ready_.push_back(pooled);
+    Metrics::instance().set("rgbd_media_pool_ready" + label_,
+                            double(ready_.size()));
+  }
+}
+
+PooledMedia *MediaPool::prewarm() {
+  gint64 start = g_get_monotonic_time();
+  GstRTSPMedia *media =
+      GST_RTSP_MEDIA_FACTORY_CLASS(rgbd_pooled_factory_parent_class)
+          ->construct(factory_, url_);
+  if (!media) {
+    return nullptr;
+  }
+  // Factory settings apply before the streams are set up, once;
+  // media-configure waits for the hand out
+  GST_RTSP_MEDIA_FACTORY_CLASS(rgbd_pooled_factory_parent_class)
+      ->configure(factory_, media);
+  g_object_set_data(G_OBJECT(media), "media-pool-configured",
+                    GINT_TO_POINTER(1));
+  beforePrepare(media);
+
+  GstElement *element = gst_rtsp_media_get_element(media);
+  GstElement *appsrc =
+      gst_bin_get_by_name_recurse_up(GST_BIN(element), options_.appsrc.c_str());
+  gst_object_unref(element);
+  if (!appsrc) {
+    std::cerr << name_ << ": no appsrc " << options_.appsrc << " to warm up."
+              << std::endl;
+    g_object_unref(media);
+    return nullptr;
+  }
+  g_object_set(G_OBJECT(appsrc), "caps", caps_, "is-live", TRUE,
+               "do-timestamp", TRUE, NULL);
+  gst_util_set_object_arg(G_OBJECT(appsrc), "format", "time");
+
+  PooledMedia *pooled = new PooledMedia();
+  pooled->media = media;
+  pooled->appsrc = appsrc;
+  pooled->blank = gst_buffer_new_allocate(NULL, frameBytes_, NULL);
+  gst_buffer_memset(pooled->blank, 0, 0, frameBytes_);
+  pooled->needData = g_signal_connect(
+      appsrc, "need-data", G_CALLBACK(&MediaPool::onWarmUpNeedData), pooled);
+
+  // Blocks until the first packets reach every stream
+  GstRTSPThread *thread = gst_rtsp_thread_pool_get_thread(
+      threads_, GST_RTSP_THREAD_TYPE_MEDIA, NULL);
+  if (!gst_rtsp_media_prepare(media, thread)) {
+    std::cerr << name_ << ": pooled media failed to prepare." << std::endl;
+    discard(pooled);
+    return nullptr;
+  }
+  Metrics::instance().observe("rgbd_media_prewarm_ms" + label_,
+                              elapsedMs(start), kSetupBoundsMs);
+  return pooled;
+}
+
+void MediaPool::onWarmUpNeedData(GstElement *appsrc, guint, gpointer data) {
+  PooledMedia *pooled = static_cast<PooledMedia *>(data);
+  // Enough frames for the encoder's lookahead to let the first packets out;
+  // a prepared media waits blocked for its client
+  if (gst_rtsp_media_get_status(pooled->media) ==
+      GST_RTSP_MEDIA_STATUS_PREPARING) {
+    gst_app_src_push_buffer(GST_APP_SRC(appsrc), gst_buffer_copy(pooled->blank));
+  }
+}
+
+void MediaPool::discard(PooledMedia *pooled) {
+  g_signal_handler_disconnect(pooled->appsrc, pooled->needData);
+  gst_rtsp_media_unprepare(pooled->media);
+  g_object_unref(pooled->media);
+  gst_object_unref(pooled->appsrc);
+  gst_buffer_unref(pooled->blank);
+  delete pooled;
+}
+
+} // namespace
+
+GstRTSPMediaFactory *newPooledMediaFactory(const std::string &name,
+                                           const MediaPoolOptions &options) {
+  RgbdPooledFactory *factory = static_cast<RgbdPooledFactory *>(
+      g_object_new(rgbd_pooled_factory_get_type(), NULL));
+  factory->pool = new MediaPool(name, options);
+  return GST_RTSP_MEDIA_FACTORY(factory);
+}
+
+void startMediaPool(GstRTSPMediaFactory *factory, GstRTSPServer *server,
+                    const std::string &path, GstCaps *caps) {
+  if (!G_TYPE_CHECK_INSTANCE_TYPE(factory, rgbd_pooled_factory_get_type())) {
+    return;
+  }
+  reinterpret_cast<RgbdPooledFactory *>(factory)->pool->start(factory, server,
+                                                              path, caps);
+}
@@ -0,0 +1,106 @@
+#include "gst_rgbd_server/metrics.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+Metrics &Metrics::instance() {
+  static Metrics metrics;
+  return metrics;
+}
+
+std::shared_ptr<std::atomic<double>> Metrics::share(const std::string &name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto &slot = gauges_[name];
+  if (!slot) {
+    slot = std::make_shared<std::atomic<double>>(0.0);
+  }
+  return slot;
+}
+
+void Metrics::add(const std::string &name, double delta) {
+  add(*share(name), delta);
+}
+
+void Metrics::add(std::atomic<double> &value, double delta) {
+  double current = value.load();
+  while (!value.compare_exchange_weak(current, current + delta)) {
+  }
+}
+
+void Metrics::observe(const std::string &name, double value,
+                      const std::vector<double> &bounds) {
+  // name{labels} -> name_bucket{labels,le="..."}, name_sum{labels}, ...
+  size_t brace = name.find('{');
+  std::string base = name.substr(0, brace);
+  std::string labels = brace == std::string::npos
+                           ? ""
+                           : name.substr(brace + 1, name.size() - brace - 2);
+  std::string prefix =
+      base + "_bucket{" + labels + (labels.empty() ? "" : ",");
+  for (double bound : bounds) {
+    std::ostringstream le;
+    le << bound;
+    std::shared_ptr<std::atomic<double>> bucket =
+        share(prefix + "le=\"" + le.str() + "\"}");
+    if (value <= bound) {
+      add(*bucket, 1);
+    }
+  }
+  std::string suffix = labels.empty() ? "" : "{" + labels + "}";
+  add(prefix + "le=\"+Inf\"}", 1);
+  add(base + "_sum" + suffix, value);
+  add(base + "_count" + suffix, 1);
+}
+
+void Metrics::remove(const std::string &label) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto it = gauges_.begin(); it != gauges_.end();) {
+    if (it->first.find(label) == std::string::npos) {
+      ++it;
+      continue;
+    }
+    it = gauges_.erase(it);
+  }
+}
+
+void Metrics::retain(const std::string &label) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++retained_[label];
+}
+
+void Metrics::release(const std::string &label) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = retained_.find(label);
+    if (it != retained_.end() && --it->second > 0) {
+      return;
+    }
+    if (it != retained_.end()) {
+      retained_.erase(it);
+    }
+  }
+  remove(label);
+}
+
+void Metrics::write(std::ostream &out) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto &gauge : gauges_) {
+    out << gauge.first << " " << gauge.second->load() << "\n";
+  }
+}
+
+bool Metrics::writeFile(const std::string &path) const {
+  std::string tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp);
+    if (!out) {
+      return false;
+    }
+    write(out);
+    if (!out) {
+      return false;
+    }
+  }
+  return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
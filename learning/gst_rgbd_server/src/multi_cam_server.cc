@@ -0,0 +1,101 @@
+#include <glib-unix.h>
+
+#include <csignal>
+#include <iostream>
+
+#include "gst_rgbd_server/multi_camera_manager.h"
+
+static gchar **cameraSpecs = nullptr;
+static gchar *host = nullptr;
+static gchar *port = nullptr;
+static gint udpBasePort = 0;
+static gint workers = 0;
+static gint width = 640;
+static gint height = 480;
+static gint fps = 30;
+static gint queueFrames = 2;
+static gchar *queueDrop = nullptr;
+
+static GOptionEntry entries[] = {
+    {"camera", 'c', 0, G_OPTION_ARG_STRING_ARRAY, &cameraSpecs,
+     "Camera to serve, repeatable: realsense[:SERIAL] or synthetic[:SEED] "
+     "(default: every connected RealSense)",
+     "SPEC"},
+    {"address", 'a', 0, G_OPTION_ARG_STRING, &host,
+     "RTSP host address (default: 127.0.0.1)", "HOST"},
+    {"port", 'p', 0, G_OPTION_ARG_STRING, &port,
+     "RTSP port (default: 8554)", "PORT"},
+    {"udp", 'u', 0, G_OPTION_ARG_INT, &udpBasePort,
+     "Send camera i over RTP/UDP to port BASE + i instead of RTSP", "BASE"},
+    {"workers", 'w', 0, G_OPTION_ARG_INT, &workers,
+     "Conversion threads shared by all cameras (default: one per core)", "N"},
+    {"width", 0, 0, G_OPTION_ARG_INT, &width, "Frame width", "W"},
+    {"height", 0, 0, G_OPTION_ARG_INT, &height, "Frame height", "H"},
+    {"fps", 0, 0, G_OPTION_ARG_INT, &fps, "Frame rate", "FPS"},
+    {"queue-frames", 0, 0, G_OPTION_ARG_INT, &queueFrames,
+     "Frames queued per encoder before the drop policy applies (default: 2)",
+     "N"},
+    {"queue-drop", 0, 0, G_OPTION_ARG_STRING, &queueDrop,
+     "Full encoder queue: drop-oldest, drop-newest or block "
+     "(default: drop-oldest)",
+     "POLICY"},
+    {NULL}};
+
+int main(int argc, char *argv[]) {
+    GError *error = NULL;
+    GOptionContext *optctx = g_option_context_new("- multi camera server");
+    g_option_context_add_main_entries(optctx, entries, NULL);
+    g_option_context_add_group(optctx, gst_init_get_option_group());
+    if (!g_option_context_parse(optctx, &argc, &argv, &error)) {
+        std::cerr << "Error parsing options: " << error->message << std::endl;
+        g_option_context_free(optctx);
+        g_clear_error(&error);
+        return -1;
+    }
+    g_option_context_free(optctx);
+
+    MultiCameraOptions options;
+    options.camera.width = width;
+    options.camera.height = height;
+    options.camera.fps = fps;
+    options.camera.depth = false;
+    options.camera.infrared = false;
+    options.camera.imu = false;
+    if (host) {
+        options.host = host;
+    }
+    if (port) {
+        options.port = port;
+    }
+    options.udpBasePort = udpBasePort;
+    options.workers = workers > 0 ? workers : 0;
+    options.queue.maxFrames = uint32_t(queueFrames > 0 ? queueFrames : 0);
+    if (queueDrop && !parseQueueDrop(queueDrop, options.queue.drop)) {
+        std::cerr << "Unknown queue policy: " << queueDrop << std::endl;
+        return -1;
+    }
+
+    MultiCameraManager manager(options);
+    if (cameraSpecs) {
+        for (gchar **spec = cameraSpecs; *spec; ++spec) {
+            if (!manager.addCamera(createCameraSource(*spec))) {
+                return -1;
+            }
+        }
+    } else if (manager.addConnectedRealSense() == 0) {
+        std::cerr << "No RealSense devices connected." << std::endl;
+        return -1;
+    }
+
+    if (!manager.start()) {
+        return -1;
+    }
+    g_unix_signal_add(SIGINT,
+                      [](gpointer manager) -> gboolean {
+                          static_cast<MultiCameraManager *>(manager)->stop();
+                          return G_SOURCE_REMOVE;
+                      },
+                      &manager);
+    manager.run();
+    return 0;
+}
@@ -0,0 +1,354 @@
+#include "gst_rgbd_server/multi_camera_manager.h"
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include "gst_rgbd_server/color_convert.h"
+#include "gst_rgbd_server/realsense_camera_source.h"
+
+namespace {
+
+// Y8 has no color, so the chroma planes are left neutral
+void grayToI420(const CameraImage &image, uint8_t *dst) {
+  const YuvPlanes planes = yuvPlanes(YuvLayout::kI420, image.width,
+                                     image.height);
+  int stride = image.stride > 0 ? image.stride : image.width;
+  const uint8_t *src = static_cast<const uint8_t *>(image.data);
+  for (int y = 0; y < image.height; ++y) {
+    memcpy(dst + size_t(y) * planes.stride[0], src + size_t(y) * stride,
+           image.width);
+  }
+  memset(dst + planes.offset[1], 128, planes.size - planes.offset[1]);
+}
+
+} // namespace
+
+MultiCameraManager::MultiCameraManager(const MultiCameraOptions &options)
+    : options_(options) {
+  // Conversions run on our pool, OpenCV's own threads would only compete
+  cv::setNumThreads(0);
+}
+
+MultiCameraManager::~MultiCameraManager() {
+  stop();
+  if (statsSource_) {
+    g_source_remove(statsSource_);
+  }
+  if (udpPipeline_) {
+    gst_element_set_state(udpPipeline_, GST_STATE_NULL);
+    gst_object_unref(udpPipeline_);
+  }
+  if (server_) {
+    g_object_unref(server_);
+  }
+  if (loop_) {
+    g_main_loop_unref(loop_);
+  }
+}
+
+size_t MultiCameraManager::addConnectedRealSense() {
+  size_t added = 0;
+  for (const std::string &serial : RealSenseCameraSource::enumerate()) {
+    if (addCamera(std::unique_ptr<CameraSource>(
+            new RealSenseCameraSource(serial)))) {
+      ++added;
+    }
+  }
+  return added;
+}
+
+bool MultiCameraManager::addCamera(std::unique_ptr<CameraSource> source) {
+  if (running_ || !source) {
+    return false;
+  }
+  std::unique_ptr<Camera> camera(new Camera);
+  camera->owner = this;
+  camera->index = cameras_.size();
+  camera->source = std::move(source);
+  cameras_.push_back(std::move(camera));
+  return true;
+}
+
+std::string MultiCameraManager::mountPath(size_t camera) const {
+  return "/cam/" + cameras_[camera]->source->serial();
+}
+
+GstCaps *MultiCameraManager::rawCaps(const Camera &camera) const {
+  const CameraConfig &config = camera.source->config();
+  return gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING, "I420",
+                             "width", G_TYPE_INT, config.width, "height",
+                             G_TYPE_INT, config.height, "framerate",
+                             GST_TYPE_FRACTION, config.fps, 1, NULL);
+}
+
+std::string MultiCameraManager::encodeBranch(size_t camera) const {
+  // Split the cores between the encoders instead of letting each x264
+  // instance size its own thread pool to the whole machine
+  size_t threads =
+      std::max<size_t>(1, WorkerPool::hardwareThreads() / cameras_.size());
+  std::ostringstream branch;
+  branch << "appsrc name=src" << camera
+         << " is-live=true do-timestamp=true format=time"
+         << " ! x264enc tune=zerolatency speed-preset=ultrafast threads="
+         << threads << " ! rtph264pay config-interval=1 pt=96";
+  return branch.str();
+}
+
+bool MultiCameraManager::start() {
+  if (cameras_.empty()) {
+    std::cerr << "No cameras to start." << std::endl;
+    return false;
+  }
+  for (auto &camera : cameras_) {
+    if (!camera->source->start(options_.camera)) {
+      std::cerr << "Failed to start camera " << camera->source->serial()
+                << std::endl;
+      return false;
+    }
+  }
+
+  pool_.reset(new WorkerPool(options_.workers, 2 * cameras_.size()));
+  loop_ = g_main_loop_new(NULL, FALSE);
+  if (!(options_.udpBasePort > 0 ? startUdp() : startRtsp())) {
+    return false;
+  }
+  statsSource_ = g_timeout_add_seconds(5, &MultiCameraManager::reportStats,
+                                       this);
+
+  running_ = true;
+  for (auto &camera : cameras_) {
+    Camera *cam = camera.get();
+    cam->thread = std::thread([this, cam] { captureLoop(*cam); });
+  }
+  return true;
+}
+
+bool MultiCameraManager::startRtsp() {
+  server_ = gst_rtsp_server_new();
+  g_object_set(server_, "address", options_.host.c_str(), "service",
+               options_.port.c_str(), NULL);
+  GstRTSPMountPoints *mounts = gst_rtsp_server_get_mount_points(server_);
+
+  for (auto &camera : cameras_) {
+    GstRTSPMediaFactory *factory = gst_rtsp_media_factory_new();
+    std::string launch = "( " + encodeBranch(camera->index) + " name=pay0 )";
+    gst_rtsp_media_factory_set_launch(factory, launch.c_str());
+    // All clients of a camera share one encoder
+    gst_rtsp_media_factory_set_shared(factory, TRUE);
+    g_signal_connect(
+        factory, "media-configure",
+        G_CALLBACK(+[](GstRTSPMediaFactory *, GstRTSPMedia *media,
+                       gpointer user_data) {
+          Camera *camera = static_cast<Camera *>(user_data);
+          GstElement *element = gst_rtsp_media_get_element(media);
+          std::string name = "src" + std::to_string(camera->index);
+          GstElement *appsrc =
+              gst_bin_get_by_name_recurse_up(GST_BIN(element), name.c_str());
+          camera->owner->addSink(*camera, appsrc);
+          g_signal_connect(media, "unprepared",
+                           G_CALLBACK(+[](GstRTSPMedia *, gpointer appsrc) {
+                             Camera *camera = static_cast<Camera *>(
+                                 g_object_get_data(G_OBJECT(appsrc), "camera"));
+                             camera->owner->removeSink(
+                                 *camera, static_cast<GstElement *>(appsrc));
+                           }),
+                           appsrc);
+          gst_object_unref(appsrc);
+          gst_object_unref(element);
+        }),
+        camera.get());
+    std::string path = mountPath(camera->index);
+    gst_rtsp_mount_points_add_factory(mounts, path.c_str(), factory);
+    std::cout << "Camera " << camera->source->serial() << " at rtsp://"
+              << options_.host << ":" << options_.port << path << std::endl;
+  }
+  g_object_unref(mounts);
+
+  if (gst_rtsp_server_attach(server_, NULL) == 0) {
+    std::cerr << "Failed to attach the RTSP server." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool MultiCameraManager::startUdp() {
+  // One pipeline, one branch per camera: a single bus and clock for all
+  std::ostringstream launch;
+  for (auto &camera : cameras_) {
+    int port = options_.udpBasePort + int(camera->index);
+    launch << encodeBranch(camera->index) << " ! udpsink host="
+           << options_.udpHost << " port=" << port << " sync=false ";
+    std::cout << "Camera " << camera->source->serial() << " at udp://"
+              << options_.udpHost << ":" << port << std::endl;
+  }
+  GError *error = NULL;
+  udpPipeline_ = gst_parse_launch(launch.str().c_str(), &error);
+  if (!udpPipeline_) {
+    std::cerr << "Failed to create the UDP pipeline: " << error->message
+              << std::endl;
+    g_clear_error(&error);
+    return false;
+  }
+  for (auto &camera : cameras_) {
+    std::string name = "src" + std::to_string(camera->index);
+    GstElement *appsrc =
+        gst_bin_get_by_name(GST_BIN(udpPipeline_), name.c_str());
+    addSink(*camera, appsrc);
+    gst_object_unref(appsrc);
+  }
+  return gst_element_set_state(udpPipeline_, GST_STATE_PLAYING) !=
+         GST_STATE_CHANGE_FAILURE;
+}
+
+void MultiCameraManager::addSink(Camera &camera, GstElement *appsrc) {
+  GstCaps *caps = rawCaps(camera);
+  g_object_set(G_OBJECT(appsrc), "caps", caps, NULL);
+  gst_caps_unref(caps);
+  g_object_set_data(G_OBJECT(appsrc), "camera", &camera);
+
+  std::lock_guard<std::mutex> lock(camera.sinksMutex);
+  camera.sinks.emplace_back(
+      new AppSrcQueue(appsrc, mountPath(camera.index), options_.queue));
+}
+
+void MultiCameraManager::removeSink(Camera &camera, GstElement *appsrc) {
+  std::lock_guard<std::mutex> lock(camera.sinksMutex);
+  auto it = std::find_if(camera.sinks.begin(), camera.sinks.end(),
+                         [appsrc](const std::unique_ptr<AppSrcQueue> &sink) {
+                           return sink->element() == appsrc;
+                         });
+  if (it != camera.sinks.end()) {
+    camera.sinks.erase(it);
+  }
+}
+
+void MultiCameraManager::run() {
+  if (running_) {
+    g_main_loop_run(loop_);
+  }
+}
+
+void MultiCameraManager::stop() {
+  if (!running_.exchange(false)) {
+    return;
+  }
+  for (auto &camera : cameras_) {
+    if (camera->thread.joinable()) {
+      camera->thread.join();
+    }
+  }
+  // Finish queued conversions before the cameras release their frames
+  pool_.reset();
+  for (auto &camera : cameras_) {
+    camera->source->stop();
+  }
+  if (loop_) {
+    g_main_loop_quit(loop_);
+  }
+}
+
+void MultiCameraManager::captureLoop(Camera &camera) {
+  while (running_) {
+    CameraFrameSet frames;
+    if (!camera.source->waitForFrames(frames, 1000)) {
+      continue;
+    }
+    ++camera.captured;
+    {
+      // Nobody to serve, skip the conversion entirely
+      std::lock_guard<std::mutex> lock(camera.sinksMutex);
+      if (camera.sinks.empty()) {
+        continue;
+      }
+    }
+    // Still converting the previous frame: drop instead of queueing latency
+    if (camera.converting.exchange(true)) {
+      ++camera.dropped;
+      continue;
+    }
+    Camera *cam = &camera;
+    bool queued = pool_->trySubmit([this, cam, frames] {
+      convertAndPush(*cam, frames);
+      cam->converting = false;
+    });
+    if (!queued) {
+      camera.converting = false;
+      ++camera.dropped;
+    }
+  }
+}
+
+void MultiCameraManager::convertAndPush(Camera &camera,
+                                        const CameraFrameSet &frames) {
+  const CameraImage &color = frames.color;
+  if (!color) {
+    return;
+  }
+
+  CameraImage image = color;
+  if (color.format == RgbdPixelFormat::kRGBA8) {
+    camera.rgbScratch.resize(size_t(color.width) * 3 * color.height);
+    int stride = color.stride > 0 ? color.stride : color.width * 4;
+    cv::Mat src(color.height, color.width, CV_8UC4,
+                const_cast<void *>(color.data), stride);
+    cv::Mat rgb(color.height, color.width, CV_8UC3, camera.rgbScratch.data());
+    cv::cvtColor(src, rgb, cv::COLOR_RGBA2RGB);
+    image.format = RgbdPixelFormat::kRGB8;
+    image.data = camera.rgbScratch.data();
+    image.stride = color.width * 3;
+  } else if (color.format != RgbdPixelFormat::kY8 &&
+             !ColorConverter::canConvert(color.format)) {
+    if (!camera.formatReported) {
+      std::cerr << camera.source->serial() << ": color format "
+                << uint32_t(color.format) << " can not be encoded"
+                << std::endl;
+      camera.formatReported = true;
+    }
+    ++camera.dropped;
+    return;
+  }
+
+  // Convert straight into the buffer handed to the encoder, laid out as
+  // GStreamer lays out I420 of this size: rows padded to 4 bytes, odd
+  // sizes rounded up for the chroma planes
+  const YuvPlanes planes =
+      yuvPlanes(YuvLayout::kI420, image.width, image.height);
+  GstBuffer *buffer = gst_buffer_new_allocate(NULL, planes.size, NULL);
+  GstMapInfo map;
+  if (!gst_buffer_map(buffer, &map, GST_MAP_WRITE)) {
+    gst_buffer_unref(buffer);
+    return;
+  }
+  if (image.format == RgbdPixelFormat::kY8) {
+    grayToI420(image, map.data);
+  } else {
+    static const ColorConverter converter(YuvLayout::kI420,
+                                          YuvMatrix::kBT601);
+    converter.convert(image, map.data);
+  }
+  gst_buffer_unmap(buffer, &map);
+
+  {
+    std::lock_guard<std::mutex> lock(camera.sinksMutex);
+    for (auto &sink : camera.sinks) {
+      sink->push(gst_buffer_ref(buffer));
+    }
+  }
+  gst_buffer_unref(buffer);
+  ++camera.pushed;
+}
+
+gboolean MultiCameraManager::reportStats(gpointer user_data) {
+  MultiCameraManager *self = static_cast<MultiCameraManager *>(user_data);
+  for (auto &camera : self->cameras_) {
+    std::cout << camera->source->serial() << ": captured "
+              << camera->captured.load() << ", pushed "
+              << camera->pushed.load() << ", dropped "
+              << camera->dropped.load() << std::endl;
+  }
+  return G_SOURCE_CONTINUE;
+}
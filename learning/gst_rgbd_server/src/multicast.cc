@@ -0,0 +1,77 @@
+#include "gst_rgbd_server/multicast.h"
+
+#include <cstdlib>
+#include <iostream>
+
+namespace {
+
+bool parsePort(const std::string &text, guint16 &port) {
+  char *end = nullptr;
+  long value = std::strtol(text.c_str(), &end, 10);
+  if (text.empty() || *end || value <= 0 || value > 65535) {
+    return false;
+  }
+  port = guint16(value);
+  return true;
+}
+
+} // namespace
+
+bool parseMulticast(const std::string &spec, MulticastOptions &options) {
+  std::string addresses = spec;
+  size_t colon = spec.find(':');
+  if (colon != std::string::npos) {
+    addresses = spec.substr(0, colon);
+    std::string ports = spec.substr(colon + 1);
+    size_t dash = ports.find('-');
+    if (dash == std::string::npos ||
+        !parsePort(ports.substr(0, dash), options.firstPort) ||
+        !parsePort(ports.substr(dash + 1), options.lastPort) ||
+        options.lastPort < options.firstPort) {
+      return false;
+    }
+  }
+  size_t dash = addresses.find('-');
+  options.firstAddress = addresses.substr(0, dash);
+  options.lastAddress = dash == std::string::npos ? options.firstAddress
+                                                  : addresses.substr(dash + 1);
+  return !options.firstAddress.empty() && !options.lastAddress.empty();
+}
+
+GstRTSPAddressPool *newMulticastPool(const MulticastOptions &options) {
+  if (!options.enabled()) {
+    return nullptr;
+  }
+  GstRTSPAddressPool *pool = gst_rtsp_address_pool_new();
+  if (!gst_rtsp_address_pool_add_range(
+          pool, options.firstAddress.c_str(), options.lastAddress.c_str(),
+          options.firstPort, options.lastPort, options.ttl)) {
+    std::cerr << "Invalid multicast range " << options.firstAddress << "-"
+              << options.lastAddress << ", serving unicast." << std::endl;
+    g_object_unref(pool);
+    return nullptr;
+  }
+  return pool;
+}
+
+void applyMulticast(GstRTSPMediaFactory *factory,
+                    const MulticastOptions &options, GstRTSPAddressPool *pool) {
+  if (!pool) {
+    return;
+  }
+  gst_rtsp_media_factory_set_address_pool(factory, pool);
+
+  GstRTSPLowerTrans protocols = GST_RTSP_LOWER_TRANS_UDP_MCAST;
+  if (options.unicastFallback) {
+    protocols = GstRTSPLowerTrans(protocols | GST_RTSP_LOWER_TRANS_UDP |
+                                  GST_RTSP_LOWER_TRANS_TCP);
+  }
+  gst_rtsp_media_factory_set_protocols(factory, protocols);
+  // A client's transport may ask for a larger ttl, which must not leak the
+  // stream past the network it was meant for
+  gst_rtsp_media_factory_set_max_mcast_ttl(factory, options.ttl);
+  if (!options.iface.empty()) {
+    gst_rtsp_media_factory_set_multicast_iface(factory,
+                                               options.iface.c_str());
+  }
+}
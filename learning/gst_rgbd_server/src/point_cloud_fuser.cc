@@ -0,0 +1,162 @@
+#include "gst_rgbd_server/point_cloud_fuser.h"
+
+#include <json/json.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+bool loadCameraExtrinsics(const std::string &path,
+                          std::map<std::string, CameraExtrinsics> &out) {
+  std::ifstream file(path);
+  if (!file) {
+    std::cerr << "Cannot open extrinsics file " << path << std::endl;
+    return false;
+  }
+  Json::Value root;
+  Json::CharReaderBuilder builder;
+  std::string errors;
+  if (!Json::parseFromStream(builder, file, &root, &errors)) {
+    std::cerr << "Invalid extrinsics file " << path << ": " << errors
+              << std::endl;
+    return false;
+  }
+  for (const Json::Value &camera : root["cameras"]) {
+    const Json::Value &matrix = camera["world_from_camera"];
+    if (!camera["serial"].isString() || !matrix.isArray() ||
+        matrix.size() != 16) {
+      std::cerr << "Extrinsics entries need a serial and 16 matrix values"
+                << std::endl;
+      return false;
+    }
+    CameraExtrinsics extrinsics;
+    for (Json::ArrayIndex i = 0; i < 16; ++i) {
+      extrinsics.matrix[i] = matrix[i].asFloat();
+    }
+    out[camera["serial"].asString()] = extrinsics;
+  }
+  return true;
+}
+
+PointCloudFuser::PointCloudFuser(WorkerPool &pool,
+                                 std::vector<FusionCamera> cameras,
+                                 const Options &options)
+    : pool_(pool), cameras_(std::move(cameras)), options_(options) {
+  options_.step = std::max(1, options_.step);
+  // Bands start on the sampling grid so banding does not change the cloud
+  options_.rowsPerBand = std::max(options_.step, options_.rowsPerBand);
+  options_.rowsPerBand -= options_.rowsPerBand % options_.step;
+}
+
+void PointCloudFuser::depthRange(const FusionCamera &camera,
+                                 uint16_t &minUnits,
+                                 uint16_t &maxUnits) const {
+  // zero depth means no measurement; clamped before converting, a float out
+  // of uint16_t range does not convert
+  minUnits = uint16_t(
+      std::min(65535.f, std::max(1.f, options_.minDepth / camera.depthScale)));
+  maxUnits = uint16_t(
+      std::min(65535.f, std::max(0.f, options_.maxDepth / camera.depthScale)));
+}
+
+size_t PointCloudFuser::countBand(const CameraFrameSet &frames,
+                                  const Band &band) const {
+  const FusionCamera &camera = cameras_[band.camera];
+  const CameraImage &depth = frames.depth;
+  uint16_t minUnits, maxUnits;
+  depthRange(camera, minUnits, maxUnits);
+  size_t count = 0;
+  for (int v = band.rowBegin; v < band.rowEnd; v += options_.step) {
+    const uint16_t *row = reinterpret_cast<const uint16_t *>(
+        static_cast<const uint8_t *>(depth.data) + size_t(v) * depth.stride);
+    for (int u = 0; u < depth.width; u += options_.step) {
+      count += row[u] >= minUnits && row[u] <= maxUnits;
+    }
+  }
+  return count;
+}
+
+void PointCloudFuser::fillBand(const CameraFrameSet &frames, const Band &band,
+                               FusedCloud &cloud) const {
+  const FusionCamera &camera = cameras_[band.camera];
+  const CameraImage &depth = frames.depth;
+  const CameraImage &color = frames.color;
+  const bool hasColor = color && color.width == depth.width &&
+                        color.height == depth.height &&
+                        color.format != RgbdPixelFormat::kYUYV &&
+                        color.format != RgbdPixelFormat::kUYVY;
+  const int colorBpp = color.format == RgbdPixelFormat::kRGBA8 ? 4 : 3;
+  const bool bgr = color.format == RgbdPixelFormat::kBGR8;
+
+  uint16_t minUnits, maxUnits;
+  depthRange(camera, minUnits, maxUnits);
+  const RgbdIntrinsics &in = camera.depthIntrinsics;
+  const float *m = camera.extrinsics.matrix;
+
+  float *xyz = cloud.xyz.data() + band.offset * 3;
+  uint8_t *rgb = cloud.rgb.data() + band.offset * 3;
+  for (int v = band.rowBegin; v < band.rowEnd; v += options_.step) {
+    const uint16_t *row = reinterpret_cast<const uint16_t *>(
+        static_cast<const uint8_t *>(depth.data) + size_t(v) * depth.stride);
+    const uint8_t *colorRow =
+        hasColor ? static_cast<const uint8_t *>(color.data) +
+                       size_t(v) * color.stride
+                 : nullptr;
+    const float y = (v - in.centerY) / in.fy;
+    for (int u = 0; u < depth.width; u += options_.step) {
+      uint16_t units = row[u];
+      if (units < minUnits || units > maxUnits) {
+        continue;
+      }
+      // Deproject, then world = M * p with M column-major
+      float z = units * camera.depthScale;
+      float px = (u - in.centerX) / in.fx * z;
+      float py = y * z;
+      xyz[0] = m[0] * px + m[4] * py + m[8] * z + m[12];
+      xyz[1] = m[1] * px + m[5] * py + m[9] * z + m[13];
+      xyz[2] = m[2] * px + m[6] * py + m[10] * z + m[14];
+      xyz += 3;
+
+      if (colorRow) {
+        const uint8_t *c = colorRow + size_t(u) * colorBpp;
+        rgb[0] = bgr ? c[2] : c[0];
+        rgb[1] = c[1];
+        rgb[2] = bgr ? c[0] : c[2];
+      } else {
+        rgb[0] = rgb[1] = rgb[2] = 255;
+      }
+      rgb += 3;
+    }
+  }
+}
+
+void PointCloudFuser::fuse(const std::vector<CameraFrameSet> &frames,
+                           FusedCloud &cloud) {
+  bands_.clear();
+  cloud.timestampNs = 0;
+  for (size_t i = 0; i < frames.size() && i < cameras_.size(); ++i) {
+    const CameraImage &depth = frames[i].depth;
+    if (!depth || depth.format != RgbdPixelFormat::kZ16) {
+      continue;
+    }
+    cloud.timestampNs = std::max(cloud.timestampNs, frames[i].timestampNs);
+    for (int row = 0; row < depth.height; row += options_.rowsPerBand) {
+      int rowEnd = std::min(depth.height, row + options_.rowsPerBand);
+      bands_.push_back(Band{i, row, rowEnd, 0, 0});
+    }
+  }
+
+  pool_.parallelFor(bands_.size(), [&](size_t b) {
+    bands_[b].count = countBand(frames[bands_[b].camera], bands_[b]);
+  });
+  size_t total = 0;
+  for (Band &band : bands_) {
+    band.offset = total;
+    total += band.count;
+  }
+  cloud.xyz.resize(total * 3);
+  cloud.rgb.resize(total * 3);
+  pool_.parallelFor(bands_.size(), [&](size_t b) {
+    fillBand(frames[bands_[b].camera], bands_[b], cloud);
+  });
+}
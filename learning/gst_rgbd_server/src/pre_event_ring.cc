@@ -0,0 +1,463 @@
+#include "gst_rgbd_server/pre_event_ring.h"
+
+#include <gst/app/gstappsrc.h>
+#include <glib-unix.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <iostream>
+
+#include "gst_rgbd_server/metrics.h"
+
+namespace {
+
+// Roughly one entry per 2 KiB of budget, enough for every frame of a
+// stream at a few hundred kbit/s; smaller frames run out of entries first,
+// which only shortens the pre-roll
+const size_t kBytesPerEntry = 2048;
+const size_t kMinEntries = 64;
+// A timestamp going back further than this means the encoder was rebuilt
+const GstClockTimeDiff kMaxBackwardsNs = GST_SECOND;
+
+gint64 steadyNowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+const char *parserFor(VideoCodec codec) {
+  switch (codec) {
+  case VideoCodec::kH264:
+    return "h264parse";
+  case VideoCodec::kH265:
+    return "h265parse";
+  case VideoCodec::kVP8:
+    break;
+  }
+  return "identity";
+}
+
+} // namespace
+
+PreEventRing::PreEventRing(size_t budgetBytes, const std::string &directory)
+    : directory_(directory.empty() ? "." : directory),
+      buffered_(Metrics::instance().gauge("rgbd_preevent_buffered_seconds")),
+      events_(Metrics::instance().gauge("rgbd_preevent_events_total")),
+      skipped_(Metrics::instance().gauge("rgbd_preevent_skipped_total")) {
+  size_t entryCount = std::max(kMinEntries, budgetBytes / kBytesPerEntry);
+  size_t indexBytes = entryCount * sizeof(Entry);
+  entries_.resize(entryCount);
+  arena_.resize(budgetBytes > indexBytes ? budgetBytes - indexBytes : 0);
+  writer_ = std::thread(&PreEventRing::run, this);
+}
+
+PreEventRing::~PreEventRing() {
+  if (signalSource_) {
+    g_source_remove(signalSource_);
+  }
+  for (int track = 0; track < trackCount_; ++track) {
+    detach(track);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  writer_.join();
+  for (int track = 0; track < trackCount_; ++track) {
+    if (tracks_[track].caps) {
+      gst_caps_unref(tracks_[track].caps);
+    }
+  }
+}
+
+int PreEventRing::addTrack(const std::string &name, VideoCodec codec) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (trackCount_ == kMaxTracks) {
+    return -1;
+  }
+  tracks_[trackCount_].name = name;
+  tracks_[trackCount_].codec = codec;
+  return trackCount_++;
+}
+
+void PreEventRing::attach(int track, GstPad *pad) {
+  if (track < 0 || track >= trackCount_ || !pad) {
+    return;
+  }
+  detach(track);
+  std::lock_guard<std::mutex> lock(mutex_);
+  Track &t = tracks_[track];
+  t.pad = GST_PAD(gst_object_ref(pad));
+  // Buffered frames of the old pad stay, a new pad starts with a keyframe
+  t.probe = gst_pad_add_probe(
+      t.pad,
+      GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER |
+                      GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+      &PreEventRing::onEncoded, this, NULL);
+  GstCaps *caps = gst_pad_get_current_caps(t.pad);
+  if (caps) {
+    gst_caps_replace(&t.caps, caps);
+    gst_caps_unref(caps);
+  }
+}
+
+void PreEventRing::detach(int track, GstPad *pad) {
+  if (track < 0 || track >= trackCount_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  Track &t = tracks_[track];
+  if (!t.pad || (pad && pad != t.pad)) {
+    return;
+  }
+  gst_pad_remove_probe(t.pad, t.probe);
+  gst_object_unref(t.pad);
+  t.pad = nullptr;
+  t.probe = 0;
+}
+
+void PreEventRing::attach(int track, GstRTSPMedia *media,
+                          GstElement *encoder) {
+  GstPad *pad = gst_element_get_static_pad(encoder, "src");
+  if (!pad) {
+    return;
+  }
+  attach(track, pad);
+  std::string key = "pre-event-pad-" + std::to_string(track);
+  g_object_set_data_full(G_OBJECT(media), key.c_str(), pad, gst_object_unref);
+  g_object_set_data(G_OBJECT(media), "pre-event-ring", this);
+  g_signal_connect(media, "unprepared",
+                   G_CALLBACK(+[](GstRTSPMedia *media, gpointer track) {
+                     PreEventRing *ring = static_cast<PreEventRing *>(
+                         g_object_get_data(G_OBJECT(media), "pre-event-ring"));
+                     std::string key = "pre-event-pad-" +
+                                       std::to_string(GPOINTER_TO_INT(track));
+                     ring->detach(GPOINTER_TO_INT(track),
+                                  static_cast<GstPad *>(g_object_get_data(
+                                      G_OBJECT(media), key.c_str())));
+                   }),
+                   GINT_TO_POINTER(track));
+}
+
+GstPadProbeReturn PreEventRing::onEncoded(GstPad *pad, GstPadProbeInfo *info,
+                                          gpointer user_data) {
+  PreEventRing *ring = static_cast<PreEventRing *>(user_data);
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+    ring->push(pad, GST_PAD_PROBE_INFO_BUFFER(info));
+    return GST_PAD_PROBE_OK;
+  }
+  GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+  if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+    GstCaps *caps = NULL;
+    gst_event_parse_caps(event, &caps);
+    std::lock_guard<std::mutex> lock(ring->mutex_);
+    int track = ring->findTrack(pad);
+    if (track >= 0) {
+      gst_caps_replace(&ring->tracks_[track].caps, caps);
+    }
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+int PreEventRing::findTrack(GstPad *pad) const {
+  for (int track = 0; track < trackCount_; ++track) {
+    if (tracks_[track].pad == pad) {
+      return track;
+    }
+  }
+  return -1;
+}
+
+void PreEventRing::push(GstPad *pad, GstBuffer *frame) {
+  size_t size = gst_buffer_get_size(frame);
+  if (!size || size > arena_.size()) {
+    return;
+  }
+  gint64 now = steadyNowNs();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // A probe call racing detach() finds its pad gone
+    int track = findTrack(pad);
+    if (track < 0) {
+      return;
+    }
+    if (count_ == entries_.size()) {
+      evictFront();
+    }
+    size_t offset = 0;
+    if (!reserve(size, offset)) {
+      return;
+    }
+    gst_buffer_extract(frame, 0, &arena_[offset], size);
+    Entry &e = entry(count_);
+    e.seq = nextSeq_++;
+    e.offset = offset;
+    e.size = size;
+    e.track = track;
+    e.keyframe = !GST_BUFFER_FLAG_IS_SET(frame, GST_BUFFER_FLAG_DELTA_UNIT);
+    e.pts = GST_BUFFER_PTS(frame);
+    e.dts = GST_BUFFER_DTS(frame);
+    e.duration = GST_BUFFER_DURATION(frame);
+    e.hostNs = now;
+    ++count_;
+    writePos_ = offset + size;
+    buffered_ = (now - entry(0).hostNs) / 1e9;
+  }
+  wake_.notify_one();
+}
+
+// Free space is [writePos_, end) and [0, oldest) while the data does not
+// wrap, [writePos_, oldest) while it does.
+bool PreEventRing::reserve(size_t size, size_t &offset) {
+  while (count_) {
+    size_t oldest = entry(0).offset;
+    if (writePos_ > oldest) {
+      if (arena_.size() - writePos_ >= size) {
+        offset = writePos_;
+        return true;
+      }
+      if (oldest >= size) {
+        offset = 0;
+        return true;
+      }
+    } else if (oldest - writePos_ >= size) {
+      offset = writePos_;
+      return true;
+    }
+    evictFront();
+  }
+  writePos_ = 0;
+  offset = 0;
+  return size <= arena_.size();
+}
+
+void PreEventRing::evictFront() {
+  tracks_[entry(0).track].broken = true;
+  head_ = (head_ + 1) % entries_.size();
+  --count_;
+  // The rest of a broken GOP goes as soon as it reaches the front
+  while (count_) {
+    Track &t = tracks_[entry(0).track];
+    if (entry(0).keyframe) {
+      t.broken = false;
+      break;
+    }
+    if (!t.broken) {
+      break;
+    }
+    head_ = (head_ + 1) % entries_.size();
+    --count_;
+  }
+}
+
+void PreEventRing::trigger() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    gint64 now = steadyNowNs();
+    if (eventEndNs_) {
+      // Already writing: keep going as long after this trigger
+      gint64 span = count_ ? now - entry(0).hostNs : 0;
+      eventEndNs_ = std::max(eventEndNs_, now + span);
+      return;
+    }
+    // Set with the trigger, so one arriving before the writer starts
+    // extends this event instead of queueing another
+    triggerNs_ = now;
+    eventEndNs_ = now + (count_ ? now - entry(0).hostNs : 0);
+  }
+  Metrics::add(events_, 1);
+  wake_.notify_all();
+}
+
+void PreEventRing::triggerOnSignal(int signum) {
+  signalSource_ = g_unix_signal_add(
+      signum,
+      [](gpointer ring) -> gboolean {
+        static_cast<PreEventRing *>(ring)->trigger();
+        return G_SOURCE_CONTINUE;
+      },
+      this);
+}
+
+void PreEventRing::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_) {
+    if (!triggerNs_) {
+      wake_.wait(lock);
+      continue;
+    }
+    triggerNs_ = 0;
+    lock.unlock();
+    writeEvent();
+    lock.lock();
+  }
+}
+
+void PreEventRing::writeEvent() {
+  // Milliseconds keep events of the same second apart
+  char stamp[32];
+  gint64 nowUs = g_get_real_time();
+  time_t now = time_t(nowUs / 1000000);
+  struct tm local;
+  localtime_r(&now, &local);
+  size_t length = strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &local);
+  snprintf(stamp + length, sizeof(stamp) - length, ".%03d",
+           int(nowUs / 1000 % 1000));
+  std::string path = directory_ + "/event-" + stamp + ".mkv";
+
+  // One Matroska file, a video track per ring track that has seen caps
+  std::string launch =
+      "matroskamux name=mux ! filesink location=\"" + path + "\"";
+  GstCaps *caps[kMaxTracks] = {};
+  uint64_t cursor = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int track = 0; track < trackCount_; ++track) {
+      if (!tracks_[track].caps) {
+        continue;
+      }
+      caps[track] = gst_caps_ref(tracks_[track].caps);
+      launch += " appsrc name=track" + std::to_string(track) +
+                " format=time ! " + parserFor(tracks_[track].codec) +
+                " ! mux.";
+    }
+    if (!count_) {
+      std::cerr << "Event triggered with nothing buffered." << std::endl;
+      eventEndNs_ = 0;
+      for (GstCaps *c : caps) {
+        if (c) {
+          gst_caps_unref(c);
+        }
+      }
+      return;
+    }
+    cursor = entry(0).seq;
+  }
+
+  GError *error = NULL;
+  GstElement *pipeline = gst_parse_launch(launch.c_str(), &error);
+  GstElement *sources[kMaxTracks] = {};
+  if (pipeline && !error) {
+    for (int track = 0; track < kMaxTracks; ++track) {
+      if (caps[track]) {
+        sources[track] = gst_bin_get_by_name(
+            GST_BIN(pipeline), ("track" + std::to_string(track)).c_str());
+        g_object_set(G_OBJECT(sources[track]), "caps", caps[track], NULL);
+      }
+    }
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    std::cout << "Writing event to " << path << std::endl;
+  } else {
+    std::cerr << "Cannot write event " << path << ": "
+              << (error ? error->message : "no pipeline") << std::endl;
+    if (error) {
+      g_error_free(error);
+    }
+  }
+  for (GstCaps *c : caps) {
+    if (c) {
+      gst_caps_unref(c);
+    }
+  }
+
+  // Per track: waiting for a keyframe, and the offset putting its first
+  // written frame at 0 with every track on the same timeline
+  bool needKeyframe[kMaxTracks];
+  std::fill(std::begin(needKeyframe), std::end(needKeyframe), true);
+  GstClockTimeDiff offset[kMaxTracks] = {};
+  GstClockTime lastOut[kMaxTracks] = {};
+  GstClockTime base = GST_CLOCK_TIME_NONE;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_ && pipeline) {
+    if (!count_ || cursor > entry(count_ - 1).seq) {
+      if (steadyNowNs() >= eventEndNs_) {
+        break;
+      }
+      wake_.wait_for(lock, std::chrono::milliseconds(100));
+      continue;
+    }
+    uint64_t oldest = entry(0).seq;
+    if (cursor < oldest) {
+      // Overwritten before it was written out
+      Metrics::add(skipped_, double(oldest - cursor));
+      cursor = oldest;
+      std::fill(std::begin(needKeyframe), std::end(needKeyframe), true);
+    }
+    const Entry e = entry(size_t(cursor - oldest));
+    if (e.hostNs > eventEndNs_) {
+      break;
+    }
+    ++cursor;
+    if (!sources[e.track] || (needKeyframe[e.track] && !e.keyframe)) {
+      continue;
+    }
+    needKeyframe[e.track] = false;
+    GstBuffer *buffer = gst_buffer_new_allocate(NULL, e.size, NULL);
+    gst_buffer_fill(buffer, 0, &arena_[e.offset], e.size);
+    lock.unlock();
+
+    GstClockTime start = GST_CLOCK_TIME_IS_VALID(e.dts) ? e.dts : e.pts;
+    if (!GST_CLOCK_TIME_IS_VALID(base)) {
+      base = start;
+      for (GstClockTimeDiff &o : offset) {
+        o = -GstClockTimeDiff(base);
+      }
+    }
+    if (GstClockTimeDiff(start) + offset[e.track] <
+        GstClockTimeDiff(lastOut[e.track]) - kMaxBackwardsNs) {
+      // A rebuilt encoder restarted its timestamps, continue after the last
+      offset[e.track] =
+          GstClockTimeDiff(lastOut[e.track]) - GstClockTimeDiff(start);
+    }
+    auto shift = [&](GstClockTime t) {
+      return GST_CLOCK_TIME_IS_VALID(t)
+                 ? GstClockTime(std::max<GstClockTimeDiff>(
+                       0, GstClockTimeDiff(t) + offset[e.track]))
+                 : GST_CLOCK_TIME_NONE;
+    };
+    GST_BUFFER_PTS(buffer) = shift(e.pts);
+    GST_BUFFER_DTS(buffer) = shift(e.dts);
+    GST_BUFFER_DURATION(buffer) = e.duration;
+    if (!e.keyframe) {
+      GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    }
+    lastOut[e.track] = shift(start);
+    gst_app_src_push_buffer(GST_APP_SRC(sources[e.track]), buffer);
+    lock.lock();
+  }
+  eventEndNs_ = 0;
+  lock.unlock();
+
+  if (!pipeline) {
+    return;
+  }
+  for (GstElement *source : sources) {
+    if (source) {
+      gst_app_src_end_of_stream(GST_APP_SRC(source));
+    }
+  }
+  GstBus *bus = gst_element_get_bus(pipeline);
+  GstMessage *message = gst_bus_timed_pop_filtered(
+      bus, 10 * GST_SECOND,
+      GstMessageType(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+  if (message) {
+    if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR) {
+      std::cerr << "Writing event " << path << " failed." << std::endl;
+    } else {
+      std::cout << "Event written to " << path << std::endl;
+    }
+    gst_message_unref(message);
+  }
+  gst_object_unref(bus);
+  gst_element_set_state(pipeline, GST_STATE_NULL);
+  for (GstElement *source : sources) {
+    if (source) {
+      gst_object_unref(source);
+    }
+  }
+  gst_object_unref(pipeline);
+}
@@ -0,0 +1,69 @@
+#include "gst_rgbd_server/rate_controller.h"
+
+#include <algorithm>
+
+RateController::RateController(const RateControllerOptions &options)
+    : options_(options) {
+  options_.maxKbps = std::max(options_.minKbps, options_.maxKbps);
+  rate_ = std::min(std::max(options_.startKbps, options_.minKbps),
+                   options_.maxKbps);
+  decision_.bitrateKbps = uint32_t(rate_);
+}
+
+const RateDecision &RateController::update(const ReceiverReport &report) {
+  // The smallest RTT and jitter seen stand for the empty network path
+  if (report.rttMs >= 0 && (baseRttMs_ < 0 || report.rttMs < baseRttMs_)) {
+    baseRttMs_ = report.rttMs;
+  }
+  if (baseJitterMs_ < 0 || report.jitterMs < baseJitterMs_) {
+    baseJitterMs_ = report.jitterMs;
+  }
+  bool queueing =
+      (report.rttMs >= 0 && report.rttMs - baseRttMs_ > options_.queueDelayMs) ||
+      report.jitterMs - baseJitterMs_ > options_.queueDelayMs / 2;
+
+  if (report.fractionLost > options_.highLoss) {
+    rate_ *= 1.0 - 0.5 * report.fractionLost;
+    reason_ = Reason::kLossDecrease;
+  } else if (queueing) {
+    rate_ *= options_.queueDecrease;
+    reason_ = Reason::kDelayDecrease;
+  } else if (report.fractionLost < options_.lowLoss) {
+    rate_ *= 1.0 + options_.increasePercent / 100.0;
+    reason_ = Reason::kIncrease;
+  } else {
+    reason_ = Reason::kHold;
+  }
+  rate_ = std::min(std::max(rate_, double(options_.minKbps)),
+                   double(options_.maxKbps));
+  decision_.bitrateKbps = uint32_t(rate_);
+
+  bool congested =
+      reason_ == Reason::kLossDecrease || reason_ == Reason::kDelayDecrease;
+  if (congested && decision_.bitrateKbps <= options_.minKbps) {
+    clearReports_ = 0;
+    if (++congestedReports_ >= options_.degradeAfterReports) {
+      congestedReports_ = 0;
+      if (options_.adaptFrameRate && decision_.fpsDivisor == 1) {
+        decision_.fpsDivisor = 2;
+      } else if (options_.adaptResolution && decision_.scaleDivisor == 1) {
+        decision_.scaleDivisor = 2;
+      }
+    }
+  } else if (!congested && decision_.bitrateKbps >= 3 * options_.minKbps) {
+    congestedReports_ = 0;
+    if (++clearReports_ >= options_.upgradeAfterReports) {
+      clearReports_ = 0;
+      // undo in reverse order, resolution costs the most bits
+      if (decision_.scaleDivisor > 1) {
+        decision_.scaleDivisor = 1;
+      } else if (decision_.fpsDivisor > 1) {
+        decision_.fpsDivisor = 1;
+      }
+    }
+  } else {
+    congestedReports_ = 0;
+    clearReports_ = 0;
+  }
+  return decision_;
+}
@@ -0,0 +1,46 @@
+#include "gst_rgbd_server/raw_rtp.h"
+
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+GstElement *makeRawPayloader(const char *name, unsigned mtu) {
+  GstElement *payloader = gst_element_factory_make("rtpvrawpay", name);
+  if (!payloader) {
+    return NULL;
+  }
+  // The default of 10 chunks pushes 10 lists per frame; one list lets the
+  // whole frame leave in as few syscalls as the sender can batch
+  g_object_set(G_OBJECT(payloader), "mtu", mtu, "chunks-per-frame", 1, NULL);
+  return payloader;
+}
+
+GstCaps *rawDepthCaps(const GstCaps *depth) {
+  if (!depth || gst_caps_get_size(depth) == 0) {
+    return NULL;
+  }
+  const GstStructure *structure = gst_caps_get_structure(depth, 0);
+  const gchar *format = gst_structure_get_string(structure, "format");
+  int width = 0;
+  if (!format || strcmp(format, "GRAY16_LE") != 0 ||
+      !gst_structure_get_int(structure, "width", &width)) {
+    std::cerr << "Raw RTP depth must be GRAY16_LE." << std::endl;
+    return NULL;
+  }
+  if (width % 2) {
+    std::cerr << "Raw RTP depth needs an even width, not " << width << "."
+              << std::endl;
+    return NULL;
+  }
+  GstCaps *caps = gst_caps_copy(depth);
+  gst_caps_set_simple(caps, "format", G_TYPE_STRING, "UYVY", NULL);
+  return caps;
+}
+
+std::string rawRtpCaps(int width, int height, int payload) {
+  std::ostringstream caps;
+  caps << "application/x-rtp,media=video,clock-rate=90000,encoding-name=RAW,"
+          "sampling=YCbCr-4:2:2,depth=(string)8,width=(string)"
+       << width << ",height=(string)" << height << ",payload=" << payload;
+  return caps.str();
+}
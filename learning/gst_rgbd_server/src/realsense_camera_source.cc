@@ -0,0 +1,230 @@
+#include "gst_rgbd_server/realsense_camera_source.h"
+
+#include <chrono>
+#include <iostream>
+
+namespace {
+
+RgbdPixelFormat pixelFormat(rs2_format format) {
+  switch (format) {
+  case RS2_FORMAT_Z16:
+    return RgbdPixelFormat::kZ16;
+  case RS2_FORMAT_RGBA8:
+    return RgbdPixelFormat::kRGBA8;
+  case RS2_FORMAT_RGB8:
+    return RgbdPixelFormat::kRGB8;
+  case RS2_FORMAT_BGR8:
+    return RgbdPixelFormat::kBGR8;
+  case RS2_FORMAT_Y8:
+    return RgbdPixelFormat::kY8;
+  case RS2_FORMAT_YUYV:
+    return RgbdPixelFormat::kYUYV;
+  case RS2_FORMAT_UYVY:
+    return RgbdPixelFormat::kUYVY;
+  default:
+    return RgbdPixelFormat::kUnknown;
+  }
+}
+
+rs2_format rsFormat(RgbdPixelFormat format) {
+  switch (format) {
+  case RgbdPixelFormat::kRGBA8:
+    return RS2_FORMAT_RGBA8;
+  case RgbdPixelFormat::kRGB8:
+    return RS2_FORMAT_RGB8;
+  case RgbdPixelFormat::kYUYV:
+    return RS2_FORMAT_YUYV;
+  case RgbdPixelFormat::kUYVY:
+    return RS2_FORMAT_UYVY;
+  default:
+    return RS2_FORMAT_BGR8;
+  }
+}
+
+CameraImage image(const rs2::video_frame &frame) {
+  CameraImage out;
+  if (!frame) {
+    return out;
+  }
+  out.data = frame.get_data();
+  out.size = frame.get_data_size();
+  out.width = frame.get_width();
+  out.height = frame.get_height();
+  out.stride = frame.get_stride_in_bytes();
+  out.format = pixelFormat(frame.get_profile().format());
+  return out;
+}
+
+RgbdIntrinsics intrinsics(const rs2::pipeline_profile &profile,
+                          rs2_stream stream) {
+  rs2_intrinsics in =
+      profile.get_stream(stream).as<rs2::video_stream_profile>()
+          .get_intrinsics();
+  return RgbdIntrinsics{uint32_t(in.width), uint32_t(in.height), in.ppx,
+                        in.ppy, in.fx, in.fy};
+}
+
+// Capture time of a frame on the host steady clock. Global time maps the
+// device clock onto the host clock, so frames of different devices compare.
+uint64_t captureTimeNs(const rs2::frame &frame) {
+  using namespace std::chrono;
+  uint64_t steadyNow =
+      duration_cast<nanoseconds>(steady_clock::now().time_since_epoch())
+          .count();
+  rs2_timestamp_domain domain = frame.get_frame_timestamp_domain();
+  if (domain != RS2_TIMESTAMP_DOMAIN_GLOBAL_TIME &&
+      domain != RS2_TIMESTAMP_DOMAIN_SYSTEM_TIME) {
+    return steadyNow;
+  }
+  int64_t systemNow =
+      duration_cast<nanoseconds>(system_clock::now().time_since_epoch())
+          .count();
+  int64_t captured = int64_t(frame.get_timestamp() * 1e6);
+  int64_t age = systemNow - captured;
+  // A device clock far off the host is worse than arrival time
+  if (age < 0 || age > int64_t(1000000000)) {
+    return steadyNow;
+  }
+  return steadyNow - uint64_t(age);
+}
+
+} // namespace
+
+RealSenseCameraSource::RealSenseCameraSource(const std::string &serial)
+    : serial_(serial) {}
+
+RealSenseCameraSource::~RealSenseCameraSource() { stop(); }
+
+std::vector<std::string> RealSenseCameraSource::enumerate() {
+  std::vector<std::string> serials;
+  rs2::context context;
+  for (rs2::device device : context.query_devices()) {
+    if (device.supports(RS2_CAMERA_INFO_SERIAL_NUMBER)) {
+      serials.push_back(device.get_info(RS2_CAMERA_INFO_SERIAL_NUMBER));
+    }
+  }
+  return serials;
+}
+
+bool RealSenseCameraSource::start(const CameraConfig &config) {
+  stop();
+  config_ = config;
+
+  if (serial_.empty()) {
+    // Fail fast instead of blocking in device_hub::wait_for_device()
+    std::vector<std::string> serials = enumerate();
+    if (serials.empty()) {
+      std::cerr << "No device connected, please connect a RealSense device."
+                << std::endl;
+      return false;
+    }
+    serial_ = serials.front();
+  }
+
+  rs2::config rsConfig;
+  rsConfig.enable_device(serial_);
+  if (config.color) {
+    rsConfig.enable_stream(RS2_STREAM_COLOR, config.width, config.height,
+                           rsFormat(config.colorFormat), config.fps);
+  }
+  if (config.depth) {
+    rsConfig.enable_stream(RS2_STREAM_DEPTH, config.width, config.height,
+                           RS2_FORMAT_Z16, config.fps);
+  }
+  if (config.infrared) {
+    rsConfig.enable_stream(RS2_STREAM_INFRARED, 1, config.width, config.height,
+                           RS2_FORMAT_Y8, config.fps);
+    rsConfig.enable_stream(RS2_STREAM_INFRARED, 2, config.width, config.height,
+                           RS2_FORMAT_Y8, config.fps);
+  }
+  if (config.imu) {
+    rsConfig.enable_stream(RS2_STREAM_ACCEL, RS2_FORMAT_MOTION_XYZ32F);
+    rsConfig.enable_stream(RS2_STREAM_GYRO, RS2_FORMAT_MOTION_XYZ32F);
+  }
+
+  try {
+    rs2::pipeline_profile selection = rsPipeline_.start(rsConfig);
+    for (rs2::sensor sensor : selection.get_device().query_sensors()) {
+      if (sensor.supports(RS2_OPTION_GLOBAL_TIME_ENABLED)) {
+        sensor.set_option(RS2_OPTION_GLOBAL_TIME_ENABLED, 1.f);
+      }
+    }
+    auto depthSensor = selection.get_device().first<rs2::depth_sensor>();
+    scale_ = depthSensor.get_option(RS2_OPTION_DEPTH_UNITS);
+    if (depthSensor.supports(RS2_OPTION_EMITTER_ENABLED)) {
+      depthSensor.set_option(RS2_OPTION_EMITTER_ENABLED, 1.f);
+    }
+    if (config.color) {
+      colorIntrinsics_ = intrinsics(selection, RS2_STREAM_COLOR);
+    }
+    if (config.depth) {
+      depthIntrinsics_ = intrinsics(selection, RS2_STREAM_DEPTH);
+    }
+  } catch (const rs2::error &e) {
+    std::cerr << "Failed to start RealSense " << serial_ << ": " << e.what()
+              << std::endl;
+    return false;
+  }
+
+  if (config.alignDepth && config.color && config.depth) {
+    alignmentFilter_.reset(new rs2::align(RS2_STREAM_COLOR));
+    depthIntrinsics_ = colorIntrinsics_;
+  }
+  started_ = true;
+  std::cout << "RealSense " << serial_ << " started." << std::endl;
+  return true;
+}
+
+void RealSenseCameraSource::stop() {
+  if (!started_) {
+    return;
+  }
+  started_ = false;
+  rsPipeline_.stop();
+  alignmentFilter_.reset();
+}
+
+bool RealSenseCameraSource::waitForFrames(CameraFrameSet &frames,
+                                          uint32_t timeoutMs) {
+  if (!started_) {
+    return false;
+  }
+  auto frameset = std::make_shared<rs2::frameset>();
+  if (!rsPipeline_.try_wait_for_frames(frameset.get(), timeoutMs)) {
+    return false;
+  }
+  if (alignmentFilter_) {
+    *frameset = alignmentFilter_->process(*frameset);
+  }
+
+  frames = CameraFrameSet();
+  frames.frameNumber = frameset->get_frame_number();
+  rs2::frame reference = frameset->get_depth_frame();
+  if (!reference) {
+    reference = frameset->get_color_frame();
+  }
+  frames.timestampNs = captureTimeNs(reference ? reference : *frameset);
+  frames.color = image(frameset->get_color_frame());
+  frames.depth = image(frameset->get_depth_frame());
+  if (config_.infrared) {
+    frames.infrared[0] = image(frameset->get_infrared_frame(1));
+    frames.infrared[1] = image(frameset->get_infrared_frame(2));
+  }
+  if (rs2::motion_frame accel = frameset->first_or_default(RS2_STREAM_ACCEL)) {
+    rs2_vector sample = accel.get_motion_data();
+    frames.hasAccel = true;
+    frames.accel[0] = sample.x;
+    frames.accel[1] = sample.y;
+    frames.accel[2] = sample.z;
+  }
+  if (rs2::motion_frame gyro = frameset->first_or_default(RS2_STREAM_GYRO)) {
+    rs2_vector sample = gyro.get_motion_data();
+    frames.hasGyro = true;
+    frames.gyro[0] = sample.x;
+    frames.gyro[1] = sample.y;
+    frames.gyro[2] = sample.z;
+  }
+  // librealsense recycles frame memory once the last reference is gone
+  frames.keepAlive = frameset;
+  return true;
+}
@@ -0,0 +1,565 @@
+#include "gst_rgbd_server/rgbd_replay_source.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#ifdef RGBD_WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef RGBD_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "gst_rgbd_server/camera_source.h"
+
+struct RgbdReplaySource::Mapping {
+  uint8_t *base = nullptr;
+  size_t size = 0;
+
+  ~Mapping() {
+    if (base) {
+      munmap(base, size);
+    }
+  }
+};
+
+struct RgbdReplaySource::PushThread {
+  std::thread thread;
+  std::atomic<bool> running{true};
+};
+
+namespace {
+
+uint32_t bytesPerPixel(RgbdPixelFormat format) {
+  switch (format) {
+  case RgbdPixelFormat::kZ16:
+  case RgbdPixelFormat::kYUYV:
+  case RgbdPixelFormat::kUYVY:
+    return 2;
+  case RgbdPixelFormat::kRGBA8:
+    return 4;
+  case RgbdPixelFormat::kRGB8:
+  case RgbdPixelFormat::kBGR8:
+    return 3;
+  case RgbdPixelFormat::kY8:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// Largest payload a frame of the stream can decode to. Sizes in the index
+// come from the file, a corrupt one must not size an allocation; streams
+// without a fixed layout get a generous fixed bound
+uint64_t maxFrameBytes(const RgbdRecordingStreamInfo &info) {
+  const RgbdPixelFormat format = static_cast<RgbdPixelFormat>(info.format);
+  uint64_t row = uint64_t(info.width) * bytesPerPixel(format);
+  if (format == RgbdPixelFormat::kXYZ32F) {
+    row = uint64_t(info.width) * 3 * sizeof(float);
+  }
+  if (row) {
+    return std::max<uint64_t>(row, info.stride) * info.height;
+  }
+  return info.bytesPerFrame ? info.bytesPerFrame : uint64_t(64) << 20;
+}
+
+bool mapFile(const std::string &path, uint8_t *&base, size_t &size) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Replay: cannot open " << path << std::endl;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    std::cerr << "Replay: empty or unreadable file " << path << std::endl;
+    ::close(fd);
+    return false;
+  }
+  void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (ptr == MAP_FAILED) {
+    std::cerr << "Replay: mmap failed for " << path << std::endl;
+    return false;
+  }
+  // frames are consumed front to back, let the kernel read ahead aggressively
+  madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+  base = static_cast<uint8_t *>(ptr);
+  size = st.st_size;
+  return true;
+}
+
+} // namespace
+
+bool RawReplayStream::parse(const std::string &spec, RawReplayStream &out) {
+  std::vector<std::string> parts;
+  std::stringstream ss(spec);
+  std::string item;
+  while (parts.size() < 3 && std::getline(ss, item, ':')) {
+    parts.push_back(item);
+  }
+  std::getline(ss, out.path);
+  if (parts.size() != 3 || out.path.empty()) {
+    return false;
+  }
+
+  if (parts[0] == "depth") {
+    out.kind = RgbdStreamKind::kDepth;
+  } else if (parts[0] == "color") {
+    out.kind = RgbdStreamKind::kColor;
+  } else if (parts[0] == "infrared") {
+    out.kind = RgbdStreamKind::kInfrared;
+  } else {
+    return false;
+  }
+
+  if (parts[1] == "z16") {
+    out.format = RgbdPixelFormat::kZ16;
+  } else if (parts[1] == "rgba") {
+    out.format = RgbdPixelFormat::kRGBA8;
+  } else if (parts[1] == "rgb") {
+    out.format = RgbdPixelFormat::kRGB8;
+  } else if (parts[1] == "bgr") {
+    out.format = RgbdPixelFormat::kBGR8;
+  } else if (parts[1] == "y8") {
+    out.format = RgbdPixelFormat::kY8;
+  } else if (parts[1] == "yuyv") {
+    out.format = RgbdPixelFormat::kYUYV;
+  } else if (parts[1] == "uyvy") {
+    out.format = RgbdPixelFormat::kUYVY;
+  } else {
+    return false;
+  }
+
+  return sscanf(parts[2].c_str(), "%ux%u", &out.width, &out.height) == 2 &&
+         out.width && out.height;
+}
+
+void ReplayFrame::clear() {
+  for (GstBuffer *buffer : buffers) {
+    if (buffer) {
+      gst_buffer_unref(buffer);
+    }
+  }
+  buffers.clear();
+}
+
+RgbdReplaySource::RgbdReplaySource() = default;
+
+RgbdReplaySource::~RgbdReplaySource() {
+  stopPushing();
+  reset();
+}
+
+void RgbdReplaySource::reset() {
+  streams_.clear();
+  mappings_.clear();
+  frameCount_ = 0;
+  position_ = 0;
+  loops_ = 0;
+  loopDuration_ = 0;
+  paceStarted_ = false;
+}
+
+bool RgbdReplaySource::open(const std::string &path,
+                            const ReplayOptions &options) {
+  reset();
+  options_ = options;
+
+  auto mapping = std::make_shared<Mapping>();
+  if (!mapFile(path, mapping->base, mapping->size)) {
+    return false;
+  }
+  const uint8_t *base = mapping->base;
+  const size_t size = mapping->size;
+
+  RgbdRecordingHeader header;
+  if (size < kRgbdRecordingAlignment) {
+    std::cerr << "Replay: " << path << " is too small" << std::endl;
+    return false;
+  }
+  memcpy(&header, base, sizeof(header));
+  if (memcmp(header.magic, kRgbdRecordingMagic, sizeof(header.magic)) != 0 ||
+      header.version != kRgbdRecordingVersion ||
+      header.numStreams > kRgbdRecordingMaxStreams) {
+    std::cerr << "Replay: " << path << " is not an rgbd recording" << std::endl;
+    return false;
+  }
+  mappings_.push_back(mapping);
+
+  streams_.resize(header.numStreams);
+  for (uint32_t i = 0; i < header.numStreams; ++i) {
+    streams_[i].info = header.streams[i];
+  }
+
+  // Frame numbers come from the file, a corrupt one must not size the
+  // tables; no stream has more frames than the file has records
+  auto addFrame = [this](const RgbdRecordingIndexEntry &e, uint64_t maxFrames) {
+    if (e.streamId >= streams_.size() || e.frameNumber >= maxFrames) {
+      return;
+    }
+    auto &frames = streams_[e.streamId].frames;
+    if (frames.size() <= e.frameNumber) {
+      frames.resize(e.frameNumber + 1);
+    }
+    FrameRef &ref = frames[e.frameNumber];
+    ref.mapping = 0;
+    ref.offset = e.offset + sizeof(RgbdFrameRecordHeader);
+    ref.storedBytes = e.storedBytes;
+    ref.rawBytes = e.rawBytes;
+    ref.timestampNs = e.timestampNs;
+    ref.codec = static_cast<RgbdCodec>(e.codec);
+  };
+
+  // Compared by division, products and sums of file values could wrap
+  if (header.indexOffset && header.indexOffset <= size &&
+      header.frameCount <=
+          (size - header.indexOffset) / sizeof(RgbdRecordingIndexEntry)) {
+    // normal case: the index gives direct access to every frame
+    const uint8_t *index = base + header.indexOffset;
+    for (uint64_t i = 0; i < header.frameCount; ++i) {
+      RgbdRecordingIndexEntry e;
+      memcpy(&e, index + i * sizeof(e), sizeof(e));
+      if (e.offset <= size - sizeof(RgbdFrameRecordHeader) &&
+          e.storedBytes <= size - sizeof(RgbdFrameRecordHeader) - e.offset) {
+        addFrame(e, header.frameCount);
+      }
+    }
+  } else {
+    // the writer did not close the file, recover by walking the records
+    std::cerr << "Replay: " << path << " has no index, scanning records"
+              << std::endl;
+    uint64_t offset = kRgbdRecordingAlignment;
+    const uint64_t maxFrames = size / kRgbdRecordingAlignment;
+    while (offset + sizeof(RgbdFrameRecordHeader) <= size) {
+      RgbdFrameRecordHeader rec;
+      memcpy(&rec, base + offset, sizeof(rec));
+      if (memcmp(rec.magic, kRgbdFrameRecordMagic, sizeof(rec.magic)) != 0 ||
+          rec.storedBytes > size - offset - sizeof(rec)) {
+        break;
+      }
+      RgbdRecordingIndexEntry e = {rec.streamId,    rec.codec,
+                                   rec.frameNumber, rec.timestampNs,
+                                   offset,          rec.rawBytes,
+                                   rec.storedBytes};
+      addFrame(e, maxFrames);
+      offset += rgbdRecordingAlignUp(sizeof(rec) + rec.storedBytes);
+    }
+  }
+
+  for (const Stream &s : streams_) {
+    frameCount_ = std::max<uint64_t>(frameCount_, s.frames.size());
+  }
+  if (!frameCount_) {
+    std::cerr << "Replay: " << path << " contains no frames" << std::endl;
+    return false;
+  }
+  advise(0);
+  return true;
+}
+
+bool RgbdReplaySource::openRaw(const std::vector<RawReplayStream> &streams,
+                               const ReplayOptions &options) {
+  reset();
+  options_ = options;
+
+  for (const RawReplayStream &raw : streams) {
+    const uint32_t bpp = bytesPerPixel(raw.format);
+    const uint64_t frameBytes = uint64_t(raw.width) * raw.height * bpp;
+    if (!frameBytes) {
+      std::cerr << "Replay: unsupported raw stream " << raw.path << std::endl;
+      return false;
+    }
+    auto mapping = std::make_shared<Mapping>();
+    if (!mapFile(raw.path, mapping->base, mapping->size)) {
+      return false;
+    }
+    const uint32_t mappingIndex = mappings_.size();
+    mappings_.push_back(mapping);
+
+    Stream s;
+    memset(&s.info, 0, sizeof(s.info));
+    s.info.kind = static_cast<uint32_t>(raw.kind);
+    s.info.format = static_cast<uint32_t>(raw.format);
+    s.info.width = raw.width;
+    s.info.height = raw.height;
+    s.info.stride = raw.width * bpp;
+    s.info.bytesPerFrame = frameBytes;
+
+    const uint64_t count = mapping->size / frameBytes;
+    if (mapping->size % frameBytes) {
+      std::cerr << "Replay: " << raw.path << " has a truncated last frame"
+                << std::endl;
+    }
+    const double period = 1e9 / std::max(options.fps, 1e-3);
+    s.frames.resize(count);
+    for (uint64_t i = 0; i < count; ++i) {
+      FrameRef &ref = s.frames[i];
+      ref.mapping = mappingIndex;
+      ref.offset = i * frameBytes;
+      ref.storedBytes = ref.rawBytes = frameBytes;
+      ref.timestampNs = uint64_t(i * period);
+    }
+    frameCount_ = std::max<uint64_t>(frameCount_, count);
+    streams_.push_back(std::move(s));
+  }
+  if (!frameCount_) {
+    std::cerr << "Replay: raw streams contain no frames" << std::endl;
+    return false;
+  }
+  advise(0);
+  return true;
+}
+
+int RgbdReplaySource::findStream(RgbdStreamKind kind) const {
+  for (size_t i = 0; i < streams_.size(); ++i) {
+    if (streams_[i].info.kind == static_cast<uint32_t>(kind)) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+const RgbdRecordingStreamInfo &
+RgbdReplaySource::streamInfo(size_t stream) const {
+  return streams_.at(stream).info;
+}
+
+GstCaps *RgbdReplaySource::caps(size_t stream) const {
+  const RgbdRecordingStreamInfo &info = streams_.at(stream).info;
+  const char *format =
+      gstVideoFormat(static_cast<RgbdPixelFormat>(info.format));
+  if (!format) {
+    return nullptr;
+  }
+  gint num = 0, den = 1;
+  gst_util_double_to_fraction(options_.fps, &num, &den);
+  return gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING, format,
+                             "width", G_TYPE_INT, info.width, "height",
+                             G_TYPE_INT, info.height, "framerate",
+                             GST_TYPE_FRACTION, num, den, NULL);
+}
+
+bool RgbdReplaySource::seek(uint64_t frameNumber) {
+  if (frameNumber >= frameCount_) {
+    return false;
+  }
+  position_ = frameNumber;
+  paceStarted_ = false;
+  advise(frameNumber);
+  return true;
+}
+
+void RgbdReplaySource::advise(uint64_t frameNumber) const {
+  const long page = sysconf(_SC_PAGESIZE);
+  for (const Stream &s : streams_) {
+    if (frameNumber >= s.frames.size()) {
+      continue;
+    }
+    uint64_t last = std::min<uint64_t>(frameNumber + options_.readaheadFrames,
+                                       s.frames.size() - 1);
+    const FrameRef &first = s.frames[frameNumber];
+    const FrameRef &end = s.frames[last];
+    const Mapping &m = *mappings_[first.mapping];
+    if (!first.storedBytes || !end.storedBytes) {
+      continue; // gap in the recording
+    }
+    uint64_t begin = first.offset & ~uint64_t(page - 1);
+    uint64_t stop = std::min<uint64_t>(end.offset + end.storedBytes, m.size);
+    if (stop > begin) {
+      madvise(m.base + begin, stop - begin, MADV_WILLNEED);
+    }
+  }
+}
+
+GstBuffer *RgbdReplaySource::makeBuffer(const Stream &stream,
+                                        const FrameRef &ref) const {
+  const std::shared_ptr<Mapping> &mapping = mappings_[ref.mapping];
+  uint8_t *data = mapping->base + ref.offset;
+  const uint64_t limit = maxFrameBytes(stream.info);
+  const uint64_t bytes =
+      ref.codec == RgbdCodec::kNone ? ref.storedBytes : ref.rawBytes;
+  // LZ4 takes int sizes, no real frame comes near 2 GB
+  if (bytes > limit || bytes > INT_MAX || ref.storedBytes > INT_MAX) {
+    std::cerr << "Replay: frame of " << bytes << " bytes exceeds the "
+              << limit << " of its stream" << std::endl;
+    return nullptr;
+  }
+
+  if (ref.codec == RgbdCodec::kNone) {
+    // zero copy, the buffer keeps the mapping alive
+    return gst_buffer_new_wrapped_full(
+        GST_MEMORY_FLAG_READONLY, data, ref.storedBytes, 0, ref.storedBytes,
+        new std::shared_ptr<Mapping>(mapping), [](gpointer p) {
+          delete static_cast<std::shared_ptr<Mapping> *>(p);
+        });
+  }
+
+  GstBuffer *buffer = gst_buffer_new_allocate(nullptr, ref.rawBytes, nullptr);
+  if (!buffer) {
+    return nullptr;
+  }
+  GstMapInfo info;
+  if (!gst_buffer_map(buffer, &info, GST_MAP_WRITE)) {
+    gst_buffer_unref(buffer);
+    return nullptr;
+  }
+  bool ok = false;
+  switch (ref.codec) {
+#ifdef RGBD_WITH_LZ4
+  case RgbdCodec::kLz4:
+    ok = LZ4_decompress_safe((const char *)data, (char *)info.data,
+                             (int)ref.storedBytes,
+                             (int)ref.rawBytes) == (int)ref.rawBytes;
+    break;
+#endif
+#ifdef RGBD_WITH_ZSTD
+  case RgbdCodec::kZstd:
+    ok = ZSTD_decompress(info.data, ref.rawBytes, data, ref.storedBytes) ==
+         ref.rawBytes;
+    break;
+#endif
+  default:
+    std::cerr << "Replay: codec " << static_cast<uint32_t>(ref.codec)
+              << " is not built in" << std::endl;
+    break;
+  }
+  gst_buffer_unmap(buffer, &info);
+  if (!ok) {
+    gst_buffer_unref(buffer);
+    return nullptr;
+  }
+  return buffer;
+}
+
+GstBuffer *RgbdReplaySource::buffer(size_t stream,
+                                    uint64_t frameNumber) const {
+  const Stream &s = streams_.at(stream);
+  if (frameNumber >= s.frames.size() || !s.frames[frameNumber].storedBytes) {
+    return nullptr;
+  }
+  return makeBuffer(s, s.frames[frameNumber]);
+}
+
+void RgbdReplaySource::pace(GstClockTime pts) {
+  if (options_.pacing == ReplayPacing::kMaxRate) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (!paceStarted_) {
+    paceStart_ = now - std::chrono::nanoseconds(pts);
+    paceStarted_ = true;
+    return;
+  }
+  std::this_thread::sleep_until(paceStart_ + std::chrono::nanoseconds(pts));
+}
+
+bool RgbdReplaySource::next(ReplayFrame &frame) {
+  frame.clear();
+  if (position_ >= frameCount_) {
+    if (!options_.loop) {
+      return false;
+    }
+    ++loops_;
+    position_ = 0;
+    advise(0);
+  }
+
+  const GstClockTime period =
+      GstClockTime(GST_SECOND / std::max(options_.fps, 1e-3));
+  GstClockTime pts = position_ * period;
+  if (options_.pacing == ReplayPacing::kRealtime) {
+    // recorded timestamps of the first stream that has this frame
+    for (const Stream &s : streams_) {
+      if (position_ < s.frames.size() && s.frames[position_].storedBytes &&
+          s.frames[0].storedBytes) {
+        pts = s.frames[position_].timestampNs - s.frames[0].timestampNs;
+        break;
+      }
+    }
+  }
+  if (position_ + 1 == frameCount_ && !loopDuration_) {
+    loopDuration_ = pts + period;
+  }
+  pts += loops_ * loopDuration_;
+  pace(pts);
+
+  frame.frameNumber = position_;
+  frame.pts = pts;
+  frame.duration = period;
+  frame.buffers.resize(streams_.size(), nullptr);
+  for (size_t i = 0; i < streams_.size(); ++i) {
+    GstBuffer *buf = buffer(i, position_);
+    if (buf) {
+      GST_BUFFER_PTS(buf) = pts;
+      GST_BUFFER_DURATION(buf) = period;
+      GST_BUFFER_OFFSET(buf) = position_;
+    }
+    frame.buffers[i] = buf;
+  }
+
+  ++position_;
+  if (options_.readaheadFrames) {
+    advise(position_ + options_.readaheadFrames - 1);
+  }
+  return true;
+}
+
+bool RgbdReplaySource::startPushing(GstAppSrc *appsrc, size_t stream) {
+  if (pusher_ || stream >= streams_.size()) {
+    return false;
+  }
+  GstCaps *streamCaps = caps(stream);
+  if (streamCaps) {
+    gst_app_src_set_caps(appsrc, streamCaps);
+    gst_caps_unref(streamCaps);
+  }
+  gst_util_set_object_arg(G_OBJECT(appsrc), "format", "time");
+
+  // A replay must not lose frames, but reading ahead of the consumer
+  // without bound would hold the whole file in memory at max rate
+  QueuePolicy policy;
+  policy.maxFrames = 4;
+  policy.drop = QueueDrop::kBlock;
+  std::shared_ptr<AppSrcQueue> queue(new AppSrcQueue(
+      GST_ELEMENT(appsrc), "replay" + std::to_string(stream), policy));
+
+  pusher_.reset(new PushThread);
+  pusher_->thread = std::thread([this, queue, stream]() {
+    ReplayFrame frame;
+    while (pusher_->running && next(frame)) {
+      GstBuffer *buf = frame.buffers[stream];
+      if (!buf) {
+        continue;
+      }
+      frame.buffers[stream] = nullptr;
+      if (queue->push(buf) != GST_FLOW_OK) {
+        break;
+      }
+    }
+    if (pusher_->running) {
+      queue->endOfStream();
+    }
+  });
+  return true;
+}
+
+void RgbdReplaySource::stopPushing() {
+  if (!pusher_) {
+    return;
+  }
+  pusher_->running = false;
+  if (pusher_->thread.joinable()) {
+    pusher_->thread.join();
+  }
+  pusher_.reset();
+}
@@ -0,0 +1,184 @@
+#include "gst_rgbd_server/rtcp_rate_adapter.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include "gst_rgbd_server/encoder_factory.h"
+#include "gst_rgbd_server/metrics.h"
+
+namespace {
+
+// RTP clock of video payloads, the unit of rb-jitter
+constexpr double kVideoClockRate = 90000.0;
+
+const char *reasonName(RateController::Reason reason) {
+  switch (reason) {
+  case RateController::Reason::kIncrease:
+    return "increase";
+  case RateController::Reason::kLossDecrease:
+    return "loss";
+  case RateController::Reason::kDelayDecrease:
+    return "delay";
+  default:
+    return "hold";
+  }
+}
+
+} // namespace
+
+RtcpRateAdapter::RtcpRateAdapter(const std::string &name, GstElement *encoder,
+                                 GstElement *adapt, int width, int height,
+                                 int fps, const RateControllerOptions &options,
+                                 guint intervalMs)
+    : name_(name), label_("{stream=\"" + name + "\"}"),
+      encoder_(GST_ELEMENT(gst_object_ref(encoder))),
+      adapt_(adapt ? GST_ELEMENT(gst_object_ref(adapt)) : nullptr),
+      width_(width), height_(height), fps_(fps), controller_(options),
+      intervalMs_(intervalMs) {
+  Metrics::instance().retain("stream=\"" + name_ + "\"");
+  apply(controller_.decision());
+}
+
+RtcpRateAdapter::~RtcpRateAdapter() {
+  if (pollSource_) {
+    g_source_remove(pollSource_);
+  }
+  // Other media of the mount may still count under the same label
+  Metrics::instance().release("stream=\"" + name_ + "\"");
+  if (rtpbin_) {
+    gst_object_unref(rtpbin_);
+  }
+  if (adapt_) {
+    gst_object_unref(adapt_);
+  }
+  gst_object_unref(encoder_);
+}
+
+void RtcpRateAdapter::attach(GstRTSPMedia *media) {
+  media_ = media;
+  pollSource_ = g_timeout_add(intervalMs_, &RtcpRateAdapter::onPoll, this);
+}
+
+void RtcpRateAdapter::attach(GstElement *rtpbin, guint session) {
+  rtpbin_ = GST_ELEMENT(gst_object_ref(rtpbin));
+  sessionId_ = session;
+  pollSource_ = g_timeout_add(intervalMs_, &RtcpRateAdapter::onPoll, this);
+}
+
+GObject *RtcpRateAdapter::session() const {
+  GObject *session = nullptr;
+  if (media_) {
+    // streams only exist once the media is prepared
+    if (gst_rtsp_media_n_streams(media_) > 0) {
+      GstRTSPStream *stream = gst_rtsp_media_get_stream(media_, 0);
+      session = stream ? gst_rtsp_stream_get_rtpsession(stream) : nullptr;
+    }
+  } else if (rtpbin_) {
+    g_signal_emit_by_name(rtpbin_, "get-internal-session", sessionId_,
+                          &session);
+  }
+  return session;
+}
+
+bool RtcpRateAdapter::readReport(ReceiverReport &report) {
+  GObject *rtpSession = session();
+  if (!rtpSession) {
+    return false;
+  }
+  GValueArray *sources = nullptr;
+  g_object_get(rtpSession, "sources", &sources, NULL);
+  g_object_unref(rtpSession);
+  if (!sources) {
+    return false;
+  }
+
+  // With several receivers the worst one sets the rate
+  bool fresh = false;
+  G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+  for (guint i = 0; i < sources->n_values; ++i) {
+    GObject *source = G_OBJECT(g_value_get_object(&sources->values[i]));
+    GstStructure *stats = nullptr;
+    g_object_get(source, "stats", &stats, NULL);
+    if (!stats) {
+      continue;
+    }
+    gboolean internal = FALSE, haveRb = FALSE;
+    gst_structure_get_boolean(stats, "internal", &internal);
+    gst_structure_get_boolean(stats, "have-rb", &haveRb);
+    guint ssrc = 0, lost = 0, jitter = 0, rtt = 0, seq = 0;
+    if (!internal && haveRb && gst_structure_get_uint(stats, "ssrc", &ssrc) &&
+        gst_structure_get_uint(stats, "rb-fractionlost", &lost) &&
+        gst_structure_get_uint(stats, "rb-jitter", &jitter) &&
+        gst_structure_get_uint(stats, "rb-round-trip", &rtt) &&
+        gst_structure_get_uint(stats, "rb-exthighestseq", &seq)) {
+      auto last = lastSeq_.find(ssrc);
+      if (last == lastSeq_.end() || last->second != seq) {
+        lastSeq_[ssrc] = seq;
+        fresh = true;
+        report.fractionLost = std::max(report.fractionLost, lost / 256.0);
+        report.jitterMs =
+            std::max(report.jitterMs, 1000.0 * jitter / kVideoClockRate);
+        // round trip is in 1/65536 s, 0 until an SR has been answered
+        if (rtt > 0) {
+          report.rttMs = std::max(report.rttMs, 1000.0 * rtt / 65536.0);
+        }
+      }
+    }
+    gst_structure_free(stats);
+  }
+  g_value_array_free(sources);
+  G_GNUC_END_IGNORE_DEPRECATIONS
+  return fresh;
+}
+
+gboolean RtcpRateAdapter::onPoll(gpointer user_data) {
+  RtcpRateAdapter *self = static_cast<RtcpRateAdapter *>(user_data);
+  ReceiverReport report;
+  if (!self->readReport(report)) {
+    return G_SOURCE_CONTINUE;
+  }
+  const RateDecision &decision = self->controller_.update(report);
+
+  Metrics &metrics = Metrics::instance();
+  metrics.set("rgbd_rtcp_fraction_lost" + self->label_, report.fractionLost);
+  metrics.set("rgbd_rtcp_jitter_ms" + self->label_, report.jitterMs);
+  metrics.set("rgbd_rtcp_rtt_ms" + self->label_, report.rttMs);
+  metrics.add(std::string("rgbd_rate_decisions_total{stream=\"") +
+                  self->name_ + "\",reason=\"" +
+                  reasonName(self->controller_.reason()) + "\"}",
+              1);
+  self->apply(decision);
+  return G_SOURCE_CONTINUE;
+}
+
+void RtcpRateAdapter::apply(const RateDecision &decision) {
+  Metrics &metrics = Metrics::instance();
+  metrics.set("rgbd_rate_bitrate_kbps" + label_, decision.bitrateKbps);
+  metrics.set("rgbd_rate_fps_divisor" + label_, decision.fpsDivisor);
+  metrics.set("rgbd_rate_scale_divisor" + label_, decision.scaleDivisor);
+  if (decision == applied_) {
+    return;
+  }
+
+  if (decision.bitrateKbps != applied_.bitrateKbps) {
+    EncoderFactory::setBitrate(encoder_, decision.bitrateKbps);
+  }
+  if (adapt_ && (decision.fpsDivisor != applied_.fpsDivisor ||
+                 decision.scaleDivisor != applied_.scaleDivisor)) {
+    // Even sizes keep 4:2:0 subsampling happy
+    int width = (width_ / decision.scaleDivisor) & ~1;
+    int height = (height_ / decision.scaleDivisor) & ~1;
+    GstCaps *caps = gst_caps_new_simple(
+        "video/x-raw", "width", G_TYPE_INT, width, "height", G_TYPE_INT,
+        height, "framerate", GST_TYPE_FRACTION, fps_, decision.fpsDivisor,
+        NULL);
+    g_object_set(adapt_, "caps", caps, NULL);
+    gst_caps_unref(caps);
+  }
+  if (applied_.bitrateKbps != 0) {
+    std::cout << name_ << ": " << decision.bitrateKbps << " kbit/s, fps / "
+              << decision.fpsDivisor << ", size / " << decision.scaleDivisor
+              << " (" << reasonName(controller_.reason()) << ")" << std::endl;
+  }
+  applied_ = decision;
+}
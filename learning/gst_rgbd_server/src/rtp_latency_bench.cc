@@ -0,0 +1,331 @@
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/gst.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "gst_rgbd_server/encoder_factory.h"
+#include "gst_rgbd_server/metrics.h"
+#include "gst_rgbd_server/raw_rtp.h"
+#include "gst_rgbd_server/udp_batch_elements.h"
+
+static gchar *modeName = nullptr;
+static gint width = 0;
+static gint height = 0;
+static gint frames = 300;
+static gint fps = 30;
+static gint mtu = kRawDefaultMtu;
+static gint port = 5600;
+static gboolean stockUdp = FALSE;
+
+static GOptionEntry entries[] = {
+    {"mode", 'm', 0, G_OPTION_ARG_STRING, &modeName,
+     "raw, h264 or both (default: both)", "MODE"},
+    {"width", 0, 0, G_OPTION_ARG_INT, &width,
+     "Frame width (default: 640x480 and 1280x720)", "W"},
+    {"height", 0, 0, G_OPTION_ARG_INT, &height, "Frame height", "H"},
+    {"frames", 'n', 0, G_OPTION_ARG_INT, &frames,
+     "Frames per measurement (default: 300)", "N"},
+    {"fps", 0, 0, G_OPTION_ARG_INT, &fps, "Send rate (default: 30)", "FPS"},
+    {"mtu", 0, 0, G_OPTION_ARG_INT, &mtu,
+     "RTP payload size of the raw mode (default: 1400)", "BYTES"},
+    {"port", 'p', 0, G_OPTION_ARG_INT, &port,
+     "Loopback UDP port (default: 5600)", "PORT"},
+    {"stock-udp", 0, 0, G_OPTION_ARG_NONE, &stockUdp,
+     "Send and receive with udpsink and udpsrc instead of the batched "
+     "sockets",
+     NULL},
+    {NULL}};
+
+// The frame number is drawn as a row of black and white 16x16 luma blocks,
+// which survive H.264 where a few bits in the pixels would not.
+static const int kBlock = 16;
+static const int kIndexBits = 20;
+
+static uint64_t steadyNowNs() {
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch())
+                        .count());
+}
+
+static void drawIndex(uint8_t *uyvy, int w, uint32_t index) {
+    for (int bit = 0; bit < kIndexBits; ++bit) {
+        uint8_t luma = (index >> bit) & 1 ? 235 : 16;
+        for (int y = 0; y < kBlock; ++y) {
+            uint8_t *row = uyvy + size_t(y) * w * 2 + bit * kBlock * 2;
+            for (int x = 0; x < kBlock; ++x) {
+                row[2 * x] = 128;
+                row[2 * x + 1] = luma;
+            }
+        }
+    }
+}
+
+static uint32_t readIndex(const uint8_t *uyvy, int stride) {
+    uint32_t index = 0;
+    for (int bit = 0; bit < kIndexBits; ++bit) {
+        const uint8_t *center = uyvy + size_t(kBlock / 2) * stride +
+                                (bit * kBlock + kBlock / 2) * 2;
+        if (center[1] > 128) {
+            index |= 1u << bit;
+        }
+    }
+    return index;
+}
+
+struct Result {
+    int sent = 0;
+    int received = 0;
+    double seconds = 0;
+    std::vector<double> latencyMs;
+    // of the batched sockets, 0 with --stock-udp
+    double sendSyscalls = 0;
+    double receiveSyscalls = 0;
+};
+
+static double metric(const char *name, const char *socket) {
+    return Metrics::instance()
+        .gauge(std::string(name) + "{socket=\"" + socket + "\"}")
+        .load();
+}
+
+// appsrc ! <send> ! udpsink, udpsrc ! <receive> ! appsink in one pipeline,
+// so both ends share the machine's clock. Without --stock-udp the UDP ends
+// are an appsink and an appsrc for RtpBatchSink and RtpBatchSource.
+static std::string launchLine(bool raw, int w, int h) {
+    std::ostringstream launch;
+    launch << "appsrc name=src is-live=true format=time "
+              "caps=video/x-raw,format=UYVY,width="
+           << w << ",height=" << h << ",framerate=" << fps << "/1 ! ";
+    if (raw) {
+        launch << "rtpvrawpay name=pay mtu=" << mtu << " chunks-per-frame=1";
+    } else {
+        EncoderRequest request;
+        request.width = w;
+        request.height = h;
+        request.fps = fps;
+        request.bitrateKbps = unsigned(w) * h / 100;
+        EncoderChoice encoder = EncoderFactory::select(request);
+        if (!encoder) {
+            return "";
+        }
+        launch << "videoconvert ! " << encoder.launch() << " ! "
+               << encoder.payloader();
+    }
+    if (stockUdp) {
+        launch << " ! udpsink host=127.0.0.1 port=" << port
+               << " sync=false async=false buffer-size="
+               << kRawSocketBufferBytes << " udpsrc port=" << port
+               << " buffer-size=" << kRawSocketBufferBytes;
+    } else {
+        launch << " ! appsink name=rtpsink appsrc name=rtpsrc";
+    }
+    if (raw) {
+        launch << " caps=\"" << rawRtpCaps(w, h) << "\" ! rtpvrawdepay";
+    } else {
+        launch << " caps=\"application/x-rtp,media=video,clock-rate=90000,"
+                  "encoding-name=H264,payload=96\" ! rtph264depay ! "
+                  "h264parse ! avdec_h264 ! videoconvert ! "
+                  "video/x-raw,format=UYVY";
+    }
+    launch << " ! appsink name=sink sync=false max-buffers=" << fps;
+    return launch.str();
+}
+
+static bool run(bool raw, int w, int h, Result &result) {
+    std::string launch = launchLine(raw, w, h);
+    if (launch.empty()) {
+        std::cerr << "No H.264 encoder available." << std::endl;
+        return false;
+    }
+    GError *error = NULL;
+    GstElement *pipeline = gst_parse_launch(launch.c_str(), &error);
+    if (error) {
+        std::cerr << "Pipeline: " << error->message << std::endl;
+        g_clear_error(&error);
+        if (pipeline) {
+            gst_object_unref(pipeline);
+        }
+        return false;
+    }
+    GstElement *src = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+    std::unique_ptr<RtpBatchSink> sender;
+    std::unique_ptr<RtpBatchSource> receiver;
+    if (!stockUdp) {
+        UdpBatchOptions options;
+        options.socketBufferBytes = kRawSocketBufferBytes;
+        GstElement *rtpsink = gst_bin_get_by_name(GST_BIN(pipeline), "rtpsink");
+        GstElement *rtpsrc = gst_bin_get_by_name(GST_BIN(pipeline), "rtpsrc");
+        sender.reset(new RtpBatchSink(rtpsink, "127.0.0.1", port, "bench-send",
+                                      options));
+        receiver.reset(
+            new RtpBatchSource(rtpsrc, port, "bench-receive", options));
+        gst_object_unref(rtpsink);
+        gst_object_unref(rtpsrc);
+    }
+    double sendSyscalls = metric("rgbd_udp_send_syscalls_total", "bench-send");
+    double receiveSyscalls =
+        metric("rgbd_udp_receive_syscalls_total", "bench-receive");
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    if (receiver) {
+        receiver->start();
+    }
+
+    std::vector<uint64_t> sentNs(size_t(frames), 0);
+    std::mutex mutex;
+    std::atomic<bool> sending{true};
+    std::thread collector([&]() {
+        // Give the last frames a second to arrive after the sender stops
+        uint64_t lastNs = steadyNowNs();
+        while (sending || steadyNowNs() - lastNs < 1000000000ull) {
+            GstSample *sample =
+                gst_app_sink_try_pull_sample(GST_APP_SINK(sink), 100 * GST_MSECOND);
+            if (!sample) {
+                continue;
+            }
+            uint64_t now = steadyNowNs();
+            lastNs = now;
+            GstBuffer *buffer = gst_sample_get_buffer(sample);
+            GstMapInfo map;
+            if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+                uint32_t index = readIndex(map.data, int(map.size / h));
+                gst_buffer_unmap(buffer, &map);
+                std::lock_guard<std::mutex> lock(mutex);
+                if (index < sentNs.size() && sentNs[index]) {
+                    result.latencyMs.push_back((now - sentNs[index]) / 1e6);
+                    sentNs[index] = 0;
+                    ++result.received;
+                }
+            }
+            gst_sample_unref(sample);
+        }
+    });
+
+    // Gray frames with the index on top, sent at the requested rate
+    std::vector<uint8_t> frame(size_t(w) * h * 2, 128);
+    uint64_t intervalNs = 1000000000ull / std::max(1, fps);
+    uint64_t startNs = steadyNowNs();
+    for (int i = 0; i < frames; ++i) {
+        uint64_t due = startNs + i * intervalNs;
+        uint64_t now = steadyNowNs();
+        if (due > now) {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+        }
+        drawIndex(frame.data(), w, uint32_t(i));
+        GstBuffer *buffer = gst_buffer_new_allocate(NULL, frame.size(), NULL);
+        gst_buffer_fill(buffer, 0, frame.data(), frame.size());
+        GST_BUFFER_PTS(buffer) = gst_util_uint64_scale(i, GST_SECOND, fps);
+        GST_BUFFER_DURATION(buffer) = gst_util_uint64_scale(1, GST_SECOND, fps);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            sentNs[size_t(i)] = steadyNowNs();
+        }
+        if (gst_app_src_push_buffer(GST_APP_SRC(src), buffer) != GST_FLOW_OK) {
+            break;
+        }
+        ++result.sent;
+    }
+    result.seconds = (steadyNowNs() - startNs) / 1e9;
+    sending = false;
+    collector.join();
+    if (!stockUdp) {
+        result.sendSyscalls =
+            metric("rgbd_udp_send_syscalls_total", "bench-send") - sendSyscalls;
+        result.receiveSyscalls =
+            metric("rgbd_udp_receive_syscalls_total", "bench-receive") -
+            receiveSyscalls;
+    }
+
+    receiver.reset();
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    sender.reset();
+    gst_object_unref(src);
+    gst_object_unref(sink);
+    gst_object_unref(pipeline);
+    return true;
+}
+
+static void report(const char *mode, int w, int h, Result &result) {
+    std::cout << mode << " " << w << "x" << h << ": sent "
+              << result.sent / std::max(result.seconds, 1e-9) << " fps, received "
+              << result.received << "/" << result.sent;
+    if (result.received == 0) {
+        std::cout << std::endl;
+        return;
+    }
+    std::vector<double> &ms = result.latencyMs;
+    std::sort(ms.begin(), ms.end());
+    double mean = 0;
+    for (double value : ms) {
+        mean += value;
+    }
+    mean /= ms.size();
+    std::cout << ", latency mean " << mean << " ms, p50 " << ms[ms.size() / 2]
+              << " ms, p99 " << ms[std::min(ms.size() - 1, ms.size() * 99 / 100)]
+              << " ms, max " << ms.back() << " ms" << std::endl;
+    if (result.sendSyscalls > 0) {
+        std::cout << "  syscalls per frame: send "
+                  << result.sendSyscalls / result.sent << ", receive "
+                  << result.receiveSyscalls / result.sent << std::endl;
+    }
+    if (result.received < result.sent && std::string(mode) == "raw") {
+        std::cout << "  lost frames: raise net.core.rmem_max / wmem_max to at "
+                     "least "
+                  << kRawSocketBufferBytes << " bytes" << std::endl;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    GError *error = NULL;
+    GOptionContext *optctx = g_option_context_new(
+        "- loopback latency of raw RFC 4175 against H.264 RTP");
+    g_option_context_add_main_entries(optctx, entries, NULL);
+    g_option_context_add_group(optctx, gst_init_get_option_group());
+    if (!g_option_context_parse(optctx, &argc, &argv, &error)) {
+        std::cerr << "Error parsing options: " << error->message << std::endl;
+        g_option_context_free(optctx);
+        g_clear_error(&error);
+        return -1;
+    }
+    g_option_context_free(optctx);
+
+    std::string mode = modeName ? modeName : "both";
+    if (mode != "raw" && mode != "h264" && mode != "both") {
+        std::cerr << "Unknown mode: " << mode << std::endl;
+        return -1;
+    }
+    std::vector<std::pair<int, int>> sizes = {{640, 480}, {1280, 720}};
+    if (width > 0 && height > 0) {
+        sizes = {{width, height}};
+    }
+    for (const auto &size : sizes) {
+        // UYVY pgroups and the index blocks both need this much
+        if (size.first % 2 || size.first < kIndexBits * kBlock ||
+            size.second < kBlock) {
+            std::cerr << "Unsupported size " << size.first << "x"
+                      << size.second << std::endl;
+            return -1;
+        }
+        for (bool raw : {true, false}) {
+            if ((raw && mode == "h264") || (!raw && mode == "raw")) {
+                continue;
+            }
+            Result result;
+            if (!run(raw, size.first, size.second, result)) {
+                return -1;
+            }
+            report(raw ? "raw" : "h264", size.first, size.second, result);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,351 @@
+#include "gst_rgbd_server/rtp_protection.h"
+
+#include <algorithm>
+#include <initializer_list>
+#include <iostream>
+
+#include "gst_rgbd_server/metrics.h"
+
+namespace {
+
+// Round trip assumed for RTX until the jitterbuffer has measured one
+constexpr double kDefaultRttMs = 20;
+// Latency changes smaller than this are not worth a jitterbuffer update
+constexpr unsigned kLatencyStepMs = 5;
+
+// Links the elements into a bin with ghost pads sinkName and srcName, the
+// shape rtpbin expects of its FEC and auxiliary elements. NULL if an element
+// is missing.
+GstElement *makeBin(std::initializer_list<GstElement *> chain,
+                    const std::string &sinkName, const std::string &srcName) {
+  for (GstElement *element : chain) {
+    if (!element) {
+      for (GstElement *other : chain) {
+        if (other) {
+          gst_object_unref(gst_object_ref_sink(other));
+        }
+      }
+      return NULL;
+    }
+  }
+  GstElement *bin = gst_bin_new(NULL);
+  GstElement *previous = NULL;
+  for (GstElement *element : chain) {
+    gst_bin_add(GST_BIN(bin), element);
+    if (previous) {
+      gst_element_link(previous, element);
+    }
+    previous = element;
+  }
+  GstPad *sink = gst_element_get_static_pad(*chain.begin(), "sink");
+  GstPad *src = gst_element_get_static_pad(previous, "src");
+  gst_element_add_pad(bin, gst_ghost_pad_new(sinkName.c_str(), sink));
+  gst_element_add_pad(bin, gst_ghost_pad_new(srcName.c_str(), src));
+  gst_object_unref(sink);
+  gst_object_unref(src);
+  return bin;
+}
+
+// media pt -> RTX pt, for rtprtxsend and rtprtxreceive alike
+void setRtxMap(GstElement *rtx, const RtpProtectionOptions &options) {
+  GstStructure *map = gst_structure_new_empty("application/x-rtp-pt-map");
+  gst_structure_set(map, std::to_string(options.mediaPt).c_str(), G_TYPE_UINT,
+                    options.rtxPt, NULL);
+  if (options.fec) {
+    gst_structure_set(map, std::to_string(options.redPt).c_str(), G_TYPE_UINT,
+                      options.redRtxPt, NULL);
+  }
+  g_object_set(G_OBJECT(rtx), "payload-type-map", map, NULL);
+  gst_structure_free(map);
+}
+
+GstElement *senderFecEncoder(GstElement *, guint, gpointer user_data) {
+  const RtpProtectionOptions &options =
+      *static_cast<RtpProtectionOptions *>(user_data);
+  if (!options.fec) {
+    return NULL;
+  }
+  GstElement *fec = gst_element_factory_make("rtpulpfecenc", NULL);
+  GstElement *red = gst_element_factory_make("rtpredenc", NULL);
+  if (fec && red) {
+    // multipacket: FEC spans the packets of a frame, not single packets
+    g_object_set(G_OBJECT(fec), "pt", options.fecPt, "percentage",
+                 options.fecPercentage, "multipacket", TRUE, NULL);
+    g_object_set(G_OBJECT(red), "pt", options.redPt, "allow-no-red-blocks",
+                 TRUE, NULL);
+  }
+  GstElement *bin = makeBin({fec, red}, "sink", "src");
+  if (!bin) {
+    std::cerr << "rtpulpfecenc or rtpredenc missing, sending without FEC."
+              << std::endl;
+  }
+  return bin;
+}
+
+GstElement *senderAux(GstElement *, guint session, gpointer user_data) {
+  const RtpProtectionOptions &options =
+      *static_cast<RtpProtectionOptions *>(user_data);
+  if (!options.rtx) {
+    return NULL;
+  }
+  GstElement *rtx = gst_element_factory_make("rtprtxsend", NULL);
+  if (rtx) {
+    setRtxMap(rtx, options);
+    // Nothing older than the receiver's budget is worth resending
+    g_object_set(G_OBJECT(rtx), "max-size-time", options.latencyMs, NULL);
+  }
+  std::string id = std::to_string(session);
+  GstElement *bin = makeBin({rtx}, "sink_" + id, "src_" + id);
+  if (!bin) {
+    std::cerr << "rtprtxsend missing, sending without RTX." << std::endl;
+  }
+  return bin;
+}
+
+void deleteOptions(gpointer data, GClosure *) {
+  delete static_cast<RtpProtectionOptions *>(data);
+}
+
+uint64_t statsField(const GstStructure *stats, const char *field) {
+  guint64 value = 0;
+  gst_structure_get_uint64(stats, field, &value);
+  return value;
+}
+
+} // namespace
+
+void protectRtpSender(GstElement *rtpbin, const RtpProtectionOptions &options) {
+  // NACKs are RTCP feedback, which needs the AVPF profile
+  gst_util_set_object_arg(G_OBJECT(rtpbin), "rtp-profile", "avpf");
+  g_signal_connect_data(rtpbin, "request-fec-encoder",
+                        G_CALLBACK(senderFecEncoder),
+                        new RtpProtectionOptions(options), deleteOptions,
+                        GConnectFlags(0));
+  g_signal_connect_data(rtpbin, "request-aux-sender", G_CALLBACK(senderAux),
+                        new RtpProtectionOptions(options), deleteOptions,
+                        GConnectFlags(0));
+}
+
+RtpReceiverProtection::RtpReceiverProtection(
+    const std::string &name, GstElement *rtpbin, const std::string &mediaCaps,
+    const RtpProtectionOptions &options, guint intervalMs)
+    : name_(name), label_("{stream=\"" + name + "\"}"),
+      rtpbin_(GST_ELEMENT(gst_object_ref(rtpbin))),
+      mediaCaps_(gst_caps_from_string(mediaCaps.c_str())), options_(options) {
+  gst_util_set_object_arg(G_OBJECT(rtpbin), "rtp-profile", "avpf");
+  // Start at the full budget, poll() brings it down once jitter is known
+  g_object_set(G_OBJECT(rtpbin), "latency", options.latencyMs,
+               "do-retransmission", gboolean(options.rtx), "do-lost", TRUE,
+               NULL);
+  stats_.latencyMs = options.latencyMs;
+  handlers_.push_back(g_signal_connect(rtpbin, "request-pt-map",
+                                       G_CALLBACK(&onRequestPtMap), this));
+  handlers_.push_back(g_signal_connect(
+      rtpbin, "request-aux-receiver", G_CALLBACK(&onRequestAuxReceiver),
+      this));
+  handlers_.push_back(g_signal_connect(
+      rtpbin, "request-fec-decoder", G_CALLBACK(&onRequestFecDecoder), this));
+  handlers_.push_back(g_signal_connect(rtpbin, "new-jitterbuffer",
+                                       G_CALLBACK(&onNewJitterbuffer), this));
+  pollSource_ = g_timeout_add(intervalMs, &RtpReceiverProtection::onPoll, this);
+}
+
+RtpReceiverProtection::~RtpReceiverProtection() {
+  if (pollSource_) {
+    g_source_remove(pollSource_);
+  }
+  for (gulong handler : handlers_) {
+    g_signal_handler_disconnect(rtpbin_, handler);
+  }
+  for (auto *refs : {&jitterbuffers_, &fecDecoders_}) {
+    for (auto &ref : *refs) {
+      g_weak_ref_clear(ref.get());
+    }
+  }
+  Metrics::instance().remove("stream=\"" + name_ + "\"");
+  if (mediaCaps_) {
+    gst_caps_unref(mediaCaps_);
+  }
+  gst_object_unref(rtpbin_);
+}
+
+GstCaps *RtpReceiverProtection::onRequestPtMap(GstElement *, guint, guint pt,
+                                               gpointer user_data) {
+  RtpReceiverProtection *self = static_cast<RtpReceiverProtection *>(user_data);
+  const RtpProtectionOptions &options = self->options_;
+  if (pt == options.mediaPt) {
+    return self->mediaCaps_ ? gst_caps_ref(self->mediaCaps_) : NULL;
+  }
+  const char *encoding = NULL;
+  guint apt = 0;
+  if (pt == options.redPt) {
+    encoding = "RED";
+  } else if (pt == options.fecPt) {
+    encoding = "ULPFEC";
+  } else if (pt == options.rtxPt || pt == options.redRtxPt) {
+    encoding = "RTX";
+    apt = pt == options.rtxPt ? options.mediaPt : options.redPt;
+  } else {
+    return NULL;
+  }
+  GstCaps *caps = gst_caps_new_simple(
+      "application/x-rtp", "media", G_TYPE_STRING, "video", "clock-rate",
+      G_TYPE_INT, 90000, "encoding-name", G_TYPE_STRING, encoding, "payload",
+      G_TYPE_INT, int(pt), NULL);
+  if (apt) {
+    gst_caps_set_simple(caps, "apt", G_TYPE_INT, int(apt), NULL);
+  }
+  return caps;
+}
+
+GstElement *RtpReceiverProtection::onRequestAuxReceiver(GstElement *,
+                                                        guint session,
+                                                        gpointer user_data) {
+  RtpReceiverProtection *self = static_cast<RtpReceiverProtection *>(user_data);
+  if (!self->options_.rtx) {
+    return NULL;
+  }
+  GstElement *rtx = gst_element_factory_make("rtprtxreceive", NULL);
+  if (rtx) {
+    setRtxMap(rtx, self->options_);
+  }
+  std::string id = std::to_string(session);
+  return makeBin({rtx}, "sink_" + id, "src_" + id);
+}
+
+GstElement *RtpReceiverProtection::onRequestFecDecoder(GstElement *rtpbin,
+                                                       guint session,
+                                                       gpointer user_data) {
+  RtpReceiverProtection *self = static_cast<RtpReceiverProtection *>(user_data);
+  const RtpProtectionOptions &options = self->options_;
+  if (!options.fec) {
+    return NULL;
+  }
+  // rtpbin keeps the packets FEC is computed over in its storage element
+  GstElement *storage = NULL;
+  g_signal_emit_by_name(rtpbin, "get-storage", session, &storage);
+  GstElement *red = gst_element_factory_make("rtpreddec", NULL);
+  GstElement *fec = gst_element_factory_make("rtpulpfecdec", NULL);
+  if (!storage || !red || !fec) {
+    std::cerr << "No FEC decoder, receiving without FEC." << std::endl;
+    for (GstElement *element : {storage, red, fec}) {
+      if (element) {
+        gst_object_unref(gst_object_ref_sink(element));
+      }
+    }
+    return NULL;
+  }
+  g_object_set(G_OBJECT(storage), "size-time",
+               guint64(options.latencyMs) * GST_MSECOND, NULL);
+  g_object_set(G_OBJECT(red), "pt", options.redPt, NULL);
+  g_object_set(G_OBJECT(fec), "pt", options.fecPt, "storage", storage, NULL);
+  gst_object_unref(storage);
+  self->track(self->fecDecoders_, fec);
+  return makeBin({red, fec}, "sink", "src");
+}
+
+void RtpReceiverProtection::onNewJitterbuffer(GstElement *,
+                                              GstElement *jitterbuffer, guint,
+                                              guint, gpointer user_data) {
+  RtpReceiverProtection *self = static_cast<RtpReceiverProtection *>(user_data);
+  self->track(self->jitterbuffers_, jitterbuffer);
+}
+
+void RtpReceiverProtection::track(std::vector<std::unique_ptr<GWeakRef>> &refs,
+                                  GstElement *element) {
+  std::unique_ptr<GWeakRef> ref(new GWeakRef);
+  g_weak_ref_init(ref.get(), element);
+  std::lock_guard<std::mutex> lock(elementsMutex_);
+  refs.push_back(std::move(ref));
+}
+
+std::vector<GstElement *>
+RtpReceiverProtection::alive(std::vector<std::unique_ptr<GWeakRef>> &refs) {
+  std::vector<GstElement *> elements;
+  std::lock_guard<std::mutex> lock(elementsMutex_);
+  for (auto it = refs.begin(); it != refs.end();) {
+    GstElement *element = GST_ELEMENT(g_weak_ref_get(it->get()));
+    if (!element) {
+      g_weak_ref_clear(it->get());
+      it = refs.erase(it);
+      continue;
+    }
+    elements.push_back(element);
+    ++it;
+  }
+  return elements;
+}
+
+gboolean RtpReceiverProtection::onPoll(gpointer user_data) {
+  static_cast<RtpReceiverProtection *>(user_data)->poll();
+  return G_SOURCE_CONTINUE;
+}
+
+void RtpReceiverProtection::poll() {
+  RtpReceiverStats stats;
+  double rttMs = 0;
+  std::vector<GstElement *> jitterbuffers = alive(jitterbuffers_);
+  std::vector<GstElement *> fecDecoders = alive(fecDecoders_);
+  for (GstElement *jitterbuffer : jitterbuffers) {
+    GstStructure *jb = NULL;
+    g_object_get(G_OBJECT(jitterbuffer), "stats", &jb, NULL);
+    if (!jb) {
+      continue;
+    }
+    stats.received += statsField(jb, "num-pushed");
+    stats.lost += statsField(jb, "num-lost");
+    stats.rtxRequests += statsField(jb, "rtx-count");
+    stats.rtxRecovered += statsField(jb, "rtx-success-count");
+    stats.jitterMs =
+        std::max(stats.jitterMs, statsField(jb, "avg-jitter") / 1e6);
+    rttMs = std::max(rttMs, statsField(jb, "rtx-rtt") / 1e6);
+    gst_structure_free(jb);
+  }
+  for (GstElement *fec : fecDecoders) {
+    guint recovered = 0;
+    g_object_get(G_OBJECT(fec), "recovered", &recovered, NULL);
+    stats.fecRecovered += recovered;
+  }
+
+  // Enough for the jitter, and with RTX for a request and its answer. A
+  // packet given up on raises it at once; a clean link brings it down slowly.
+  double target = 4 * stats.jitterMs;
+  if (options_.rtx) {
+    target += 2 * (rttMs > 0 ? rttMs : kDefaultRttMs);
+  }
+  unsigned latency = stats_.latencyMs;
+  if (stats.lost > stats_.lost) {
+    target = std::max(target, latency * 1.5);
+  } else {
+    target = std::max(target, latency * 0.9);
+  }
+  target = std::min<double>(std::max<double>(target, options_.minLatencyMs),
+                            options_.latencyMs);
+  stats.latencyMs = latency;
+  if (unsigned(target) + kLatencyStepMs <= latency ||
+      unsigned(target) >= latency + kLatencyStepMs) {
+    stats.latencyMs = unsigned(target);
+    for (GstElement *jitterbuffer : jitterbuffers) {
+      g_object_set(G_OBJECT(jitterbuffer), "latency", stats.latencyMs, NULL);
+    }
+  }
+  for (GstElement *element : jitterbuffers) {
+    gst_object_unref(element);
+  }
+  for (GstElement *element : fecDecoders) {
+    gst_object_unref(element);
+  }
+  stats_ = stats;
+
+  Metrics &metrics = Metrics::instance();
+  metrics.set("rgbd_rtp_received_total" + label_, double(stats.received));
+  metrics.set("rgbd_rtp_lost_total" + label_, double(stats.lost));
+  metrics.set("rgbd_rtp_rtx_requests_total" + label_,
+              double(stats.rtxRequests));
+  metrics.set("rgbd_rtp_rtx_recovered_total" + label_,
+              double(stats.rtxRecovered));
+  metrics.set("rgbd_rtp_fec_recovered_total" + label_,
+              double(stats.fecRecovered));
+  metrics.set("rgbd_rtp_latency_ms" + label_, stats.latencyMs);
+  metrics.set("rgbd_rtp_jitter_ms" + label_, stats.jitterMs);
+}
@@ -0,0 +1,323 @@
+#include "gst_rgbd_server/segment_recorder.h"
+
+#include <gst/app/gstappsrc.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+
+#include "gst_rgbd_server/metrics.h"
+
+namespace {
+
+// A frame without duration is taken to last this long
+const GstClockTime kDefaultFrameDuration = GST_SECOND / 30;
+
+gint64 steadyNowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+bool endsWith(const std::string &text, const std::string &suffix) {
+  return text.size() >= suffix.size() &&
+         text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+const char *parserFor(VideoCodec codec) {
+  switch (codec) {
+  case VideoCodec::kH264:
+    return "h264parse";
+  case VideoCodec::kH265:
+    return "h265parse";
+  case VideoCodec::kVP8:
+    break;
+  }
+  return "identity";
+}
+
+gboolean onBusMessage(GstBus *, GstMessage *message, gpointer user_data) {
+  if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR) {
+    GError *error = NULL;
+    gst_message_parse_error(message, &error, NULL);
+    std::cerr << "Recording " << static_cast<const char *>(user_data)
+              << " failed: " << error->message << std::endl;
+    g_error_free(error);
+  }
+  return TRUE;
+}
+
+} // namespace
+
+std::string recordingLocation(const std::string &location,
+                              const std::string &suffix) {
+  size_t slash = location.rfind('/');
+  size_t dot = location.rfind('.');
+  if (dot == std::string::npos ||
+      (slash != std::string::npos && dot < slash)) {
+    return location + suffix;
+  }
+  return location.substr(0, dot) + suffix + location.substr(dot);
+}
+
+SegmentRecorder::SegmentRecorder(const std::string &name,
+                                 const std::string &location,
+                                 VideoCodec codec,
+                                 const RecorderOptions &options, bool imuTrack)
+    : name_(name), label_("{recording=\"" + name + "\"}"), options_(options),
+      queued_(Metrics::instance().share("rgbd_recorder_queue_bytes" + label_)),
+      frames_(Metrics::instance().share("rgbd_recorder_frames_total" + label_)),
+      dropped_(
+          Metrics::instance().share("rgbd_recorder_dropped_total" + label_)) {
+  std::string muxer = endsWith(location, ".mp4") ? "mp4mux" : "matroskamux";
+  std::string launch =
+      "appsrc name=video format=time max-bytes=" +
+      std::to_string(options_.maxQueueBytes) + " ! " + parserFor(codec) +
+      " ! splitmuxsink name=sink location=\"" + location +
+      "\" max-size-time=" +
+      std::to_string(guint64(options_.segmentSeconds) * GST_SECOND) +
+      " max-files=" + std::to_string(options_.maxFiles) +
+      " muxer-factory=" + muxer;
+  if (imuTrack) {
+    launch += " appsrc name=imu format=time ! sink.subtitle_0";
+  }
+
+  GError *error = NULL;
+  GstElement *pipeline = gst_parse_launch(launch.c_str(), &error);
+  if (!pipeline || error) {
+    std::cerr << "Cannot record " << name_ << ": "
+              << (error ? error->message : "no pipeline") << std::endl;
+    if (error) {
+      g_error_free(error);
+    }
+    if (pipeline) {
+      gst_object_unref(pipeline);
+    }
+    return;
+  }
+  pipeline_ = pipeline;
+  video_ = gst_bin_get_by_name(GST_BIN(pipeline_), "video");
+  if (imuTrack) {
+    imu_ = gst_bin_get_by_name(GST_BIN(pipeline_), "imu");
+    GstCaps *caps =
+        gst_caps_new_simple("text/x-raw", "format", G_TYPE_STRING, "utf8", NULL);
+    g_object_set(G_OBJECT(imu_), "caps", caps, NULL);
+    gst_caps_unref(caps);
+  }
+
+  GstBus *bus = gst_element_get_bus(pipeline_);
+  gst_bus_add_watch_full(bus, G_PRIORITY_DEFAULT, onBusMessage,
+                         g_strdup(name_.c_str()), g_free);
+  gst_object_unref(bus);
+  if (gst_element_set_state(pipeline_, GST_STATE_PLAYING) ==
+      GST_STATE_CHANGE_FAILURE) {
+    std::cerr << "Cannot record " << name_ << " to " << location << std::endl;
+  } else {
+    std::cout << "Recording " << name_ << " to " << location << std::endl;
+  }
+}
+
+SegmentRecorder::~SegmentRecorder() {
+  detach();
+  if (pipeline_) {
+    // Let the muxer finish the open segment, an MP4 is unreadable without
+    // its index
+    gst_app_src_end_of_stream(GST_APP_SRC(video_));
+    if (imu_) {
+      gst_app_src_end_of_stream(GST_APP_SRC(imu_));
+    }
+    GstBus *bus = gst_element_get_bus(pipeline_);
+    GstMessage *message = gst_bus_timed_pop_filtered(
+        bus, 5 * GST_SECOND,
+        GstMessageType(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+    if (message) {
+      gst_message_unref(message);
+    }
+    gst_bus_remove_watch(bus);
+    gst_object_unref(bus);
+    gst_element_set_state(pipeline_, GST_STATE_NULL);
+    if (imu_) {
+      gst_object_unref(imu_);
+    }
+    gst_object_unref(video_);
+    gst_object_unref(pipeline_);
+  }
+  if (caps_) {
+    gst_caps_unref(caps_);
+  }
+  Metrics::instance().remove("recording=\"" + name_ + "\"");
+}
+
+void SegmentRecorder::attach(GstPad *pad) {
+  if (!pipeline_ || !pad) {
+    return;
+  }
+  detach();
+  std::lock_guard<std::mutex> lock(mutex_);
+  pad_ = GST_PAD(gst_object_ref(pad));
+  rebase_ = true;
+  needKeyframe_ = true;
+  probe_ = gst_pad_add_probe(
+      pad_,
+      GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER |
+                      GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+      &SegmentRecorder::onEncoded, this, NULL);
+  // The caps were sent before this probe, if the pad is running already
+  GstCaps *caps = gst_pad_get_current_caps(pad_);
+  if (caps) {
+    setCaps(caps);
+    gst_caps_unref(caps);
+  }
+}
+
+void SegmentRecorder::detach(GstPad *pad) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!pad_ || (pad && pad != pad_)) {
+    return;
+  }
+  // A call already in the probe sees pad_ changed and lets its frame pass
+  gst_pad_remove_probe(pad_, probe_);
+  gst_object_unref(pad_);
+  pad_ = nullptr;
+  probe_ = 0;
+}
+
+void SegmentRecorder::attach(GstRTSPMedia *media, GstElement *encoder) {
+  GstPad *pad = gst_element_get_static_pad(encoder, "src");
+  if (!pad) {
+    return;
+  }
+  attach(pad);
+  g_object_set_data_full(G_OBJECT(media), "recorder-pad", pad,
+                         gst_object_unref);
+  g_signal_connect(media, "unprepared",
+                   G_CALLBACK(+[](GstRTSPMedia *media, gpointer recorder) {
+                     static_cast<SegmentRecorder *>(recorder)->detach(
+                         static_cast<GstPad *>(g_object_get_data(
+                             G_OBJECT(media), "recorder-pad")));
+                   }),
+                   this);
+}
+
+GstPadProbeReturn SegmentRecorder::onEncoded(GstPad *pad,
+                                             GstPadProbeInfo *info,
+                                             gpointer user_data) {
+  SegmentRecorder *recorder = static_cast<SegmentRecorder *>(user_data);
+  std::lock_guard<std::mutex> lock(recorder->mutex_);
+  if (pad != recorder->pad_) {
+    return GST_PAD_PROBE_OK;
+  }
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+    recorder->push(GST_PAD_PROBE_INFO_BUFFER(info));
+  } else {
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+    if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+      GstCaps *caps = NULL;
+      gst_event_parse_caps(event, &caps);
+      recorder->setCaps(caps);
+    }
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+void SegmentRecorder::setCaps(GstCaps *caps) {
+  if (caps_ && gst_caps_is_equal(caps_, caps)) {
+    return;
+  }
+  // The muxers take no caps changes within a file, so new caps, e.g. after
+  // the rate controller lowered the resolution, start the next segment
+  if (caps_) {
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline_), "sink");
+    g_signal_emit_by_name(sink, "split-now");
+    gst_object_unref(sink);
+    gst_caps_unref(caps_);
+    needKeyframe_ = true;
+  }
+  caps_ = gst_caps_ref(caps);
+  gst_app_src_set_caps(GST_APP_SRC(video_), caps_);
+}
+
+void SegmentRecorder::push(GstBuffer *frame) {
+  bool keyframe = !GST_BUFFER_FLAG_IS_SET(frame, GST_BUFFER_FLAG_DELTA_UNIT);
+  GstClockTime start = GST_BUFFER_DTS_OR_PTS(frame);
+  if ((needKeyframe_ && !keyframe) || !GST_CLOCK_TIME_IS_VALID(start)) {
+    return;
+  }
+
+  guint64 level = gst_app_src_get_current_level_bytes(GST_APP_SRC(video_));
+  *queued_ = double(level);
+  if (level + gst_buffer_get_size(frame) > options_.maxQueueBytes) {
+    // The disk is behind; what is left of this GOP cannot be decoded anyway
+    needKeyframe_ = true;
+    Metrics::add(*dropped_, 1);
+    return;
+  }
+  needKeyframe_ = false;
+  if (rebase_) {
+    offset_ = GST_CLOCK_DIFF(start, end_);
+    rebase_ = false;
+  }
+
+  // Shares the encoded memory, only the timestamps are the recorder's own
+  GstBuffer *copy = gst_buffer_copy(frame);
+  GstClockTime pts = GST_BUFFER_PTS(frame);
+  if (GST_CLOCK_TIME_IS_VALID(pts)) {
+    GST_BUFFER_PTS(copy) = GstClockTime(std::max<GstClockTimeDiff>(
+        0, GstClockTimeDiff(pts) + offset_));
+  }
+  GstClockTime dts = GST_BUFFER_DTS(frame);
+  if (GST_CLOCK_TIME_IS_VALID(dts)) {
+    GST_BUFFER_DTS(copy) = GstClockTime(std::max<GstClockTimeDiff>(
+        0, GstClockTimeDiff(dts) + offset_));
+  }
+  GstClockTime duration = GST_BUFFER_DURATION(frame);
+  GstClockTime out = GST_BUFFER_DTS_OR_PTS(copy);
+  end_ = std::max(end_, out + (GST_CLOCK_TIME_IS_VALID(duration)
+                                   ? duration
+                                   : kDefaultFrameDuration));
+  lastPts_ = GST_BUFFER_PTS(copy);
+  lastHostNs_ = steadyNowNs();
+
+  if (gst_app_src_push_buffer(GST_APP_SRC(video_), copy) == GST_FLOW_OK) {
+    Metrics::add(*frames_, 1);
+  }
+}
+
+void SegmentRecorder::pushImu(const CameraFrameSet &frames) {
+  if (!imu_ || (!frames.hasAccel && !frames.hasGyro)) {
+    return;
+  }
+  GstClockTime pts;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!pad_ || needKeyframe_ || !GST_CLOCK_TIME_IS_VALID(lastPts_)) {
+      return;
+    }
+    // Placed next to the last frame by the steady clock; off by no more
+    // than the encoder's latency
+    GstClockTimeDiff sinceFrame =
+        GstClockTimeDiff(frames.timestampNs) - lastHostNs_;
+    pts = GstClockTime(std::max<GstClockTimeDiff>(
+        GstClockTimeDiff(lastImuPts_), GstClockTimeDiff(lastPts_) + sinceFrame));
+    lastImuPts_ = pts;
+  }
+
+  char line[160];
+  int length = 0;
+  if (frames.hasAccel) {
+    length += snprintf(line + length, sizeof(line) - length,
+                       "accel %.4f %.4f %.4f", frames.accel[0],
+                       frames.accel[1], frames.accel[2]);
+  }
+  if (frames.hasGyro) {
+    length += snprintf(line + length, sizeof(line) - length,
+                       "%sgyro %.4f %.4f %.4f", length ? " " : "",
+                       frames.gyro[0], frames.gyro[1], frames.gyro[2]);
+  }
+  GstBuffer *buffer = gst_buffer_new_allocate(NULL, gsize(length), NULL);
+  gst_buffer_fill(buffer, 0, line, gsize(length));
+  GST_BUFFER_PTS(buffer) = pts;
+  GST_BUFFER_DURATION(buffer) = kDefaultFrameDuration;
+  gst_app_src_push_buffer(GST_APP_SRC(imu_), buffer);
+}
@@ -0,0 +1,164 @@
+#include "gst_rgbd_server/shm_elements.h"
+
+#include <gst/app/gstappsink.h>
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+ShmRingSource::ShmRingSource(const std::string &ring, RgbdStreamKind kind,
+                             GstElement *appsrc, const QueuePolicy &policy)
+    : ring_(ring), kind_(kind), queue_(appsrc, "shm:" + ring, policy) {
+  g_object_set(G_OBJECT(appsrc), "is-live", TRUE, "do-timestamp", TRUE, NULL);
+  gst_util_set_object_arg(G_OBJECT(appsrc), "format", "time");
+}
+
+ShmRingSource::~ShmRingSource() { stop(); }
+
+void ShmRingSource::start() {
+  if (running_.exchange(true)) {
+    return;
+  }
+  thread_ = std::thread(&ShmRingSource::run, this);
+}
+
+void ShmRingSource::stop() {
+  running_ = false;
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void ShmRingSource::updateCaps(const ShmImageInfo &info) {
+  if (info.format == format_ && info.width == width_ &&
+      info.height == height_) {
+    return;
+  }
+  const char *format = gstVideoFormat(RgbdPixelFormat(info.format));
+  GstCaps *caps = gst_caps_new_simple(
+      "video/x-raw", "format", G_TYPE_STRING, format, "width", G_TYPE_INT,
+      int(info.width), "height", G_TYPE_INT, int(info.height), "framerate",
+      GST_TYPE_FRACTION, 0, 1, NULL);
+  g_object_set(G_OBJECT(queue_.element()), "caps", caps, NULL);
+  gst_caps_unref(caps);
+  format_ = info.format;
+  width_ = info.width;
+  height_ = info.height;
+}
+
+void ShmRingSource::run() {
+  ShmFrameReader reader;
+  while (running_) {
+    if (!reader.isOpen() || reader.writerClosed()) {
+      // The writer is not up yet or restarted with a new ring
+      if (!reader.open(ring_)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        continue;
+      }
+    }
+    ShmFrameView view;
+    if (!reader.acquire(view, 100)) {
+      continue;
+    }
+    int index = view.find(kind_);
+    if (index < 0) {
+      continue;
+    }
+    const ShmImageInfo &info = view.images[index];
+    if (!gstVideoFormat(RgbdPixelFormat(info.format)) || !info.width ||
+        !info.height) {
+      continue;
+    }
+
+    // appsrc without GstVideoMeta means rows padded to 4 bytes
+    size_t row = size_t(info.stride / info.width) * info.width;
+    size_t stride = (row + 3) & ~size_t(3);
+    GstBuffer *buffer = gst_buffer_new_allocate(NULL, stride * info.height,
+                                                NULL);
+    GstMapInfo map;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_WRITE)) {
+      gst_buffer_unref(buffer);
+      continue;
+    }
+    if (stride == info.stride) {
+      memcpy(map.data, view.data[index], stride * info.height);
+    } else {
+      for (uint32_t y = 0; y < info.height; ++y) {
+        memcpy(map.data + y * stride, view.data[index] + y * info.stride, row);
+      }
+    }
+    gst_buffer_unmap(buffer, &map);
+    // Overwritten while copying: drop it, the next one is newer anyway
+    if (!reader.release(view)) {
+      gst_buffer_unref(buffer);
+      continue;
+    }
+    updateCaps(info);
+    if (queue_.push(buffer) != GST_FLOW_OK) {
+      break;
+    }
+  }
+}
+
+ShmRingSink::ShmRingSink(const std::string &ring, RgbdStreamKind kind,
+                         GstElement *appsink, uint32_t slotCount,
+                         uint64_t slotBytes)
+    : kind_(kind), appsink_(GST_ELEMENT(gst_object_ref(appsink))) {
+  if (!writer_.open(ring, slotCount, slotBytes)) {
+    return;
+  }
+  g_object_set(G_OBJECT(appsink), "emit-signals", TRUE, "sync", FALSE, NULL);
+  handler_ = g_signal_connect(appsink, "new-sample",
+                              G_CALLBACK(&ShmRingSink::onNewSample), this);
+}
+
+ShmRingSink::~ShmRingSink() {
+  if (handler_) {
+    g_signal_handler_disconnect(appsink_, handler_);
+  }
+  gst_object_unref(appsink_);
+}
+
+GstFlowReturn ShmRingSink::onNewSample(GstElement *appsink,
+                                       gpointer user_data) {
+  GstSample *sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink));
+  if (!sample) {
+    return GST_FLOW_EOS;
+  }
+  static_cast<ShmRingSink *>(user_data)->write(sample);
+  gst_sample_unref(sample);
+  return GST_FLOW_OK;
+}
+
+void ShmRingSink::write(GstSample *sample) {
+  GstStructure *structure =
+      gst_caps_get_structure(gst_sample_get_caps(sample), 0);
+  const gchar *format = gst_structure_get_string(structure, "format");
+  ShmImage image;
+  image.kind = kind_;
+  image.image.format = pixelFormatFromGst(format ? format : "");
+  if (image.image.format == RgbdPixelFormat::kUnknown ||
+      !gst_structure_get_int(structure, "width", &image.image.width) ||
+      !gst_structure_get_int(structure, "height", &image.image.height) ||
+      image.image.height <= 0) {
+    return;
+  }
+  GstBuffer *buffer = gst_sample_get_buffer(sample);
+  GstMapInfo map;
+  if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+    return;
+  }
+  image.image.data = map.data;
+  image.image.size = map.size;
+  image.image.stride = int(map.size / image.image.height);
+  // Pipeline timestamps are running time, readers expect the steady clock
+  uint64_t timestampNs =
+      uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+                   .count());
+  if (!writer_.write(++frames_, timestampNs, &image, 1)) {
+    std::cerr << "Frame of " << map.size << " bytes does not fit the ring."
+              << std::endl;
+  }
+  gst_buffer_unmap(buffer, &map);
+}
@@ -0,0 +1,304 @@
+#include "gst_rgbd_server/shm_frame_ring.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+// Image payloads start on cache lines
+constexpr uint64_t kImageAlignment = 64;
+
+uint64_t alignUp(uint64_t value, uint64_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+std::string shmPath(const std::string &name) {
+  return name.empty() || name[0] != '/' ? "/" + name : name;
+}
+
+uint32_t *futexWord(const std::atomic<uint32_t> &word) {
+  return reinterpret_cast<uint32_t *>(
+      const_cast<std::atomic<uint32_t> *>(&word));
+}
+
+// Not FUTEX_PRIVATE_FLAG, the readers live in other processes
+void futexWait(const std::atomic<uint32_t> &word, uint32_t expected,
+               int timeoutMs) {
+  struct timespec timeout;
+  timeout.tv_sec = timeoutMs / 1000;
+  timeout.tv_nsec = long(timeoutMs % 1000) * 1000000;
+  syscall(SYS_futex, futexWord(word), FUTEX_WAIT, expected, &timeout, NULL,
+          0);
+}
+
+void futexWakeAll(const std::atomic<uint32_t> &word) {
+  syscall(SYS_futex, futexWord(word), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+} // namespace
+
+ShmFrameWriter::~ShmFrameWriter() { close(); }
+
+bool ShmFrameWriter::open(const std::string &name, uint32_t slotCount,
+                          uint64_t slotBytes) {
+  close();
+  if (slotCount < 2 || !slotBytes) {
+    std::cerr << "Shared memory ring needs 2 or more non-empty slots."
+              << std::endl;
+    return false;
+  }
+  std::string path = shmPath(name);
+  // Readers still mapping a stale ring keep it, and see it closed
+  shm_unlink(path.c_str());
+  int fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) {
+    std::cerr << "Failed to create shared memory " << path << ": "
+              << strerror(errno) << std::endl;
+    return false;
+  }
+  uint64_t slotStride =
+      kShmRingAlignment + alignUp(slotBytes, kShmRingAlignment);
+  size_t bytes = kShmRingAlignment + size_t(slotStride) * slotCount;
+  void *base = MAP_FAILED;
+  if (ftruncate(fd, off_t(bytes)) == 0) {
+    base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  ::close(fd);
+  if (base == MAP_FAILED) {
+    std::cerr << "Failed to map shared memory " << path << ": "
+              << strerror(errno) << std::endl;
+    shm_unlink(path.c_str());
+    return false;
+  }
+
+  // ftruncate zero fills, so every generation starts at 0 (never written)
+  header_ = static_cast<ShmRingHeader *>(base);
+  header_->version = kShmRingVersion;
+  header_->slotCount = slotCount;
+  header_->slotBytes = slotBytes;
+  header_->slotStride = slotStride;
+  // Readers check the magic last, after everything else is in place
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(header_->magic, kShmRingMagic, sizeof(kShmRingMagic));
+  name_ = path;
+  mappedBytes_ = bytes;
+  sequence_ = 0;
+  return true;
+}
+
+void ShmFrameWriter::close() {
+  if (!header_) {
+    return;
+  }
+  header_->closed.store(1, std::memory_order_release);
+  header_->wake.fetch_add(1, std::memory_order_release);
+  futexWakeAll(header_->wake);
+  munmap(header_, mappedBytes_);
+  shm_unlink(name_.c_str());
+  header_ = nullptr;
+}
+
+bool ShmFrameWriter::write(uint64_t frameNumber, uint64_t timestampNs,
+                           const ShmImage *images, size_t count) {
+  if (!header_ || count > kShmMaxImages) {
+    return false;
+  }
+  uint64_t payload = 0;
+  for (size_t i = 0; i < count; ++i) {
+    payload = alignUp(payload, kImageAlignment) + images[i].image.size;
+  }
+  if (payload > header_->slotBytes) {
+    return false;
+  }
+
+  uint64_t sequence = sequence_ + 1;
+  uint8_t *base = reinterpret_cast<uint8_t *>(header_) + kShmRingAlignment +
+                  (sequence % header_->slotCount) * header_->slotStride;
+  ShmSlotHeader *slot = reinterpret_cast<ShmSlotHeader *>(base);
+  uint8_t *data = base + kShmRingAlignment;
+
+  // Odd while writing: a reader still on the previous frame set of this
+  // slot notices on release()
+  slot->generation.store(2 * sequence - 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  uint64_t offset = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const ShmImage &image = images[i];
+    offset = alignUp(offset, kImageAlignment);
+    ShmImageInfo &info = slot->images[i];
+    info = ShmImageInfo();
+    info.kind = uint32_t(image.kind);
+    info.format = uint32_t(image.image.format);
+    info.width = uint32_t(image.image.width);
+    info.height = uint32_t(image.image.height);
+    info.stride = uint32_t(image.image.stride);
+    info.size = uint32_t(image.image.size);
+    info.offset = offset;
+    info.intrinsics = image.intrinsics;
+    info.depthScale = image.depthScale;
+    memcpy(data + offset, image.image.data, image.image.size);
+    offset += image.image.size;
+  }
+  slot->frameNumber = frameNumber;
+  slot->timestampNs = timestampNs;
+  slot->imageCount = uint32_t(count);
+
+  slot->generation.store(2 * sequence, std::memory_order_release);
+  header_->published.store(sequence, std::memory_order_release);
+  sequence_ = sequence;
+  header_->wake.fetch_add(1, std::memory_order_release);
+  futexWakeAll(header_->wake);
+  return true;
+}
+
+int ShmFrameView::find(RgbdStreamKind kind) const {
+  for (uint32_t i = 0; i < imageCount; ++i) {
+    if (images[i].kind == uint32_t(kind)) {
+      return int(i);
+    }
+  }
+  return -1;
+}
+
+ShmFrameReader::~ShmFrameReader() { close(); }
+
+bool ShmFrameReader::open(const std::string &name) {
+  close();
+  std::string path = shmPath(name);
+  int fd = shm_open(path.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  void *base = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && size_t(st.st_size) >= kShmRingAlignment) {
+    base = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+  }
+  ::close(fd);
+  if (base == MAP_FAILED) {
+    return false;
+  }
+
+  ShmRingHeader *header = static_cast<ShmRingHeader *>(base);
+  bool valid =
+      memcmp(header->magic, kShmRingMagic, sizeof(kShmRingMagic)) == 0;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  valid = valid && header->version == kShmRingVersion &&
+          header->slotCount >= 2 &&
+          kShmRingAlignment + header->slotStride * header->slotCount <=
+              uint64_t(st.st_size);
+  if (!valid) {
+    // Not ours, or the writer is still setting it up
+    munmap(base, size_t(st.st_size));
+    return false;
+  }
+  header_ = header;
+  mappedBytes_ = size_t(st.st_size);
+  // Start at the newest frame set, not at whatever the ring still holds
+  last_ = header_->published.load(std::memory_order_acquire);
+  if (last_) {
+    --last_;
+  }
+  skipped_ = 0;
+  return true;
+}
+
+void ShmFrameReader::close() {
+  if (header_) {
+    munmap(header_, mappedBytes_);
+    header_ = nullptr;
+  }
+}
+
+bool ShmFrameReader::writerClosed() const {
+  return header_ && header_->closed.load(std::memory_order_acquire);
+}
+
+const ShmSlotHeader *ShmFrameReader::slot(uint64_t sequence) const {
+  const uint8_t *base = reinterpret_cast<const uint8_t *>(header_);
+  return reinterpret_cast<const ShmSlotHeader *>(
+      base + kShmRingAlignment +
+      (sequence % header_->slotCount) * header_->slotStride);
+}
+
+// Copies the slot's metadata, then checks it was not rewritten meanwhile, so
+// offsets and sizes are never taken from a half written header.
+bool ShmFrameReader::load(uint64_t sequence, ShmFrameView &view) const {
+  const ShmSlotHeader *s = slot(sequence);
+  if (s->generation.load(std::memory_order_acquire) != 2 * sequence) {
+    return false;
+  }
+  view.sequence = sequence;
+  view.frameNumber = s->frameNumber;
+  view.timestampNs = s->timestampNs;
+  view.imageCount = std::min<uint32_t>(s->imageCount, kShmMaxImages);
+  memcpy(view.images, s->images, sizeof(view.images));
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (s->generation.load(std::memory_order_relaxed) != 2 * sequence) {
+    return false;
+  }
+  const uint8_t *data =
+      reinterpret_cast<const uint8_t *>(s) + kShmRingAlignment;
+  for (uint32_t i = 0; i < view.imageCount; ++i) {
+    const ShmImageInfo &info = view.images[i];
+    if (info.offset + info.size > header_->slotBytes) {
+      return false;
+    }
+    view.data[i] = data + info.offset;
+  }
+  return true;
+}
+
+bool ShmFrameReader::acquire(ShmFrameView &view, int timeoutMs) {
+  if (!header_) {
+    return false;
+  }
+  auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+  for (;;) {
+    uint32_t wake = header_->wake.load(std::memory_order_acquire);
+    uint64_t published = header_->published.load(std::memory_order_acquire);
+    while (published > last_) {
+      uint64_t next = last_ + 1;
+      // The writer is about to reuse the slot after next: skip ahead
+      if (published - next + 2 >= header_->slotCount) {
+        next = published;
+      }
+      skipped_ += next - last_ - 1;
+      if (load(next, view)) {
+        last_ = next;
+        return true;
+      }
+      // Overwritten between the two loads, retry from the newest
+      skipped_ += 1;
+      last_ = next;
+      published = header_->published.load(std::memory_order_acquire);
+    }
+    if (header_->closed.load(std::memory_order_acquire)) {
+      return false;
+    }
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now());
+    if (remaining.count() <= 0) {
+      return false;
+    }
+    futexWait(header_->wake, wake, int(remaining.count()));
+  }
+}
+
+bool ShmFrameReader::release(const ShmFrameView &view) const {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return header_ && slot(view.sequence)->generation.load(
+                        std::memory_order_relaxed) == 2 * view.sequence;
+}
@@ -0,0 +1,180 @@
+#include <gst/gst.h>
+#include <opencv2/opencv.hpp>
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+
+#include "gst_rgbd_server/shm_elements.h"
+#include "gst_rgbd_server/shm_frame_ring.h"
+
+static gchar *ringName = nullptr;
+static gchar *launch = nullptr;
+static gboolean noDisplay = FALSE;
+
+static GOptionEntry entries[] = {
+    {"ring", 'r', 0, G_OPTION_ARG_STRING, &ringName,
+     "Shared memory ring to read, as passed to --shm (default: rgbd)",
+     "NAME"},
+    {"launch", 'l', 0, G_OPTION_ARG_STRING, &launch,
+     "Feed color into the appsrc named shmsrc of this pipeline instead of "
+     "showing it, e.g. \"appsrc name=shmsrc ! videoconvert ! autovideosink\"",
+     "PIPELINE"},
+    {"no-display", 0, 0, G_OPTION_ARG_NONE, &noDisplay,
+     "Only print frame rate and latency", NULL},
+    {NULL}};
+
+static uint64_t steadyNowNs() {
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch())
+                        .count());
+}
+
+static cv::Mat showable(const ShmImageInfo &info, const uint8_t *data) {
+    switch (RgbdPixelFormat(info.format)) {
+    case RgbdPixelFormat::kBGR8:
+        return cv::Mat(info.height, info.width, CV_8UC3, (void *)data,
+                       info.stride).clone();
+    case RgbdPixelFormat::kRGB8: {
+        cv::Mat bgr;
+        cv::cvtColor(cv::Mat(info.height, info.width, CV_8UC3, (void *)data,
+                             info.stride),
+                     bgr, cv::COLOR_RGB2BGR);
+        return bgr;
+    }
+    case RgbdPixelFormat::kYUYV:
+    case RgbdPixelFormat::kUYVY: {
+        cv::Mat bgr;
+        cv::cvtColor(cv::Mat(info.height, info.width, CV_8UC2, (void *)data,
+                             info.stride),
+                     bgr,
+                     RgbdPixelFormat(info.format) == RgbdPixelFormat::kYUYV
+                         ? cv::COLOR_YUV2BGR_YUYV
+                         : cv::COLOR_YUV2BGR_UYVY);
+        return bgr;
+    }
+    case RgbdPixelFormat::kZ16:
+        return cv::Mat(info.height, info.width, CV_16UC1, (void *)data,
+                       info.stride).clone();
+    default:
+        return cv::Mat();
+    }
+}
+
+// Runs the ring's color through a user pipeline, until it ends or fails.
+static int runPipeline(const std::string &ring) {
+    GError *error = NULL;
+    GstElement *pipeline = gst_parse_launch(launch, &error);
+    if (error) {
+        std::cerr << "Invalid pipeline: " << error->message << std::endl;
+        g_clear_error(&error);
+        if (pipeline) {
+            gst_object_unref(pipeline);
+        }
+        return -1;
+    }
+    GstElement *appsrc = gst_bin_get_by_name(GST_BIN(pipeline), "shmsrc");
+    if (!appsrc) {
+        std::cerr << "The pipeline has no appsrc named shmsrc." << std::endl;
+        gst_object_unref(pipeline);
+        return -1;
+    }
+    std::unique_ptr<ShmRingSource> source(
+        new ShmRingSource(ring, RgbdStreamKind::kColor, appsrc));
+    gst_object_unref(appsrc);
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    source->start();
+
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstMessage *msg = gst_bus_timed_pop_filtered(
+        bus, GST_CLOCK_TIME_NONE,
+        GstMessageType(GST_MESSAGE_ERROR | GST_MESSAGE_EOS));
+    int ret = GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR ? -1 : 0;
+    gst_message_unref(msg);
+    gst_object_unref(bus);
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    source.reset();
+    gst_object_unref(pipeline);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    GError *error = NULL;
+    GOptionContext *optctx =
+        g_option_context_new("- viewer of a shared memory frame ring");
+    g_option_context_add_main_entries(optctx, entries, NULL);
+    g_option_context_add_group(optctx, gst_init_get_option_group());
+    if (!g_option_context_parse(optctx, &argc, &argv, &error)) {
+        std::cerr << "Error parsing options: " << error->message << std::endl;
+        g_option_context_free(optctx);
+        g_clear_error(&error);
+        return -1;
+    }
+    g_option_context_free(optctx);
+    std::string ring = ringName ? ringName : "rgbd";
+
+    if (launch) {
+        return runPipeline(ring);
+    }
+
+    ShmFrameReader reader;
+    uint64_t frames = 0;
+    uint64_t torn = 0;
+    double latencyMs = 0;
+    uint64_t reportNs = steadyNowNs();
+    while (true) {
+        if (!reader.isOpen() || reader.writerClosed()) {
+            if (!reader.open(ring)) {
+                std::cout << "Waiting for /dev/shm/" << ring << std::endl;
+                g_usleep(500000);
+                continue;
+            }
+        }
+        ShmFrameView view;
+        if (!reader.acquire(view, 1000)) {
+            continue;
+        }
+        latencyMs += (steadyNowNs() - view.timestampNs) / 1e6;
+        cv::Mat color, depth;
+        int c = view.find(RgbdStreamKind::kColor);
+        int d = view.find(RgbdStreamKind::kDepth);
+        if (!noDisplay && c >= 0) {
+            color = showable(view.images[c], view.data[c]);
+        }
+        if (!noDisplay && d >= 0) {
+            depth = showable(view.images[d], view.data[d]);
+        }
+        // The copies above are torn if the writer lapped us meanwhile
+        if (!reader.release(view)) {
+            ++torn;
+            continue;
+        }
+        ++frames;
+
+        uint64_t now = steadyNowNs();
+        if (now - reportNs >= 1000000000ull) {
+            std::cout << frames << " frame sets, capture to read "
+                      << latencyMs / std::max<uint64_t>(frames, 1)
+                      << " ms, skipped " << reader.skipped() << ", torn "
+                      << torn << std::endl;
+            frames = 0;
+            latencyMs = 0;
+            reportNs = now;
+        }
+        if (noDisplay) {
+            continue;
+        }
+        if (!color.empty()) {
+            cv::imshow("Shared Color", color);
+        }
+        if (!depth.empty()) {
+            cv::imshow("Shared Depth", depth);
+        }
+        if (cv::waitKey(1) == 27) {
+            break;
+        }
+    }
+    cv::destroyAllWindows();
+    return 0;
+}
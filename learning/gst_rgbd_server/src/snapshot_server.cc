@@ -0,0 +1,312 @@
+#include "gst_rgbd_server/snapshot_server.h"
+
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <opencv2/imgcodecs.hpp>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#include "gst_rgbd_server/cv_image.h"
+#include "gst_rgbd_server/metrics.h"
+
+namespace {
+
+// A client gets this long to send its whole request, and as long again to
+// take the whole response; a deadline, so trickling bytes does not extend it
+const int kClientTimeoutMs = 1000;
+const size_t kMaxRequestBytes = 2048;
+const int kJpegQuality = 90;
+
+using Deadline = std::chrono::steady_clock::time_point;
+
+Deadline clientDeadline() {
+  return std::chrono::steady_clock::now() +
+         std::chrono::milliseconds(kClientTimeoutMs);
+}
+
+// Milliseconds left until deadline, 0 once it passed
+int msUntil(Deadline deadline) {
+  auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  deadline - std::chrono::steady_clock::now())
+                  .count();
+  return left > 0 ? int(left) : 0;
+}
+
+bool sendAll(int fd, const void *data, size_t size, Deadline deadline) {
+  const char *bytes = static_cast<const char *>(data);
+  while (size) {
+    ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent < 0 && errno == EAGAIN) {
+      pollfd wait = {fd, POLLOUT, 0};
+      if (poll(&wait, 1, msUntil(deadline)) <= 0) {
+        return false;
+      }
+      continue;
+    }
+    if (sent <= 0) {
+      return false;
+    }
+    bytes += sent;
+    size -= size_t(sent);
+  }
+  return true;
+}
+
+void respond(int fd, const char *status, const char *type,
+             const std::string &extraHeaders, const void *body, size_t size,
+             bool head) {
+  std::string header = std::string("HTTP/1.0 ") + status +
+                       "\r\nContent-Type: " + type +
+                       "\r\nContent-Length: " + std::to_string(size) +
+                       "\r\nCache-Control: no-store\r\n" + extraHeaders +
+                       "Connection: close\r\n\r\n";
+  Deadline deadline = clientDeadline();
+  if (sendAll(fd, header.data(), header.size(), deadline) && !head && size) {
+    sendAll(fd, body, size, deadline);
+  }
+}
+
+} // namespace
+
+SnapshotServer::SnapshotServer()
+    : requests_(Metrics::instance().gauge("rgbd_snapshot_requests_total")),
+      encodes_(Metrics::instance().gauge("rgbd_snapshot_encodes_total")) {}
+
+SnapshotServer::~SnapshotServer() { stop(); }
+
+bool SnapshotServer::start(const std::string &endpoint) {
+  stop();
+  if (endpoint.compare(0, 5, "unix:") == 0) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::string path = endpoint.substr(5);
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+      std::cerr << "Invalid snapshot socket " << path << std::endl;
+      return false;
+    }
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    // A socket left behind by an earlier run
+    unlink(path.c_str());
+    listenFd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd_ >= 0 &&
+        bind(listenFd_, reinterpret_cast<sockaddr *>(&address),
+             sizeof(address)) == 0) {
+      unixPath_ = path;
+    } else if (listenFd_ >= 0) {
+      ::close(listenFd_);
+      listenFd_ = -1;
+    }
+  } else {
+    size_t colon = endpoint.rfind(':');
+    std::string host =
+        colon == std::string::npos ? "127.0.0.1" : endpoint.substr(0, colon);
+    std::string port =
+        colon == std::string::npos ? endpoint : endpoint.substr(colon + 1);
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *result = NULL;
+    int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+    if (error) {
+      std::cerr << "Failed to resolve " << endpoint << ": "
+                << gai_strerror(error) << std::endl;
+      return false;
+    }
+    listenFd_ = socket(result->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int reuse = 1;
+    if (listenFd_ >= 0) {
+      setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+      if (bind(listenFd_, result->ai_addr, result->ai_addrlen) != 0) {
+        ::close(listenFd_);
+        listenFd_ = -1;
+      }
+    }
+    freeaddrinfo(result);
+  }
+  if (listenFd_ < 0 || listen(listenFd_, 64) != 0 || pipe(wakeFds_) != 0) {
+    std::cerr << "Cannot serve snapshots on " << endpoint << ": "
+              << strerror(errno) << std::endl;
+    stop();
+    return false;
+  }
+  thread_ = std::thread(&SnapshotServer::run, this);
+  std::cout << "Snapshots on " << endpoint << ": /color.jpg /color.png "
+            << "/depth.png" << std::endl;
+  return true;
+}
+
+void SnapshotServer::stop() {
+  if (thread_.joinable()) {
+    char wake = 0;
+    if (write(wakeFds_[1], &wake, 1) < 0) {
+      std::cerr << "Cannot wake the snapshot thread." << std::endl;
+    }
+    thread_.join();
+  }
+  for (int &fd : wakeFds_) {
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+  if (listenFd_ >= 0) {
+    ::close(listenFd_);
+    listenFd_ = -1;
+  }
+  if (!unixPath_.empty()) {
+    unlink(unixPath_.c_str());
+    unixPath_.clear();
+  }
+}
+
+void SnapshotServer::publish(const CameraFrameSet &frames) {
+  Slot &slot = slots_[back_];
+  slot.frameId = frames.frameNumber;
+  slot.timestampNs = frames.timestampNs;
+  slot.color = frames.color;
+  slot.depth = frames.depth;
+  slot.keepAlive = frames.keepAlive;
+  back_ = middle_.exchange(uint8_t(back_ | kFresh)) & 3;
+}
+
+const SnapshotServer::Slot &SnapshotServer::latest() {
+  if (middle_.load() & kFresh) {
+    front_ = middle_.exchange(front_) & 3;
+  }
+  return slots_[front_];
+}
+
+void SnapshotServer::run() {
+  pollfd fds[2] = {{listenFd_, POLLIN, 0}, {wakeFds_[0], POLLIN, 0}};
+  while (true) {
+    if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+      break;
+    }
+    if (fds[1].revents) {
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      int fd = accept4(listenFd_, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+      if (fd >= 0) {
+        serve(fd);
+        ::close(fd);
+      }
+    }
+  }
+}
+
+void SnapshotServer::serve(int fd) {
+  char request[kMaxRequestBytes];
+  size_t size = 0;
+  Deadline deadline = clientDeadline();
+  while (size < sizeof(request) - 1) {
+    pollfd wait = {fd, POLLIN, 0};
+    if (poll(&wait, 1, msUntil(deadline)) <= 0) {
+      return;
+    }
+    ssize_t got = recv(fd, request + size, sizeof(request) - 1 - size, 0);
+    if (got <= 0) {
+      return;
+    }
+    size += size_t(got);
+    request[size] = '\0';
+    if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+      break;
+    }
+  }
+  request[size] = '\0';
+
+  // "GET /color.jpg?anything HTTP/1.1"
+  char method[8] = {0};
+  char target[256] = {0};
+  if (sscanf(request, "%7s %255s", method, target) != 2) {
+    respond(fd, "400 Bad Request", "text/plain", "", "", 0, false);
+    return;
+  }
+  bool head = strcmp(method, "HEAD") == 0;
+  if (!head && strcmp(method, "GET") != 0) {
+    respond(fd, "405 Method Not Allowed", "text/plain", "", "", 0, false);
+    return;
+  }
+  std::string path = target;
+  path = path.substr(0, path.find('?'));
+
+  const Slot &slot = latest();
+  Encoded *encoded = nullptr;
+  const char *type = nullptr;
+  if (!encode(path, slot, encoded, type)) {
+    const char *status = type ? "503 Service Unavailable" : "404 Not Found";
+    respond(fd, status, "text/plain", "", "", 0, head);
+    return;
+  }
+  Metrics::add(requests_, 1);
+  std::string headers = "X-Frame-Id: " + std::to_string(slot.frameId) +
+                        "\r\nX-Timestamp-Ns: " +
+                        std::to_string(slot.timestampNs) + "\r\n";
+  respond(fd, "200 OK", type, headers, encoded->bytes.data(),
+          encoded->bytes.size(), head);
+}
+
+// Sets out to the image for path, encoded at most once per frame. False with
+// type unset for an unknown path, with type set if there is no such image
+// yet.
+bool SnapshotServer::encode(const std::string &path, const Slot &slot,
+                            Encoded *&out, const char *&type) {
+  const CameraImage *image = nullptr;
+  const char *extension = nullptr;
+  if (path == "/color.jpg") {
+    out = &colorJpeg_;
+    type = "image/jpeg";
+    image = &slot.color;
+    extension = ".jpg";
+  } else if (path == "/color.png") {
+    out = &colorPng_;
+    type = "image/png";
+    image = &slot.color;
+    extension = ".png";
+  } else if (path == "/depth.png") {
+    out = &depthPng_;
+    type = "image/png";
+    image = &slot.depth;
+    extension = ".png";
+  } else {
+    return false;
+  }
+  if (!*image) {
+    return false;
+  }
+  if (out->frameId == slot.frameId && !out->bytes.empty()) {
+    return true;
+  }
+
+  cv::Mat mat = image == &slot.depth
+                    ? cv::Mat(image->height, image->width, CV_16UC1,
+                              const_cast<void *>(image->data), image->stride)
+                    : bgrImage(*image);
+  std::vector<int> params;
+  if (out == &colorJpeg_) {
+    params = {cv::IMWRITE_JPEG_QUALITY, kJpegQuality};
+  } else {
+    // Dashboards fetch often, decode fast; level 1 is most of the gain
+    params = {cv::IMWRITE_PNG_COMPRESSION, 1};
+  }
+  if (mat.empty() || !cv::imencode(extension, mat, out->bytes, params)) {
+    out->bytes.clear();
+    return false;
+  }
+  out->frameId = slot.frameId;
+  Metrics::add(encodes_, 1);
+  return true;
+}
@@ -0,0 +1,84 @@
+#include "gst_rgbd_server/stream_activation.h"
+
+StreamActivation::StreamActivation(guint graceMs, Callback onChange)
+    : graceMs_(graceMs), onChange_(std::move(onChange)) {
+  for (uint32_t i = 0; i < kMaxStreams; ++i) {
+    timerData_[i] = Timer{this, i};
+  }
+}
+
+StreamActivation::~StreamActivation() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (guint &timer : timers_) {
+    if (timer) {
+      g_source_remove(timer);
+      timer = 0;
+    }
+  }
+}
+
+void StreamActivation::acquire(uint32_t stream) {
+  if (stream >= kMaxStreams) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++counts_[stream];
+    if (timers_[stream]) {
+      // came back within the grace period, the stream is still running
+      g_source_remove(timers_[stream]);
+      timers_[stream] = 0;
+    }
+    if (active_ & (1u << stream)) {
+      return;
+    }
+    active_ |= 1u << stream;
+  }
+  notify();
+}
+
+void StreamActivation::release(uint32_t stream) {
+  if (stream >= kMaxStreams) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (counts_[stream] == 0 || --counts_[stream] > 0) {
+      return;
+    }
+    if (graceMs_ > 0) {
+      if (!timers_[stream]) {
+        timers_[stream] =
+            g_timeout_add(graceMs_, onGraceExpired, &timerData_[stream]);
+      }
+      return;
+    }
+    active_ &= ~(1u << stream);
+  }
+  notify();
+}
+
+uint32_t StreamActivation::active() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return active_;
+}
+
+gboolean StreamActivation::onGraceExpired(gpointer user_data) {
+  Timer *timer = static_cast<Timer *>(user_data);
+  StreamActivation *self = timer->owner;
+  {
+    std::lock_guard<std::mutex> lock(self->mutex_);
+    self->timers_[timer->stream] = 0;
+    if (self->counts_[timer->stream] > 0) {
+      return G_SOURCE_REMOVE;
+    }
+    self->active_ &= ~(1u << timer->stream);
+  }
+  self->notify();
+  return G_SOURCE_REMOVE;
+}
+
+void StreamActivation::notify() {
+  std::lock_guard<std::mutex> lock(changeMutex_);
+  onChange_(active());
+}
@@ -0,0 +1,432 @@
+#include "gst_rgbd_server/synthetic_camera_source.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <thread>
+
+namespace {
+
+constexpr float kPi = 3.14159265358979f;
+constexpr float kFloorY = 1.2f;  // camera height above the floor, y points down
+constexpr float kWallZ = 6.0f;   // back wall distance
+constexpr float kMaxRange = 10.0f;
+constexpr float kGravity = 9.80665f;
+const float kLight[3] = {-0.4f, -0.8f, -0.45f}; // towards the light, unit
+// Buffer sets kept for reuse; frames held past this are allocated per frame
+// and freed by whoever releases them last
+constexpr size_t kMaxPooledStorage = 8;
+
+uint32_t hash32(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352dU;
+  x ^= x >> 15;
+  x *= 0x846ca68bU;
+  x ^= x >> 16;
+  return x;
+}
+
+uint32_t bytesPerPixel(RgbdPixelFormat format) {
+  switch (format) {
+  case RgbdPixelFormat::kRGBA8:
+    return 4;
+  case RgbdPixelFormat::kYUYV:
+  case RgbdPixelFormat::kUYVY:
+    return 2;
+  default:
+    return 3;
+  }
+}
+
+} // namespace
+
+struct SyntheticCameraSource::Hit {
+  float z;
+  float normal[3];
+  float albedo[3];
+  bool sky;
+
+  float shade() const;
+};
+
+struct SyntheticCameraSource::Storage {
+  std::vector<uint8_t> color;
+  std::vector<uint16_t> depth;
+  std::vector<uint8_t> infrared[2];
+};
+
+SyntheticCameraSource::SyntheticCameraSource(uint32_t seed) : seed_(seed) {
+  // Scene layout is fixed by the seed so virtual cameras differ from each other
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> unit(0.f, 1.f);
+  int count = 3 + seed % 3;
+  for (int i = 0; i < count; ++i) {
+    Sphere s;
+    s.radius = 0.2f + 0.3f * unit(rng);
+    s.center[0] = -1.5f + 3.f * unit(rng);
+    s.center[1] = kFloorY - s.radius - 0.4f * unit(rng);
+    s.center[2] = 2.0f + 2.5f * unit(rng);
+    s.orbit[0] = 0.3f + 0.7f * unit(rng);
+    s.orbit[1] = 0.15f * unit(rng);
+    s.orbit[2] = 0.2f + 0.6f * unit(rng);
+    s.speed = 0.5f + 1.5f * unit(rng);
+    s.phase = 2.f * kPi * unit(rng);
+    for (float &c : s.albedo) {
+      c = 0.2f + 0.8f * unit(rng);
+    }
+    spheres_.push_back(s);
+  }
+}
+
+SyntheticCameraSource::~SyntheticCameraSource() { stop(); }
+
+std::string SyntheticCameraSource::serial() const {
+  return "synthetic-" + std::to_string(seed_);
+}
+
+bool SyntheticCameraSource::start(const CameraConfig &config) {
+  if (config.width <= 0 || config.height <= 0 || config.fps <= 0) {
+    std::cerr << "Invalid synthetic camera profile " << config.width << "x"
+              << config.height << "@" << config.fps << std::endl;
+    return false;
+  }
+  config_ = config;
+  float fx = 0.5f * config.width /
+             std::tan(0.5f * kHorizontalFovDeg * kPi / 180.f);
+  intrinsics_ = RgbdIntrinsics{uint32_t(config.width), uint32_t(config.height),
+                               0.5f * config.width, 0.5f * config.height, fx,
+                               fx};
+  rayX_.resize(config.width);
+  for (int u = 0; u < config.width; ++u) {
+    rayX_[u] = (u + 0.5f - intrinsics_.centerX) / intrinsics_.fx;
+  }
+  rayY_.resize(config.height);
+  for (int v = 0; v < config.height; ++v) {
+    rayY_[v] = (v + 0.5f - intrinsics_.centerY) / intrinsics_.fy;
+  }
+  pool_.clear();
+  background_ = acquireStorage();
+  pool_.clear();
+  for (int v = 0; v < config.height; ++v) {
+    renderSpan(v, 0, config.width, {}, *background_);
+  }
+  frameNumber_ = 0;
+  // Start on the frame period grid of the steady clock, so synthetic cameras
+  // with the same rate tick in phase like hardware synced devices
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  auto period = std::chrono::nanoseconds(1000000000LL / config.fps);
+  startTime_ = std::chrono::steady_clock::time_point(
+      (std::chrono::duration_cast<std::chrono::nanoseconds>(now) / period + 1) *
+      period);
+  started_ = true;
+  return true;
+}
+
+void SyntheticCameraSource::stop() { started_ = false; }
+
+void SyntheticCameraSource::place(float t, std::vector<Placed> &placed) const {
+  placed.clear();
+  for (const Sphere &s : spheres_) {
+    float a = s.speed * t + s.phase;
+    Placed p;
+    p.center[0] = s.center[0] + s.orbit[0] * std::sin(a);
+    p.center[1] = s.center[1] - s.orbit[1] * std::abs(std::sin(2.f * a));
+    p.center[2] = s.center[2] + s.orbit[2] * std::cos(a);
+    p.radius2 = s.radius * s.radius;
+    p.invRadius = 1.f / s.radius;
+    p.albedo = s.albedo;
+    // Projected extent over the sphere's depth range, widened by the stereo
+    // baseline for the right imager
+    float nearZ = std::max(0.05f, p.center[2] - s.radius);
+    float farZ = p.center[2] + s.radius;
+    float left = p.center[0] - s.radius;
+    float right = p.center[0] + s.radius + kStereoBaseline;
+    float top = p.center[1] - s.radius;
+    float bottom = p.center[1] + s.radius;
+    float minX = std::min(left / nearZ, left / farZ);
+    float maxX = std::max(right / nearZ, right / farZ);
+    float minY = std::min(top / nearZ, top / farZ);
+    float maxY = std::max(bottom / nearZ, bottom / farZ);
+    p.uMin = std::max(0, int(intrinsics_.centerX + minX * intrinsics_.fx) - 1);
+    p.uMax = std::min(config_.width - 1,
+                      int(intrinsics_.centerX + maxX * intrinsics_.fx) + 1);
+    p.vMin = std::max(0, int(intrinsics_.centerY + minY * intrinsics_.fy) - 1);
+    p.vMax = std::min(config_.height - 1,
+                      int(intrinsics_.centerY + maxY * intrinsics_.fy) + 1);
+    placed.push_back(p);
+  }
+}
+
+// Closest hit of the ray origin + s * (dirX, dirY, 1), so s is the depth.
+void SyntheticCameraSource::trace(float originX, int u, int v,
+                                  const std::vector<Placed> &placed,
+                                  Hit &hit) const {
+  const float dirX = rayX_[u];
+  const float dirY = rayY_[v];
+  hit.z = kMaxRange;
+  hit.sky = true;
+
+  if (dirY > 0.f) {
+    float z = kFloorY / dirY;
+    if (z < hit.z) {
+      float x = originX + dirX * z;
+      bool checker =
+          (int(std::floor(x * 2.f)) + int(std::floor(z * 2.f))) & 1;
+      float shade = checker ? 0.75f : 0.35f;
+      hit = Hit{z, {0.f, -1.f, 0.f}, {shade, shade, shade * 0.9f}, false};
+    }
+  }
+  if (kWallZ < hit.z) {
+    float y = dirY * kWallZ;
+    float g = 0.4f + 0.2f * std::max(-1.f, std::min(1.f, y));
+    hit = Hit{kWallZ, {0.f, 0.f, -1.f}, {g * 0.8f, g * 0.9f, g}, false};
+  }
+
+  float dd = dirX * dirX + dirY * dirY + 1.f;
+  for (const Placed &s : placed) {
+    if (u < s.uMin || u > s.uMax || v < s.vMin || v > s.vMax) {
+      continue;
+    }
+    float cx = s.center[0] - originX;
+    float cy = s.center[1];
+    float cz = s.center[2];
+    float dc = dirX * cx + dirY * cy + cz;
+    float disc = dc * dc - dd * (cx * cx + cy * cy + cz * cz - s.radius2);
+    if (disc < 0.f) {
+      continue;
+    }
+    float z = (dc - std::sqrt(disc)) / dd;
+    if (z <= 0.f || z >= hit.z) {
+      continue;
+    }
+    hit.z = z;
+    hit.sky = false;
+    hit.normal[0] = (dirX * z - cx) * s.invRadius;
+    hit.normal[1] = (dirY * z - cy) * s.invRadius;
+    hit.normal[2] = (z - cz) * s.invRadius;
+    std::copy(s.albedo, s.albedo + 3, hit.albedo);
+  }
+}
+
+float SyntheticCameraSource::Hit::shade() const {
+  if (sky) {
+    return 0.f;
+  }
+  float lambert = 0.f;
+  for (int k = 0; k < 3; ++k) {
+    lambert += normal[k] * kLight[k];
+  }
+  return 0.25f + 0.75f * std::max(0.f, lambert);
+}
+
+// Projector dots are fixed in the scene, so they shift by the disparity
+// between the two imagers like real structured light.
+uint8_t SyntheticCameraSource::infrared(const Hit &hit, float worldX, int v,
+                                        float shade) const {
+  uint32_t dot = hash32(uint32_t(int(worldX * 400.f)) * 73856093U ^
+                        uint32_t(v) * 19349663U ^ seed_);
+  float ir = 0.3f * shade + (!hit.sky && (dot & 15) == 0 ? 0.6f : 0.f);
+  return uint8_t(255.f * std::min(1.f, ir));
+}
+
+void SyntheticCameraSource::renderSpan(int v, int uBegin, int uEnd,
+                                       const std::vector<Placed> &placed,
+                                       Storage &storage) const {
+  const int width = config_.width;
+  const uint32_t colorBpp = bytesPerPixel(config_.colorFormat);
+  uint8_t *color = config_.color
+                       ? storage.color.data() + size_t(v) * width * colorBpp
+                       : nullptr;
+  uint16_t *depth =
+      config_.depth ? storage.depth.data() + size_t(v) * width : nullptr;
+  uint8_t *irLeft = config_.infrared
+                        ? storage.infrared[0].data() + size_t(v) * width
+                        : nullptr;
+  uint8_t *irRight = config_.infrared
+                         ? storage.infrared[1].data() + size_t(v) * width
+                         : nullptr;
+
+  Hit hit;
+  for (int u = uBegin; u < uEnd; ++u) {
+    trace(0.f, u, v, placed, hit);
+    float shade = hit.shade();
+
+    if (depth) {
+      float units = hit.sky ? 0.f : hit.z / kDepthScale;
+      depth[u] = uint16_t(std::min(65535.f, units + 0.5f));
+    }
+    if (color) {
+      uint8_t r = uint8_t(255.f * std::min(1.f, hit.albedo[0] * shade));
+      uint8_t g = uint8_t(255.f * std::min(1.f, hit.albedo[1] * shade));
+      uint8_t b = uint8_t(255.f * std::min(1.f, hit.albedo[2] * shade));
+      uint8_t *px = color + size_t(u) * colorBpp;
+      switch (config_.colorFormat) {
+      case RgbdPixelFormat::kRGB8:
+        px[0] = r, px[1] = g, px[2] = b;
+        break;
+      case RgbdPixelFormat::kRGBA8:
+        px[0] = r, px[1] = g, px[2] = b, px[3] = 255;
+        break;
+      case RgbdPixelFormat::kYUYV:
+        // BT.601 limited range, chroma from the even pixel of each pair
+        px[0] = uint8_t((66 * r + 129 * g + 25 * b + 128) / 256 + 16);
+        if ((u & 1) == 0) {
+          px[1] = uint8_t((-38 * r - 74 * g + 112 * b + 128) / 256 + 128);
+          px[3] = uint8_t((112 * r - 94 * g - 18 * b + 128) / 256 + 128);
+        }
+        break;
+      case RgbdPixelFormat::kUYVY:
+        px[1] = uint8_t((66 * r + 129 * g + 25 * b + 128) / 256 + 16);
+        if ((u & 1) == 0) {
+          px[0] = uint8_t((-38 * r - 74 * g + 112 * b + 128) / 256 + 128);
+          px[2] = uint8_t((112 * r - 94 * g - 18 * b + 128) / 256 + 128);
+        }
+        break;
+      default:
+        px[0] = b, px[1] = g, px[2] = r;
+        break;
+      }
+    }
+    if (irLeft) {
+      irLeft[u] = infrared(hit, rayX_[u] * hit.z, v, shade);
+    }
+  }
+  if (irRight) {
+    for (int u = uBegin; u < uEnd; ++u) {
+      trace(kStereoBaseline, u, v, placed, hit);
+      irRight[u] =
+          infrared(hit, kStereoBaseline + rayX_[u] * hit.z, v, hit.shade());
+    }
+  }
+}
+
+void SyntheticCameraSource::render(uint64_t frameNumber,
+                                   Storage &storage) const {
+  const int width = config_.width;
+  std::vector<Placed> placed;
+  place(float(frameNumber) / config_.fps, placed);
+
+  // The floor and the wall never move: start from the prerendered background
+  // and only trace the columns the spheres can cover on each row.
+  if (config_.color) {
+    std::copy(background_->color.begin(), background_->color.end(),
+              storage.color.begin());
+  }
+  if (config_.depth) {
+    std::copy(background_->depth.begin(), background_->depth.end(),
+              storage.depth.begin());
+  }
+  for (int i = 0; config_.infrared && i < 2; ++i) {
+    std::copy(background_->infrared[i].begin(), background_->infrared[i].end(),
+              storage.infrared[i].begin());
+  }
+
+  for (int v = 0; v < config_.height; ++v) {
+    int uBegin = width;
+    int uEnd = 0;
+    for (const Placed &p : placed) {
+      if (v >= p.vMin && v <= p.vMax) {
+        uBegin = std::min(uBegin, p.uMin);
+        uEnd = std::max(uEnd, p.uMax + 1);
+      }
+    }
+    if (uBegin < uEnd) {
+      // whole YUYV / UYVY macropixels
+      renderSpan(v, uBegin & ~1, std::min(width, (uEnd + 1) & ~1), placed,
+                 storage);
+    }
+  }
+}
+
+std::shared_ptr<SyntheticCameraSource::Storage>
+SyntheticCameraSource::acquireStorage() {
+  // Reuse a buffer set nobody downstream holds any more
+  for (const std::shared_ptr<Storage> &storage : pool_) {
+    if (storage.use_count() == 1) {
+      return storage;
+    }
+  }
+  auto storage = std::make_shared<Storage>();
+  size_t pixels = size_t(config_.width) * config_.height;
+  if (config_.color) {
+    storage->color.resize(pixels * bytesPerPixel(config_.colorFormat));
+  }
+  if (config_.depth) {
+    storage->depth.resize(pixels);
+  }
+  if (config_.infrared) {
+    storage->infrared[0].resize(pixels);
+    storage->infrared[1].resize(pixels);
+  }
+  if (pool_.size() < kMaxPooledStorage) {
+    pool_.push_back(storage);
+  }
+  return storage;
+}
+
+bool SyntheticCameraSource::waitForFrames(CameraFrameSet &frames,
+                                          uint32_t timeoutMs) {
+  if (!started_) {
+    return false;
+  }
+  uint64_t frameNumber = frameNumber_;
+  auto due = startTime_ + std::chrono::nanoseconds(
+                              frameNumber * 1000000000ULL / config_.fps);
+  if (realtime_) {
+    if (due - std::chrono::steady_clock::now() >
+        std::chrono::milliseconds(timeoutMs)) {
+      return false;
+    }
+    std::this_thread::sleep_until(due);
+  }
+  ++frameNumber_;
+
+  std::shared_ptr<Storage> storage = acquireStorage();
+  render(frameNumber, *storage);
+
+  frames = CameraFrameSet();
+  frames.frameNumber = frameNumber;
+  frames.timestampNs =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          (realtime_ ? due : std::chrono::steady_clock::now())
+              .time_since_epoch())
+          .count();
+  const int width = config_.width;
+  const int height = config_.height;
+  if (config_.color) {
+    uint32_t bpp = bytesPerPixel(config_.colorFormat);
+    frames.color = CameraImage{storage->color.data(), storage->color.size(),
+                               width, height, int(width * bpp),
+                               config_.colorFormat};
+  }
+  if (config_.depth) {
+    frames.depth = CameraImage{storage->depth.data(),
+                               storage->depth.size() * sizeof(uint16_t), width,
+                               height, int(width * sizeof(uint16_t)),
+                               RgbdPixelFormat::kZ16};
+  }
+  if (config_.infrared) {
+    for (int i = 0; i < 2; ++i) {
+      frames.infrared[i] =
+          CameraImage{storage->infrared[i].data(), storage->infrared[i].size(),
+                      width, height, width, RgbdPixelFormat::kY8};
+    }
+  }
+  if (config_.imu) {
+    // Camera at rest on a vibrating mount: gravity along -y plus a small
+    // deterministic oscillation
+    float t = float(frameNumber) / config_.fps;
+    frames.hasAccel = true;
+    frames.accel[0] = 0.05f * std::sin(2.f * kPi * 7.f * t);
+    frames.accel[1] = -kGravity + 0.08f * std::sin(2.f * kPi * 11.f * t);
+    frames.accel[2] = 0.05f * std::cos(2.f * kPi * 5.f * t);
+    frames.hasGyro = true;
+    frames.gyro[0] = 0.01f * std::sin(2.f * kPi * 3.f * t);
+    frames.gyro[1] = 0.01f * std::cos(2.f * kPi * 2.f * t);
+    frames.gyro[2] = 0.005f * std::sin(2.f * kPi * 1.f * t);
+  }
+  frames.keepAlive = storage;
+  return true;
+}
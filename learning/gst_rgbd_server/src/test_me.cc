@@ -1,16 +1,20 @@
 #include <gst/gst.h>
 #include <gst/rtsp-server/rtsp-server.h>
-#include <librealsense2/rs.hpp>
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include <iostream>
 
+#include "gst_rgbd_server/camera_source.h"
+#include "gst_rgbd_server/encoder_factory.h"
+#include "gst_rgbd_server/gop_cache.h"
+#include "gst_rgbd_server/media_pool.h"
+#include "gst_rgbd_server/multicast.h"
+#include "gst_rgbd_server/rtcp_rate_adapter.h"
+
 const int WIDTH = 640;
 const int HEIGHT = 480;
-const int SIZE = WIDTH * HEIGHT * 3;
 const int FRAME = 30;
-rs2::align align(RS2_STREAM_COLOR);
 
 typedef struct
 {
@@ -23,25 +27,46 @@ static void
 need_data (GstElement * appsrc, guint unused, gpointer user_data)
 {
     GstBuffer *buffer;
-    guint size = SIZE;
     GstFlowReturn ret;
-    rs2::pipeline* pPipe = (rs2::pipeline* ) user_data;
-
-    rs2::frameset rs_d415 = pPipe->wait_for_frames();
-    rs2::frame color = rs_d415.get_color_frame();
-
-    cv::Mat imRGB(cv::Size(WIDTH, HEIGHT), CV_8UC3, (void *) color.get_data(), cv::Mat::AUTO_STEP);
-
-    //GstMapInfo mapinfo;
-    buffer = gst_buffer_new_allocate (NULL, size, NULL);
-    //gst_buffer_map (buffer, &mapinfo, GST_MAP_WRITE);
-    // Connect address of Mat and Buffer !!!!
-    //memcpy(mapinfo.data, imRGB.data,  gst_buffer_get_size( buffer ) );
-
-    // gst_buffer_new_wrapped_full: have error when direct use imOut
-    buffer = gst_buffer_new_wrapped_full( (GstMemoryFlags)0, (void *)imRGB.data, size, 0, size, NULL, NULL );
+    CameraSource* pCamera = (CameraSource* ) user_data;
+
+    /* the last frame set goes out again when the camera times out, since
+     * appsrc asks only once and would otherwise wait forever */
+    CameraFrameSet *last =
+        (CameraFrameSet *) g_object_get_data (G_OBJECT (appsrc), "last-frames");
+    CameraFrameSet frames;
+    if (pCamera->waitForFrames(frames) && frames.color) {
+        if (!last) {
+            last = new CameraFrameSet ();
+            g_object_set_data_full (G_OBJECT (appsrc), "last-frames", last,
+                                    [](gpointer last) {
+                                        delete (CameraFrameSet *) last;
+                                    });
+        }
+        *last = frames;
+    } else if (last && pCamera->isStarted ()) {
+        g_printerr ("Camera %s timed out, repeating the last frame\n",
+                    pCamera->serial ().c_str ());
+        frames = *last;
+    } else {
+        g_printerr ("Camera %s has no frames, ending the stream\n",
+                    pCamera->serial ().c_str ());
+        g_signal_emit_by_name (appsrc, "end-of-stream", &ret);
+        return;
+    }
+
+    // Wrap the camera memory and keep the frame set alive until the buffer is
+    // released downstream
+    buffer = gst_buffer_new_wrapped_full( GST_MEMORY_FLAG_READONLY,
+                                          (void *)frames.color.data, frames.color.size,
+                                          0, frames.color.size,
+                                          new std::shared_ptr<void>(frames.keepAlive),
+                                          [](gpointer keepAlive) {
+                                              delete (std::shared_ptr<void> *) keepAlive;
+                                          } );
 
     g_signal_emit_by_name (appsrc, "push-buffer", buffer, &ret);
+    gst_buffer_unref (buffer);
 }
 
 /* called when a new media pipeline is constructed. We can query the
@@ -51,7 +76,7 @@ media_configure (GstRTSPMediaFactory * factory, GstRTSPMedia * media,
                  gpointer user_data)
 {
     GstElement *element, *appsrc;
-    rs2::pipeline* pPipe = (rs2::pipeline* ) user_data;
+    CameraSource* pCamera = (CameraSource* ) user_data;
 
     /* get the element used for providing the streams of the media */
     element = gst_rtsp_media_get_element (media);
@@ -64,13 +89,38 @@ media_configure (GstRTSPMediaFactory * factory, GstRTSPMedia * media,
     /* configure the caps of the video */
     g_object_set (G_OBJECT (appsrc), "caps",
                   gst_caps_new_simple ("video/x-raw",
-                                       "format", G_TYPE_STRING, "RGB",
+                                       "format", G_TYPE_STRING, "YUY2",
                                        "width", G_TYPE_INT, WIDTH,
                                        "height", G_TYPE_INT, HEIGHT,
                                        "framerate", GST_TYPE_FRACTION, FRAME, 1, NULL), NULL);
 
     /* install the callback that will be called when a buffer is needed */
-    g_signal_connect (appsrc, "need-data", (GCallback) need_data, pPipe);
+    g_signal_connect (appsrc, "need-data", (GCallback) need_data, pCamera);
+
+    /* follow the receiver reports and retune the encoder until the media
+     * goes away */
+    GstElement *encoder = gst_bin_get_by_name_recurse_up (GST_BIN (element), "enc");
+    RtcpRateAdapter *adapter = new RtcpRateAdapter ("/test", encoder, NULL,
+                                                    WIDTH, HEIGHT, FRAME,
+                                                    RateControllerOptions ());
+    adapter->attach (media);
+    g_object_set_data_full (G_OBJECT (media), "rate-adapter", adapter,
+                            [](gpointer adapter) {
+                                delete (RtcpRateAdapter *) adapter;
+                            });
+    g_signal_connect (media, "unprepared",
+                      (GCallback) +[](GstRTSPMedia *media, gpointer) {
+                          g_object_set_data (G_OBJECT (media), "rate-adapter", NULL);
+                      }, NULL);
+
+    /* clients joining the running media start from the cached GOP or a
+     * forced keyframe; the media deletes the cache when unprepared */
+    GstElement *payloader = gst_bin_get_by_name_recurse_up (GST_BIN (element), "pay0");
+    GopCache *cache = new GopCache ("/test", encoder, payloader);
+    cache->attach (media);
+    gst_object_unref (payloader);
+    gst_object_unref (encoder);
+
     gst_object_unref (appsrc);
     gst_object_unref (element);
 }
@@ -85,12 +135,22 @@ main (int argc, char *argv[])
 
     gst_init (&argc, &argv);
 
-    /* Initialize realsense d415*/
-    rs2::pipeline rs_pipe;
-    rs2::config rs_cfg;
-    rs_cfg.enable_stream(RS2_STREAM_COLOR, WIDTH, HEIGHT, RS2_FORMAT_RGB8, FRAME);
-    rs_pipe.start(rs_cfg);
-    gpointer pPipe = (gpointer) &rs_pipe;
+    /* Initialize the camera, realsense d415 unless given e.g. synthetic:1 */
+    std::unique_ptr<CameraSource> camera =
+        createCameraSource (argc > 1 ? argv[1] : "realsense");
+    CameraConfig cam_cfg;
+    cam_cfg.width = WIDTH;
+    cam_cfg.height = HEIGHT;
+    cam_cfg.fps = FRAME;
+    /* the sensor's native format, the encoder's upload only subsamples
+     * its chroma */
+    cam_cfg.colorFormat = RgbdPixelFormat::kYUYV;
+    cam_cfg.depth = false;
+    cam_cfg.infrared = false;
+    cam_cfg.imu = false;
+    if (!camera || !camera->start (cam_cfg))
+        return -1;
+    gpointer pCamera = (gpointer) camera.get();
 
     /* create loop*/
     loop = g_main_loop_new (NULL, FALSE);
@@ -98,6 +158,11 @@ main (int argc, char *argv[])
     /* create a server instance */
     server = gst_rtsp_server_new ();
 
+    /* a few threads for the clients instead of the single default one */
+    GstRTSPThreadPool *threads = gst_rtsp_server_get_thread_pool (server);
+    gst_rtsp_thread_pool_set_max_threads (threads, 4);
+    g_object_unref (threads);
+
     /* get the mount points for this server, every server has a default object
      * that be used to map uri mount points to media factories */
     mounts = gst_rtsp_server_get_mount_points (server);
@@ -106,28 +171,67 @@ main (int argc, char *argv[])
      * gst-launch syntax to create pipelines.
      * any launch line works as long as it contains elements named pay%d. Each
      * element with pay%d names will be a stream */
-    factory = gst_rtsp_media_factory_new ();
-    gst_rtsp_media_factory_set_launch (factory,
-                                       "( appsrc name=mysrc ! videoconvert ! "
-                                       "x264enc tune=zerolatency"
-                                       //"speed-preset=ultrafast "
-                                    //    "pass=qual quantizer=20 tune=zerolatency "
-                                       //"intra-refresh=true vbv-buf-capacity=0 qp-min=18 "
-                                       //"byte-stream=true key-int-max=15"
-                                       " ! rtph264pay name=pay0 pt=96 )");
+    /* one media kept prepared, so a DESCRIBE does not wait for the encoder
+     * to start */
+    factory = newPooledMediaFactory ("/test", MediaPoolOptions ());
+    /* the first available H.264 encoder, tuned by a named preset
+     * (zero-latency, intra-refresh, sliced-threads) given as argv[2] */
+    EncoderRequest request;
+    request.width = WIDTH;
+    request.height = HEIGHT;
+    request.fps = FRAME;
+    if (argc > 2 && !parseEncoderPreset (argv[2], request.preset)) {
+        g_printerr ("Unknown preset %s\n", argv[2]);
+        return -1;
+    }
+    EncoderChoice encoder = EncoderFactory::select (request);
+    if (!encoder)
+        return -1;
+    std::string launch = "( appsrc name=mysrc ! videoconvert ! " +
+                         encoder.launch ("enc") + " ! " +
+                         encoder.payloader () + " name=pay0 pt=96 )";
+    gst_rtsp_media_factory_set_launch (factory, launch.c_str ());
+    /* one pipeline for all clients, so a new one joins a running encoder */
+    gst_rtsp_media_factory_set_shared (factory, TRUE);
+    /* multicast to clients that ask for it when a group range is given as
+     * argv[3], e.g. 239.255.42.1:5000-5999; unicast to everybody else */
+    if (argc > 3) {
+        MulticastOptions multicast;
+        if (!parseMulticast (argv[3], multicast)) {
+            g_printerr ("Invalid multicast range %s\n", argv[3]);
+            return -1;
+        }
+        multicast.iface = "lo";
+        GstRTSPAddressPool *pool = newMulticastPool (multicast);
+        applyMulticast (factory, multicast, pool);
+        if (pool)
+            g_object_unref (pool);
+    }
 
     /* notify when our media is ready, This is called whenever someone asks for
      * the media and a new pipeline with our appsrc is created */
 
     g_signal_connect (factory, "media-configure", (GCallback) media_configure,
-                      pPipe);
+                      pCamera);
 
     /* attach the test factory to the /test url */
     gst_rtsp_mount_points_add_factory (mounts, "/test", factory);
 
+    /* start preparing it, primed with blank frames of the camera's caps */
+    GstCaps *caps = gst_caps_new_simple ("video/x-raw",
+                                         "format", G_TYPE_STRING, "YUY2",
+                                         "width", G_TYPE_INT, WIDTH,
+                                         "height", G_TYPE_INT, HEIGHT,
+                                         "framerate", GST_TYPE_FRACTION, FRAME, 1, NULL);
+    startMediaPool (factory, server, "/test", caps);
+    gst_caps_unref (caps);
+
     /* don't need the ref to the mounts anymore */
     g_object_unref (mounts);
 
+    /* route every PLAY to the GOP cache of its media */
+    GopCache::watch (server);
+
     /* attach the server to the default maincontext */
     gst_rtsp_server_attach (server, NULL);
 
@@ -0,0 +1,444 @@
+#include "gst_rgbd_server/thread_policy.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <system_error>
+#include <thread>
+
+#include "gst_rgbd_server/metrics.h"
+
+namespace {
+
+pid_t currentTid() { return pid_t(syscall(SYS_gettid)); }
+
+std::string tidLabel(pid_t tid) {
+  return "tid=\"" + std::to_string(tid) + "\"";
+}
+
+// "2,4-5" or "*"
+bool parseCpus(const std::string &list, std::vector<int> &cpus) {
+  cpus.clear();
+  if (list == "*") {
+    return true;
+  }
+  std::istringstream in(list);
+  std::string item;
+  while (std::getline(in, item, ',')) {
+    char *end = nullptr;
+    long first = strtol(item.c_str(), &end, 10);
+    long last = first;
+    if (*end == '-') {
+      last = strtol(end + 1, &end, 10);
+    }
+    if (end == item.c_str() || *end || first < 0 || last < first ||
+        last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (long cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(int(cpu));
+    }
+  }
+  return !cpus.empty();
+}
+
+bool parseInt(const std::string &text, int &value) {
+  char *end = nullptr;
+  long parsed = strtol(text.c_str(), &end, 10);
+  if (text.empty() || *end) {
+    return false;
+  }
+  value = int(parsed);
+  return true;
+}
+
+// CPU seconds and the core the thread last ran on, from
+// /proc/self/task/<tid>/stat. False once the thread is gone.
+bool readStat(pid_t tid, double &cpuSeconds, int &lastCpu) {
+  static const double ticks = double(sysconf(_SC_CLK_TCK));
+  std::ifstream in("/proc/self/task/" + std::to_string(tid) + "/stat");
+  std::string line;
+  if (!std::getline(in, line)) {
+    return false;
+  }
+  // The name in parentheses may hold spaces, fields count from after it
+  size_t paren = line.rfind(')');
+  if (paren == std::string::npos) {
+    return false;
+  }
+  std::istringstream fields(line.substr(paren + 1));
+  std::vector<std::string> field;
+  std::string token;
+  while (fields >> token) {
+    field.push_back(token);
+  }
+  // state is field 3, utime 14, stime 15, processor 39
+  if (field.size() < 37) {
+    return false;
+  }
+  cpuSeconds = (strtod(field[11].c_str(), nullptr) +
+                strtod(field[12].c_str(), nullptr)) /
+               ticks;
+  lastCpu = atoi(field[36].c_str());
+  return true;
+}
+
+// A streaming thread of one task, joined through its handle
+struct PoolThread {
+  std::mutex mutex;
+  std::condition_variable finished;
+  bool done = false;
+};
+using PoolHandle = std::shared_ptr<PoolThread>;
+
+struct RgbdTaskPool {
+  GstTaskPool parent;
+  gchar *name;
+  gchar *alias;
+};
+
+struct RgbdTaskPoolClass {
+  GstTaskPoolClass parent_class;
+};
+
+GType rgbd_task_pool_get_type();
+
+G_DEFINE_TYPE(RgbdTaskPool, rgbd_task_pool, GST_TYPE_TASK_POOL)
+
+// Threads are started per task, there is nothing to set up
+void poolPrepare(GstTaskPool *pool, GError **error) {}
+
+void poolCleanup(GstTaskPool *pool) {}
+
+gpointer poolPush(GstTaskPool *pool, GstTaskPoolFunction func,
+                  gpointer user_data, GError **error) {
+  RgbdTaskPool *self = reinterpret_cast<RgbdTaskPool *>(pool);
+  std::string name = self->name;
+  std::string alias = self->alias;
+  PoolHandle *handle = new PoolHandle(std::make_shared<PoolThread>());
+  PoolHandle state = *handle;
+  try {
+    std::thread([state, func, user_data, name, alias]() {
+      ThreadPolicy::instance().enter(name, alias);
+      func(user_data);
+      ThreadPolicy::instance().leave();
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->done = true;
+      }
+      state->finished.notify_all();
+    }).detach();
+  } catch (const std::system_error &e) {
+    g_set_error(error, GST_CORE_ERROR, GST_CORE_ERROR_FAILED,
+                "Cannot start a thread for %s: %s", name.c_str(), e.what());
+    delete handle;
+    return nullptr;
+  }
+  return handle;
+}
+
+void poolJoin(GstTaskPool *pool, gpointer id) {
+  PoolHandle *handle = static_cast<PoolHandle *>(id);
+  if (!handle) {
+    return;
+  }
+  {
+    PoolThread &state = **handle;
+    std::unique_lock<std::mutex> lock(state.mutex);
+    state.finished.wait(lock, [&state] { return state.done; });
+  }
+  delete handle;
+}
+
+#if GST_CHECK_VERSION(1, 20, 0)
+void poolDisposeHandle(GstTaskPool *pool, gpointer id) {
+  delete static_cast<PoolHandle *>(id);
+}
+#endif
+
+void poolFinalize(GObject *object) {
+  RgbdTaskPool *self = reinterpret_cast<RgbdTaskPool *>(object);
+  g_free(self->name);
+  g_free(self->alias);
+  G_OBJECT_CLASS(rgbd_task_pool_parent_class)->finalize(object);
+}
+
+void rgbd_task_pool_class_init(RgbdTaskPoolClass *klass) {
+  G_OBJECT_CLASS(klass)->finalize = poolFinalize;
+  GstTaskPoolClass *pool = GST_TASK_POOL_CLASS(klass);
+  pool->prepare = poolPrepare;
+  pool->cleanup = poolCleanup;
+  pool->push = poolPush;
+  pool->join = poolJoin;
+#if GST_CHECK_VERSION(1, 20, 0)
+  pool->dispose_handle = poolDisposeHandle;
+#endif
+}
+
+void rgbd_task_pool_init(RgbdTaskPool *pool) {
+  pool->name = nullptr;
+  pool->alias = nullptr;
+}
+
+} // namespace
+
+bool parseThreadRules(const std::string &spec, std::vector<ThreadRule> &rules) {
+  rules.clear();
+  std::istringstream in(spec);
+  std::string text;
+  while (std::getline(in, text, ';')) {
+    if (text.empty()) {
+      continue;
+    }
+    size_t equals = text.find('=');
+    if (equals == std::string::npos || equals == 0) {
+      return false;
+    }
+    ThreadRule rule;
+    rule.pattern = text.substr(0, equals);
+    std::istringstream parts(text.substr(equals + 1));
+    std::string part;
+    std::getline(parts, part, ':');
+    if (!parseCpus(part, rule.cpus)) {
+      return false;
+    }
+    while (std::getline(parts, part, ':')) {
+      if (part.compare(0, 5, "fifo=") == 0) {
+        if (!parseInt(part.substr(5), rule.fifoPriority) ||
+            rule.fifoPriority < 1 || rule.fifoPriority > 99) {
+          return false;
+        }
+      } else if (part.compare(0, 5, "nice=") == 0) {
+        if (!parseInt(part.substr(5), rule.nice) || rule.nice < -20 ||
+            rule.nice > 19) {
+          return false;
+        }
+        rule.setNice = true;
+      } else {
+        return false;
+      }
+    }
+    rules.push_back(rule);
+  }
+  return true;
+}
+
+ThreadPolicy &ThreadPolicy::instance() {
+  static ThreadPolicy policy;
+  return policy;
+}
+
+bool ThreadPolicy::configure(const std::string &spec) {
+  std::vector<ThreadRule> rules;
+  if (!parseThreadRules(spec, rules)) {
+    std::cerr << "Invalid thread rules: " << spec << std::endl;
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  rules_ = rules;
+  enabled_ = true;
+  return true;
+}
+
+bool ThreadPolicy::addRules(const std::string &spec) {
+  std::vector<ThreadRule> rules;
+  if (!parseThreadRules(spec, rules)) {
+    std::cerr << "Invalid thread rules: " << spec << std::endl;
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  rules_.insert(rules_.begin(), rules.begin(), rules.end());
+  enabled_ = true;
+  return true;
+}
+
+const ThreadRule *ThreadPolicy::match(const std::string &name,
+                                      const std::string &alias) const {
+  for (const ThreadRule &rule : rules_) {
+    if (g_pattern_match_simple(rule.pattern.c_str(), name.c_str()) ||
+        (!alias.empty() &&
+         g_pattern_match_simple(rule.pattern.c_str(), alias.c_str()))) {
+      return &rule;
+    }
+  }
+  return nullptr;
+}
+
+void ThreadPolicy::apply(const ThreadRule &rule, const std::string &name) {
+  if (!rule.cpus.empty()) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu : rule.cpus) {
+      CPU_SET(cpu, &cpus);
+    }
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (error && !warnedAffinity_) {
+      std::cerr << "Cannot pin thread " << name << ": " << strerror(error)
+                << std::endl;
+      warnedAffinity_ = true;
+    }
+  }
+  int error = 0;
+  if (rule.fifoPriority) {
+    sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = rule.fifoPriority;
+    error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  }
+  if (!error && rule.setNice &&
+      setpriority(PRIO_PROCESS, id_t(currentTid()), rule.nice) != 0) {
+    error = errno;
+  }
+  if (error && !warnedPriority_) {
+    std::cerr << "Cannot raise the priority of thread " << name << ": "
+              << strerror(error)
+              << " (needs CAP_SYS_NICE or an rtprio/nice limit)"
+              << std::endl;
+    warnedPriority_ = true;
+  }
+}
+
+void ThreadPolicy::enter(const std::string &name, const std::string &alias) {
+  if (!enabled_) {
+    return;
+  }
+  // Linux keeps 15 characters of a thread name
+  pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+  pid_t tid = currentTid();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (const ThreadRule *rule = match(name, alias)) {
+    apply(*rule, name);
+  }
+  // The tid of a thread that exited without leave() may be reused
+  threads_.erase(std::remove_if(threads_.begin(), threads_.end(),
+                                [tid](const Tracked &thread) {
+                                  return thread.tid == tid;
+                                }),
+                 threads_.end());
+  Tracked thread;
+  thread.name = name;
+  thread.tid = tid;
+  thread.labels = "{thread=\"" + name + "\"," + tidLabel(tid) + "}";
+  thread.cpuSeconds = 0;
+  thread.sampledUs = 0;
+  thread.percent = 0;
+  thread.lastCpu = -1;
+  threads_.push_back(thread);
+}
+
+void ThreadPolicy::leave() {
+  if (!enabled_) {
+    return;
+  }
+  pid_t tid = currentTid();
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = std::find_if(
+      threads_.begin(), threads_.end(),
+      [tid](const Tracked &thread) { return thread.tid == tid; });
+  if (it != threads_.end()) {
+    threads_.erase(it);
+    Metrics::instance().remove(tidLabel(tid));
+  }
+}
+
+GstBusSyncReply ThreadPolicy::onSyncMessage(GstBus *bus, GstMessage *message,
+                                            gpointer user_data) {
+  if (GST_MESSAGE_TYPE(message) != GST_MESSAGE_STREAM_STATUS) {
+    return GST_BUS_PASS;
+  }
+  GstStreamStatusType type;
+  GstElement *owner = nullptr;
+  gst_message_parse_stream_status(message, &type, &owner);
+  const GValue *value = gst_message_get_stream_status_object(message);
+  if (type != GST_STREAM_STATUS_TYPE_CREATE || !owner || !value ||
+      !G_VALUE_HOLDS(value, GST_TYPE_TASK)) {
+    return GST_BUS_PASS;
+  }
+  // A pool of its own per task, so the thread knows whose it is
+  RgbdTaskPool *pool = static_cast<RgbdTaskPool *>(
+      g_object_new(rgbd_task_pool_get_type(), NULL));
+  gst_object_ref_sink(pool);
+  pool->name = g_strdup(GST_OBJECT_NAME(owner));
+  GstElementFactory *factory = gst_element_get_factory(owner);
+  pool->alias = g_strdup(factory ? GST_OBJECT_NAME(factory) : "");
+  gst_task_set_pool(GST_TASK(g_value_get_object(value)), GST_TASK_POOL(pool));
+  gst_object_unref(pool);
+  return GST_BUS_PASS;
+}
+
+void ThreadPolicy::watch(GstElement *element) {
+  if (!enabled_) {
+    return;
+  }
+  // A child's bus only forwards to its bin, the handler goes on the top one
+  GstObject *top = GST_OBJECT(gst_object_ref(element));
+  while (GstObject *parent = gst_object_get_parent(top)) {
+    gst_object_unref(top);
+    top = parent;
+  }
+  GstBus *bus = gst_element_get_bus(GST_ELEMENT(top));
+  if (bus) {
+    gst_bus_set_sync_handler(bus, &ThreadPolicy::onSyncMessage, this, NULL);
+    gst_object_unref(bus);
+  }
+  gst_object_unref(top);
+}
+
+void ThreadPolicy::sample() {
+  if (!enabled_) {
+    return;
+  }
+  gint64 now = g_get_monotonic_time();
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto it = threads_.begin(); it != threads_.end();) {
+    double cpuSeconds = 0;
+    int lastCpu = -1;
+    if (!readStat(it->tid, cpuSeconds, lastCpu)) {
+      Metrics::instance().remove(tidLabel(it->tid));
+      it = threads_.erase(it);
+      continue;
+    }
+    if (it->sampledUs && now > it->sampledUs) {
+      it->percent =
+          100.0 * (cpuSeconds - it->cpuSeconds) / ((now - it->sampledUs) / 1e6);
+    }
+    it->cpuSeconds = cpuSeconds;
+    it->sampledUs = now;
+    it->lastCpu = lastCpu;
+    Metrics &metrics = Metrics::instance();
+    metrics.set("rgbd_thread_cpu_seconds_total" + it->labels, cpuSeconds);
+    metrics.set("rgbd_thread_cpu_percent" + it->labels, it->percent);
+    metrics.set("rgbd_thread_last_cpu" + it->labels, lastCpu);
+    ++it;
+  }
+}
+
+void ThreadPolicy::report(std::ostream &out) {
+  if (!enabled_) {
+    return;
+  }
+  sample();
+  std::lock_guard<std::mutex> lock(mutex_);
+  out << "Thread CPU usage:" << std::endl;
+  for (const Tracked &thread : threads_) {
+    std::ostringstream line;
+    line << "  " << std::left << std::setw(16) << thread.name << std::right
+         << std::setw(8) << thread.tid << std::fixed << std::setprecision(1)
+         << std::setw(7) << thread.percent << "% " << std::setw(9)
+         << thread.cpuSeconds << " s  cpu " << thread.lastCpu;
+    out << line.str() << std::endl;
+  }
+}
@@ -2,6 +2,10 @@
 #include <gst/gst.h>
 #include <iostream>
 
+#include "gst_rgbd_server/app_queue.h"
+#include "gst_rgbd_server/encoder_factory.h"
+#include "gst_rgbd_server/udp_batch_elements.h"
+
 int main(int argc, char *argv[]) {
     // Initialize GStreamer
     gst_init(&argc, &argv);
@@ -14,33 +18,39 @@ int main(int argc, char *argv[]) {
     // Start RealSense pipeline
     pipe.start(cfg);
 
-    // Create GStreamer pipeline
-    GstElement *pipeline = gst_pipeline_new("realsense-pipeline");
-
-    // Create elements
-    GstElement *source = gst_element_factory_make("appsrc", "source");
-    GstElement *convert = gst_element_factory_make("nvvideoconvert", "convert");
-    GstElement *encoder = gst_element_factory_make("nvv4l2h264enc", "encoder"); // NVIDIA H.264 encoder
-    GstElement *payloader = gst_element_factory_make("rtph264pay", "payloader"); // RTSP payloader
-    GstElement *udpsink = gst_element_factory_make("udpsink", "udpsink");
-
-    // Check if elements are created successfully
-    if (!pipeline || !source || !convert || !encoder || !payloader || !udpsink) {
-        std::cerr << "Error creating elements!" << std::endl;
+    // Create GStreamer pipeline, with nvv4l2h264enc on Jetson and whatever
+    // H.264 encoder the machine has otherwise
+    EncoderRequest request;
+    request.width = 640;
+    request.height = 480;
+    request.fps = 30;
+    EncoderChoice encoder = EncoderFactory::select(request);
+    if (!encoder) {
         return -1;
     }
-
-    // Set properties for the appsrc element
-    g_object_set(G_OBJECT(source), "is-live", TRUE, "caps",
-                 gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING, "RGB", NULL), NULL);
-
-    // Set properties for udpsink (change the IP and port as needed)
-    g_object_set(G_OBJECT(udpsink), "host", "127.0.0.1", "port", 5000, NULL);
-
-    // Build the pipeline
-    gst_bin_add_many(GST_BIN(pipeline), source, convert, encoder, payloader, udpsink, NULL);
-    if (!gst_element_link_many(source, convert, encoder, payloader, udpsink, NULL)) {
-        std::cerr << "Error linking elements!" << std::endl;
+    // RTP leaves through the appsink, set host and port of the sender below
+    std::string launch =
+        "appsrc name=source is-live=true format=time do-timestamp=true "
+        "caps=\"video/x-raw,format=RGB,width=640,height=480,framerate=30/1\" ! "
+        "videoconvert ! " + encoder.launch("encoder") + " ! " +
+        encoder.payloader() + " ! appsink name=rtp";
+    GError *error = NULL;
+    GstElement *pipeline = gst_parse_launch(launch.c_str(), &error);
+    if (!pipeline || error) {
+        std::cerr << "Error creating pipeline: "
+                  << (error ? error->message : "unknown") << std::endl;
+        g_clear_error(&error);
+        return -1;
+    }
+    GstElement *source = gst_bin_get_by_name(GST_BIN(pipeline), "source");
+    // Keep the two newest frames when the encoder falls behind
+    AppSrcQueue queue(source, "udp", QueuePolicy());
+    gst_object_unref(source); // the queue keeps it alive
+    // Each payloaded list leaves with one sendmmsg() instead of per packet
+    GstElement *rtp = gst_bin_get_by_name(GST_BIN(pipeline), "rtp");
+    RtpBatchSink sender(rtp, "127.0.0.1", 5000, "udp");
+    gst_object_unref(rtp);
+    if (!sender.isOpen()) {
         gst_object_unref(pipeline);
         return -1;
     }
@@ -61,20 +71,20 @@ int main(int argc, char *argv[]) {
         // Get the color frame
         rs2::video_frame color_frame = frames.get_color_frame();
 
-        // Create GStreamer buffer and push it to the pipeline
+        // Create GStreamer buffer and push it to the pipeline. A queued
+        // buffer outlives this iteration, so it holds on to the frame.
+        gsize size = color_frame.get_height() * color_frame.get_stride_in_bytes();
         GstBuffer *buffer = gst_buffer_new();
         gst_buffer_append_memory(buffer, gst_memory_new_wrapped(GST_MEMORY_FLAG_READONLY,
                                                                 const_cast<void*>(color_frame.get_data()),
-                                                                color_frame.get_height() * color_frame.get_stride_in_bytes(),
+                                                                size,
                                                                 0,
-                                                                color_frame.get_height() * color_frame.get_stride_in_bytes(),
-                                                                nullptr,
-                                                                nullptr));
-
-        GstFlowReturn ret;
-        g_signal_emit_by_name(source, "push-buffer", buffer, &ret);
-
-        gst_buffer_unref(buffer);
+                                                                size,
+                                                                new rs2::frame(color_frame),
+                                                                [](gpointer frame) {
+                                                                    delete static_cast<rs2::frame *>(frame);
+                                                                }));
+        queue.push(buffer);
     }
 
     // Cleanup
@@ -0,0 +1,316 @@
+#include "gst_rgbd_server/udp_batch.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include "gst_rgbd_server/metrics.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+namespace {
+
+// Limits of one GSO send: segments the kernel takes before 5.x raised it,
+// and the largest UDP payload over IPv6
+constexpr size_t kMaxGsoSegments = 64;
+constexpr size_t kMaxGsoBytes = 65535 - 8 - 40;
+
+std::atomic<double> &counter(const char *metric, const std::string &name) {
+  return Metrics::instance().gauge(std::string(metric) + "{socket=\"" + name +
+                                   "\"}");
+}
+
+// Sockets under one name may send from different threads
+void accumulate(std::atomic<double> &value, double delta) {
+  double current = value.load();
+  while (!value.compare_exchange_weak(current, current + delta)) {
+  }
+}
+
+addrinfo *resolve(const std::string &host, int port, bool passive) {
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  addrinfo *result = NULL;
+  int error = getaddrinfo(host.empty() ? NULL : host.c_str(),
+                          std::to_string(port).c_str(), &hints, &result);
+  if (error) {
+    std::cerr << "Failed to resolve " << host << ": " << gai_strerror(error)
+              << std::endl;
+    return NULL;
+  }
+  return result;
+}
+
+bool gsoRefused(int error) {
+  return error == EIO || error == EINVAL || error == ENOPROTOOPT ||
+         error == EOPNOTSUPP;
+}
+
+} // namespace
+
+UdpBatchSender::UdpBatchSender(const std::string &name,
+                               const UdpBatchOptions &options)
+    : name_(name), options_(options),
+      syscalls_(counter("rgbd_udp_send_syscalls_total", name)),
+      sent_(counter("rgbd_udp_packets_sent_total", name)),
+      gsoSends_(counter("rgbd_udp_gso_sends_total", name)),
+      errors_(counter("rgbd_udp_send_errors_total", name)),
+      batchPackets_(counter("rgbd_udp_send_batch_packets", name)) {
+  options_.batch = std::max(1u, std::min(options_.batch, unsigned(UIO_MAXIOV)));
+}
+
+UdpBatchSender::~UdpBatchSender() { close(); }
+
+bool UdpBatchSender::open(const std::string &host, int port) {
+  close();
+  addrinfo *address = resolve(host, port, false);
+  if (!address) {
+    return false;
+  }
+  fd_ = socket(address->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  // Connected, so the kernel looks the route up once instead of per packet
+  if (fd_ < 0 || connect(fd_, address->ai_addr, address->ai_addrlen) != 0) {
+    std::cerr << "Failed to open UDP socket to " << host << ":" << port
+              << ": " << strerror(errno) << std::endl;
+    freeaddrinfo(address);
+    close();
+    return false;
+  }
+  freeaddrinfo(address);
+  if (options_.socketBufferBytes > 0) {
+    setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &options_.socketBufferBytes,
+               sizeof(options_.socketBufferBytes));
+  }
+  // Setting a zero segment size succeeds exactly where GSO is supported
+  int zero = 0;
+  gso_ = options_.gso &&
+         setsockopt(fd_, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) == 0;
+  return true;
+}
+
+void UdpBatchSender::close() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+  iovs_.clear();
+  packets_.clear();
+}
+
+void UdpBatchSender::add(const iovec *iov, size_t iovCount) {
+  Packet packet{iovs_.size(), iovCount, 0};
+  for (size_t i = 0; i < iovCount; ++i) {
+    iovs_.push_back(iov[i]);
+    packet.size += iov[i].iov_len;
+  }
+  packets_.push_back(packet);
+}
+
+void UdpBatchSender::buildMessages(size_t from) {
+  msgs_.clear();
+  msgPackets_.clear();
+  std::vector<uint16_t> segments;
+  size_t i = from;
+  while (i < packets_.size()) {
+    size_t first = i;
+    size_t segment = packets_[i].size;
+    size_t bytes = segment;
+    size_t iovCount = packets_[i].count;
+    ++i;
+    // Equal size packets, then at most one shorter one to end the run
+    while (gso_ && i < packets_.size() && i - first < kMaxGsoSegments &&
+           packets_[i].size <= segment &&
+           bytes + packets_[i].size <= kMaxGsoBytes &&
+           iovCount + packets_[i].count <= UIO_MAXIOV) {
+      bool last = packets_[i].size < segment;
+      bytes += packets_[i].size;
+      iovCount += packets_[i].count;
+      ++i;
+      if (last) {
+        break;
+      }
+    }
+    struct mmsghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_hdr.msg_iov = &iovs_[packets_[first].iov];
+    msg.msg_hdr.msg_iovlen = iovCount;
+    msgs_.push_back(msg);
+    msgPackets_.push_back(first);
+    segments.push_back(i - first > 1 ? uint16_t(segment) : 0);
+  }
+  msgPackets_.push_back(packets_.size());
+
+  // Control data last, once msgs_ no longer moves
+  const size_t space = CMSG_SPACE(sizeof(uint16_t));
+  controls_.assign(space * msgs_.size(), 0);
+  for (size_t m = 0; m < msgs_.size(); ++m) {
+    if (!segments[m]) {
+      continue;
+    }
+    msghdr &hdr = msgs_[m].msg_hdr;
+    hdr.msg_control = &controls_[m * space];
+    hdr.msg_controllen = space;
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    memcpy(CMSG_DATA(cmsg), &segments[m], sizeof(uint16_t));
+  }
+}
+
+size_t UdpBatchSender::sendMessages(bool &ok, size_t &syscalls) {
+  size_t done = 0;
+  while (done < msgs_.size()) {
+    unsigned count = unsigned(
+        std::min<size_t>(msgs_.size() - done, options_.batch));
+    int sent = sendmmsg(fd_, &msgs_[done], count, 0);
+    ++syscalls;
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent < 0 && gso_ && msgs_[done].msg_hdr.msg_controllen &&
+        gsoRefused(errno)) {
+      // Usually a segment above the device MTU; the rest goes one by one
+      std::cerr << "UDP GSO refused on " << name_ << " (" << strerror(errno)
+                << "), sending without it." << std::endl;
+      gso_ = false;
+      return msgPackets_[done];
+    }
+    if (sent < 0) {
+      // ECONNREFUSED only says nobody listened to an earlier packet
+      if (errno != ECONNREFUSED) {
+        ok = false;
+        accumulate(errors_, 1);
+      }
+      sent = 1;
+    }
+    for (int m = 0; m < sent; ++m) {
+      if (msgs_[done + m].msg_hdr.msg_controllen) {
+        accumulate(gsoSends_, 1);
+      }
+    }
+    done += size_t(sent);
+  }
+  return packets_.size();
+}
+
+bool UdpBatchSender::flush() {
+  if (packets_.empty()) {
+    return true;
+  }
+  if (fd_ < 0) {
+    iovs_.clear();
+    packets_.clear();
+    return false;
+  }
+  bool ok = true;
+  size_t syscalls = 0;
+  size_t from = 0;
+  while (from < packets_.size()) {
+    buildMessages(from);
+    from = sendMessages(ok, syscalls);
+  }
+  accumulate(syscalls_, double(syscalls));
+  accumulate(sent_, double(packets_.size()));
+  batchPackets_ = double(packets_.size()) / std::max<size_t>(syscalls, 1);
+  iovs_.clear();
+  packets_.clear();
+  return ok;
+}
+
+UdpBatchReceiver::UdpBatchReceiver(const std::string &name,
+                                   const UdpBatchOptions &options)
+    : name_(name), options_(options),
+      syscalls_(counter("rgbd_udp_receive_syscalls_total", name)),
+      received_(counter("rgbd_udp_packets_received_total", name)),
+      truncated_(counter("rgbd_udp_receive_truncated_total", name)),
+      batchPackets_(counter("rgbd_udp_receive_batch_packets", name)) {
+  options_.batch = std::max(1u, std::min(options_.batch, unsigned(UIO_MAXIOV)));
+}
+
+UdpBatchReceiver::~UdpBatchReceiver() { close(); }
+
+bool UdpBatchReceiver::open(int port, const std::string &address) {
+  close();
+  addrinfo *local = resolve(address, port, true);
+  if (!local) {
+    return false;
+  }
+  fd_ = socket(local->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  int one = 1;
+  if (fd_ >= 0) {
+    // Like udpsrc, so a restarted receiver does not wait for the old port
+    setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (options_.socketBufferBytes > 0) {
+      setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &options_.socketBufferBytes,
+                 sizeof(options_.socketBufferBytes));
+    }
+  }
+  if (fd_ < 0 || bind(fd_, local->ai_addr, local->ai_addrlen) != 0) {
+    std::cerr << "Failed to bind UDP port " << port << ": " << strerror(errno)
+              << std::endl;
+    freeaddrinfo(local);
+    close();
+    return false;
+  }
+  freeaddrinfo(local);
+  return true;
+}
+
+void UdpBatchReceiver::close() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+int UdpBatchReceiver::receive(uint8_t *const *buffers, size_t *lengths,
+                              size_t count, int timeoutMs) {
+  if (fd_ < 0) {
+    return -1;
+  }
+  count = std::min<size_t>(count, options_.batch);
+  pollfd poller{fd_, POLLIN, 0};
+  int ready = poll(&poller, 1, timeoutMs);
+  if (ready <= 0) {
+    return ready < 0 && errno != EINTR ? -1 : 0;
+  }
+
+  msgs_.resize(count);
+  iovs_.resize(count);
+  for (size_t i = 0; i < count; ++i) {
+    iovs_[i].iov_base = buffers[i];
+    iovs_[i].iov_len = options_.maxPacket;
+    memset(&msgs_[i], 0, sizeof(msgs_[i]));
+    msgs_[i].msg_hdr.msg_iov = &iovs_[i];
+    msgs_[i].msg_hdr.msg_iovlen = 1;
+  }
+  int received =
+      recvmmsg(fd_, msgs_.data(), unsigned(count), MSG_DONTWAIT, NULL);
+  accumulate(syscalls_, 1);
+  if (received < 0) {
+    return errno == EAGAIN || errno == EINTR ? 0 : -1;
+  }
+  for (int i = 0; i < received; ++i) {
+    lengths[i] = msgs_[i].msg_len;
+    if (msgs_[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      lengths[i] = 0;
+      accumulate(truncated_, 1);
+    }
+  }
+  accumulate(received_, received);
+  batchPackets_ = received;
+  return received;
+}
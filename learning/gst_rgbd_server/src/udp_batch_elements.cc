@@ -0,0 +1,203 @@
+#include "gst_rgbd_server/udp_batch_elements.h"
+
+#include <gst/app/gstappsink.h>
+
+#include <iostream>
+
+namespace {
+
+// Bound on packets waiting in the appsrc, a few 720p raw frames
+QueuePolicy rtpQueuePolicy() {
+  QueuePolicy policy;
+  policy.maxFrames = 0;
+  policy.maxBytes = 16 << 20;
+  policy.drop = QueueDrop::kDropNewest;
+  return policy;
+}
+
+} // namespace
+
+RtpBatchSink::RtpBatchSink(GstElement *appsink, const std::string &host,
+                           int port, const std::string &name,
+                           const UdpBatchOptions &options)
+    : appsink_(GST_ELEMENT(gst_object_ref(appsink))), sender_(name, options) {
+  if (!sender_.open(host, port)) {
+    return;
+  }
+  g_object_set(G_OBJECT(appsink), "emit-signals", TRUE, "sync", FALSE,
+               "async", FALSE, "enable-last-sample", FALSE, NULL);
+  // Lists arrive as one sample from GStreamer 1.12, before that per buffer
+  if (g_object_class_find_property(G_OBJECT_GET_CLASS(appsink),
+                                   "buffer-list")) {
+    g_object_set(G_OBJECT(appsink), "buffer-list", TRUE, NULL);
+  }
+  handler_ = g_signal_connect(appsink, "new-sample",
+                              G_CALLBACK(&RtpBatchSink::onNewSample), this);
+}
+
+RtpBatchSink::~RtpBatchSink() {
+  if (handler_) {
+    g_signal_handler_disconnect(appsink_, handler_);
+  }
+  gst_object_unref(appsink_);
+}
+
+GstFlowReturn RtpBatchSink::onNewSample(GstElement *appsink,
+                                        gpointer user_data) {
+  GstSample *sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink));
+  if (!sample) {
+    return GST_FLOW_EOS;
+  }
+  static_cast<RtpBatchSink *>(user_data)->send(sample);
+  gst_sample_unref(sample);
+  return GST_FLOW_OK;
+}
+
+void RtpBatchSink::send(GstSample *sample) {
+  GstBufferList *list = gst_sample_get_buffer_list(sample);
+  if (list) {
+    for (guint i = 0; i < gst_buffer_list_length(list); ++i) {
+      add(gst_buffer_list_get(list, i));
+    }
+  } else if (GstBuffer *buffer = gst_sample_get_buffer(sample)) {
+    add(buffer);
+  }
+  sender_.flush();
+  for (size_t i = 0; i < memories_.size(); ++i) {
+    gst_memory_unmap(memories_[i], &maps_[i]);
+  }
+  memories_.clear();
+  maps_.clear();
+}
+
+void RtpBatchSink::add(GstBuffer *buffer) {
+  iovs_.clear();
+  for (guint i = 0; i < gst_buffer_n_memory(buffer); ++i) {
+    GstMemory *memory = gst_buffer_peek_memory(buffer, i);
+    GstMapInfo map;
+    if (!gst_memory_map(memory, &map, GST_MAP_READ)) {
+      continue;
+    }
+    memories_.push_back(memory);
+    maps_.push_back(map);
+    iovs_.push_back(iovec{map.data, map.size});
+  }
+  if (!iovs_.empty()) {
+    sender_.add(iovs_.data(), iovs_.size());
+  }
+}
+
+RtpBatchSource::RtpBatchSource(GstElement *appsrc, int port,
+                               const std::string &name,
+                               const UdpBatchOptions &options,
+                               const std::string &address)
+    : appsrc_(GST_ELEMENT(gst_object_ref(appsrc))),
+      queue_(appsrc, name, rtpQueuePolicy()), receiver_(name, options) {
+  g_object_set(G_OBJECT(appsrc), "is-live", TRUE, NULL);
+  gst_util_set_object_arg(G_OBJECT(appsrc), "format", "time");
+  if (!receiver_.open(port, address)) {
+    return;
+  }
+  // Enough packets for the reads in flight and what the jitterbuffer holds;
+  // the pool grows beyond that rather than stall
+  pool_ = gst_buffer_pool_new();
+  GstStructure *config = gst_buffer_pool_get_config(pool_);
+  gst_buffer_pool_config_set_params(config, NULL, options.maxPacket,
+                                    4 * options.batch, 0);
+  gst_buffer_pool_set_config(pool_, config);
+  gst_buffer_pool_set_active(pool_, TRUE);
+}
+
+RtpBatchSource::~RtpBatchSource() {
+  stop();
+  if (pool_) {
+    gst_buffer_pool_set_active(pool_, FALSE);
+    gst_object_unref(pool_);
+  }
+  gst_object_unref(appsrc_);
+}
+
+void RtpBatchSource::start() {
+  if (!pool_ || running_.exchange(true)) {
+    return;
+  }
+  thread_ = std::thread(&RtpBatchSource::run, this);
+}
+
+void RtpBatchSource::stop() {
+  running_ = false;
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void RtpBatchSource::run() {
+  size_t batch = receiver_.options().batch;
+  std::vector<GstBuffer *> buffers(batch, nullptr);
+  std::vector<GstMapInfo> maps(batch);
+  std::vector<uint8_t *> data(batch, nullptr);
+  std::vector<size_t> lengths(batch, 0);
+  while (running_) {
+    // Slots used by the last read get fresh buffers, the others stay mapped
+    bool ready = true;
+    for (size_t i = 0; i < batch && ready; ++i) {
+      if (buffers[i]) {
+        continue;
+      }
+      if (gst_buffer_pool_acquire_buffer(pool_, &buffers[i], NULL) !=
+              GST_FLOW_OK ||
+          !gst_buffer_map(buffers[i], &maps[i], GST_MAP_WRITE)) {
+        if (buffers[i]) {
+          gst_buffer_unref(buffers[i]);
+          buffers[i] = nullptr;
+        }
+        ready = false;
+      } else {
+        data[i] = maps[i].data;
+      }
+    }
+    if (!ready) {
+      std::cerr << "RTP receive pool ran dry." << std::endl;
+      break;
+    }
+
+    int count = receiver_.receive(data.data(), lengths.data(), batch, 100);
+    if (count < 0) {
+      break;
+    }
+    if (count == 0) {
+      continue;
+    }
+
+    GstClockTime now = GST_CLOCK_TIME_NONE;
+    if (GstClock *clock = gst_element_get_clock(appsrc_)) {
+      now = gst_clock_get_time(clock) - gst_element_get_base_time(appsrc_);
+      gst_object_unref(clock);
+    }
+    GstBufferList *list = gst_buffer_list_new_sized(guint(count));
+    for (int i = 0; i < count; ++i) {
+      gst_buffer_unmap(buffers[i], &maps[i]);
+      if (lengths[i]) {
+        gst_buffer_set_size(buffers[i], gssize(lengths[i]));
+        GST_BUFFER_PTS(buffers[i]) = now;
+        GST_BUFFER_DTS(buffers[i]) = now;
+        gst_buffer_list_add(list, buffers[i]);
+      } else {
+        // truncated, back to the pool
+        gst_buffer_unref(buffers[i]);
+      }
+      buffers[i] = nullptr;
+    }
+    if (gst_buffer_list_length(list) == 0) {
+      gst_buffer_list_unref(list);
+    } else if (queue_.pushList(list) != GST_FLOW_OK) {
+      break;
+    }
+  }
+  for (size_t i = 0; i < batch; ++i) {
+    if (buffers[i]) {
+      gst_buffer_unmap(buffers[i], &maps[i]);
+      gst_buffer_unref(buffers[i]);
+    }
+  }
+}
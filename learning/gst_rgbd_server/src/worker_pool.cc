@@ -0,0 +1,109 @@
+#include "gst_rgbd_server/worker_pool.h"
+
+#include <utility>
+
+WorkerPool::WorkerPool(size_t threads, size_t maxQueued,
+                       std::function<void()> onStart)
+    : maxQueued_(maxQueued ? maxQueued : 1), onStart_(std::move(onStart)) {
+  if (threads == 0) {
+    threads = hardwareThreads();
+  }
+  threads_.reserve(threads);
+  for (size_t i = 0; i < threads; ++i) {
+    threads_.emplace_back(&WorkerPool::run, this);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  jobReady_.notify_all();
+  spaceReady_.notify_all();
+  for (std::thread &thread : threads_) {
+    thread.join();
+  }
+}
+
+size_t WorkerPool::hardwareThreads() {
+  size_t cores = std::thread::hardware_concurrency();
+  return cores ? cores : 1;
+}
+
+bool WorkerPool::trySubmit(std::function<void()> job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_ || jobs_.size() >= maxQueued_) {
+      return false;
+    }
+    jobs_.push_back(std::move(job));
+  }
+  jobReady_.notify_one();
+  return true;
+}
+
+bool WorkerPool::submit(std::function<void()> job) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    spaceReady_.wait(lock,
+                     [this] { return stopping_ || jobs_.size() < maxQueued_; });
+    if (stopping_) {
+      return false;
+    }
+    jobs_.push_back(std::move(job));
+  }
+  jobReady_.notify_one();
+  return true;
+}
+
+void WorkerPool::parallelFor(size_t count,
+                             const std::function<void(size_t)> &fn) {
+  if (count == 0) {
+    return;
+  }
+  std::mutex doneMutex;
+  std::condition_variable doneReady;
+  size_t remaining = count - 1;
+  for (size_t i = 1; i < count; ++i) {
+    auto job = [&, i] {
+      fn(i);
+      std::lock_guard<std::mutex> lock(doneMutex);
+      if (--remaining == 0) {
+        doneReady.notify_one();
+      }
+    };
+    if (!submit(job)) {
+      job();
+    }
+  }
+  fn(0);
+  std::unique_lock<std::mutex> lock(doneMutex);
+  doneReady.wait(lock, [&] { return remaining == 0; });
+}
+
+size_t WorkerPool::queued() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return jobs_.size();
+}
+
+void WorkerPool::run() {
+  if (onStart_) {
+    onStart_();
+  }
+  for (;;) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      jobReady_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+      // Drain what is queued before stopping, jobs may own frame references
+      if (jobs_.empty()) {
+        return;
+      }
+      job = std::move(jobs_.front());
+      jobs_.pop_front();
+    }
+    spaceReady_.notify_one();
+    job();
+  }
+}
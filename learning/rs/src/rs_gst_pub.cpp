@@ -1,11 +1,34 @@
 #include <gst/gst.h>
-#include <librealsense2/rs.hpp>
 #include <opencv2/opencv.hpp>
 
+#include <algorithm>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <iostream>
+
+#include "gst_rgbd_server/app_queue.h"
+#include "gst_rgbd_server/camera_source.h"
+#include "gst_rgbd_server/encoder_factory.h"
+#include "gst_rgbd_server/pre_event_ring.h"
+#include "gst_rgbd_server/raw_rtp.h"
+#include "gst_rgbd_server/rgbd_replay_source.h"
+#include "gst_rgbd_server/rtcp_rate_adapter.h"
+#include "gst_rgbd_server/rtp_protection.h"
+#include "gst_rgbd_server/segment_recorder.h"
+#include "gst_rgbd_server/thread_policy.h"
+#include "gst_rgbd_server/udp_batch_elements.h"
+
 const int WIDTH = 640;
 const int HEIGHT = 480;
 const int FRAMERATE = 30;
 
+// Color RTP goes to 5000, depth to 5002. Sender reports leave on the next
+// port up, receiver reports from rs_gst_sub come back on these:
+const int COLOR_RTCP_IN_PORT = 5005;
+const int DEPTH_RTCP_IN_PORT = 5007;
+
 void setSourceCaps(GstElement *source, const char *format, int width, int height, int framerate) {
     GstCaps *caps = gst_caps_new_simple("video/x-raw",
                                         "format", G_TYPE_STRING, format,
@@ -17,23 +40,216 @@ void setSourceCaps(GstElement *source, const char *format, int width, int height
     gst_caps_unref(caps);
 }
 
+// Wrap a camera image without copying; the buffer keeps the frame set alive.
+GstBuffer *wrapImage(const CameraImage &image,
+                     const std::shared_ptr<void> &keepAlive) {
+    return gst_buffer_new_wrapped_full(
+        GST_MEMORY_FLAG_READONLY, const_cast<void *>(image.data), image.size, 0,
+        image.size, new std::shared_ptr<void>(keepAlive), [](gpointer data) {
+            delete static_cast<std::shared_ptr<void> *>(data);
+        });
+}
+
+// "<upload> ! <encoder> name=NAME" of the chosen encoder as one element.
+GstElement *makeEncodeBin(const EncoderChoice &encoder, const char *name) {
+    if (!encoder) {
+        return NULL;
+    }
+    GError *error = NULL;
+    GstElement *bin = gst_parse_bin_from_description(
+        encoder.launch(name).c_str(), TRUE, &error);
+    if (error) {
+        g_printerr("Error: %s\n", error->message);
+        g_clear_error(&error);
+    }
+    return bin;
+}
+
+// Adds and links the non-NULL elements in order, so the raw chains can leave
+// out the stages they do not have.
+bool addChain(GstElement *pipeline, std::initializer_list<GstElement *> chain) {
+    GstElement *previous = NULL;
+    for (GstElement *element : chain) {
+        if (!element) {
+            continue;
+        }
+        gst_bin_add(GST_BIN(pipeline), element);
+        if (previous && !gst_element_link(previous, element)) {
+            return false;
+        }
+        previous = element;
+    }
+    return true;
+}
+
+// Route a payloader through rtpbin session `session`: RTP to rtp_sink, sender
+// reports to host:rtp_port + 1 and receiver reports in on rtcp_in_port, so
+// RtcpRateAdapter can see what the receivers get.
+bool addRtpSession(GstElement *pipeline, GstElement *rtpbin,
+                   GstElement *payloader, GstElement *rtp_sink,
+                   guint session, const char *host, int rtp_port,
+                   int rtcp_in_port) {
+    GstElement *rtcp_sink = gst_element_factory_make("udpsink", NULL);
+    GstElement *rtcp_source = gst_element_factory_make("udpsrc", NULL);
+    if (!rtcp_sink || !rtcp_source) {
+        return false;
+    }
+    g_object_set(G_OBJECT(rtcp_sink), "host", host, "port", rtp_port + 1,
+                 "sync", false, "async", false, NULL);
+    g_object_set(G_OBJECT(rtcp_source), "port", rtcp_in_port, NULL);
+    gst_bin_add_many(GST_BIN(pipeline), rtcp_sink, rtcp_source, NULL);
+
+    std::string id = std::to_string(session);
+    return gst_element_link_pads(payloader, "src", rtpbin,
+                                 ("send_rtp_sink_" + id).c_str()) &&
+           gst_element_link_pads(rtpbin, ("send_rtp_src_" + id).c_str(),
+                                 rtp_sink, "sink") &&
+           gst_element_link_pads(rtpbin, ("send_rtcp_src_" + id).c_str(),
+                                 rtcp_sink, "sink") &&
+           gst_element_link_pads(rtcp_source, "src", rtpbin,
+                                 ("recv_rtcp_sink_" + id).c_str());
+}
+
+// Feed a recording into both appsrcs instead of the camera. The replay buffers
+// wrap the memory map, so nothing is copied on the way to the encoders.
+int pushReplay(RgbdReplaySource &replay, AppSrcQueue &color_source,
+               AppSrcQueue &depth_source) {
+    int colorStream = replay.findStream(RgbdStreamKind::kColor);
+    int depthStream = replay.findStream(RgbdStreamKind::kDepth);
+    ReplayFrame frame;
+    while (replay.next(frame)) {
+        // Rate control polls from the default main context
+        while (g_main_context_iteration(NULL, FALSE)) {
+        }
+        const std::pair<int, AppSrcQueue *> targets[] = {
+            {colorStream, &color_source}, {depthStream, &depth_source}};
+        for (const auto &target : targets) {
+            if (target.first < 0 || !frame.buffers[target.first]) {
+                continue;
+            }
+            GstFlowReturn ret = target.second->push(
+                gst_buffer_ref(frame.buffers[target.first]));
+            if (ret != GST_FLOW_OK) {
+                g_printerr("Error: Failed to push replay buffer.\n");
+                return -1;
+            }
+        }
+        frame.clear();
+    }
+    color_source.endOfStream();
+    depth_source.endOfStream();
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     gst_init(&argc, &argv);
 
+    // rs_gst_pub [FLAGS] [realsense[:SERIAL] | synthetic[:SEED]]
+    // rs_gst_pub [FLAGS] recording.rgbdrec [realtime|fixed|max]
+    // --raw sends uncompressed RFC 4175 video instead of H.264, for wired
+    // links; a recording goes at its own size, see rs_gst_sub --size.
+    // --no-fec and --no-rtx turn off loss protection, --latency=MS bounds
+    // how old a packet RTX still resends. rs_gst_sub needs the same flags.
+    // --record=PATTERN writes the encoded color stream to segments, e.g.
+    // /data/pub-%05d.mkv, --record-depth the depth stream next to it and
+    // --record-imu the IMU as a text track. --pre-event=MB keeps that
+    // much of both encoded streams in memory; SIGUSR1 saves it and as long
+    // after to event-*.mkv. --threads=RULES pins and prioritizes the capture
+    // loop and the streaming threads by name, e.g.
+    // 'capture=2:fifo=50;color-source=3:fifo=40;depth-source=3:fifo=40', and
+    // prints their CPU usage on exit.
+    bool raw = false;
+    RtpProtectionOptions protection;
+    RecorderOptions record;
+    size_t pre_event_bytes = 0;
+    for (; argc > 1 && strncmp(argv[1], "--", 2) == 0; --argc, ++argv) {
+        if (strcmp(argv[1], "--raw") == 0) {
+            raw = true;
+        } else if (strcmp(argv[1], "--no-fec") == 0) {
+            protection.fec = false;
+        } else if (strcmp(argv[1], "--no-rtx") == 0) {
+            protection.rtx = false;
+        } else if (strncmp(argv[1], "--latency=", 10) == 0) {
+            protection.latencyMs = unsigned(atoi(argv[1] + 10));
+        } else if (strncmp(argv[1], "--record=", 9) == 0) {
+            record.location = argv[1] + 9;
+        } else if (strcmp(argv[1], "--record-depth") == 0) {
+            record.depth = true;
+        } else if (strcmp(argv[1], "--record-imu") == 0) {
+            record.imu = true;
+        } else if (strncmp(argv[1], "--pre-event=", 12) == 0) {
+            pre_event_bytes = size_t(std::max(0, atoi(argv[1] + 12))) << 20;
+        } else if (strncmp(argv[1], "--threads=", 10) == 0) {
+            if (!ThreadPolicy::instance().configure(argv[1] + 10)) {
+                return -1;
+            }
+        } else {
+            g_printerr("Error: Unknown option %s.\n", argv[1]);
+            return -1;
+        }
+    }
+    std::string cameraSpec = "realsense";
+    std::unique_ptr<RgbdReplaySource> replay;
+    if (argc > 1 && (strncmp(argv[1], "realsense", 9) == 0 ||
+                     strncmp(argv[1], "synthetic", 9) == 0)) {
+        cameraSpec = argv[1];
+    } else if (argc > 1) {
+        ReplayOptions options;
+        options.fps = FRAMERATE;
+        options.loop = true;
+        if (argc > 2 && strcmp(argv[2], "fixed") == 0) {
+            options.pacing = ReplayPacing::kFixedRate;
+        } else if (argc > 2 && strcmp(argv[2], "max") == 0) {
+            options.pacing = ReplayPacing::kMaxRate;
+        }
+        replay.reset(new RgbdReplaySource);
+        if (!replay->open(argv[1], options)) {
+            g_printerr("Error: Could not open recording %s.\n", argv[1]);
+            return -1;
+        }
+    }
+
     GstElement *color_source = gst_element_factory_make("appsrc", "color-source");
     GstElement *depth_source = gst_element_factory_make("appsrc", "depth-source");
     GstElement *color_convert = gst_element_factory_make("videoconvert", "color-convert");
-    GstElement *depth_convert = gst_element_factory_make("videoconvert", "depth-convert");
-    GstElement *color_encoder = gst_element_factory_make("x264enc", "color-encoder");
-    GstElement *depth_encoder = gst_element_factory_make("x264enc", "depth-encoder");
-    GstElement *color_payloader = gst_element_factory_make("rtph264pay", "color-payloader");
-    GstElement *depth_payloader = gst_element_factory_make("rtph264pay", "depth-payloader");
-    GstElement *color_udpsink = gst_element_factory_make("udpsink", "color-udpsink");
-    GstElement *depth_udpsink = gst_element_factory_make("udpsink", "depth-udpsink");
-
-    if (!color_source || !depth_source || !color_convert || !depth_convert ||
-        !color_encoder || !depth_encoder || !color_payloader || !depth_payloader ||
-        !color_udpsink || !depth_udpsink) {
+    GstElement *depth_convert = NULL;
+    GstElement *color_encoder = NULL;
+    GstElement *depth_encoder = NULL;
+    GstElement *color_payloader = NULL;
+    GstElement *depth_payloader = NULL;
+    if (raw) {
+        // Color leaves as UYVY, whatever a recording holds; depth is already
+        // shaped as UYVY by its caps and goes to the payloader untouched
+        color_encoder = gst_element_factory_make("capsfilter", "color-format");
+        if (color_encoder) {
+            GstCaps *caps = gst_caps_new_simple("video/x-raw", "format",
+                                                G_TYPE_STRING, "UYVY", NULL);
+            g_object_set(G_OBJECT(color_encoder), "caps", caps, NULL);
+            gst_caps_unref(caps);
+        }
+        color_payloader = makeRawPayloader("color-payloader");
+        depth_payloader = makeRawPayloader("depth-payloader");
+    } else {
+        depth_convert = gst_element_factory_make("videoconvert", "depth-convert");
+        // Upload and encoder of the best H.264 encoder on this machine, as a bin
+        EncoderRequest request;
+        request.width = WIDTH;
+        request.height = HEIGHT;
+        request.fps = FRAMERATE;
+        EncoderChoice encoder = EncoderFactory::select(request);
+        color_encoder = makeEncodeBin(encoder, "color-encoder");
+        depth_encoder = makeEncodeBin(encoder, "depth-encoder");
+        color_payloader = gst_element_factory_make("rtph264pay", "color-payloader");
+        depth_payloader = gst_element_factory_make("rtph264pay", "depth-payloader");
+    }
+    // RTP leaves through RtpBatchSink below, many packets per syscall
+    GstElement *color_rtp_sink = gst_element_factory_make("appsink", "color-rtp-sink");
+    GstElement *depth_rtp_sink = gst_element_factory_make("appsink", "depth-rtp-sink");
+    GstElement *rtpbin = gst_element_factory_make("rtpbin", "rtpbin");
+
+    if (!color_source || !depth_source || !color_convert || !color_encoder ||
+        (!raw && (!depth_convert || !depth_encoder)) || !color_payloader ||
+        !depth_payloader || !color_rtp_sink || !depth_rtp_sink || !rtpbin) {
         g_printerr("Error: Could not create GStreamer elements.\n");
         return -1;
     }
@@ -48,25 +264,143 @@ int main(int argc, char *argv[]) {
     setSourceCaps(color_source, "BGR", WIDTH, HEIGHT, FRAMERATE);
 
     g_object_set(G_OBJECT(depth_source), "name", "depth-source", NULL);
-    setSourceCaps(depth_source, "GRAY16_LE", WIDTH, HEIGHT, FRAMERATE);
+    setSourceCaps(depth_source, raw ? "UYVY" : "GRAY16_LE", WIDTH, HEIGHT,
+                  FRAMERATE);
 
-    g_object_set(G_OBJECT(color_udpsink), "auto-multicast", true, "force-ipv4",
-                 true, "host", "127.0.0.1", "port", 5000, "sync", false, NULL);
-    g_object_set(G_OBJECT(depth_udpsink), "auto-multicast", true, "force-ipv4",
-                 true, "host", "127.0.0.1", "port", 5001, "sync", false, NULL);
+    if (replay) {
+        // Take size and format from the recording, timestamps from the replay
+        const std::pair<RgbdStreamKind, GstElement *> sources[] = {
+            {RgbdStreamKind::kColor, color_source},
+            {RgbdStreamKind::kDepth, depth_source}};
+        for (const auto &source : sources) {
+            int stream = replay->findStream(source.first);
+            GstCaps *caps = stream >= 0 ? replay->caps(stream) : nullptr;
+            if (caps && raw && source.first == RgbdStreamKind::kDepth) {
+                GstCaps *depth = rawDepthCaps(caps);
+                gst_caps_unref(caps);
+                if (!depth) {
+                    return -1;
+                }
+                caps = depth;
+            }
+            if (caps) {
+                g_object_set(G_OBJECT(source.second), "caps", caps, NULL);
+                gst_caps_unref(caps);
+            }
+            gst_util_set_object_arg(G_OBJECT(source.second), "format", "time");
+        }
+        // Raw RTP does not carry the frame size, the receiver is told it
+        if (raw) {
+            int color = replay->findStream(RgbdStreamKind::kColor);
+            int depth = replay->findStream(RgbdStreamKind::kDepth);
+            uint32_t width = WIDTH, height = HEIGHT;
+            if (color >= 0) {
+                width = replay->streamInfo(color).width;
+                height = replay->streamInfo(color).height;
+            }
+            if (color >= 0 && depth >= 0 &&
+                (replay->streamInfo(depth).width != width ||
+                 replay->streamInfo(depth).height != height)) {
+                g_printerr("Error: --raw needs color and depth of one size.\n");
+                return -1;
+            }
+            if (depth >= 0) {
+                width = replay->streamInfo(depth).width;
+                height = replay->streamInfo(depth).height;
+            }
+            if (width != uint32_t(WIDTH) || height != uint32_t(HEIGHT)) {
+                g_print("Receive with rs_gst_sub --raw --size=%ux%u\n", width,
+                        height);
+            }
+        }
+    }
 
-    gst_bin_add_many(GST_BIN(pipeline), color_source, color_convert, color_encoder,
-                     color_payloader, color_udpsink, depth_source, depth_convert,
-                     depth_encoder, depth_payloader, depth_udpsink, NULL);
+    UdpBatchOptions udp;
+    if (raw) {
+        udp.socketBufferBytes = kRawSocketBufferBytes;
+    }
+    std::unique_ptr<RtpBatchSink> color_sender(
+        new RtpBatchSink(color_rtp_sink, "127.0.0.1", 5000, "pub-color", udp));
+    std::unique_ptr<RtpBatchSink> depth_sender(
+        new RtpBatchSink(depth_rtp_sink, "127.0.0.1", 5002, "pub-depth", udp));
+    if (!color_sender->isOpen() || !depth_sender->isOpen()) {
+        g_printerr("Error: Could not open the RTP sockets.\n");
+        return -1;
+    }
 
-    if (!gst_element_link_many(color_source, color_convert, color_encoder,
-                               color_payloader, color_udpsink, NULL) ||
-        !gst_element_link_many(depth_source, depth_convert, depth_encoder,
-                               depth_payloader, depth_udpsink, NULL)) {
+    gst_bin_add_many(GST_BIN(pipeline), color_rtp_sink, depth_rtp_sink, rtpbin,
+                     NULL);
+    // FEC and RTX join each session as addRtpSession requests its pads
+    protectRtpSender(rtpbin, protection);
+
+    if (!addChain(pipeline, {color_source, color_convert, color_encoder,
+                             color_payloader}) ||
+        !addChain(pipeline, {depth_source, depth_convert, depth_encoder,
+                             depth_payloader}) ||
+        !addRtpSession(pipeline, rtpbin, color_payloader, color_rtp_sink, 0,
+                       "127.0.0.1", 5000, COLOR_RTCP_IN_PORT) ||
+        !addRtpSession(pipeline, rtpbin, depth_payloader, depth_rtp_sink, 1,
+                       "127.0.0.1", 5002, DEPTH_RTCP_IN_PORT)) {
         g_printerr("Error: Could not link GStreamer elements.\n");
         return -1;
     }
 
+    // Bitrate follows the receiver reports of each stream; raw video has no
+    // bitrate to adapt
+    std::unique_ptr<RtcpRateAdapter> color_rate, depth_rate;
+    if (!raw) {
+        GstElement *color_enc = gst_bin_get_by_name(GST_BIN(color_encoder), "color-encoder");
+        GstElement *depth_enc = gst_bin_get_by_name(GST_BIN(depth_encoder), "depth-encoder");
+        color_rate.reset(new RtcpRateAdapter("color", color_enc, NULL, WIDTH,
+                                             HEIGHT, FRAMERATE,
+                                             RateControllerOptions()));
+        color_rate->attach(rtpbin, 0);
+        depth_rate.reset(new RtcpRateAdapter("depth", depth_enc, NULL, WIDTH,
+                                             HEIGHT, FRAMERATE,
+                                             RateControllerOptions()));
+        depth_rate->attach(rtpbin, 1);
+        gst_object_unref(color_enc);
+        gst_object_unref(depth_enc);
+    }
+
+    // Recordings tap the encoders' output, raw video has none to tap
+    std::unique_ptr<SegmentRecorder> color_recorder, depth_recorder;
+    if (record.enabled() && raw) {
+        g_printerr("Warning: --record needs an encoder, not recording.\n");
+    } else if (record.enabled()) {
+        color_recorder.reset(new SegmentRecorder(
+            "color", record.location, VideoCodec::kH264, record, record.imu));
+        GstPad *pad = gst_element_get_static_pad(color_encoder, "src");
+        color_recorder->attach(pad);
+        gst_object_unref(pad);
+        if (record.depth) {
+            depth_recorder.reset(new SegmentRecorder(
+                "depth", recordingLocation(record.location, "-depth"),
+                VideoCodec::kH264, record));
+            pad = gst_element_get_static_pad(depth_encoder, "src");
+            depth_recorder->attach(pad);
+            gst_object_unref(pad);
+        }
+    }
+
+    std::unique_ptr<PreEventRing> pre_event;
+    if (pre_event_bytes && !raw) {
+        pre_event.reset(new PreEventRing(pre_event_bytes, "."));
+        GstPad *pad = gst_element_get_static_pad(color_encoder, "src");
+        pre_event->attach(pre_event->addTrack("color", VideoCodec::kH264), pad);
+        gst_object_unref(pad);
+        pad = gst_element_get_static_pad(depth_encoder, "src");
+        pre_event->attach(pre_event->addTrack("depth", VideoCodec::kH264), pad);
+        gst_object_unref(pad);
+        // Delivered by the main context iterations of the frame loop
+        pre_event->triggerOnSignal(SIGUSR1);
+    }
+
+    // The appsrc tasks carry each frame through encoder, payloader and the
+    // batched send, their threads are the ones to pin
+    ThreadPolicy::instance().watch(pipeline);
+    ThreadPolicy::instance().enter("capture");
+
     GstStateChangeReturn state_ret =
         gst_element_set_state(pipeline, GST_STATE_PLAYING);
     if (state_ret == GST_STATE_CHANGE_FAILURE) {
@@ -75,43 +409,92 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
-    rs2::pipeline pipeline_rs2;
-    rs2::config config;
-    config.enable_stream(RS2_STREAM_COLOR, WIDTH, HEIGHT, RS2_FORMAT_BGR8, FRAMERATE);
-    config.enable_stream(RS2_STREAM_DEPTH, WIDTH, HEIGHT, RS2_FORMAT_Z16, FRAMERATE);
-    pipeline_rs2.start(config);
+    // Live frames are dropped rather than queued when an encoder falls behind;
+    // a replay waits for the encoders instead, it has nothing to catch up with
+    QueuePolicy policy;
+    if (replay) {
+        policy.maxFrames = 4;
+        policy.drop = QueueDrop::kBlock;
+    }
+    std::unique_ptr<AppSrcQueue> color_queue(
+        new AppSrcQueue(color_source, "color-source", policy));
+    std::unique_ptr<AppSrcQueue> depth_queue(
+        new AppSrcQueue(depth_source, "depth-source", policy));
+
+    if (replay) {
+        int ret = pushReplay(*replay, *color_queue, *depth_queue);
+        ThreadPolicy::instance().report(std::cout);
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        pre_event.reset();
+        color_recorder.reset();
+        depth_recorder.reset();
+        color_queue.reset();
+        depth_queue.reset();
+        color_sender.reset();
+        depth_sender.reset();
+        gst_object_unref(pipeline);
+        gst_deinit();
+        return ret;
+    }
+
+    std::unique_ptr<CameraSource> camera = createCameraSource(cameraSpec);
+    CameraConfig config;
+    config.width = WIDTH;
+    config.height = HEIGHT;
+    config.fps = FRAMERATE;
+    // The sensor's native YUYV goes to the encoder as is, only the preview
+    // below converts it to BGR. Raw mode asks for UYVY, which the sensor
+    // delivers as well and RFC 4175 carries without converting.
+    config.colorFormat = raw ? RgbdPixelFormat::kUYVY : RgbdPixelFormat::kYUYV;
+    config.infrared = false;
+    config.imu = record.imu && color_recorder;
+    if (!camera || !camera->start(config)) {
+        g_printerr("Error: Could not start camera %s.\n", cameraSpec.c_str());
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        gst_object_unref(pipeline);
+        return -1;
+    }
+    setSourceCaps(color_source, raw ? "UYVY" : "YUY2", WIDTH, HEIGHT,
+                  FRAMERATE);
 
     cv::Mat color_frame, depth_frame;
     while (true) {
-        rs2::frameset frames = pipeline_rs2.wait_for_frames();
-        auto color_frame_rs2 = frames.get_color_frame();
-        auto depth_frame_rs2 = frames.get_depth_frame();
+        CameraFrameSet frames;
+        if (!camera->waitForFrames(frames) || !frames.color || !frames.depth) {
+            continue;
+        }
 
-        color_frame = cv::Mat(cv::Size(WIDTH, HEIGHT), CV_8UC3,
-                              (void *)color_frame_rs2.get_data());
+        cv::Mat yuv422(cv::Size(WIDTH, HEIGHT), CV_8UC2,
+                     (void *)frames.color.data, frames.color.stride);
         auto unscaled = cv::Mat(cv::Size(WIDTH, HEIGHT), CV_16UC1,
-                                (void *)depth_frame_rs2.get_data());
-        auto units = depth_frame_rs2.get_units();
+                                (void *)frames.depth.data, frames.depth.stride);
+        auto units = camera->depthScale();
         unscaled.convertTo(depth_frame, CV_64F, units);
 
-        GstBuffer *color_buffer = gst_buffer_new_wrapped(
-            color_frame.data, color_frame.total() * color_frame.elemSize());
-        GstBuffer *depth_buffer = gst_buffer_new_wrapped(
-            unscaled.data, unscaled.total() * unscaled.elemSize());
+        if (color_recorder) {
+            color_recorder->pushImu(frames);
+        }
 
-        GstFlowReturn ret;
-        g_signal_emit_by_name(color_source, "push-buffer", color_buffer, &ret);
+        GstBuffer *color_buffer = wrapImage(frames.color, frames.keepAlive);
+        GstBuffer *depth_buffer = wrapImage(frames.depth, frames.keepAlive);
+
+        GstFlowReturn ret = color_queue->push(color_buffer);
         if (ret != GST_FLOW_OK) {
             g_printerr("Error: Failed to push buffer to color pipeline.\n");
             break;
         }
 
-        g_signal_emit_by_name(depth_source, "push-buffer", depth_buffer, &ret);
+        ret = depth_queue->push(depth_buffer);
         if (ret != GST_FLOW_OK) {
             g_printerr("Error: Failed to push buffer to depth pipeline.\n");
             break;
         }
 
+        while (g_main_context_iteration(NULL, FALSE)) {
+        }
+
+        cv::cvtColor(yuv422, color_frame,
+                     raw ? cv::COLOR_YUV2BGR_UYVY : cv::COLOR_YUV2BGR_YUYV);
         cv::imshow("Color Pub", color_frame);
         cv::imshow("Depth Pub", unscaled);
 
@@ -120,9 +503,17 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    pipeline_rs2.stop();
+    ThreadPolicy::instance().report(std::cout);
+    camera->stop();
     cv::destroyAllWindows();
     gst_element_set_state(pipeline, GST_STATE_NULL);
+    pre_event.reset();
+    color_recorder.reset();
+    depth_recorder.reset();
+    color_queue.reset();
+    depth_queue.reset();
+    color_sender.reset();
+    depth_sender.reset();
     gst_object_unref(pipeline);
     gst_deinit();
 
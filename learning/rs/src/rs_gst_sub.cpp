@@ -1,27 +1,207 @@
 #include <gst/gst.h>
 #include <opencv2/opencv.hpp>
 
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "gst_rgbd_server/app_queue.h"
+#include "gst_rgbd_server/loss_injector.h"
+#include "gst_rgbd_server/raw_rtp.h"
+#include "gst_rgbd_server/rtp_protection.h"
+#include "gst_rgbd_server/udp_batch_elements.h"
+
+// Frame size unless --size says otherwise; raw RTP carries no size of its
+// own, so it must match what rs_gst_pub --raw sends
+const int WIDTH = 640;
+const int HEIGHT = 480;
+
+const char *H264_RTP_CAPS =
+    "application/x-rtp,media=video,clock-rate=90000,encoding-name=H264,payload=96";
+
+// The receive half of one stream: RTP from the appsrc named rtpsrc, which an
+// RtpBatchSource feeds from rtp_port, RTCP from the udpsrc named rtcpsrc on
+// the next port up, receiver reports and NACKs back to the publisher on
+// rtcp_out_port. rtpsrc and rtcpsrc are linked to rtpbin by linkReceiver,
+// once RtpReceiverProtection is in place. H.264 is decoded to `format`; raw
+// RFC 4175 is depayloaded as UYVY, which depth reinterprets.
+std::string receiveLaunch(bool raw, int width, int height, int rtp_port,
+                          int rtcp_out_port,
+                          const std::string &pub_host, const char *format,
+                          const char *appsink) {
+    std::string rtp;
+    if (raw) {
+        // rtpvrawdepay writes the packets straight into frames of its pool
+        rtp = "rtpbin name=rtpbin appsrc name=rtpsrc caps=\"" +
+              rawRtpCaps(width, height) + "\" rtpbin. ! rtpvrawdepay";
+    } else {
+        rtp = std::string("rtpbin name=rtpbin appsrc name=rtpsrc caps=\"") +
+              H264_RTP_CAPS + "\" rtpbin. ! rtph264depay ! h264parse ! avdec_h264 ! videoconvert ! video/x-raw,format=" +
+              format;
+    }
+    return rtp + " ! appsink name=" + appsink + " sync=false "
+           "udpsrc name=rtcpsrc port=" + std::to_string(rtp_port + 1) +
+           " rtpbin.send_rtcp_src_0 ! udpsink host=" +
+           pub_host + " port=" + std::to_string(rtcp_out_port) +
+           " sync=false async=false";
+}
+
+// Sets up FEC, RTX and the adaptive jitterbuffer on the pipeline's rtpbin,
+// then links rtpsrc and rtcpsrc to session 0.
+std::unique_ptr<RtpReceiverProtection>
+protectReceiver(GstElement *pipeline, const std::string &name, bool raw,
+                int width, int height, const RtpProtectionOptions &options) {
+    GstElement *rtpbin = gst_bin_get_by_name(GST_BIN(pipeline), "rtpbin");
+    GstElement *rtpsrc = gst_bin_get_by_name(GST_BIN(pipeline), "rtpsrc");
+    GstElement *rtcpsrc = gst_bin_get_by_name(GST_BIN(pipeline), "rtcpsrc");
+    std::unique_ptr<RtpReceiverProtection> protection(new RtpReceiverProtection(
+        name, rtpbin, raw ? rawRtpCaps(width, height) : H264_RTP_CAPS, options));
+    bool linked =
+        gst_element_link_pads(rtpsrc, "src", rtpbin, "recv_rtp_sink_0") &&
+        gst_element_link_pads(rtcpsrc, "src", rtpbin, "recv_rtcp_sink_0");
+    gst_object_unref(rtpbin);
+    gst_object_unref(rtpsrc);
+    gst_object_unref(rtcpsrc);
+    if (!linked) {
+        return nullptr;
+    }
+    return protection;
+}
+
+void printProtection(const char *stream, const RtpReceiverStats &stats) {
+    g_print("%s: %lu received, %lu lost, %lu recovered by FEC, %lu of %lu "
+            "retransmissions, jitter %.1f ms, latency %u ms\n",
+            stream, (unsigned long)stats.received, (unsigned long)stats.lost,
+            (unsigned long)stats.fecRecovered,
+            (unsigned long)stats.rtxRecovered,
+            (unsigned long)stats.rtxRequests, stats.jitterMs, stats.latencyMs);
+}
 
 
 int main(int argc, char *argv[]) {
     gst_init(&argc, &argv);
 
+    // rs_gst_sub [FLAGS] [PUB_HOST]
+    // --raw receives the uncompressed RFC 4175 streams of rs_gst_pub --raw.
+    // --no-fec, --no-rtx and --latency=MS must match rs_gst_pub; the
+    // jitterbuffer adapts below that latency. --loss=PERCENT[,BURST] drops
+    // incoming packets on purpose, to measure recovery on localhost.
+    // --size=WxH is the publisher's frame size, that of its recording when
+    // it replays one.
+    bool raw = false;
+    int width = WIDTH;
+    int height = HEIGHT;
+    RtpProtectionOptions protection;
+    LossInjectorOptions loss;
+    for (; argc > 1 && strncmp(argv[1], "--", 2) == 0; --argc, ++argv) {
+        if (strcmp(argv[1], "--raw") == 0) {
+            raw = true;
+        } else if (strcmp(argv[1], "--no-fec") == 0) {
+            protection.fec = false;
+        } else if (strcmp(argv[1], "--no-rtx") == 0) {
+            protection.rtx = false;
+        } else if (strncmp(argv[1], "--latency=", 10) == 0) {
+            protection.latencyMs = unsigned(atoi(argv[1] + 10));
+        } else if (strncmp(argv[1], "--size=", 7) == 0) {
+            if (sscanf(argv[1] + 7, "%dx%d", &width, &height) != 2 ||
+                width <= 0 || height <= 0) {
+                g_printerr("Invalid size %s, expected WxH.\n", argv[1] + 7);
+                return 1;
+            }
+        } else if (strncmp(argv[1], "--loss=", 7) == 0) {
+            char *end = NULL;
+            loss.lossPercent = strtod(argv[1] + 7, &end);
+            if (*end == ',') {
+                loss.burstPackets = unsigned(atoi(end + 1));
+            }
+        } else {
+            g_printerr("Unknown option %s.\n", argv[1]);
+            return 1;
+        }
+    }
 
+    // Receiver reports go back to the publisher, which adapts its bitrate
+    std::string pub_host = argc > 1 ? argv[1] : "127.0.0.1";
 
     // Create a GStreamer pipeline to receive RGB video via UDP
-    GstElement *rgb_pipeline = gst_parse_launch("udpsrc port=5000 ! application/x-rtp,media=video,encoding-name=H264,payload=96 ! rtph264depay ! h264parse ! avdec_h264 ! videoconvert ! video/x-raw,format=BGR ! appsink name=appsink_rgb sync=false", NULL);
+    std::string rgb_launch =
+        receiveLaunch(raw, width, height, 5000, 5005, pub_host, "BGR",
+                      "appsink_rgb");
+    GstElement *rgb_pipeline = gst_parse_launch(rgb_launch.c_str(), NULL);
 
     // Create a GStreamer pipeline to receive depth frames via UDP
-    GstElement *depth_pipeline = gst_parse_launch("udpsrc port=5001 ! application/x-rtp,media=video,encoding-name=H264,payload=96 ! rtph264depay ! h264parse ! avdec_h264 ! videoconvert ! video/x-raw,format=GRAY16_LE ! appsink name=appsink_depth sync=false", NULL);
+    std::string depth_launch =
+        receiveLaunch(raw, width, height, 5002, 5007, pub_host, "GRAY16_LE",
+                      "appsink_depth");
+    GstElement *depth_pipeline = gst_parse_launch(depth_launch.c_str(), NULL);
 
     if (!rgb_pipeline || !depth_pipeline) {
         g_print("Failed to create GStreamer pipelines.\n");
         return 1;
     }
 
+    std::unique_ptr<RtpReceiverProtection> rgb_protection =
+        protectReceiver(rgb_pipeline, "sub-color", raw, width, height,
+                        protection);
+    std::unique_ptr<RtpReceiverProtection> depth_protection =
+        protectReceiver(depth_pipeline, "sub-depth", raw, width, height,
+                        protection);
+    if (!rgb_protection || !depth_protection) {
+        g_print("Failed to link the RTP sessions.\n");
+        return 1;
+    }
+
+    // RTP comes in with recvmmsg, many packets per syscall
+    UdpBatchOptions udp;
+    if (raw) {
+        udp.socketBufferBytes = kRawSocketBufferBytes;
+    }
+    GstElement *rgb_rtpsrc = gst_bin_get_by_name(GST_BIN(rgb_pipeline), "rtpsrc");
+    GstElement *depth_rtpsrc = gst_bin_get_by_name(GST_BIN(depth_pipeline), "rtpsrc");
+    std::unique_ptr<RtpBatchSource> rgb_receiver(
+        new RtpBatchSource(rgb_rtpsrc, 5000, "sub-color", udp));
+    std::unique_ptr<RtpBatchSource> depth_receiver(
+        new RtpBatchSource(depth_rtpsrc, 5002, "sub-depth", udp));
+    // Losses are injected where the packets enter, so FEC, RTX and the
+    // jitterbuffer see them like losses on the link
+    if (loss.lossPercent > 0) {
+        GstPad *rgb_pad = gst_element_get_static_pad(rgb_rtpsrc, "src");
+        GstPad *depth_pad = gst_element_get_static_pad(depth_rtpsrc, "src");
+        attachLossInjector(rgb_pad, loss, "sub-color");
+        // another pattern for depth, the streams lose packets independently
+        loss.seed = 2;
+        attachLossInjector(depth_pad, loss, "sub-depth");
+        gst_object_unref(rgb_pad);
+        gst_object_unref(depth_pad);
+    }
+    gst_object_unref(rgb_rtpsrc);
+    gst_object_unref(depth_rtpsrc);
+    if (!rgb_receiver->isOpen() || !depth_receiver->isOpen()) {
+        g_print("Failed to open the RTP ports.\n");
+        return 1;
+    }
+
+    // The windows only ever show the newest frame, anything older is dropped
+    // in the appsink instead of piling up behind a slow imshow
+    QueuePolicy latest;
+    latest.maxFrames = 1;
+    GstElement *rgb_appsink = gst_bin_get_by_name(GST_BIN(rgb_pipeline), "appsink_rgb");
+    GstElement *depth_appsink = gst_bin_get_by_name(GST_BIN(depth_pipeline), "appsink_depth");
+    std::unique_ptr<AppSinkQueue> rgb_queue(
+        new AppSinkQueue(rgb_appsink, "sub-color", latest));
+    std::unique_ptr<AppSinkQueue> depth_queue(
+        new AppSinkQueue(depth_appsink, "sub-depth", latest));
+    gst_object_unref(rgb_appsink);
+    gst_object_unref(depth_appsink);
+
     // Set the pipelines' state to playing
     gst_element_set_state(rgb_pipeline, GST_STATE_PLAYING);
     gst_element_set_state(depth_pipeline, GST_STATE_PLAYING);
+    rgb_receiver->start();
+    depth_receiver->start();
 
     cv::namedWindow("RGB Video", cv::WINDOW_AUTOSIZE);
     cv::namedWindow("Depth Video", cv::WINDOW_AUTOSIZE);
@@ -31,41 +211,68 @@ int main(int argc, char *argv[]) {
     GstBus *depth_bus = gst_element_get_bus(depth_pipeline);
     GstMessage *rgb_msg, *depth_msg;
     cv::Mat rgb_frame, depth_frame;
+    auto last_report = std::chrono::steady_clock::now();
 
     while (true) {
+        // The jitterbuffer latency is adapted from the default main context
+        while (g_main_context_iteration(NULL, FALSE)) {
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_report >= std::chrono::seconds(5)) {
+            printProtection("color", rgb_protection->stats());
+            printProtection("depth", depth_protection->stats());
+            last_report = now;
+        }
+
         // Retrieve frames from RGB pipeline
-        GstSample *rgb_sample = nullptr;
-        g_signal_emit_by_name(gst_bin_get_by_name(GST_BIN(rgb_pipeline), "appsink_rgb"), "pull-sample", &rgb_sample);
+        // A stalled stream must not hold up the other one
+        GstSample *rgb_sample = rgb_queue->pull(10 * GST_MSECOND);
         if (rgb_sample) {
             GstBuffer *rgb_buffer = gst_sample_get_buffer(rgb_sample);
             GstMapInfo rgb_info;
             if (gst_buffer_map(rgb_buffer, &rgb_info, GST_MAP_READ)) {
-                // Process the RGB frame (rgb_info.data) here
-                rgb_frame = cv::Mat(cv::Size(640, 480), CV_8UC3, rgb_info.data);
-                gst_buffer_unmap(rgb_buffer, &rgb_info);
-                gst_sample_unref(rgb_sample);
-
-                if (!rgb_frame.empty()) {
-                    cv::imshow("RGB Video", rgb_frame);
+                // A frame of another size than --size is not read past its end
+                if (rgb_info.size < size_t(width) * height * (raw ? 2 : 3)) {
+                    g_printerr("RGB frame of %zu bytes is not %dx%d.\n",
+                               rgb_info.size, width, height);
+                } else {
+                    if (raw) {
+                        cv::cvtColor(cv::Mat(cv::Size(width, height), CV_8UC2,
+                                             rgb_info.data),
+                                     rgb_frame, cv::COLOR_YUV2BGR_UYVY);
+                    } else {
+                        rgb_frame = cv::Mat(cv::Size(width, height), CV_8UC3,
+                                            rgb_info.data);
+                    }
+                    if (!rgb_frame.empty()) {
+                        cv::imshow("RGB Video", rgb_frame);
+                    }
                 }
+                gst_buffer_unmap(rgb_buffer, &rgb_info);
             }
+            gst_sample_unref(rgb_sample);
         }
 
         // Retrieve frames from depth pipeline
-        GstSample *depth_sample = nullptr;
-        g_signal_emit_by_name(gst_bin_get_by_name(GST_BIN(depth_pipeline), "appsink_depth"), "pull-sample", &depth_sample);
+        GstSample *depth_sample = depth_queue->pull(10 * GST_MSECOND);
         if (depth_sample) {
             GstBuffer *depth_buffer = gst_sample_get_buffer(depth_sample);
             GstMapInfo depth_info;
             if (gst_buffer_map(depth_buffer, &depth_info, GST_MAP_READ)) {
-                auto unscaled = cv::Mat(cv::Size(640, 480), CV_16UC1, (void*)depth_info.data);
-                unscaled.convertTo(depth_frame, CV_64F, 0.001);
-                if (!depth_frame.empty()) {
-                    cv::imshow("Depth Video", unscaled);
+                if (depth_info.size < size_t(width) * height * 2) {
+                    g_printerr("Depth frame of %zu bytes is not %dx%d.\n",
+                               depth_info.size, width, height);
+                } else {
+                    // Raw depth arrives as UYVY of the same size, the bytes are Z16
+                    auto unscaled = cv::Mat(cv::Size(width, height), CV_16UC1, (void*)depth_info.data);
+                    unscaled.convertTo(depth_frame, CV_64F, 0.001);
+                    if (!depth_frame.empty()) {
+                        cv::imshow("Depth Video", unscaled);
+                    }
                 }
                 gst_buffer_unmap(depth_buffer, &depth_info);
-                gst_sample_unref(depth_sample);
             }
+            gst_sample_unref(depth_sample);
         }
 
         if (cv::waitKey(30) == 27) {  // Exit if the Esc key is pressed
@@ -75,8 +282,14 @@ int main(int argc, char *argv[]) {
 
     // Release resources
     cv::destroyAllWindows();
+    rgb_receiver.reset();
+    depth_receiver.reset();
     gst_element_set_state(rgb_pipeline, GST_STATE_NULL);
     gst_element_set_state(depth_pipeline, GST_STATE_NULL);
+    rgb_protection.reset();
+    depth_protection.reset();
+    rgb_queue.reset();
+    depth_queue.reset();
     gst_object_unref(rgb_pipeline);
     gst_object_unref(depth_pipeline);
     gst_deinit();